@@ -0,0 +1,64 @@
+/*
+ * Bump allocator for short-lived scratch memory.
+ *
+ * Allocations are carved from a fixed buffer and never freed one by one,
+ * the whole arena is reset at once when the scratch data is dead (e.g. at
+ * the end of a command). A mark can be taken to release everything
+ * allocated after it, for scratch memory reused in a loop.
+ */
+#ifndef __TEE_ARENA_H__
+#define __TEE_ARENA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TEE_ARENA_ALIGN		8
+
+struct tee_arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+	size_t peak;
+};
+
+static inline void tee_arena_init(struct tee_arena *arena, void *buf,
+				  size_t size)
+{
+	arena->base = buf;
+	arena->size = size;
+	arena->used = 0;
+	arena->peak = 0;
+}
+
+/* Returns NULL when the arena cannot hold size more bytes */
+static inline void *tee_arena_alloc(struct tee_arena *arena, size_t size)
+{
+	size_t start = (arena->used + TEE_ARENA_ALIGN - 1) &
+		       ~(size_t)(TEE_ARENA_ALIGN - 1);
+
+	if (start > arena->size || size > arena->size - start)
+		return NULL;
+
+	arena->used = start + size;
+	if (arena->used > arena->peak)
+		arena->peak = arena->used;
+	return arena->base + start;
+}
+
+static inline size_t tee_arena_mark(const struct tee_arena *arena)
+{
+	return arena->used;
+}
+
+/* Release everything allocated since mark was taken */
+static inline void tee_arena_release(struct tee_arena *arena, size_t mark)
+{
+	arena->used = mark;
+}
+
+static inline void tee_arena_reset(struct tee_arena *arena)
+{
+	arena->used = 0;
+}
+
+#endif /* __TEE_ARENA_H__ */
@@ -4,9 +4,14 @@ mkdir temp
 
 cp $1 ./temp/$1
 
-tee_crypto crypto --digest --mode TEE_ALG_SHA256 --in_file ./temp/$1 --out_file ./temp/$1.sha256
-
-tee_crypto crypto --sign --mode TEE_ALG_RSASSA_PKCS1_V1_5_SHA256 --key_type RSA --ID $2 --in_file ./temp/$1.sha256 --out_file ./temp/$1.sig
+# The binary is not secret, it is hashed on the host and only the digest
+# goes to the TA for signing.
+# Pass "hmac" as third argument to use a TA-held HMAC key instead of RSA
+if [ "$3" = "hmac" ]; then
+  tee_crypto crypto --sign --prehash --mode TEE_ALG_HMAC_SHA256 --key_type HMAC --ID $2 --in_file ./temp/$1 --out_file ./temp/$1.sig
+else
+  tee_crypto crypto --sign --prehash --mode TEE_ALG_RSASSA_PKCS1_V1_5_SHA256 --key_type RSA --ID $2 --in_file ./temp/$1 --out_file ./temp/$1.sig
+fi
 
 optee_example_secure_storage store -f ./temp/$1.sig -i $1
 
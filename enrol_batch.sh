@@ -0,0 +1,24 @@
+#!/bin/bash
+
+# Enrol several binaries with a single signing operation in the TA:
+#   enrol_batch.sh <key ID> <binary>...
+# Each signature file holds the proof of its binary and the batch
+# signature, run.sh verifies it like a plain one.
+KEY_ID=$1
+shift
+
+mkdir temp
+
+IN_FILES=""
+for BIN in "$@"; do
+  cp $BIN ./temp/$BIN
+  IN_FILES="$IN_FILES --in_file ./temp/$BIN"
+done
+
+tee_crypto sign-batch --mode TEE_ALG_RSASSA_PKCS1_V1_5_SHA256 --key_type RSA --ID $KEY_ID $IN_FILES
+
+for BIN in "$@"; do
+  optee_example_secure_storage store -f ./temp/$BIN.sig -i $BIN
+done
+
+rm -rf ./temp/
@@ -0,0 +1,415 @@
+#include <string.h>
+#include <unistd.h>
+
+#include <se_ta.h>
+#include <teesecure.h>
+#include <tees_sha2.h>
+#include <tee_trace.h>
+
+TEEC_Result tees_crypto_generate_key(TEEC_Session *sess, uint32_t key_type,
+				     uint32_t key_size, uint32_t key_id,
+				     uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_VALUE_INPUT,
+					 TEEC_VALUE_INPUT, TEEC_NONE);
+
+	op.params[0].value.a = key_type;
+	op.params[0].value.b = key_size;
+	op.params[1].value.a = key_id;
+
+	return tee_trace_invoke(sess, GENERATE_KEY, "GENERATE_KEY", &op,
+				origin);
+}
+
+TEEC_Result tees_crypto_generate_keys(TEEC_Session *sess, uint32_t key_type,
+				      uint32_t key_size,
+				      const uint32_t *key_ids, size_t count,
+				      uint32_t *provisioned, uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_OUTPUT, TEEC_NONE);
+
+	op.params[0].value.a = key_type;
+	op.params[0].value.b = key_size;
+	op.params[1].tmpref.buffer = (void *)key_ids;
+	op.params[1].tmpref.size = count * sizeof(*key_ids);
+
+	res = tee_trace_invoke(sess, GENERATE_KEYS, "GENERATE_KEYS", &op,
+			       origin);
+	if (provisioned)
+		*provisioned = op.params[2].value.a;
+	return res;
+}
+
+TEEC_Result tees_crypto_fill_pool(TEEC_Session *sess, uint32_t key_type,
+				  uint32_t key_size, uint32_t target,
+				  uint32_t budget, uint32_t *level,
+				  uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT, TEEC_VALUE_INOUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].value.a = key_type;
+	op.params[0].value.b = key_size;
+	op.params[1].value.a = target;
+	op.params[1].value.b = budget;
+
+	res = tee_trace_invoke(sess, FILL_POOL, "FILL_POOL", &op, origin);
+	if (level)
+		*level = op.params[1].value.a;
+	return res;
+}
+
+TEEC_Result tees_crypto_run(TEEC_Session *sess, uint32_t key_id,
+			    uint32_t flags, const void *in, size_t in_len,
+			    void *out, size_t *out_len, uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_MEMREF_TEMP_INOUT, TEEC_NONE);
+
+	op.params[0].value.a = key_id;
+	op.params[0].value.b = flags;
+	op.params[1].tmpref.buffer = (void *)in;
+	op.params[1].tmpref.size = in_len;
+	op.params[2].tmpref.buffer = out;
+	op.params[2].tmpref.size = *out_len;
+
+	res = tee_trace_invoke(sess, ENC_DEC, "ENC_DEC", &op, origin);
+	*out_len = op.params[2].tmpref.size;
+	return res;
+}
+
+TEEC_Result tees_crypto_run_iv(TEEC_Session *sess, uint32_t key_id,
+			       uint32_t flags, const void *in, size_t in_len,
+			       void *out, size_t *out_len,
+			       const void *iv, size_t iv_len,
+			       uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INOUT,
+					 TEEC_MEMREF_TEMP_INPUT);
+
+	op.params[0].value.a = key_id;
+	op.params[0].value.b = flags;
+	op.params[1].tmpref.buffer = (void *)in;
+	op.params[1].tmpref.size = in_len;
+	op.params[2].tmpref.buffer = out;
+	op.params[2].tmpref.size = *out_len;
+	op.params[3].tmpref.buffer = (void *)iv;
+	op.params[3].tmpref.size = iv_len;
+
+	res = tee_trace_invoke(sess, ENC_DEC, "ENC_DEC", &op, origin);
+	*out_len = op.params[2].tmpref.size;
+	return res;
+}
+
+TEEC_Result tees_crypto_sign_chunk(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t flags, uint32_t stage,
+				   TEEC_SharedMemory *shm, size_t len,
+				   void *sig, size_t *sig_len,
+				   uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_PARTIAL_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INPUT);
+
+	op.params[0].value.a = key_id;
+	op.params[0].value.b = flags;
+	op.params[1].memref.parent = shm;
+	op.params[1].memref.offset = 0;
+	op.params[1].memref.size = len;
+	op.params[2].tmpref.buffer = sig;
+	op.params[2].tmpref.size = *sig_len;
+	op.params[3].value.a = stage;
+
+	res = tee_trace_invoke(sess, SIGN_FILE, "SIGN_FILE", &op, origin);
+	*sig_len = op.params[2].tmpref.size;
+	return res;
+}
+
+static TEEC_Result envelope_chunk(TEEC_Session *sess, uint32_t cmd,
+				  const char *name, uint32_t key_id,
+				  uint32_t flags, uint32_t stage,
+				  TEEC_SharedMemory *in, size_t in_len,
+				  TEEC_SharedMemory *out, size_t *out_len,
+				  uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_PARTIAL_INPUT,
+					 TEEC_MEMREF_PARTIAL_OUTPUT,
+					 TEEC_VALUE_INPUT);
+
+	op.params[0].value.a = key_id;
+	op.params[0].value.b = flags;
+	op.params[1].memref.parent = in;
+	op.params[1].memref.offset = 0;
+	op.params[1].memref.size = in_len;
+	op.params[2].memref.parent = out;
+	op.params[2].memref.offset = 0;
+	op.params[2].memref.size = out->size;
+	op.params[3].value.a = stage;
+
+	res = tee_trace_invoke(sess, cmd, name, &op, origin);
+	*out_len = op.params[2].memref.size;
+	return res;
+}
+
+TEEC_Result tees_crypto_seal_chunk(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t flags, uint32_t stage,
+				   TEEC_SharedMemory *in, size_t in_len,
+				   TEEC_SharedMemory *out, size_t *out_len,
+				   uint32_t *origin)
+{
+	return envelope_chunk(sess, ENVELOPE_SEAL, "ENVELOPE_SEAL", key_id,
+			      flags, stage, in, in_len, out, out_len, origin);
+}
+
+TEEC_Result tees_crypto_open_chunk(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t stage,
+				   TEEC_SharedMemory *in, size_t in_len,
+				   TEEC_SharedMemory *out, size_t *out_len,
+				   uint32_t *origin)
+{
+	return envelope_chunk(sess, ENVELOPE_OPEN, "ENVELOPE_OPEN", key_id,
+			      0, stage, in, in_len, out, out_len, origin);
+}
+
+TEEC_Result tees_crypto_sign_batch(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t flags, const void *digests,
+				   size_t count, void *sig, size_t *sig_len,
+				   void *proofs, size_t *proofs_len,
+				   uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT);
+
+	op.params[0].value.a = key_id;
+	op.params[0].value.b = flags;
+	op.params[1].tmpref.buffer = (void *)digests;
+	op.params[1].tmpref.size = count * SE_BATCH_HASH_SIZE;
+	op.params[2].tmpref.buffer = sig;
+	op.params[2].tmpref.size = *sig_len;
+	op.params[3].tmpref.buffer = proofs;
+	op.params[3].tmpref.size = *proofs_len;
+
+	res = tee_trace_invoke(sess, SIGN_BATCH, "SIGN_BATCH", &op, origin);
+	*sig_len = op.params[2].tmpref.size;
+	*proofs_len = op.params[3].tmpref.size;
+	return res;
+}
+
+uint32_t tees_batch_depth(uint32_t count)
+{
+	uint32_t depth = 0;
+
+	while ((1ULL << depth) < count)
+		depth++;
+	return depth;
+}
+
+static void batch_hash(uint8_t prefix, const uint8_t *a, const uint8_t *b,
+		       uint8_t *out)
+{
+	struct tees_sha256_ctx ctx;
+
+	tees_sha256_init(&ctx);
+	tees_sha256_update(&ctx, &prefix, sizeof(prefix));
+	tees_sha256_update(&ctx, a, SE_BATCH_HASH_SIZE);
+	if (b)
+		tees_sha256_update(&ctx, b, SE_BATCH_HASH_SIZE);
+	tees_sha256_final(&ctx, out);
+}
+
+/* Same walk as the TA, the node of the item at level k is index >> k */
+void tees_batch_digest(const uint8_t digest[32], uint32_t index,
+		       uint32_t count, const uint8_t *proof,
+		       uint8_t batch_digest[32])
+{
+	uint32_t depth = tees_batch_depth(count);
+	uint8_t node[SE_BATCH_HASH_SIZE];
+	uint8_t prefix = SE_BATCH_ROOT;
+	struct tees_sha256_ctx ctx;
+	uint8_t count_le[4];
+	uint32_t width = count;
+	uint32_t k;
+
+	batch_hash(SE_BATCH_LEAF, digest, NULL, node);
+	for (k = 0; k < depth; k++) {
+		const uint8_t *sibling = proof + k * SE_BATCH_HASH_SIZE;
+		uint32_t pos = index >> k;
+
+		if ((pos ^ 1) < width) {
+			if (pos & 1)
+				batch_hash(SE_BATCH_NODE, sibling, node, node);
+			else
+				batch_hash(SE_BATCH_NODE, node, sibling, node);
+		}
+		width = (width + 1) / 2;
+	}
+
+	for (k = 0; k < sizeof(count_le); k++)
+		count_le[k] = count >> (8 * k);
+
+	tees_sha256_init(&ctx);
+	tees_sha256_update(&ctx, &prefix, sizeof(prefix));
+	tees_sha256_update(&ctx, count_le, sizeof(count_le));
+	tees_sha256_update(&ctx, node, sizeof(node));
+	tees_sha256_final(&ctx, batch_digest);
+}
+
+TEEC_Result tees_crypto_random(TEEC_Session *sess, void *buf, size_t len,
+			       uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT, TEEC_NONE,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = buf;
+	op.params[0].tmpref.size = len;
+
+	return tee_trace_invoke(sess, RANDOM, "RANDOM", &op, origin);
+}
+
+TEEC_Result tees_random_pool_init(struct tees_random_pool *pool,
+				  TEEC_Context *ctx, TEEC_Session *sess,
+				  size_t size)
+{
+	memset(pool, 0, sizeof(*pool));
+	pool->sess = sess;
+	pool->pid = getpid();
+	pool->shm.size = size;
+	pool->shm.flags = TEEC_MEM_OUTPUT;
+	return TEEC_AllocateSharedMemory(ctx, &pool->shm);
+}
+
+static TEEC_Result random_pool_refill(struct tees_random_pool *pool,
+				      uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_PARTIAL_OUTPUT, TEEC_NONE,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].memref.parent = &pool->shm;
+	op.params[0].memref.offset = 0;
+	op.params[0].memref.size = pool->shm.size;
+
+	res = tee_trace_invoke(pool->sess, RANDOM, "RANDOM", &op, origin);
+	if (res != TEEC_SUCCESS)
+		return res;
+	pool->avail = pool->shm.size;
+	pool->refills++;
+	return TEEC_SUCCESS;
+}
+
+TEEC_Result tees_random_pool_get(struct tees_random_pool *pool, void *buf,
+				 size_t len, uint32_t *origin)
+{
+	uint8_t *out = buf;
+	TEEC_Result res;
+
+	if (len > pool->shm.size)
+		return tees_crypto_random(pool->sess, buf, len, origin);
+
+	/* The parent still holds the same bytes after a fork() */
+	if (pool->pid != getpid()) {
+		memset(pool->shm.buffer, 0, pool->shm.size);
+		pool->avail = 0;
+		pool->pid = getpid();
+	}
+
+	while (len) {
+		uint8_t *src;
+		size_t n;
+
+		if (!pool->avail) {
+			res = random_pool_refill(pool, origin);
+			if (res != TEEC_SUCCESS)
+				return res;
+		}
+		n = len < pool->avail ? len : pool->avail;
+		src = (uint8_t *)pool->shm.buffer + pool->shm.size -
+		      pool->avail;
+		memcpy(out, src, n);
+		memset(src, 0, n);
+		pool->avail -= n;
+		out += n;
+		len -= n;
+	}
+	return TEEC_SUCCESS;
+}
+
+void tees_random_pool_free(struct tees_random_pool *pool)
+{
+	if (pool->shm.buffer)
+		memset(pool->shm.buffer, 0, pool->shm.size);
+	TEEC_ReleaseSharedMemory(&pool->shm);
+	pool->avail = 0;
+}
+
+TEEC_Result tees_crypto_stats(TEEC_Session *sess, struct se_cmd_stats *stats,
+			      uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT, TEEC_NONE,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = stats;
+	op.params[0].tmpref.size = sizeof(*stats) * SE_CMD_COUNT;
+
+	return tee_trace_invoke(sess, STATS, "STATS", &op, origin);
+}
+
+TEEC_Result tees_crypto_stats_reset(TEEC_Session *sess, uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_NONE, TEEC_NONE,
+					 TEEC_NONE, TEEC_NONE);
+
+	return tee_trace_invoke(sess, STATS_RESET, "STATS_RESET", &op, origin);
+}
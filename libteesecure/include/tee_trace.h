@@ -0,0 +1,45 @@
+/*
+ * Opt-in tracing of the host programs.
+ *
+ * Spans are written as Chrome trace events ("ph":"X") so the file can be
+ * loaded as is in chrome://tracing or https://ui.perfetto.dev. Tracing is
+ * enabled by tee_trace_init() with a file name, or by the TEE_TRACE
+ * environment variable. When disabled every call is a cheap no-op.
+ */
+#ifndef __TEE_TRACE_H__
+#define __TEE_TRACE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <tee_client_api.h>
+
+/* Name of the environment variable enabling tracing */
+#define TEE_TRACE_ENV	"TEE_TRACE"
+
+/*
+ * Start tracing to path, or to $TEE_TRACE when path is NULL. prog names
+ * the process in the trace. The trace is completed at exit, including
+ * when the program bails out with errx().
+ */
+void tee_trace_init(const char *prog, const char *path);
+
+/* Monotonic timestamp in microseconds, 0 when tracing is disabled */
+uint64_t tee_trace_now(void);
+
+/* Record a span that started at start_us and ends now */
+void tee_trace_span(const char *cat, const char *name, uint64_t start_us);
+
+/* Same as tee_trace_span() with the number of bytes processed */
+void tee_trace_span_bytes(const char *cat, const char *name,
+			  uint64_t start_us, size_t bytes);
+
+/*
+ * TEEC_InvokeCommand() recorded as a span named after the command, with
+ * the command ID, result and origin as arguments.
+ */
+TEEC_Result tee_trace_invoke(TEEC_Session *sess, uint32_t cmd,
+			     const char *name, TEEC_Operation *op,
+			     uint32_t *origin);
+
+#endif /* __TEE_TRACE_H__ */
@@ -0,0 +1,59 @@
+/*
+ * Host side SHA-256 and SHA-512.
+ *
+ * Meant for inputs that are not secret, e.g. a binary to be signed: only the
+ * digest has to go through the world switch then. The block function is
+ * picked once at run time, SHA extensions on x86, the ARMv8 crypto
+ * extensions on arm64 and portable C otherwise.
+ */
+#ifndef __TEES_SHA2_H__
+#define __TEES_SHA2_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TEES_SHA256_SIZE	32
+#define TEES_SHA512_SIZE	64
+
+struct tees_sha256_ctx {
+	uint32_t state[8];
+	uint64_t len;
+	uint8_t buf[64];
+	void (*blocks)(uint32_t *state, const uint8_t *data, size_t nblocks);
+};
+
+struct tees_sha512_ctx {
+	uint64_t state[8];
+	uint64_t len;
+	uint8_t buf[128];
+	void (*blocks)(uint64_t *state, const uint8_t *data, size_t nblocks);
+};
+
+void tees_sha256_init(struct tees_sha256_ctx *ctx);
+void tees_sha256_update(struct tees_sha256_ctx *ctx, const void *data,
+			size_t len);
+void tees_sha256_final(struct tees_sha256_ctx *ctx,
+		       uint8_t digest[TEES_SHA256_SIZE]);
+void tees_sha256(const void *data, size_t len,
+		 uint8_t digest[TEES_SHA256_SIZE]);
+
+void tees_sha512_init(struct tees_sha512_ctx *ctx);
+void tees_sha512_update(struct tees_sha512_ctx *ctx, const void *data,
+			size_t len);
+void tees_sha512_final(struct tees_sha512_ctx *ctx,
+		       uint8_t digest[TEES_SHA512_SIZE]);
+void tees_sha512(const void *data, size_t len,
+		 uint8_t digest[TEES_SHA512_SIZE]);
+
+/* Name of the SHA-256 block function in use, for logs and benchmarks */
+const char *tees_sha256_engine(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TEES_SHA2_H__ */
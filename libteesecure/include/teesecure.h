@@ -0,0 +1,262 @@
+/*
+ * libteesecure - host side access to the crypto and secure storage TAs.
+ *
+ * The functions below wrap one TA command each. They never print nor exit,
+ * the TEEC result is returned and origin (which may be NULL) tells where it
+ * came from. Sessions are opened with tees_session_open() on a context
+ * initialized by tees_context_init(), several sessions may share a context
+ * and sessions may be used from different threads, one thread at a time.
+ *
+ * teesecure.hpp provides C++ RAII classes on top of this API.
+ */
+#ifndef __TEESECURE_H__
+#define __TEESECURE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <tee_client_api.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * The TA headers define the flags and the layout of the stats, they are
+ * not included here as their short macro names clash easily.
+ */
+struct se_cmd_stats;
+struct secure_storage_cmd_stats;
+struct secure_storage_archive_cursor;
+struct secure_storage_stat;
+
+/* Key object types accepted by tees_crypto_generate_key() */
+#define TEES_KEY_AES		0xA0000010
+#define TEES_KEY_RSA_KEYPAIR	0xA1000030
+#define TEES_KEY_HMAC_SHA256	0xA0000004
+
+TEEC_Result tees_context_init(TEEC_Context *ctx);
+void tees_context_finalize(TEEC_Context *ctx);
+
+TEEC_Result tees_session_open(TEEC_Context *ctx, TEEC_Session *sess,
+			      const TEEC_UUID *uuid, uint32_t *origin);
+void tees_session_close(TEEC_Session *sess);
+
+/* Shortcuts opening a session with one of our TAs */
+TEEC_Result tees_crypto_open(TEEC_Context *ctx, TEEC_Session *sess,
+			     uint32_t *origin);
+TEEC_Result tees_storage_open(TEEC_Context *ctx, TEEC_Session *sess,
+			      uint32_t *origin);
+
+/*
+ * Crypto TA
+ */
+TEEC_Result tees_crypto_generate_key(TEEC_Session *sess, uint32_t key_type,
+				     uint32_t key_size, uint32_t key_id,
+				     uint32_t *origin);
+
+/* provisioned (may be NULL) is set to the number of keys stored */
+TEEC_Result tees_crypto_generate_keys(TEEC_Session *sess, uint32_t key_type,
+				      uint32_t key_size,
+				      const uint32_t *key_ids, size_t count,
+				      uint32_t *provisioned, uint32_t *origin);
+
+/* level (may be NULL) is set to the number of keys in the pool */
+TEEC_Result tees_crypto_fill_pool(TEEC_Session *sess, uint32_t key_type,
+				  uint32_t key_size, uint32_t target,
+				  uint32_t budget, uint32_t *level,
+				  uint32_t *origin);
+
+/*
+ * ENC_DEC with flags made of the se_ta.h bits. out is also an input for
+ * VERIFY, where it holds the signature or MAC to check. *out_len is the
+ * size of out on entry and the size of the result on return.
+ */
+TEEC_Result tees_crypto_run(TEEC_Session *sess, uint32_t key_id,
+			    uint32_t flags, const void *in, size_t in_len,
+			    void *out, size_t *out_len, uint32_t *origin);
+
+/* Same as tees_crypto_run() for AES, with a binary IV */
+TEEC_Result tees_crypto_run_iv(TEEC_Session *sess, uint32_t key_id,
+			       uint32_t flags, const void *in, size_t in_len,
+			       void *out, size_t *out_len,
+			       const void *iv, size_t iv_len,
+			       uint32_t *origin);
+
+/*
+ * One SIGN_FILE chunk, the len first bytes of shm. stage holds the
+ * SIGN_FILE_* flags, *sig_len is 0 on return until the last chunk.
+ */
+TEEC_Result tees_crypto_sign_chunk(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t flags, uint32_t stage,
+				   TEEC_SharedMemory *shm, size_t len,
+				   void *sig, size_t *sig_len,
+				   uint32_t *origin);
+
+/*
+ * One ENVELOPE_SEAL or ENVELOPE_OPEN chunk, the in_len first bytes of in.
+ * The output goes to out, which must be SE_ENVELOPE_OVERHEAD bytes larger
+ * than the input, and *out_len is set to its size.
+ */
+TEEC_Result tees_crypto_seal_chunk(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t flags, uint32_t stage,
+				   TEEC_SharedMemory *in, size_t in_len,
+				   TEEC_SharedMemory *out, size_t *out_len,
+				   uint32_t *origin);
+TEEC_Result tees_crypto_open_chunk(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t stage,
+				   TEEC_SharedMemory *in, size_t in_len,
+				   TEEC_SharedMemory *out, size_t *out_len,
+				   uint32_t *origin);
+
+/*
+ * SIGN_BATCH over count SHA-256 digests laid out back to back. proofs
+ * receives tees_batch_depth(count) hashes per item, *proofs_len is the
+ * size of proofs on entry and of the proofs on return.
+ */
+TEEC_Result tees_crypto_sign_batch(TEEC_Session *sess, uint32_t key_id,
+				   uint32_t flags, const void *digests,
+				   size_t count, void *sig, size_t *sig_len,
+				   void *proofs, size_t *proofs_len,
+				   uint32_t *origin);
+
+/* Number of proof hashes of each item of a batch of count digests */
+uint32_t tees_batch_depth(uint32_t count);
+
+/*
+ * Recompute, on the host, the batch digest signed by SIGN_BATCH from the
+ * digest of item index and its proof. The result is checked against the
+ * batch signature with an ENC_DEC VERIFY.
+ */
+void tees_batch_digest(const uint8_t digest[32], uint32_t index,
+		       uint32_t count, const uint8_t *proof,
+		       uint8_t batch_digest[32]);
+
+/* Fills buf with len random bytes from the TEE */
+TEEC_Result tees_crypto_random(TEEC_Session *sess, void *buf, size_t len,
+			       uint32_t *origin);
+
+/*
+ * Random bytes served from memory shared with the TEE, refilled with one
+ * RANDOM call whenever it runs dry, so small requests cost no world
+ * switch. Bytes are wiped from the pool as they are handed out, requests
+ * larger than the pool bypass it. A pool is used by one thread at a time,
+ * like its session. The child of a fork() drops the bytes it inherited,
+ * so parent and child never hand out the same ones.
+ */
+struct tees_random_pool {
+	TEEC_Session *sess;
+	TEEC_SharedMemory shm;
+	size_t avail;		/* unused bytes, at the end of shm */
+	uint32_t refills;	/* RANDOM calls made, for statistics */
+	pid_t pid;		/* process the unused bytes belong to */
+};
+
+TEEC_Result tees_random_pool_init(struct tees_random_pool *pool,
+				  TEEC_Context *ctx, TEEC_Session *sess,
+				  size_t size);
+TEEC_Result tees_random_pool_get(struct tees_random_pool *pool, void *buf,
+				 size_t len, uint32_t *origin);
+void tees_random_pool_free(struct tees_random_pool *pool);
+
+/* stats must hold SE_CMD_COUNT entries */
+TEEC_Result tees_crypto_stats(TEEC_Session *sess, struct se_cmd_stats *stats,
+			      uint32_t *origin);
+TEEC_Result tees_crypto_stats_reset(TEEC_Session *sess, uint32_t *origin);
+
+/*
+ * Secure storage TA. Object and log IDs are NUL terminated strings.
+ */
+TEEC_Result tees_storage_read(TEEC_Session *sess, const char *id,
+			      void *data, size_t *data_len, uint32_t *origin);
+
+/* Same as tees_storage_read(), *version is set to the object version */
+TEEC_Result tees_storage_read_version(TEEC_Session *sess, const char *id,
+				      void *data, size_t *data_len,
+				      uint64_t *version, uint32_t *origin);
+
+TEEC_Result tees_storage_write(TEEC_Session *sess, const char *id,
+			       const void *data, size_t data_len,
+			       uint32_t placement, uint32_t *origin);
+
+TEEC_Result tees_storage_write_buffered(TEEC_Session *sess, const char *id,
+					const void *data, size_t data_len,
+					uint32_t *origin);
+
+/*
+ * Writes the object only if it is at *version, 0 for an object never
+ * written this way or missing, TEES_VERSION_NONE for a missing object
+ * only. On success *version is the new version, on TEEC_ERROR_BAD_STATE
+ * the current one, TEES_VERSION_NONE if there is no object.
+ */
+#define TEES_VERSION_NONE	UINT64_MAX
+
+TEEC_Result tees_storage_write_if_version(TEEC_Session *sess, const char *id,
+					  const void *data, size_t data_len,
+					  uint32_t placement, uint64_t *version,
+					  uint32_t *origin);
+
+TEEC_Result tees_storage_delete(TEEC_Session *sess, const char *id,
+				uint32_t *origin);
+
+/*
+ * Size, times and digest of an object, from the TA's metadata index.
+ * TEEC_ERROR_ITEM_NOT_FOUND if there is no such object.
+ */
+TEEC_Result tees_storage_stat(TEEC_Session *sess, const char *id,
+			      struct secure_storage_stat *stat,
+			      uint32_t *origin);
+
+/* *exists is set to 1 if there is an object stored under id, 0 otherwise */
+TEEC_Result tees_storage_exists(TEEC_Session *sess, const char *id,
+				int *exists, uint32_t *origin);
+
+TEEC_Result tees_storage_flush(TEEC_Session *sess, uint32_t flags,
+			       uint32_t *origin);
+
+TEEC_Result tees_storage_set_policy(TEEC_Session *sess, uint32_t flags,
+				    uint32_t rpmb_max_size, uint32_t *origin);
+
+TEEC_Result tees_storage_log_append(TEEC_Session *sess, const char *id,
+				    const void *data, size_t data_len,
+				    uint32_t *origin);
+
+/*
+ * Reads the next chunk of a log starting at the cursor (seg, offset) and
+ * advances the cursor past the bytes returned.
+ */
+TEEC_Result tees_storage_log_read(TEEC_Session *sess, const char *id,
+				  void *data, size_t *data_len,
+				  uint32_t *seg, uint32_t *offset,
+				  uint32_t *origin);
+
+/*
+ * Archive the client objects chunk by chunk. Start from a zeroed cursor and
+ * call again until it has TA_SECURE_STORAGE_ARCHIVE_DONE set. The key is
+ * TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE bytes, the chunk buffer should hold
+ * TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE bytes. *chunk_len is the length of
+ * the chunk, or the size needed on TEEC_ERROR_SHORT_BUFFER.
+ */
+TEEC_Result tees_storage_export_chunk(TEEC_Session *sess, const void *key,
+				      void *chunk, size_t *chunk_len,
+				      struct secure_storage_archive_cursor *cur,
+				      uint32_t *origin);
+
+/* Chunks are imported in the order they were exported, same cursor rules */
+TEEC_Result tees_storage_import_chunk(TEEC_Session *sess, const void *key,
+				      const void *chunk, size_t chunk_len,
+				      struct secure_storage_archive_cursor *cur,
+				      uint32_t *origin);
+
+/* stats must hold TA_SECURE_STORAGE_CMD_COUNT entries */
+TEEC_Result tees_storage_stats(TEEC_Session *sess,
+			       struct secure_storage_cmd_stats *stats,
+			       uint32_t *origin);
+TEEC_Result tees_storage_stats_reset(TEEC_Session *sess, uint32_t *origin);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __TEESECURE_H__ */
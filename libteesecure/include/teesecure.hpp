@@ -0,0 +1,730 @@
+/*
+ * C++ API of libteesecure.
+ *
+ * Context, Session and SharedBuffer own the matching TEEC object and are
+ * move-only, the TEEC object is released by the destructor. The TEEC
+ * objects are kept at a fixed address so that moving a Context does not
+ * break the sessions opened on it. A Session or SharedBuffer must not
+ * outlive the Context it was created from.
+ *
+ * Failures are reported by throwing teesecure::Error.
+ */
+#ifndef __TEESECURE_HPP__
+#define __TEESECURE_HPP__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+#include <teesecure.h>
+#include <se_ta.h>
+#include <secure_storage_ta.h>
+
+namespace teesecure {
+
+using Bytes = std::span<const uint8_t>;
+using MutableBytes = std::span<uint8_t>;
+
+class Error : public std::runtime_error {
+public:
+	Error(const char *what, TEEC_Result result, uint32_t origin)
+		: std::runtime_error(message(what, result, origin)),
+		  result_(result), origin_(origin) {}
+
+	TEEC_Result result() const noexcept { return result_; }
+	uint32_t origin() const noexcept { return origin_; }
+
+private:
+	static std::string message(const char *what, TEEC_Result result,
+				   uint32_t origin)
+	{
+		char buf[128];
+
+		std::snprintf(buf, sizeof(buf), "%s failed 0x%x origin 0x%x",
+			      what, result, origin);
+		return buf;
+	}
+
+	TEEC_Result result_;
+	uint32_t origin_;
+};
+
+inline void check(TEEC_Result res, uint32_t origin, const char *what)
+{
+	if (res != TEEC_SUCCESS)
+		throw Error(what, res, origin);
+}
+
+class Context {
+public:
+	Context() : ctx_(new TEEC_Context())
+	{
+		TEEC_Result res = tees_context_init(ctx_.get());
+
+		if (res != TEEC_SUCCESS) {
+			/* Nothing to finalize */
+			delete ctx_.release();
+			throw Error("TEEC_InitializeContext", res,
+				    TEEC_ORIGIN_API);
+		}
+	}
+
+	TEEC_Context *get() const noexcept { return ctx_.get(); }
+
+private:
+	struct Finalize {
+		void operator()(TEEC_Context *ctx) const noexcept
+		{
+			tees_context_finalize(ctx);
+			delete ctx;
+		}
+	};
+
+	std::unique_ptr<TEEC_Context, Finalize> ctx_;
+};
+
+class Session {
+public:
+	Session(Context &ctx, const TEEC_UUID &uuid)
+		: sess_(new TEEC_Session())
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		TEEC_Result res = tees_session_open(ctx.get(), sess_.get(),
+						    &uuid, &origin);
+
+		if (res != TEEC_SUCCESS) {
+			delete sess_.release();
+			throw Error("TEEC_OpenSession", res, origin);
+		}
+	}
+
+	TEEC_Session *get() const noexcept { return sess_.get(); }
+
+private:
+	struct Close {
+		void operator()(TEEC_Session *sess) const noexcept
+		{
+			tees_session_close(sess);
+			delete sess;
+		}
+	};
+
+	std::unique_ptr<TEEC_Session, Close> sess_;
+};
+
+/*
+ * Memory shared with the TEE once, instead of being copied by the client
+ * library on every call like the spans passed to the session methods.
+ */
+class SharedBuffer {
+public:
+	SharedBuffer(Context &ctx, std::size_t size,
+		     uint32_t flags = TEEC_MEM_INPUT | TEEC_MEM_OUTPUT)
+		: shm_(new TEEC_SharedMemory())
+	{
+		TEEC_Result res;
+
+		shm_->size = size;
+		shm_->flags = flags;
+		res = TEEC_AllocateSharedMemory(ctx.get(), shm_.get());
+		if (res != TEEC_SUCCESS) {
+			delete shm_.release();
+			throw Error("TEEC_AllocateSharedMemory", res,
+				    TEEC_ORIGIN_API);
+		}
+	}
+
+	MutableBytes data() const noexcept
+	{
+		return { static_cast<uint8_t *>(shm_->buffer), shm_->size };
+	}
+
+	std::size_t size() const noexcept { return shm_->size; }
+	TEEC_SharedMemory *get() const noexcept { return shm_.get(); }
+
+private:
+	struct Release {
+		void operator()(TEEC_SharedMemory *shm) const noexcept
+		{
+			TEEC_ReleaseSharedMemory(shm);
+			delete shm;
+		}
+	};
+
+	std::unique_ptr<TEEC_SharedMemory, Release> shm_;
+};
+
+/*
+ * Typed crypto operations, each one stands for a key held by the TA and
+ * the algorithm to use it with.
+ */
+enum class KeyType : uint32_t {
+	Aes = TEES_KEY_AES,
+	Rsa = TEES_KEY_RSA_KEYPAIR,
+	Hmac = TEES_KEY_HMAC_SHA256,
+};
+
+enum class AesMode : uint32_t {
+	Cbc = CBC_NOPAD,
+	Ctr = CTR,
+};
+
+enum class RsaPadding : uint32_t {
+	None = ENC_RSA,
+	Oaep = ENC_RSAES,
+	Pkcs1 = SIGN_RSASSA,
+	Pss = SIGN_RSASSA_MGF,
+};
+
+enum class DigestAlg : uint32_t {
+	Sha256 = SHA256,
+	Sha512 = SHA512,
+};
+
+enum class EnvelopeCipher : uint32_t {
+	Gcm = GCM,
+	Ctr = CTR,
+};
+
+struct Aes {
+	uint32_t key_id;
+	AesMode mode;
+	std::span<const uint8_t, 16> iv;
+	bool derived = false;
+};
+
+struct Rsa {
+	uint32_t key_id;
+	RsaPadding padding;
+};
+
+struct Hmac {
+	uint32_t key_id;
+	bool derived = false;
+};
+
+using CryptoStats = std::array<se_cmd_stats, SE_CMD_COUNT>;
+
+class CryptoSession : public Session {
+public:
+	explicit CryptoSession(Context &ctx)
+		: Session(ctx, TEEC_UUID TA_SE_UUID) {}
+
+	void generate_key(KeyType type, uint32_t key_size, uint32_t key_id)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_crypto_generate_key(get(), uint32_t(type), key_size,
+					       key_id, &origin),
+		      origin, "GENERATE_KEY");
+	}
+
+	/* Returns the number of keys provisioned, also on failure */
+	uint32_t generate_keys(KeyType type, uint32_t key_size,
+			       std::span<const uint32_t> key_ids)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		uint32_t provisioned = 0;
+
+		check(tees_crypto_generate_keys(get(), uint32_t(type), key_size,
+						key_ids.data(), key_ids.size(),
+						&provisioned, &origin),
+		      origin, "GENERATE_KEYS");
+		return provisioned;
+	}
+
+	/* Returns the number of keys in the pool */
+	uint32_t fill_pool(KeyType type, uint32_t key_size, uint32_t target,
+			   uint32_t budget = 0)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		uint32_t level = 0;
+
+		check(tees_crypto_fill_pool(get(), uint32_t(type), key_size,
+					    target, budget, &level, &origin),
+		      origin, "FILL_POOL");
+		return level;
+	}
+
+	std::size_t encrypt(const Aes &op, Bytes in, MutableBytes out)
+	{
+		return run_aes(op, ENCRYPT, in, out);
+	}
+
+	std::size_t decrypt(const Aes &op, Bytes in, MutableBytes out)
+	{
+		return run_aes(op, DECRYPT, in, out);
+	}
+
+	std::size_t encrypt(const Rsa &op, Bytes in, MutableBytes out)
+	{
+		return run(op.key_id, RSA | ENCRYPT | uint32_t(op.padding),
+			   in, out);
+	}
+
+	std::size_t decrypt(const Rsa &op, Bytes in, MutableBytes out)
+	{
+		return run(op.key_id, RSA | DECRYPT | uint32_t(op.padding),
+			   in, out);
+	}
+
+	/* Signs a SHA-256 digest */
+	std::size_t sign(const Rsa &op, Bytes digest, MutableBytes sig)
+	{
+		return run(op.key_id, RSA | SIGN | uint32_t(op.padding),
+			   digest, sig);
+	}
+
+	bool verify(const Rsa &op, Bytes digest, Bytes sig)
+	{
+		return check_sig(op.key_id, RSA | VERIFY | uint32_t(op.padding),
+				 digest, sig, TEEC_ERROR_SIGNATURE_INVALID);
+	}
+
+	std::size_t sign(const Hmac &op, Bytes data, MutableBytes mac)
+	{
+		return run(op.key_id, HMAC | SIGN | MAC_SHA256 | key_flags(op),
+			   data, mac);
+	}
+
+	bool verify(const Hmac &op, Bytes data, Bytes mac)
+	{
+		return check_sig(op.key_id,
+				 HMAC | VERIFY | MAC_SHA256 | key_flags(op),
+				 data, mac, TEEC_ERROR_MAC_INVALID);
+	}
+
+	std::size_t digest(DigestAlg alg, Bytes in, MutableBytes out)
+	{
+		return run(0, DIGEST | uint32_t(alg), in, out);
+	}
+
+	/*
+	 * One chunk of a file signed with SIGN_FILE, see se_ta.h. Returns
+	 * the signature size, 0 until the SIGN_FILE_LAST chunk.
+	 */
+	template <class Key>
+	std::size_t sign_chunk(const Key &op, uint32_t stage,
+			       SharedBuffer &chunk, std::size_t len,
+			       MutableBytes sig)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t sig_len = sig.size();
+
+		check(tees_crypto_sign_chunk(get(), op.key_id, sign_flags(op),
+					     stage, chunk.get(), len,
+					     sig.data(), &sig_len, &origin),
+		      origin, "SIGN_FILE");
+		return sig_len;
+	}
+
+	/*
+	 * Sign digests, SE_BATCH_HASH_SIZE bytes each, with one SIGN_BATCH,
+	 * see se_ta.h. proofs receives tees_batch_depth(count) hashes per
+	 * digest. Returns the signature size.
+	 */
+	template <class Key>
+	std::size_t sign_batch(const Key &op, Bytes digests, MutableBytes sig,
+			       MutableBytes proofs)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t sig_len = sig.size();
+		std::size_t proofs_len = proofs.size();
+
+		check(tees_crypto_sign_batch(get(), op.key_id, sign_flags(op),
+					     digests.data(),
+					     digests.size() / SE_BATCH_HASH_SIZE,
+					     sig.data(), &sig_len,
+					     proofs.data(), &proofs_len,
+					     &origin),
+		      origin, "SIGN_BATCH");
+		return sig_len;
+	}
+
+	/*
+	 * One chunk of an envelope sealed for, or opened with, the RSA key
+	 * key_id, see se_ta.h. out must be SE_ENVELOPE_OVERHEAD bytes larger
+	 * than len. Returns the size of the output.
+	 */
+	std::size_t seal_chunk(uint32_t key_id, EnvelopeCipher cipher,
+			       uint32_t stage, SharedBuffer &in,
+			       std::size_t len, SharedBuffer &out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t out_len = 0;
+
+		check(tees_crypto_seal_chunk(get(), key_id, uint32_t(cipher),
+					     stage, in.get(), len, out.get(),
+					     &out_len, &origin),
+		      origin, "ENVELOPE_SEAL");
+		return out_len;
+	}
+
+	std::size_t open_chunk(uint32_t key_id, uint32_t stage,
+			       SharedBuffer &in, std::size_t len,
+			       SharedBuffer &out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t out_len = 0;
+
+		check(tees_crypto_open_chunk(get(), key_id, stage, in.get(),
+					     len, out.get(), &out_len,
+					     &origin),
+		      origin, "ENVELOPE_OPEN");
+		return out_len;
+	}
+
+	/* One RANDOM call, RandomPool serves small requests cheaper */
+	void random(MutableBytes out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_crypto_random(get(), out.data(), out.size(),
+					 &origin),
+		      origin, "RANDOM");
+	}
+
+	CryptoStats stats()
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		CryptoStats stats;
+
+		check(tees_crypto_stats(get(), stats.data(), &origin),
+		      origin, "STATS");
+		return stats;
+	}
+
+	void reset_stats()
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_crypto_stats_reset(get(), &origin), origin,
+		      "STATS_RESET");
+	}
+
+private:
+	static uint32_t sign_flags(const Rsa &op)
+	{
+		return RSA | uint32_t(op.padding);
+	}
+
+	static uint32_t sign_flags(const Hmac &op)
+	{
+		return HMAC | key_flags(op);
+	}
+
+	/* Keys marked derived are expanded from the TA master key */
+	template <typename Op>
+	static uint32_t key_flags(const Op &op)
+	{
+		return op.derived ? DERIVED : 0;
+	}
+
+	std::size_t run(uint32_t key_id, uint32_t flags, Bytes in,
+			MutableBytes out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t out_len = out.size();
+
+		check(tees_crypto_run(get(), key_id, flags, in.data(),
+				      in.size(), out.data(), &out_len,
+				      &origin),
+		      origin, "ENC_DEC");
+		return out_len;
+	}
+
+	std::size_t run_aes(const Aes &op, uint32_t dir, Bytes in,
+			    MutableBytes out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t out_len = out.size();
+
+		check(tees_crypto_run_iv(get(), op.key_id,
+					 AES | dir | uint32_t(op.mode) |
+					 key_flags(op),
+					 in.data(), in.size(),
+					 out.data(), &out_len,
+					 op.iv.data(), op.iv.size(), &origin),
+		      origin, "ENC_DEC");
+		return out_len;
+	}
+
+	/*
+	 * The signature travels in an in/out buffer, so it is copied to keep
+	 * the caller's buffer untouched.
+	 */
+	bool check_sig(uint32_t key_id, uint32_t flags, Bytes in, Bytes sig,
+		       TEEC_Result invalid)
+	{
+		std::array<uint8_t, 512> buf;
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t len = sig.size();
+		TEEC_Result res;
+
+		if (len > buf.size())
+			throw Error("ENC_DEC", TEEC_ERROR_BAD_PARAMETERS,
+				    TEEC_ORIGIN_API);
+		std::memcpy(buf.data(), sig.data(), len);
+
+		res = tees_crypto_run(get(), key_id, flags, in.data(),
+				      in.size(), buf.data(), &len, &origin);
+		if (res == invalid)
+			return false;
+		check(res, origin, "ENC_DEC");
+		return true;
+	}
+};
+
+/*
+ * Random bytes from the TEE pooled on the host, see tees_random_pool in
+ * teesecure.h. Used by one thread at a time, it must not outlive the
+ * session it draws from.
+ */
+class RandomPool {
+public:
+	RandomPool(Context &ctx, CryptoSession &sess,
+		   std::size_t size = 64 * 1024)
+		: pool_(new tees_random_pool())
+	{
+		TEEC_Result res = tees_random_pool_init(pool_.get(), ctx.get(),
+							sess.get(), size);
+
+		if (res != TEEC_SUCCESS) {
+			delete pool_.release();
+			throw Error("TEEC_AllocateSharedMemory", res,
+				    TEEC_ORIGIN_API);
+		}
+	}
+
+	void fill(MutableBytes out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_random_pool_get(pool_.get(), out.data(), out.size(),
+					   &origin),
+		      origin, "RANDOM");
+	}
+
+	uint32_t refills() const noexcept { return pool_->refills; }
+
+private:
+	struct Free {
+		void operator()(tees_random_pool *pool) const noexcept
+		{
+			tees_random_pool_free(pool);
+			delete pool;
+		}
+	};
+
+	std::unique_ptr<tees_random_pool, Free> pool_;
+};
+
+enum class Placement : uint32_t {
+	Auto = TA_SECURE_STORAGE_PLACE_AUTO,
+	Critical = TA_SECURE_STORAGE_PLACE_CRITICAL,
+	Bulk = TA_SECURE_STORAGE_PLACE_BULK,
+};
+
+/* Position in an append-only log, start with a zeroed one */
+struct LogCursor {
+	uint32_t segment = 0;
+	uint32_t offset = 0;
+};
+
+using StorageStats = std::array<secure_storage_cmd_stats,
+				TA_SECURE_STORAGE_CMD_COUNT>;
+
+class StorageSession : public Session {
+public:
+	explicit StorageSession(Context &ctx)
+		: Session(ctx, TEEC_UUID TA_SECURE_STORAGE_UUID) {}
+
+	/*
+	 * Returns the object size. An out span too small throws with
+	 * TEEC_ERROR_SHORT_BUFFER, size() tells the size needed.
+	 */
+	std::size_t read(const std::string &id, MutableBytes out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t len = out.size();
+
+		check(tees_storage_read(get(), id.c_str(), out.data(), &len,
+					&origin),
+		      origin, "READ_RAW");
+		return len;
+	}
+
+	/* Same as read(), version is set to the object version */
+	std::size_t read(const std::string &id, MutableBytes out,
+			 uint64_t &version)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t len = out.size();
+
+		check(tees_storage_read_version(get(), id.c_str(), out.data(),
+						&len, &version, &origin),
+		      origin, "READ_RAW");
+		return len;
+	}
+
+	/* Size of an object, without reading it */
+	std::size_t size(const std::string &id)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t len = 0;
+		TEEC_Result res;
+
+		res = tees_storage_read(get(), id.c_str(), nullptr, &len,
+					&origin);
+		if (res != TEEC_ERROR_SHORT_BUFFER)
+			check(res, origin, "READ_RAW");
+		return len;
+	}
+
+	void write(const std::string &id, Bytes data,
+		   Placement placement = Placement::Auto)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_storage_write(get(), id.c_str(), data.data(),
+					 data.size(), uint32_t(placement),
+					 &origin),
+		      origin, "WRITE_RAW");
+	}
+
+	/*
+	 * Writes only if the object is at version, which is then set to the
+	 * new version. Returns false, with version set to the current one,
+	 * when somebody else wrote the object first. TEES_VERSION_NONE only
+	 * creates the object, see tees_storage_write_if_version().
+	 */
+	bool write_if_version(const std::string &id, Bytes data,
+			      uint64_t &version,
+			      Placement placement = Placement::Auto)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		TEEC_Result res;
+
+		res = tees_storage_write_if_version(get(), id.c_str(),
+						    data.data(), data.size(),
+						    uint32_t(placement),
+						    &version, &origin);
+		if (res == TEEC_ERROR_BAD_STATE)
+			return false;
+		check(res, origin, "WRITE_IF_VERSION");
+		return true;
+	}
+
+	void write_buffered(const std::string &id, Bytes data)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_storage_write_buffered(get(), id.c_str(),
+						  data.data(), data.size(),
+						  &origin),
+		      origin, "WRITE_BUFFERED");
+	}
+
+	/* Metadata from the TA's index, the object is not read */
+	secure_storage_stat stat(const std::string &id)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		secure_storage_stat st;
+
+		check(tees_storage_stat(get(), id.c_str(), &st, &origin),
+		      origin, "STAT");
+		return st;
+	}
+
+	bool exists(const std::string &id)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		int exists;
+
+		check(tees_storage_exists(get(), id.c_str(), &exists, &origin),
+		      origin, "EXISTS");
+		return exists;
+	}
+
+	/* Returns false when there was no such object */
+	bool remove(const std::string &id)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		TEEC_Result res = tees_storage_delete(get(), id.c_str(),
+						      &origin);
+
+		if (res == TEEC_ERROR_ITEM_NOT_FOUND)
+			return false;
+		check(res, origin, "DELETE");
+		return true;
+	}
+
+	void flush(uint32_t flags = 0)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_storage_flush(get(), flags, &origin), origin,
+		      "FLUSH");
+	}
+
+	void set_policy(uint32_t flags, uint32_t rpmb_max_size)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_storage_set_policy(get(), flags, rpmb_max_size,
+					      &origin),
+		      origin, "SET_POLICY");
+	}
+
+	void log_append(const std::string &id, Bytes record)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_storage_log_append(get(), id.c_str(),
+					      record.data(), record.size(),
+					      &origin),
+		      origin, "LOG_APPEND");
+	}
+
+	/* Returns the number of log bytes read, 0 at the end of the log */
+	std::size_t log_read(const std::string &id, LogCursor &cursor,
+			     MutableBytes out)
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		std::size_t len = out.size();
+
+		check(tees_storage_log_read(get(), id.c_str(), out.data(),
+					    &len, &cursor.segment,
+					    &cursor.offset, &origin),
+		      origin, "LOG_READ");
+		return len;
+	}
+
+	StorageStats stats()
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+		StorageStats stats;
+
+		check(tees_storage_stats(get(), stats.data(), &origin),
+		      origin, "STATS");
+		return stats;
+	}
+
+	void reset_stats()
+	{
+		uint32_t origin = TEEC_ORIGIN_API;
+
+		check(tees_storage_stats_reset(get(), &origin), origin,
+		      "STATS_RESET");
+	}
+};
+
+} /* namespace teesecure */
+
+#endif /* __TEESECURE_HPP__ */
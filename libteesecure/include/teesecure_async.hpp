@@ -0,0 +1,375 @@
+/*
+ * Asynchronous C++ API of libteesecure.
+ *
+ * A Pipeline opens a number of sessions with one TA and runs a worker
+ * thread per session, fed from a single submission queue. submit() queues
+ * a call on whichever session is free next and returns a std::future,
+ * co_await on schedule() does the same from a C++20 coroutine, which is
+ * resumed on the worker with the result. Up to one request per worker is
+ * in the TA at a time, the others wait in the queue, and submitting blocks
+ * while the queue holds depth requests. A worker submitting to its own
+ * pipeline never blocks: with the queue full it runs the request itself,
+ * on its session.
+ *
+ * Both TAs open an instance per session, so requests on different workers
+ * run in parallel in the TEE as far as the TA allows (the secure storage
+ * serializes writers).
+ *
+ * Queued calls run after submit() returns: anything they reference must
+ * stay valid until they complete. AsyncCrypto and AsyncStorage take their
+ * inputs by value and return owned buffers for that reason. The Pipeline
+ * must not outlive its Context, destroying it runs the queued requests
+ * and waits for them.
+ */
+#ifndef __TEESECURE_ASYNC_HPP__
+#define __TEESECURE_ASYNC_HPP__
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <teesecure.hpp>
+
+namespace teesecure {
+
+template <class S>
+class Pipeline {
+public:
+	Pipeline(Context &ctx, unsigned workers = 4, std::size_t depth = 64)
+		: depth_(depth ? depth : 1)
+	{
+		workers = workers ? workers : 1;
+
+		/* Sessions are opened here so that failures reach the caller */
+		sessions_.reserve(workers);
+		while (sessions_.size() < workers)
+			sessions_.emplace_back(ctx);
+
+		threads_.reserve(workers);
+		try {
+			for (S &sess : sessions_)
+				threads_.emplace_back(
+					[this, &sess] { work(sess); });
+		} catch (...) {
+			stop();
+			throw;
+		}
+	}
+
+	Pipeline(const Pipeline &) = delete;
+	Pipeline &operator=(const Pipeline &) = delete;
+
+	~Pipeline()
+	{
+		stop();
+	}
+
+	/* Runs f(session) on a worker, f may throw */
+	template <class F>
+	auto submit(F f) -> std::future<std::invoke_result_t<F &, S &>>
+	{
+		using R = std::invoke_result_t<F &, S &>;
+		auto task = std::make_unique<Task<std::packaged_task<R(S &)>>>(
+			std::packaged_task<R(S &)>(std::move(f)));
+		auto future = task->fn.get_future();
+		std::unique_ptr<Job> job = std::move(task);
+
+		if (!push(job))
+			job->run(*session_);
+		return future;
+	}
+
+	/*
+	 * Awaitable form of submit(): co_await pipeline.schedule(f) returns
+	 * what f returns, or rethrows what it threw, in the coroutine.
+	 */
+	template <class F>
+	auto schedule(F f)
+	{
+		return Awaiter<F>(*this, std::move(f));
+	}
+
+	unsigned workers() const noexcept { return sessions_.size(); }
+
+	/* Requests queued and not yet picked up by a worker */
+	std::size_t pending() const
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		return queue_.size();
+	}
+
+private:
+	struct Job {
+		virtual ~Job() = default;
+		virtual void run(S &sess) = 0;
+	};
+
+	template <class Fn>
+	struct Task : Job {
+		explicit Task(Fn f) : fn(std::move(f)) {}
+		void run(S &sess) override { fn(sess); }
+
+		Fn fn;
+	};
+
+	template <class F>
+	class Awaiter {
+		using R = std::invoke_result_t<F &, S &>;
+		using Value = std::conditional_t<std::is_void_v<R>, std::monostate,
+						 R>;
+
+	public:
+		Awaiter(Pipeline &pipeline, F f)
+			: pipeline_(pipeline), f_(std::move(f)) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		/* Does not suspend when f had to run right away */
+		bool await_suspend(std::coroutine_handle<> handle)
+		{
+			std::unique_ptr<Job> job = std::make_unique<Task<Resume>>(
+				Resume{ this, handle });
+
+			if (pipeline_.push(job))
+				return true;
+			call(*session_);
+			return false;
+		}
+
+		R await_resume()
+		{
+			if (error_)
+				std::rethrow_exception(error_);
+			if constexpr (!std::is_void_v<R>)
+				return std::move(*value_);
+		}
+
+	private:
+		void call(S &sess)
+		{
+			try {
+				if constexpr (std::is_void_v<R>)
+					f_(sess);
+				else
+					value_.emplace(f_(sess));
+			} catch (...) {
+				error_ = std::current_exception();
+			}
+		}
+
+		struct Resume {
+			void operator()(S &sess)
+			{
+				self->call(sess);
+				handle.resume();
+			}
+
+			Awaiter *self;
+			std::coroutine_handle<> handle;
+		};
+
+		Pipeline &pipeline_;
+		F f_;
+		std::optional<Value> value_;
+		std::exception_ptr error_;
+	};
+
+	/*
+	 * Queue the job once there is room. A worker of this pipeline must not
+	 * wait for room, all the workers could end up waiting: it gets false
+	 * back with the queue full and runs the job itself, on session_.
+	 */
+	bool push(std::unique_ptr<Job> &job)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			if (current_ == this && queue_.size() >= depth_)
+				return false;
+			space_.wait(lock, [this] {
+				return queue_.size() < depth_;
+			});
+			queue_.push_back(std::move(job));
+		}
+		ready_.notify_one();
+		return true;
+	}
+
+	/* Runs until stopped, requests queued before that still run */
+	void work(S &sess)
+	{
+		current_ = this;
+		session_ = &sess;
+		for (;;) {
+			std::unique_ptr<Job> job;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+
+				ready_.wait(lock, [this] {
+					return stopping_ || !queue_.empty();
+				});
+				if (queue_.empty())
+					return;
+				job = std::move(queue_.front());
+				queue_.pop_front();
+			}
+			space_.notify_one();
+			job->run(sess);
+		}
+	}
+
+	/* Lets the workers started so far drain the queue and joins them */
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stopping_ = true;
+		}
+		ready_.notify_all();
+		for (std::thread &thread : threads_)
+			thread.join();
+	}
+
+	std::vector<S> sessions_;
+	std::vector<std::thread> threads_;
+	mutable std::mutex mutex_;
+	std::condition_variable ready_;
+	std::condition_variable space_;
+	std::deque<std::unique_ptr<Job>> queue_;
+	std::size_t depth_;
+	bool stopping_ = false;
+	/* The pipeline the calling thread works for, if any, and its session */
+	static inline thread_local const Pipeline *current_;
+	static inline thread_local S *session_;
+};
+
+using Buffer = std::vector<uint8_t>;
+
+class AsyncCrypto : public Pipeline<CryptoSession> {
+public:
+	using Pipeline::Pipeline;
+
+	std::future<Buffer> digest(DigestAlg alg, Buffer in)
+	{
+		return submit([alg, in = std::move(in)](CryptoSession &sess) {
+			Buffer out(alg == DigestAlg::Sha512 ? 64 : 32);
+
+			out.resize(sess.digest(alg, in, out));
+			return out;
+		});
+	}
+
+	/* The IV is copied, op.iv need not outlive the call */
+	std::future<Buffer> encrypt(const Aes &op, Buffer in)
+	{
+		return run_aes(op, std::move(in), true);
+	}
+
+	std::future<Buffer> decrypt(const Aes &op, Buffer in)
+	{
+		return run_aes(op, std::move(in), false);
+	}
+
+	/* Signs a SHA-256 digest */
+	std::future<Buffer> sign(Rsa op, Buffer digest)
+	{
+		return submit([op, in = std::move(digest)](CryptoSession &sess) {
+			Buffer sig(512);
+
+			sig.resize(sess.sign(op, in, sig));
+			return sig;
+		});
+	}
+
+	std::future<Buffer> sign(Hmac op, Buffer data)
+	{
+		return submit([op, in = std::move(data)](CryptoSession &sess) {
+			Buffer mac(32);
+
+			mac.resize(sess.sign(op, in, mac));
+			return mac;
+		});
+	}
+
+private:
+	std::future<Buffer> run_aes(const Aes &op, Buffer in, bool encrypt)
+	{
+		std::array<uint8_t, 16> iv;
+
+		std::copy(op.iv.begin(), op.iv.end(), iv.begin());
+		return submit([key_id = op.key_id, mode = op.mode, iv,
+			       derived = op.derived, in = std::move(in),
+			       encrypt](CryptoSession &sess) {
+			Aes copy{ key_id, mode, iv, derived };
+			Buffer out(in.size());
+
+			if (encrypt)
+				out.resize(sess.encrypt(copy, in, out));
+			else
+				out.resize(sess.decrypt(copy, in, out));
+			return out;
+		});
+	}
+};
+
+class AsyncStorage : public Pipeline<StorageSession> {
+public:
+	using Pipeline::Pipeline;
+
+	std::future<Buffer> read(std::string id)
+	{
+		return submit([id = std::move(id)](StorageSession &sess) {
+			return read_object(sess, id);
+		});
+	}
+
+	std::future<void> write(std::string id, Buffer data,
+				Placement placement = Placement::Auto)
+	{
+		return submit([id = std::move(id), data = std::move(data),
+			       placement](StorageSession &sess) {
+			sess.write(id, data, placement);
+		});
+	}
+
+	/* Returns false when there was no such object */
+	std::future<bool> remove(std::string id)
+	{
+		return submit([id = std::move(id)](StorageSession &sess) {
+			return sess.remove(id);
+		});
+	}
+
+	/* Sizes the buffer first, again if a writer grew the object since */
+	static Buffer read_object(StorageSession &sess, const std::string &id)
+	{
+		Buffer out(sess.size(id));
+
+		for (;;) {
+			try {
+				out.resize(sess.read(id, out));
+				return out;
+			} catch (const Error &e) {
+				if (e.result() != TEEC_ERROR_SHORT_BUFFER)
+					throw;
+			}
+			out.resize(sess.size(id));
+		}
+	}
+};
+
+} /* namespace teesecure */
+
+#endif /* __TEESECURE_ASYNC_HPP__ */
@@ -0,0 +1,55 @@
+#include <se_ta.h>
+#include <secure_storage_ta.h>
+#include <teesecure.h>
+#include <tee_trace.h>
+
+TEEC_Result tees_context_init(TEEC_Context *ctx)
+{
+	uint64_t start = tee_trace_now();
+	TEEC_Result res;
+
+	res = TEEC_InitializeContext(NULL, ctx);
+	tee_trace_span("session", "TEEC_InitializeContext", start);
+	return res;
+}
+
+void tees_context_finalize(TEEC_Context *ctx)
+{
+	TEEC_FinalizeContext(ctx);
+}
+
+TEEC_Result tees_session_open(TEEC_Context *ctx, TEEC_Session *sess,
+			      const TEEC_UUID *uuid, uint32_t *origin)
+{
+	uint64_t start = tee_trace_now();
+	TEEC_Result res;
+
+	res = TEEC_OpenSession(ctx, sess, uuid, TEEC_LOGIN_PUBLIC,
+			       NULL, NULL, origin);
+	tee_trace_span("session", "TEEC_OpenSession", start);
+	return res;
+}
+
+void tees_session_close(TEEC_Session *sess)
+{
+	uint64_t start = tee_trace_now();
+
+	TEEC_CloseSession(sess);
+	tee_trace_span("session", "TEEC_CloseSession", start);
+}
+
+TEEC_Result tees_crypto_open(TEEC_Context *ctx, TEEC_Session *sess,
+			     uint32_t *origin)
+{
+	const TEEC_UUID uuid = TA_SE_UUID;
+
+	return tees_session_open(ctx, sess, &uuid, origin);
+}
+
+TEEC_Result tees_storage_open(TEEC_Context *ctx, TEEC_Session *sess,
+			      uint32_t *origin)
+{
+	const TEEC_UUID uuid = TA_SECURE_STORAGE_UUID;
+
+	return tees_session_open(ctx, sess, &uuid, origin);
+}
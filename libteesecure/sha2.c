@@ -0,0 +1,378 @@
+/*
+ * Portable SHA-256/SHA-512 (FIPS 180-4) and the run time selection of the
+ * SHA-256 block function.
+ */
+#include <string.h>
+
+#include <tees_sha2.h>
+
+#include "sha2_local.h"
+
+typedef void (*sha256_blocks_fn)(uint32_t *state, const uint8_t *data,
+				 size_t nblocks);
+
+const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static const uint64_t sha512_k[80] = {
+	0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL,
+	0xe9b5dba58189dbbcULL, 0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL,
+	0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL, 0xd807aa98a3030242ULL,
+	0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+	0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL,
+	0xc19bf174cf692694ULL, 0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL,
+	0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL, 0x2de92c6f592b0275ULL,
+	0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+	0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL,
+	0xbf597fc7beef0ee4ULL, 0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL,
+	0x06ca6351e003826fULL, 0x142929670a0e6e70ULL, 0x27b70a8546d22ffcULL,
+	0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+	0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL,
+	0x92722c851482353bULL, 0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL,
+	0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL, 0xd192e819d6ef5218ULL,
+	0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+	0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL,
+	0x34b0bcb5e19b48a8ULL, 0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL,
+	0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL, 0x748f82ee5defb2fcULL,
+	0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+	0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL,
+	0xc67178f2e372532bULL, 0xca273eceea26619cULL, 0xd186b8c721c0c207ULL,
+	0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL, 0x06f067aa72176fbaULL,
+	0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+	0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL,
+	0x431d67c49c100d4cULL, 0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL,
+	0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+};
+
+#define ROR32(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define ROR64(x, n)	(((x) >> (n)) | ((x) << (64 - (n))))
+#define CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+
+static uint32_t load_be32(const uint8_t *p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+	       ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t load_be64(const uint8_t *p)
+{
+	return ((uint64_t)load_be32(p) << 32) | load_be32(p + 4);
+}
+
+static void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void store_be64(uint8_t *p, uint64_t v)
+{
+	store_be32(p, v >> 32);
+	store_be32(p + 4, v);
+}
+
+static void sha256_blocks_c(uint32_t *state, const uint8_t *data,
+			    size_t nblocks)
+{
+	uint32_t w[64];
+	uint32_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (nblocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be32(data + 4 * i);
+		for (; i < 64; i++)
+			w[i] = (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^
+				(w[i - 2] >> 10)) + w[i - 7] +
+			       (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^
+				(w[i - 15] >> 3)) + w[i - 16];
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+		for (i = 0; i < 64; i++) {
+			t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+			     CH(e, f, g) + sha256_k[i] + w[i];
+			t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+			     MAJ(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+		data += 64;
+	}
+}
+
+static void sha512_blocks_c(uint64_t *state, const uint8_t *data,
+			    size_t nblocks)
+{
+	uint64_t w[80];
+	uint64_t a, b, c, d, e, f, g, h, t1, t2;
+	int i;
+
+	while (nblocks--) {
+		for (i = 0; i < 16; i++)
+			w[i] = load_be64(data + 8 * i);
+		for (; i < 80; i++)
+			w[i] = (ROR64(w[i - 2], 19) ^ ROR64(w[i - 2], 61) ^
+				(w[i - 2] >> 6)) + w[i - 7] +
+			       (ROR64(w[i - 15], 1) ^ ROR64(w[i - 15], 8) ^
+				(w[i - 15] >> 7)) + w[i - 16];
+
+		a = state[0];
+		b = state[1];
+		c = state[2];
+		d = state[3];
+		e = state[4];
+		f = state[5];
+		g = state[6];
+		h = state[7];
+		for (i = 0; i < 80; i++) {
+			t1 = h + (ROR64(e, 14) ^ ROR64(e, 18) ^ ROR64(e, 41)) +
+			     CH(e, f, g) + sha512_k[i] + w[i];
+			t2 = (ROR64(a, 28) ^ ROR64(a, 34) ^ ROR64(a, 39)) +
+			     MAJ(a, b, c);
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+		data += 128;
+	}
+}
+
+static sha256_blocks_fn sha256_resolved;
+
+/* Probing is idempotent, racing threads all store the same pointer */
+static sha256_blocks_fn sha256_select(void)
+{
+	sha256_blocks_fn fn = __atomic_load_n(&sha256_resolved,
+					      __ATOMIC_RELAXED);
+
+	if (fn)
+		return fn;
+
+	fn = sha256_blocks_c;
+#ifdef SHA2_HAVE_X86
+	if (sha256_x86_supported())
+		fn = sha256_blocks_x86;
+#endif
+#ifdef SHA2_HAVE_ARM
+	if (sha256_arm_supported())
+		fn = sha256_blocks_arm;
+#endif
+	__atomic_store_n(&sha256_resolved, fn, __ATOMIC_RELAXED);
+	return fn;
+}
+
+const char *tees_sha256_engine(void)
+{
+	sha256_blocks_fn fn = sha256_select();
+
+#ifdef SHA2_HAVE_X86
+	if (fn == sha256_blocks_x86)
+		return "x86-sha";
+#endif
+#ifdef SHA2_HAVE_ARM
+	if (fn == sha256_blocks_arm)
+		return "armv8-ce";
+#endif
+	return fn == sha256_blocks_c ? "c" : "unknown";
+}
+
+void tees_sha256_init(struct tees_sha256_ctx *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->blocks = sha256_select();
+}
+
+void tees_sha256_update(struct tees_sha256_ctx *ctx, const void *data,
+			size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->len % sizeof(ctx->buf);
+
+	ctx->len += len;
+
+	if (used) {
+		size_t n = sizeof(ctx->buf) - used;
+
+		if (len < n) {
+			memcpy(ctx->buf + used, p, len);
+			return;
+		}
+		memcpy(ctx->buf + used, p, n);
+		ctx->blocks(ctx->state, ctx->buf, 1);
+		p += n;
+		len -= n;
+	}
+
+	/* Whole blocks are hashed straight from the caller's buffer */
+	if (len >= sizeof(ctx->buf)) {
+		ctx->blocks(ctx->state, p, len / sizeof(ctx->buf));
+		p += len & ~(sizeof(ctx->buf) - 1);
+		len %= sizeof(ctx->buf);
+	}
+	memcpy(ctx->buf, p, len);
+}
+
+void tees_sha256_final(struct tees_sha256_ctx *ctx,
+		       uint8_t digest[TEES_SHA256_SIZE])
+{
+	size_t used = ctx->len % sizeof(ctx->buf);
+	int i;
+
+	ctx->buf[used++] = 0x80;
+	if (used > sizeof(ctx->buf) - 8) {
+		memset(ctx->buf + used, 0, sizeof(ctx->buf) - used);
+		ctx->blocks(ctx->state, ctx->buf, 1);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, sizeof(ctx->buf) - 8 - used);
+	store_be64(ctx->buf + sizeof(ctx->buf) - 8, ctx->len << 3);
+	ctx->blocks(ctx->state, ctx->buf, 1);
+
+	for (i = 0; i < 8; i++)
+		store_be32(digest + 4 * i, ctx->state[i]);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void tees_sha256(const void *data, size_t len,
+		 uint8_t digest[TEES_SHA256_SIZE])
+{
+	struct tees_sha256_ctx ctx;
+
+	tees_sha256_init(&ctx);
+	tees_sha256_update(&ctx, data, len);
+	tees_sha256_final(&ctx, digest);
+}
+
+void tees_sha512_init(struct tees_sha512_ctx *ctx)
+{
+	static const uint64_t iv[8] = {
+		0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL,
+		0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+		0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL,
+		0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->len = 0;
+	ctx->blocks = sha512_blocks_c;
+}
+
+void tees_sha512_update(struct tees_sha512_ctx *ctx, const void *data,
+			size_t len)
+{
+	const uint8_t *p = data;
+	size_t used = ctx->len % sizeof(ctx->buf);
+
+	ctx->len += len;
+
+	if (used) {
+		size_t n = sizeof(ctx->buf) - used;
+
+		if (len < n) {
+			memcpy(ctx->buf + used, p, len);
+			return;
+		}
+		memcpy(ctx->buf + used, p, n);
+		ctx->blocks(ctx->state, ctx->buf, 1);
+		p += n;
+		len -= n;
+	}
+
+	if (len >= sizeof(ctx->buf)) {
+		ctx->blocks(ctx->state, p, len / sizeof(ctx->buf));
+		p += len & ~(sizeof(ctx->buf) - 1);
+		len %= sizeof(ctx->buf);
+	}
+	memcpy(ctx->buf, p, len);
+}
+
+void tees_sha512_final(struct tees_sha512_ctx *ctx,
+		       uint8_t digest[TEES_SHA512_SIZE])
+{
+	size_t used = ctx->len % sizeof(ctx->buf);
+	int i;
+
+	/* Lengths are counted in bytes, the high 64 bits are always zero */
+	ctx->buf[used++] = 0x80;
+	if (used > sizeof(ctx->buf) - 16) {
+		memset(ctx->buf + used, 0, sizeof(ctx->buf) - used);
+		ctx->blocks(ctx->state, ctx->buf, 1);
+		used = 0;
+	}
+	memset(ctx->buf + used, 0, sizeof(ctx->buf) - 8 - used);
+	store_be64(ctx->buf + sizeof(ctx->buf) - 8, ctx->len << 3);
+	ctx->blocks(ctx->state, ctx->buf, 1);
+
+	for (i = 0; i < 8; i++)
+		store_be64(digest + 8 * i, ctx->state[i]);
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+void tees_sha512(const void *data, size_t len,
+		 uint8_t digest[TEES_SHA512_SIZE])
+{
+	struct tees_sha512_ctx ctx;
+
+	tees_sha512_init(&ctx);
+	tees_sha512_update(&ctx, data, len);
+	tees_sha512_final(&ctx, digest);
+}
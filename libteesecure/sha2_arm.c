@@ -0,0 +1,71 @@
+/*
+ * SHA-256 block function using the ARMv8 crypto extensions. Built with a
+ * target attribute so the library still runs on cores without them, it is
+ * only called when the kernel reports HWCAP_SHA2.
+ */
+#if defined(__aarch64__)
+
+#include <arm_neon.h>
+#include <sys/auxv.h>
+
+#include "sha2_local.h"
+
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2	(1 << 6)
+#endif
+
+#ifdef __clang__
+#define ARM_CE_TARGET __attribute__((target("crypto")))
+#else
+#define ARM_CE_TARGET __attribute__((target("+crypto")))
+#endif
+
+int sha256_arm_supported(void)
+{
+	return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+}
+
+/* Each step runs four rounds and computes the next four schedule words */
+ARM_CE_TARGET
+void sha256_blocks_arm(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+	uint32x4_t state0, state1, abcd, efgh, tmp, prev;
+	uint32x4_t w[4];
+	int i;
+
+	state0 = vld1q_u32(&state[0]);
+	state1 = vld1q_u32(&state[4]);
+
+	while (nblocks--) {
+		abcd = state0;
+		efgh = state1;
+
+		for (i = 0; i < 4; i++)
+			w[i] = vreinterpretq_u32_u8(vrev32q_u8(
+				vld1q_u8(data + 16 * i)));
+
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			uint32x4_t *cur = &w[i & 3];
+
+			tmp = vaddq_u32(*cur, vld1q_u32(&sha256_k[4 * i]));
+			if (i < 12)
+				*cur = vsha256su1q_u32(
+					vsha256su0q_u32(*cur, w[(i + 1) & 3]),
+					w[(i + 2) & 3], w[(i + 3) & 3]);
+
+			prev = state0;
+			state0 = vsha256hq_u32(state0, state1, tmp);
+			state1 = vsha256h2q_u32(state1, prev, tmp);
+		}
+
+		state0 = vaddq_u32(state0, abcd);
+		state1 = vaddq_u32(state1, efgh);
+		data += 64;
+	}
+
+	vst1q_u32(&state[0], state0);
+	vst1q_u32(&state[4], state1);
+}
+
+#endif
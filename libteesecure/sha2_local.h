@@ -0,0 +1,25 @@
+/*
+ * SHA-256 block functions, internal to libteesecure. Each one processes
+ * nblocks 64 byte blocks and updates state in place.
+ */
+#ifndef __SHA2_LOCAL_H__
+#define __SHA2_LOCAL_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+extern const uint32_t sha256_k[64];
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA2_HAVE_X86
+int sha256_x86_supported(void);
+void sha256_blocks_x86(uint32_t *state, const uint8_t *data, size_t nblocks);
+#endif
+
+#if defined(__aarch64__)
+#define SHA2_HAVE_ARM
+int sha256_arm_supported(void);
+void sha256_blocks_arm(uint32_t *state, const uint8_t *data, size_t nblocks);
+#endif
+
+#endif /* __SHA2_LOCAL_H__ */
@@ -0,0 +1,88 @@
+/*
+ * SHA-256 block function using the x86 SHA extensions (SHA-NI). Built
+ * with target attributes so the rest of the library keeps the baseline
+ * ISA, it is only called when cpuid reports the extensions.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#include "sha2_local.h"
+
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1,ssse3")))
+
+int sha256_x86_supported(void)
+{
+	unsigned int eax, ebx, ecx, edx;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 0;
+	if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+		return 0;
+	if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return (ebx & bit_SHA) != 0;
+}
+
+/*
+ * The state is kept as ABEF and CDGH for sha256rnds2, each step below runs
+ * four rounds and computes the next four words of the message schedule.
+ */
+SHA_NI_TARGET
+void sha256_blocks_x86(uint32_t *state, const uint8_t *data, size_t nblocks)
+{
+	const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+					     0x0405060700010203ULL);
+	__m128i state0, state1, abef, cdgh, tmp, msg;
+	__m128i w[4];
+	int i;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	state1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xb1);		/* CDAB */
+	state1 = _mm_shuffle_epi32(state1, 0x1b);	/* EFGH */
+	state0 = _mm_alignr_epi8(tmp, state1, 8);	/* ABEF */
+	state1 = _mm_blend_epi16(state1, tmp, 0xf0);	/* CDGH */
+
+	while (nblocks--) {
+		abef = state0;
+		cdgh = state1;
+
+		for (i = 0; i < 4; i++)
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+				(const __m128i *)(data + 16 * i)), bswap);
+
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			__m128i *cur = &w[i & 3];
+
+			if (i >= 4) {
+				tmp = _mm_sha256msg1_epu32(*cur, w[(i + 1) & 3]);
+				tmp = _mm_add_epi32(tmp,
+					_mm_alignr_epi8(w[(i + 3) & 3],
+							w[(i + 2) & 3], 4));
+				*cur = _mm_sha256msg2_epu32(tmp, w[(i + 3) & 3]);
+			}
+
+			msg = _mm_add_epi32(*cur, _mm_loadu_si128(
+				(const __m128i *)&sha256_k[4 * i]));
+			state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+		}
+
+		state0 = _mm_add_epi32(state0, abef);
+		state1 = _mm_add_epi32(state1, cdgh);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(state0, 0x1b);		/* FEBA */
+	state1 = _mm_shuffle_epi32(state1, 0xb1);	/* DCHG */
+	state0 = _mm_blend_epi16(tmp, state1, 0xf0);	/* DCBA */
+	state1 = _mm_alignr_epi8(state1, tmp, 8);	/* HGFE */
+	_mm_storeu_si128((__m128i *)&state[0], state0);
+	_mm_storeu_si128((__m128i *)&state[4], state1);
+}
+
+#endif
@@ -0,0 +1,339 @@
+#include <string.h>
+
+#include <secure_storage_ta.h>
+#include <teesecure.h>
+#include <tee_trace.h>
+
+TEEC_Result tees_storage_read(TEEC_Session *sess, const char *id,
+			      void *data, size_t *data_len, uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = *data_len;
+
+	res = tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_READ_RAW,
+			       "READ_RAW", &op, origin);
+	/* Also the size needed on TEEC_ERROR_SHORT_BUFFER */
+	*data_len = op.params[1].tmpref.size;
+	return res;
+}
+
+TEEC_Result tees_storage_read_version(TEEC_Session *sess, const char *id,
+				      void *data, size_t *data_len,
+				      uint64_t *version, uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_OUTPUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = *data_len;
+
+	res = tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_READ_RAW,
+			       "READ_RAW", &op, origin);
+	*data_len = op.params[1].tmpref.size;
+	*version = ((uint64_t)op.params[2].value.b << 32) |
+		   op.params[2].value.a;
+	return res;
+}
+
+TEEC_Result tees_storage_write(TEEC_Session *sess, const char *id,
+			       const void *data, size_t data_len,
+			       uint32_t placement, uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INPUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = (void *)data;
+	op.params[1].tmpref.size = data_len;
+	op.params[2].value.a = placement;
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_WRITE_RAW,
+				"WRITE_RAW", &op, origin);
+}
+
+TEEC_Result tees_storage_write_buffered(TEEC_Session *sess, const char *id,
+					const void *data, size_t data_len,
+					uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = (void *)data;
+	op.params[1].tmpref.size = data_len;
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_WRITE_BUFFERED,
+				"WRITE_BUFFERED", &op, origin);
+}
+
+TEEC_Result tees_storage_write_if_version(TEEC_Session *sess, const char *id,
+					  const void *data, size_t data_len,
+					  uint32_t placement, uint64_t *version,
+					  uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_INOUT, TEEC_VALUE_INPUT);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = (void *)data;
+	op.params[1].tmpref.size = data_len;
+	op.params[2].value.a = (uint32_t)*version;
+	op.params[2].value.b = (uint32_t)(*version >> 32);
+	op.params[3].value.a = placement;
+
+	res = tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_WRITE_IF_VERSION,
+			       "WRITE_IF_VERSION", &op, origin);
+	if (res == TEEC_SUCCESS || res == TEEC_ERROR_BAD_STATE)
+		*version = ((uint64_t)op.params[2].value.b << 32) |
+			   op.params[2].value.a;
+	return res;
+}
+
+TEEC_Result tees_storage_delete(TEEC_Session *sess, const char *id,
+				uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_DELETE,
+				"DELETE", &op, origin);
+}
+
+TEEC_Result tees_storage_stat(TEEC_Session *sess, const char *id,
+			      struct secure_storage_stat *stat,
+			      uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = stat;
+	op.params[1].tmpref.size = sizeof(*stat);
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_STAT,
+				"STAT", &op, origin);
+}
+
+TEEC_Result tees_storage_exists(TEEC_Session *sess, const char *id,
+				int *exists, uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_VALUE_OUTPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+
+	res = tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_EXISTS,
+			       "EXISTS", &op, origin);
+	*exists = res == TEEC_SUCCESS && op.params[1].value.a;
+	return res;
+}
+
+TEEC_Result tees_storage_flush(TEEC_Session *sess, uint32_t flags,
+			       uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].value.a = flags;
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_FLUSH,
+				"FLUSH", &op, origin);
+}
+
+TEEC_Result tees_storage_set_policy(TEEC_Session *sess, uint32_t flags,
+				    uint32_t rpmb_max_size, uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].value.a = flags;
+	op.params[0].value.b = rpmb_max_size;
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_SET_POLICY,
+				"SET_POLICY", &op, origin);
+}
+
+TEEC_Result tees_storage_log_append(TEEC_Session *sess, const char *id,
+				    const void *data, size_t data_len,
+				    uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = (void *)data;
+	op.params[1].tmpref.size = data_len;
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_LOG_APPEND,
+				"LOG_APPEND", &op, origin);
+}
+
+TEEC_Result tees_storage_log_read(TEEC_Session *sess, const char *id,
+				  void *data, size_t *data_len,
+				  uint32_t *seg, uint32_t *offset,
+				  uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_VALUE_INOUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)id;
+	op.params[0].tmpref.size = strlen(id);
+	op.params[1].tmpref.buffer = data;
+	op.params[1].tmpref.size = *data_len;
+	op.params[2].value.a = *seg;
+	op.params[2].value.b = *offset;
+
+	res = tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_LOG_READ,
+			       "LOG_READ", &op, origin);
+	if (res == TEEC_SUCCESS) {
+		*data_len = op.params[1].tmpref.size;
+		*seg = op.params[2].value.a;
+		*offset = op.params[2].value.b;
+	}
+	return res;
+}
+
+TEEC_Result tees_storage_export_chunk(TEEC_Session *sess, const void *key,
+				      void *chunk, size_t *chunk_len,
+				      struct secure_storage_archive_cursor *cur,
+				      uint32_t *origin)
+{
+	TEEC_Operation op;
+	TEEC_Result res;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_MEMREF_TEMP_INOUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)key;
+	op.params[0].tmpref.size = TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE;
+	op.params[1].tmpref.buffer = chunk;
+	op.params[1].tmpref.size = *chunk_len;
+	op.params[2].tmpref.buffer = cur;
+	op.params[2].tmpref.size = sizeof(*cur);
+
+	res = tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_EXPORT,
+			       "EXPORT", &op, origin);
+	if (res == TEEC_SUCCESS || res == TEEC_ERROR_SHORT_BUFFER)
+		*chunk_len = op.params[1].tmpref.size;
+	return res;
+}
+
+TEEC_Result tees_storage_import_chunk(TEEC_Session *sess, const void *key,
+				      const void *chunk, size_t chunk_len,
+				      struct secure_storage_archive_cursor *cur,
+				      uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INPUT,
+					 TEEC_MEMREF_TEMP_INOUT, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = (void *)key;
+	op.params[0].tmpref.size = TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE;
+	op.params[1].tmpref.buffer = (void *)chunk;
+	op.params[1].tmpref.size = chunk_len;
+	op.params[2].tmpref.buffer = cur;
+	op.params[2].tmpref.size = sizeof(*cur);
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_IMPORT,
+				"IMPORT", &op, origin);
+}
+
+TEEC_Result tees_storage_stats(TEEC_Session *sess,
+			       struct secure_storage_cmd_stats *stats,
+			       uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_OUTPUT,
+					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+
+	op.params[0].tmpref.buffer = stats;
+	op.params[0].tmpref.size = sizeof(*stats) * TA_SECURE_STORAGE_CMD_COUNT;
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_STATS,
+				"STATS", &op, origin);
+}
+
+TEEC_Result tees_storage_stats_reset(TEEC_Session *sess, uint32_t *origin)
+{
+	TEEC_Operation op;
+
+	memset(&op, 0, sizeof(op));
+	op.paramTypes = TEEC_PARAM_TYPES(TEEC_NONE, TEEC_NONE,
+					 TEEC_NONE, TEEC_NONE);
+
+	return tee_trace_invoke(sess, TA_SECURE_STORAGE_CMD_STATS_RESET,
+				"STATS_RESET", &op, origin);
+}
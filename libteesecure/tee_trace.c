@@ -0,0 +1,150 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <tee_trace.h>
+
+/*
+ * trace_file is only used under trace_lock. tracing tells the callers
+ * whether to bother at all without taking it.
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static bool tracing;
+
+/* Write s as the contents of a JSON string */
+static void put_string(const char *s)
+{
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			fprintf(trace_file, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(trace_file, "\\u%04x", c);
+		else
+			fputc(c, trace_file);
+	}
+}
+
+/* Threads still running at exit find tracing stopped */
+static void tee_trace_finish(void)
+{
+	pthread_mutex_lock(&trace_lock);
+	__atomic_store_n(&tracing, false, __ATOMIC_RELAXED);
+	fprintf(trace_file, "\n]}\n");
+	fclose(trace_file);
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void tee_trace_init(const char *prog, const char *path)
+{
+	if (!path)
+		path = getenv(TEE_TRACE_ENV);
+	if (!path || !*path)
+		return;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+
+	trace_file = fopen(path, "w");
+	if (!trace_file) {
+		perror(path);
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+
+	fprintf(trace_file,
+		"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+		"\"args\":{\"name\":\"", (int)getpid());
+	put_string(prog);
+	fprintf(trace_file, "\"}}");
+	__atomic_store_n(&tracing, true, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&trace_lock);
+	atexit(tee_trace_finish);
+}
+
+uint64_t tee_trace_now(void)
+{
+	struct timespec ts;
+
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Every event starts with the separator and is written whole under the
+ * lock, so events of different threads never interleave.
+ */
+static void emit(const char *cat, const char *name, uint64_t start_us,
+		 const char *args)
+{
+	uint64_t end_us = tee_trace_now();
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_file) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+
+	fprintf(trace_file, ",\n{\"ph\":\"X\",\"cat\":\"");
+	put_string(cat);
+	fprintf(trace_file, "\",\"name\":\"");
+	put_string(name);
+	fprintf(trace_file,
+		"\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%ld,"
+		"\"args\":{%s}}",
+		(unsigned long long)start_us,
+		(unsigned long long)(end_us - start_us),
+		(int)getpid(), (long)syscall(SYS_gettid), args);
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void tee_trace_span(const char *cat, const char *name, uint64_t start_us)
+{
+	if (__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		emit(cat, name, start_us, "");
+}
+
+void tee_trace_span_bytes(const char *cat, const char *name,
+			  uint64_t start_us, size_t bytes)
+{
+	char args[32];
+
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		return;
+
+	snprintf(args, sizeof(args), "\"bytes\":%zu", bytes);
+	emit(cat, name, start_us, args);
+}
+
+TEEC_Result tee_trace_invoke(TEEC_Session *sess, uint32_t cmd,
+			     const char *name, TEEC_Operation *op,
+			     uint32_t *origin)
+{
+	uint64_t start_us = tee_trace_now();
+	TEEC_Result res;
+	char args[64];
+
+	res = TEEC_InvokeCommand(sess, cmd, op, origin);
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED))
+		return res;
+
+	snprintf(args, sizeof(args),
+		 "\"cmd\":%u,\"res\":\"0x%08x\",\"origin\":%u",
+		 cmd, res, origin ? *origin : 0);
+	emit("invoke", name, start_us, args);
+	return res;
+}
@@ -6,9 +6,18 @@ include $(CLEAR_VARS)
 LOCAL_CFLAGS += -DANDROID_BUILD
 LOCAL_CFLAGS += -Wall
 
-LOCAL_SRC_FILES += host/main.c
+LOCAL_SRC_FILES += host/main.c \
+		   ../libteesecure/session.c \
+		   ../libteesecure/crypto.c \
+		   ../libteesecure/storage.c \
+		   ../libteesecure/tee_trace.c \
+		   ../libteesecure/sha2.c \
+		   ../libteesecure/sha2_x86.c \
+		   ../libteesecure/sha2_arm.c
 
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/ta/include \
+		    $(LOCAL_PATH)/../libteesecure/include \
+		    $(LOCAL_PATH)/../tee_crypto/ta/include \
 		    $(OPTEE_CLIENT_EXPORT)/include
 
 LOCAL_SHARED_LIBRARIES := libteec
@@ -26,8 +26,12 @@
  */
 
 #include <err.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 /* OP-TEE TEE client API (built by optee_client) */
 #include <tee_client_api.h>
@@ -35,6 +39,10 @@
 /* TA API: UUID and command IDs */
 #include <secure_storage_ta.h>
 
+#include <teesecure.h>
+
+#include <tee_trace.h>
+
 /* TEE resources */
 struct test_ctx {
 	TEEC_Context ctx;
@@ -42,25 +50,37 @@ struct test_ctx {
 };
 
 void usage(void) {
-	printf("Usage: secure_storage store -f input_file_name -i file_id\n ");
+	printf("Usage: secure_storage store -f input_file_name -i file_id [-p key|bulk] [-v expected_version|none]\n ");
 	printf("Usage: secure_storage get -f output_file_name -i file_id\n ");
+	printf("Usage: secure_storage stat -i file_id\n ");
+	printf("Usage: secure_storage exists -i file_id\n ");
+	printf("Usage: secure_storage store-batch -f list_file (lines of \"file_id input_file_name\")\n ");
+	printf("Usage: secure_storage flush\n ");
+	printf("Usage: secure_storage policy -t on|off [-s rpmb_max_size] [-d on|off] [-k on|off]\n ");
+	printf("Usage: secure_storage log-append -m message -i log_id\n ");
+	printf("Usage: secure_storage log-read -f output_file_name -i log_id\n ");
+	printf("Usage: secure_storage stats [-r on]\n ");
+	printf("Usage: secure_storage export -f archive_file -K key_file\n ");
+	printf("Usage: secure_storage import -f archive_file -K key_file\n ");
+	printf("Usage: secure_storage contend -i file_id [-n sessions] [-c reads] [-w writes]\n ");
+	printf("Usage: secure_storage bench [-n sessions] [-c ops_per_session] [-o objects] [-x read:write:delete]\n"
+	       "                            [-z size|uniform:min-max|log:min-max] [-p key|bulk] [-f json_file]\n ");
+	printf("Any mode also takes --trace trace_file (or $TEE_TRACE) to record a Chrome trace\n ");
 	return(1);
 }
 
 void prepare_tee_session(struct test_ctx *ctx)
 {
-	TEEC_UUID uuid = TA_SECURE_STORAGE_UUID;
 	uint32_t origin;
 	TEEC_Result res;
 
 	/* Initialize a context connecting us to the TEE */
-	res = TEEC_InitializeContext(NULL, &ctx->ctx);
+	res = tees_context_init(&ctx->ctx);
 	if (res != TEEC_SUCCESS)
 		errx(1, "TEEC_InitializeContext failed with code 0x%x", res);
 
 	/* Open a session with the TA */
-	res = TEEC_OpenSession(&ctx->ctx, &ctx->sess, &uuid,
-			       TEEC_LOGIN_PUBLIC, NULL, NULL, &origin);
+	res = tees_storage_open(&ctx->ctx, &ctx->sess, &origin);
 	if (res != TEEC_SUCCESS)
 		errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
 			res, origin);
@@ -68,123 +88,725 @@ void prepare_tee_session(struct test_ctx *ctx)
 
 void terminate_tee_session(struct test_ctx *ctx)
 {
-	TEEC_CloseSession(&ctx->sess);
-	TEEC_FinalizeContext(&ctx->ctx);
+	tees_session_close(&ctx->sess);
+	tees_context_finalize(&ctx->ctx);
+}
+
+static void print_storage_stats(struct secure_storage_cmd_stats *stats)
+{
+	static const char *const names[TA_SECURE_STORAGE_CMD_COUNT] = {
+		"READ_RAW", "WRITE_RAW", "DELETE", "LOG_APPEND", "LOG_READ",
+		"WRITE_BUFFERED", "FLUSH", "SET_POLICY", "STATS", "STATS_RESET",
+		"EXPORT", "IMPORT", "WRITE_IF_VERSION", "STAT", "EXISTS"
+	};
+	int i;
+
+	printf("%-16s %8s %6s %10s %10s %7s %7s %8s %8s %8s %7s %8s\n",
+	       "command", "calls", "errors", "bytes_in", "bytes_out",
+	       "avg_ms", "max_ms", "total_ms",
+	       "obj_open", "op_alloc", "crypto", "storage");
+	for (i = 0; i < TA_SECURE_STORAGE_CMD_COUNT; i++) {
+		struct secure_storage_cmd_stats *st = &stats[i];
+
+		printf("%-16s %8" PRIu32 " %6" PRIu32 " %10" PRIu64
+		       " %10" PRIu64 " %7" PRIu64 " %7" PRIu32 " %8" PRIu64
+		       " %8" PRIu64 " %8" PRIu64 " %7" PRIu64 " %8" PRIu64 "\n",
+		       names[i], st->calls, st->errors,
+		       st->bytes_in, st->bytes_out,
+		       st->calls ? st->time_total_ms / st->calls : 0,
+		       st->time_max_ms, st->time_total_ms,
+		       st->phase_total_ms[TA_SECURE_STORAGE_PHASE_OBJ_OPEN],
+		       st->phase_total_ms[TA_SECURE_STORAGE_PHASE_OP_ALLOC],
+		       st->phase_total_ms[TA_SECURE_STORAGE_PHASE_CRYPTO],
+		       st->phase_total_ms[TA_SECURE_STORAGE_PHASE_STORAGE]);
+	}
+}
+
+/*
+ * Splits the framed records accumulated in buf and writes one record per
+ * line. Returns the number of trailing bytes belonging to a record that
+ * has not been fully received yet.
+ */
+static size_t dump_log_records(FILE *file_handle, char *buf, size_t len)
+{
+	size_t pos = 0;
+	uint32_t rec_len;
+
+	while (len - pos >= sizeof(rec_len)) {
+		memcpy(&rec_len, buf + pos, sizeof(rec_len));
+		if (len - pos - sizeof(rec_len) < rec_len)
+			break;
+		pos += sizeof(rec_len);
+		fwrite(buf + pos, rec_len, 1, file_handle);
+		fputc('\n', file_handle);
+		pos += rec_len;
+	}
+
+	memmove(buf, buf + pos, len - pos);
+	return len - pos;
+}
+
+/* The archive key is read from a file holding exactly its bytes */
+static void read_archive_key(const char *key_name, uint8_t *key)
+{
+	FILE *key_handle;
+	size_t len;
+
+	if (key_name == NULL)
+		errx(1, "No archive key given, use -K key_file");
+	key_handle = fopen(key_name, "rb");
+	if (key_handle == NULL)
+		err(1, "Failed to open %s", key_name);
+	len = fread(key, 1, TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE, key_handle);
+	if (len != TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE || fgetc(key_handle) != EOF)
+		errx(1, "%s must hold a %d byte key", key_name,
+		     TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE);
+	fclose(key_handle);
+}
+
+/*
+ * Contention benchmark: every reader runs a session of its own, hence a TA
+ * instance of its own, and reads the same object over and over while an
+ * optional writer session rewrites it.
+ */
+struct contend_job {
+	TEEC_Context *ctx;
+	const char *id;
+	const char *data;
+	size_t size;
+	int reads;
+	int writes;
+	pthread_mutex_t lock;
+	uint64_t done;
+	uint64_t busy;
+	uint64_t written;
+	uint64_t write_busy;
+	uint64_t total_us;
+	uint64_t max_us;
+	int failed;
+};
+
+/* tee_trace_now() only runs while tracing */
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-TEEC_Result read_secure_object(struct test_ctx *ctx, char *id,
-			char *data, size_t *data_len)
+static void *contend_reader(void *arg)
 {
-	TEEC_Operation op;
+	struct contend_job *job = arg;
+	char *buffer = malloc(job->size ? job->size : 1);
+	uint64_t total_us = 0;
+	uint64_t max_us = 0;
+	uint64_t done = 0;
+	uint64_t busy = 0;
+	int failed = 0;
+	TEEC_Session sess;
 	uint32_t origin;
 	TEEC_Result res;
-	size_t id_len = strlen(id);
-
-	memset(&op, 0, sizeof(op));
-	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_MEMREF_TEMP_OUTPUT,
-					 TEEC_NONE, TEEC_NONE);
-
-	op.params[0].tmpref.buffer = id;
-	op.params[0].tmpref.size = id_len;
-
-	op.params[1].tmpref.buffer = data;
-	op.params[1].tmpref.size = *data_len;
-
-	res = TEEC_InvokeCommand(&ctx->sess,
-				 TA_SECURE_STORAGE_CMD_READ_RAW,
-				 &op, &origin);
-	switch (res) {
-	case TEEC_SUCCESS:
-	case TEEC_ERROR_SHORT_BUFFER:
-	case TEEC_ERROR_ITEM_NOT_FOUND:
-		break;
-	default:
-		printf("Command READ_RAW failed: 0x%x / %u\n", res, origin);
+
+	if (buffer == NULL)
+		errx(1, "Out of memory");
+
+	res = tees_storage_open(job->ctx, &sess, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
+		     res, origin);
+
+	for (int i = 0; i < job->reads; i++) {
+		size_t size = job->size;
+		uint64_t start = now_us();
+		uint64_t us;
+
+		res = tees_storage_read(&sess, job->id, buffer, &size, &origin);
+		us = now_us() - start;
+		if (res == TEEC_ERROR_BUSY) {
+			busy++;
+			continue;
+		}
+		if (res != TEEC_SUCCESS) {
+			warnx("Failed to read %s: 0x%x / %u", job->id, res,
+			      origin);
+			failed = 1;
+			break;
+		}
+		done++;
+		total_us += us;
+		if (us > max_us)
+			max_us = us;
 	}
-	*data_len = op.params[1].tmpref.size;
-	return res;
+	tees_session_close(&sess);
+	free(buffer);
+
+	pthread_mutex_lock(&job->lock);
+	job->done += done;
+	job->busy += busy;
+	job->total_us += total_us;
+	if (max_us > job->max_us)
+		job->max_us = max_us;
+	job->failed |= failed;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
 }
 
-TEEC_Result write_secure_object(struct test_ctx *ctx, char *id,
-			char *data, size_t data_len)
+static void *contend_writer(void *arg)
 {
-	TEEC_Operation op;
+	struct contend_job *job = arg;
+	uint64_t written = 0;
+	uint64_t busy = 0;
+	int failed = 0;
+	TEEC_Session sess;
 	uint32_t origin;
 	TEEC_Result res;
-	size_t id_len = strlen(id);
 
-	memset(&op, 0, sizeof(op));
-	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_NONE, TEEC_NONE);
+	res = tees_storage_open(job->ctx, &sess, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
+		     res, origin);
 
-	op.params[0].tmpref.buffer = id;
-	op.params[0].tmpref.size = id_len;
+	/* Writes back the current content so the readers see no change */
+	for (int i = 0; i < job->writes; i++) {
+		res = tees_storage_write(&sess, job->id, job->data, job->size,
+					 TA_SECURE_STORAGE_PLACE_AUTO, &origin);
+		if (res == TEEC_ERROR_BUSY) {
+			busy++;
+			continue;
+		}
+		if (res != TEEC_SUCCESS) {
+			warnx("Failed to write %s: 0x%x / %u", job->id, res,
+			      origin);
+			failed = 1;
+			break;
+		}
+		written++;
+	}
+	tees_session_close(&sess);
 
-	op.params[1].tmpref.buffer = data;
-	op.params[1].tmpref.size = data_len;
+	pthread_mutex_lock(&job->lock);
+	job->written += written;
+	job->write_busy += busy;
+	job->failed |= failed;
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
 
-	res = TEEC_InvokeCommand(&ctx->sess,
-				 TA_SECURE_STORAGE_CMD_WRITE_RAW,
-				 &op, &origin);
+static int do_contend(TEEC_Context *ctx, const char *id, int sessions,
+		      int reads, int writes)
+{
+	struct contend_job job = { 0 };
+	pthread_t threads[sessions + 1];
+	char *data = NULL;
+	size_t size = 0;
+	TEEC_Session sess;
+	uint32_t origin;
+	TEEC_Result res;
+	uint64_t start;
+	uint64_t elapsed_us;
+	int started = 0;
 
+	/* Size the read buffers, and get the content the writer puts back */
+	res = tees_storage_open(ctx, &sess, &origin);
 	if (res != TEEC_SUCCESS)
-		printf("Command WRITE_RAW failed: 0x%x / %u\n", res, origin);
+		errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
+		     res, origin);
+	res = tees_storage_read(&sess, id, NULL, &size, &origin);
+	if (res == TEEC_ERROR_SHORT_BUFFER) {
+		data = malloc(size ? size : 1);
+		if (data == NULL)
+			errx(1, "Out of memory");
+		res = tees_storage_read(&sess, id, data, &size, &origin);
+	}
+	if (res != TEEC_SUCCESS)
+		errx(1, "Failed to read %s: 0x%x / %u", id, res, origin);
+	tees_session_close(&sess);
+
+	job.ctx = ctx;
+	job.id = id;
+	job.data = data;
+	job.size = size;
+	job.reads = reads;
+	job.writes = writes;
+	pthread_mutex_init(&job.lock, NULL);
+
+	start = now_us();
+	for (int i = 0; i < sessions + (writes > 0); i++) {
+		if (pthread_create(&threads[i], NULL,
+				   i < sessions ? contend_reader :
+						  contend_writer,
+				   &job) != 0) {
+			warnx("Failed to start session %d", i);
+			break;
+		}
+		started++;
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	elapsed_us = now_us() - start;
+
+	printf("%d sessions, %" PRIu64 " reads, %" PRIu64 " busy, %" PRIu64 " writes, %" PRIu64 " busy in %" PRIu64 " ms\n",
+	       sessions, job.done, job.busy, job.written, job.write_busy,
+	       elapsed_us / 1000);
+	printf("%" PRIu64 " reads/s, latency avg %" PRIu64 " us max %" PRIu64 " us\n",
+	       elapsed_us ? job.done * 1000000 / elapsed_us : 0,
+	       job.done ? job.total_us / job.done : 0, job.max_us);
+
+	pthread_mutex_destroy(&job.lock);
+	free(data);
+	return (started == 0 || job.failed) ? -1 : 0;
+}
+
+/*
+ * Workload generator: every session runs a mix of reads, writes and
+ * deletes over a key space of bench objects, prefilled beforehand, and
+ * the latency of every operation is kept for the percentiles. The
+ * sequence of operations only depends on the options, runs can be
+ * compared with each other.
+ */
+enum { BENCH_READ, BENCH_WRITE, BENCH_DELETE, BENCH_OPS };
+
+static const char *const bench_op_names[BENCH_OPS] = {
+	"read", "write", "delete"
+};
+
+enum bench_size_dist { BENCH_SIZE_FIXED, BENCH_SIZE_UNIFORM, BENCH_SIZE_LOG };
+
+static const char *const bench_dist_names[] = { "fixed", "uniform", "log" };
+
+struct bench_config {
+	int sessions;
+	int ops;
+	uint32_t objects;
+	uint32_t mix[BENCH_OPS];
+	enum bench_size_dist dist;
+	size_t min_size;
+	size_t max_size;
+	uint32_t placement;
+};
+
+struct bench_stats {
+	uint64_t ops;
+	uint64_t misses;	/* object not found */
+	uint64_t busy;
+	uint64_t bytes;
+	uint64_t total_us;
+	uint32_t *lat_us;	/* one per operation */
+};
+
+struct bench_worker {
+	TEEC_Context *ctx;
+	const struct bench_config *cfg;
+	uint64_t rng;
+	struct bench_stats st[BENCH_OPS];
+	int failed;
+};
+
+/* xorshift64*, plenty for picking keys and sizes */
+static uint64_t bench_rand(uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545f4914f6cdd1dULL;
+}
 
-	switch (res) {
-	case TEEC_SUCCESS:
+static size_t bench_size(const struct bench_config *cfg, uint64_t *rng)
+{
+	size_t lo = cfg->min_size;
+	size_t hi = cfg->max_size;
+	int bits_lo, bits_hi, bits;
+
+	switch (cfg->dist) {
+	case BENCH_SIZE_UNIFORM:
+		break;
+	case BENCH_SIZE_LOG:
+		/* As many objects of each bit length, then uniform within it */
+		bits_lo = 64 - __builtin_clzll(lo);
+		bits_hi = 64 - __builtin_clzll(hi);
+		bits = bits_lo + bench_rand(rng) % (bits_hi - bits_lo + 1);
+		if (bits > bits_lo)
+			lo = (size_t)1 << (bits - 1);
+		if (bits < bits_hi)
+			hi = ((size_t)1 << bits) - 1;
 		break;
 	default:
-		printf("Command WRITE_RAW failed: 0x%x / %u\n", res, origin);
+		return lo;
 	}
+	return lo + bench_rand(rng) % (hi - lo + 1);
+}
 
-	return res;
+static void bench_id(char *id, size_t len, uint32_t n)
+{
+	snprintf(id, len, "bench/%" PRIu32, n);
 }
 
-TEEC_Result delete_secure_object(struct test_ctx *ctx, char *id)
+/* Payloads differ from each other, so that dedup cannot fold them */
+static void bench_stamp(char *data, size_t size, uint64_t *rng)
 {
-	TEEC_Operation op;
+	uint64_t stamp = bench_rand(rng);
+
+	memcpy(data, &stamp, size < sizeof(stamp) ? size : sizeof(stamp));
+}
+
+static void *bench_run(void *arg)
+{
+	struct bench_worker *w = arg;
+	const struct bench_config *cfg = w->cfg;
+	uint32_t mix_total = cfg->mix[BENCH_READ] + cfg->mix[BENCH_WRITE] +
+			     cfg->mix[BENCH_DELETE];
+	char *buffer = malloc(cfg->max_size);
+	char *data = malloc(cfg->max_size);
+	TEEC_Session sess;
 	uint32_t origin;
 	TEEC_Result res;
-	size_t id_len = strlen(id);
 
-	memset(&op, 0, sizeof(op));
-	op.paramTypes = TEEC_PARAM_TYPES(TEEC_MEMREF_TEMP_INPUT,
-					 TEEC_NONE, TEEC_NONE, TEEC_NONE);
+	if (buffer == NULL || data == NULL)
+		errx(1, "Out of memory");
+	for (size_t i = 0; i < cfg->max_size; i++)
+		data[i] = (char)bench_rand(&w->rng);
 
-	op.params[0].tmpref.buffer = id;
-	op.params[0].tmpref.size = id_len;
+	res = tees_storage_open(w->ctx, &sess, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
+		     res, origin);
 
-	res = TEEC_InvokeCommand(&ctx->sess,
-				 TA_SECURE_STORAGE_CMD_DELETE,
-				 &op, &origin);
+	for (int i = 0; i < cfg->ops; i++) {
+		uint32_t pick = bench_rand(&w->rng) % mix_total;
+		uint32_t n = bench_rand(&w->rng) % cfg->objects;
+		struct bench_stats *st;
+		size_t size = 0;
+		char id[32];
+		uint64_t start;
+		uint32_t us;
+		int op;
 
-	switch (res) {
-	case TEEC_SUCCESS:
-	case TEEC_ERROR_ITEM_NOT_FOUND:
-		break;
-	default:
-		printf("Command DELETE failed: 0x%x / %u\n", res, origin);
+		if (pick < cfg->mix[BENCH_READ])
+			op = BENCH_READ;
+		else if (pick < cfg->mix[BENCH_READ] + cfg->mix[BENCH_WRITE])
+			op = BENCH_WRITE;
+		else
+			op = BENCH_DELETE;
+		bench_id(id, sizeof(id), n);
+
+		if (op == BENCH_WRITE) {
+			size = bench_size(cfg, &w->rng);
+			bench_stamp(data, size, &w->rng);
+		}
+
+		start = now_us();
+		if (op == BENCH_READ) {
+			size = cfg->max_size;
+			res = tees_storage_read(&sess, id, buffer, &size,
+						&origin);
+		} else if (op == BENCH_WRITE) {
+			res = tees_storage_write(&sess, id, data, size,
+						 cfg->placement, &origin);
+		} else {
+			res = tees_storage_delete(&sess, id, &origin);
+		}
+		us = now_us() - start;
+
+		st = &w->st[op];
+		if (res == TEEC_ERROR_ITEM_NOT_FOUND) {
+			st->misses++;
+			size = 0;
+		} else if (res == TEEC_ERROR_BUSY) {
+			st->busy++;
+			continue;
+		} else if (res != TEEC_SUCCESS) {
+			warnx("Failed to %s %s: 0x%x / %u", bench_op_names[op],
+			      id, res, origin);
+			w->failed = 1;
+			break;
+		}
+		st->lat_us[st->ops++] = us;
+		st->total_us += us;
+		if (op != BENCH_DELETE)
+			st->bytes += size;
 	}
 
-	return res;
+	tees_session_close(&sess);
+	free(data);
+	free(buffer);
+	return NULL;
 }
 
-#define TEST_OBJECT_SIZE	7000
+/* Writes, or deletes when data is NULL, every object of the key space */
+static void bench_populate(TEEC_Context *ctx, const struct bench_config *cfg,
+			   char *data)
+{
+	uint64_t rng = 1;
+	TEEC_Session sess;
+	uint32_t origin;
+	TEEC_Result res;
+	char id[32];
+
+	res = tees_storage_open(ctx, &sess, &origin);
+	if (res != TEEC_SUCCESS)
+		errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
+		     res, origin);
+
+	for (uint32_t n = 0; n < cfg->objects; n++) {
+		bench_id(id, sizeof(id), n);
+		if (data != NULL) {
+			size_t size = bench_size(cfg, &rng);
+
+			bench_stamp(data, size, &rng);
+			res = tees_storage_write(&sess, id, data, size,
+						 cfg->placement, &origin);
+		} else {
+			res = tees_storage_delete(&sess, id, &origin);
+			if (res == TEEC_ERROR_ITEM_NOT_FOUND)
+				res = TEEC_SUCCESS;
+		}
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to %s %s: 0x%x / %u",
+			     data ? "write" : "delete", id, res, origin);
+	}
+	tees_session_close(&sess);
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted latencies */
+static uint32_t bench_percentile(const uint32_t *lat, uint64_t n, unsigned per_mille)
+{
+	uint64_t rank = (n * per_mille + 999) / 1000;
+
+	if (n == 0)
+		return 0;
+	return lat[rank ? rank - 1 : 0];
+}
+
+static void bench_report(FILE *out, const struct bench_config *cfg,
+			 struct bench_stats *st, uint64_t elapsed_us)
+{
+	double secs = elapsed_us ? elapsed_us / 1e6 : 1e-6;
+	uint64_t ops = 0;
+	uint64_t bytes = 0;
+
+	for (int op = 0; op < BENCH_OPS; op++) {
+		ops += st[op].ops;
+		bytes += st[op].bytes;
+	}
+
+	fprintf(out, "{\n");
+	fprintf(out, "  \"sessions\": %d,\n", cfg->sessions);
+	fprintf(out, "  \"ops_per_session\": %d,\n", cfg->ops);
+	fprintf(out, "  \"objects\": %" PRIu32 ",\n", cfg->objects);
+	fprintf(out, "  \"mix\": { \"read\": %" PRIu32 ", \"write\": %" PRIu32
+		", \"delete\": %" PRIu32 " },\n",
+		cfg->mix[BENCH_READ], cfg->mix[BENCH_WRITE],
+		cfg->mix[BENCH_DELETE]);
+	fprintf(out, "  \"size\": { \"dist\": \"%s\", \"min\": %zu, \"max\": %zu },\n",
+		bench_dist_names[cfg->dist], cfg->min_size, cfg->max_size);
+	fprintf(out, "  \"elapsed_us\": %" PRIu64 ",\n", elapsed_us);
+	fprintf(out, "  \"ops\": %" PRIu64 ",\n", ops);
+	fprintf(out, "  \"ops_per_s\": %.1f,\n", ops / secs);
+	fprintf(out, "  \"bytes_per_s\": %.1f", bytes / secs);
+
+	for (int op = 0; op < BENCH_OPS; op++) {
+		struct bench_stats *s = &st[op];
+
+		qsort(s->lat_us, s->ops, sizeof(*s->lat_us), bench_cmp_u32);
+		fprintf(out, ",\n  \"%s\": {\n", bench_op_names[op]);
+		fprintf(out, "    \"ops\": %" PRIu64 ", \"misses\": %" PRIu64
+			", \"busy\": %" PRIu64 ", \"bytes\": %" PRIu64 ",\n",
+			s->ops, s->misses, s->busy, s->bytes);
+		fprintf(out, "    \"ops_per_s\": %.1f, \"bytes_per_s\": %.1f,\n",
+			s->ops / secs, s->bytes / secs);
+		fprintf(out, "    \"latency_us\": { \"avg\": %" PRIu64
+			", \"p50\": %" PRIu32 ", \"p90\": %" PRIu32
+			", \"p99\": %" PRIu32 ", \"p999\": %" PRIu32
+			", \"max\": %" PRIu32 " }\n  }",
+			s->ops ? s->total_us / s->ops : 0,
+			bench_percentile(s->lat_us, s->ops, 500),
+			bench_percentile(s->lat_us, s->ops, 900),
+			bench_percentile(s->lat_us, s->ops, 990),
+			bench_percentile(s->lat_us, s->ops, 999),
+			s->ops ? s->lat_us[s->ops - 1] : 0);
+	}
+	fprintf(out, "\n}\n");
+}
+
+/* size, uniform:min-max or log:min-max */
+static void bench_parse_size(const char *spec, struct bench_config *cfg)
+{
+	const char *range = spec;
+	char *end;
+
+	cfg->dist = BENCH_SIZE_FIXED;
+	if (strncmp(spec, "uniform:", 8) == 0) {
+		cfg->dist = BENCH_SIZE_UNIFORM;
+		range = spec + 8;
+	} else if (strncmp(spec, "log:", 4) == 0) {
+		cfg->dist = BENCH_SIZE_LOG;
+		range = spec + 4;
+	}
+
+	cfg->min_size = strtoul(range, &end, 0);
+	cfg->max_size = cfg->min_size;
+	if (cfg->dist != BENCH_SIZE_FIXED) {
+		if (*end != '-')
+			errx(1, "Invalid size distribution %s", spec);
+		cfg->max_size = strtoul(end + 1, &end, 0);
+	}
+	if (*end || cfg->min_size == 0 || cfg->max_size < cfg->min_size)
+		errx(1, "Invalid size distribution %s", spec);
+}
+
+static void bench_parse_mix(const char *spec, struct bench_config *cfg)
+{
+	if (sscanf(spec, "%" SCNu32 ":%" SCNu32 ":%" SCNu32,
+		   &cfg->mix[BENCH_READ], &cfg->mix[BENCH_WRITE],
+		   &cfg->mix[BENCH_DELETE]) != 3 ||
+	    !(cfg->mix[BENCH_READ] + cfg->mix[BENCH_WRITE] +
+	      cfg->mix[BENCH_DELETE]))
+		errx(1, "Invalid operation mix %s, use read:write:delete", spec);
+}
+
+static int do_bench(TEEC_Context *ctx, const struct bench_config *cfg,
+		    FILE *out)
+{
+	struct bench_worker *workers = calloc(cfg->sessions, sizeof(*workers));
+	pthread_t threads[cfg->sessions];
+	struct bench_stats total[BENCH_OPS] = { 0 };
+	char *data = malloc(cfg->max_size);
+	uint64_t start;
+	uint64_t elapsed_us;
+	int started = 0;
+	int failed = 0;
+
+	if (workers == NULL || data == NULL)
+		errx(1, "Out of memory");
+	for (int op = 0; op < BENCH_OPS; op++) {
+		total[op].lat_us = malloc((size_t)cfg->sessions * cfg->ops *
+					  sizeof(uint32_t) + 1);
+		if (total[op].lat_us == NULL)
+			errx(1, "Out of memory");
+	}
+
+	fprintf(stderr, "Prefilling %" PRIu32 " objects...\n", cfg->objects);
+	memset(data, 0x5a, cfg->max_size);
+	bench_populate(ctx, cfg, data);
+
+	/* Each worker records into its own slice of the latency arrays */
+	for (int i = 0; i < cfg->sessions; i++) {
+		workers[i].ctx = ctx;
+		workers[i].cfg = cfg;
+		workers[i].rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+		for (int op = 0; op < BENCH_OPS; op++)
+			workers[i].st[op].lat_us = total[op].lat_us +
+						   (size_t)i * cfg->ops;
+	}
+
+	fprintf(stderr, "Running %d sessions of %d operations...\n",
+		cfg->sessions, cfg->ops);
+	start = now_us();
+	for (int i = 0; i < cfg->sessions; i++) {
+		if (pthread_create(&threads[i], NULL, bench_run,
+				   &workers[i]) != 0) {
+			warnx("Failed to start session %d", i);
+			failed = 1;
+			break;
+		}
+		started++;
+	}
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	elapsed_us = now_us() - start;
+
+	/* Gather the slices at the start of the arrays */
+	for (int op = 0; op < BENCH_OPS; op++) {
+		for (int i = 0; i < started; i++) {
+			struct bench_stats *s = &workers[i].st[op];
+
+			memmove(total[op].lat_us + total[op].ops, s->lat_us,
+				s->ops * sizeof(uint32_t));
+			total[op].ops += s->ops;
+			total[op].misses += s->misses;
+			total[op].busy += s->busy;
+			total[op].bytes += s->bytes;
+			total[op].total_us += s->total_us;
+		}
+	}
+	for (int i = 0; i < started; i++)
+		failed |= workers[i].failed;
+
+	bench_report(out, cfg, total, elapsed_us);
+
+	fprintf(stderr, "Removing the bench objects...\n");
+	bench_populate(ctx, cfg, NULL);
+
+	for (int op = 0; op < BENCH_OPS; op++)
+		free(total[op].lat_us);
+	free(data);
+	free(workers);
+	return failed ? -1 : 0;
+}
 
 int main(int argc, char *argv[])
 {
-	char *file_name;
-	char *file_id;
+	char *file_name = NULL;
+	char *file_id = NULL;
 
-	if( (argc != 6) && (strcmp(argv[1], "-h") != 0) ){
+	if ((argc < 2) || (argc % 2 != 0) || (strcmp(argv[1], "-h") == 0)) {
 		usage();
+		return 1;
 	}
 
-	enum {STORE, GET} mode = GET;
+	char *message = NULL;
+	uint32_t placement = TA_SECURE_STORAGE_PLACE_AUTO;
+	uint32_t policy_flags = 0;
+	uint32_t rpmb_max_size = 512;
+	int stats_reset = 0;
+	char *trace_name = NULL;
+	char *key_name = NULL;
+	int sessions = 4;
+	int reads = 100;
+	int writes = 0;
+	char *version_arg = NULL;
+	char *objects_arg = NULL;
+	char *mix_arg = "70:25:5";
+	char *size_arg = "1024";
+	uint64_t start;
+
+	enum {STORE, STORE_BATCH, FLUSH, POLICY, GET, LOG_APPEND, LOG_READ,
+	      STATS, EXPORT, IMPORT, CONTEND, BENCH, STAT, EXISTS} mode = GET;
 	if (strcmp(argv[1], "store") == 0)
 		mode = STORE;
+	else if (strcmp(argv[1], "store-batch") == 0)
+		mode = STORE_BATCH;
+	else if (strcmp(argv[1], "flush") == 0)
+		mode = FLUSH;
+	else if (strcmp(argv[1], "policy") == 0)
+		mode = POLICY;
+	else if (strcmp(argv[1], "log-append") == 0)
+		mode = LOG_APPEND;
+	else if (strcmp(argv[1], "log-read") == 0)
+		mode = LOG_READ;
+	else if (strcmp(argv[1], "stats") == 0)
+		mode = STATS;
+	else if (strcmp(argv[1], "export") == 0)
+		mode = EXPORT;
+	else if (strcmp(argv[1], "import") == 0)
+		mode = IMPORT;
+	else if (strcmp(argv[1], "contend") == 0)
+		mode = CONTEND;
+	else if (strcmp(argv[1], "bench") == 0)
+		mode = BENCH;
+	else if (strcmp(argv[1], "stat") == 0)
+		mode = STAT;
+	else if (strcmp(argv[1], "exists") == 0)
+		mode = EXISTS;
 
 	for (int i = 2; i < argc; i=i+2){
 		if (strcmp(argv[i], "-f") == 0) {
@@ -193,11 +815,69 @@ int main(int argc, char *argv[])
 		else if (strcmp(argv[i], "-i") == 0) {
 			file_id = argv[i+1];
 		}
+		else if (strcmp(argv[i], "-m") == 0) {
+			message = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-p") == 0) {
+			if (strcmp(argv[i+1], "key") == 0)
+				placement = TA_SECURE_STORAGE_PLACE_CRITICAL;
+			else if (strcmp(argv[i+1], "bulk") == 0)
+				placement = TA_SECURE_STORAGE_PLACE_BULK;
+			else
+				usage();
+		}
+		else if (strcmp(argv[i], "-t") == 0) {
+			if (strcmp(argv[i+1], "on") == 0)
+				policy_flags |= TA_SECURE_STORAGE_POLICY_TIERING;
+		}
+		else if (strcmp(argv[i], "-d") == 0) {
+			if (strcmp(argv[i+1], "on") == 0)
+				policy_flags |= TA_SECURE_STORAGE_POLICY_DEDUP;
+		}
+		else if (strcmp(argv[i], "-k") == 0) {
+			if (strcmp(argv[i+1], "on") == 0)
+				policy_flags |= TA_SECURE_STORAGE_POLICY_KV;
+		}
+		else if (strcmp(argv[i], "-s") == 0) {
+			rpmb_max_size = strtoul(argv[i+1], NULL, 0);
+		}
+		else if (strcmp(argv[i], "-r") == 0) {
+			stats_reset = strcmp(argv[i+1], "on") == 0;
+		}
+		else if (strcmp(argv[i], "-K") == 0) {
+			key_name = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-n") == 0) {
+			sessions = atoi(argv[i+1]);
+		}
+		else if (strcmp(argv[i], "-c") == 0) {
+			reads = atoi(argv[i+1]);
+		}
+		else if (strcmp(argv[i], "-w") == 0) {
+			writes = atoi(argv[i+1]);
+		}
+		else if (strcmp(argv[i], "-v") == 0) {
+			version_arg = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-o") == 0) {
+			objects_arg = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-x") == 0) {
+			mix_arg = argv[i+1];
+		}
+		else if (strcmp(argv[i], "-z") == 0) {
+			size_arg = argv[i+1];
+		}
+		else if (strcmp(argv[i], "--trace") == 0) {
+			trace_name = argv[i+1];
+		}
 		else {
 			usage();
 		}
 	}
 
+	tee_trace_init("secure_storage", trace_name);
+
 	// Read or write file open
 	// TODO: Close files afterwards
 	
@@ -205,6 +885,7 @@ int main(int argc, char *argv[])
 		printf("Storing file to secure storage...\n");
 		char *buffer = NULL;
 		FILE *file_handle = NULL;
+		start = tee_trace_now();
 		file_handle = fopen(file_name, "rb");
 		fseek(file_handle, 0L, SEEK_END); // Go to the end of the file
     	long size = ftell(file_handle); // Get file size
@@ -213,41 +894,435 @@ int main(int argc, char *argv[])
 		fread(buffer, size, 1, file_handle); // Copy file contents to the buffer
 		
 		fclose(file_handle); file_handle = NULL; // Close and nullify the file
+		tee_trace_span_bytes("file", "read input", start, size);
 
 		struct test_ctx ctx;
+		uint32_t origin;
 		TEEC_Result res;
 		prepare_tee_session(&ctx);
-		res = write_secure_object(&ctx, file_id,
-					buffer, size);
+		if (version_arg != NULL) {
+			/* Only replaces the version the caller last read */
+			uint64_t version = strcmp(version_arg, "none") == 0 ?
+					   TEES_VERSION_NONE :
+					   strtoull(version_arg, NULL, 0);
+
+			res = tees_storage_write_if_version(&ctx.sess, file_id,
+							    buffer, size,
+							    placement, &version,
+							    &origin);
+			if (res == TEEC_ERROR_BAD_STATE &&
+			    version == TEES_VERSION_NONE)
+				errx(2, "Object does not exist, it is not at %s",
+				     version_arg);
+			if (res == TEEC_ERROR_BAD_STATE)
+				errx(2, "Object is at version %" PRIu64
+				     ", not %s", version, version_arg);
+			if (res == TEEC_SUCCESS)
+				printf("Object is now at version %" PRIu64 "\n",
+				       version);
+		} else {
+			res = tees_storage_write(&ctx.sess, file_id,
+						 buffer, size, placement,
+						 &origin);
+		}
 		if (res != TEEC_SUCCESS)
-			errx(1, "Failed to create an object in the secure storage");
+			errx(1, "Failed to create an object in the secure storage: 0x%x / %u",
+			     res, origin);
 
 		printf("Stored file to secure storage.\n");
 		terminate_tee_session(&ctx);
 		return 0;
 
+	} else if (mode == STORE_BATCH) {
+
+		char line[512];
+		char id[128];
+		char path[384];
+		FILE *list_handle = NULL;
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		list_handle = fopen(file_name, "r");
+		if (list_handle == NULL)
+			err(1, "Failed to open %s", file_name);
+
+		prepare_tee_session(&ctx);
+		printf("Storing files to secure storage...\n");
+		while (fgets(line, sizeof(line), list_handle) != NULL) {
+			if (sscanf(line, "%127s %383s", id, path) != 2)
+				continue;
+
+			start = tee_trace_now();
+			FILE *file_handle = fopen(path, "rb");
+			if (file_handle == NULL)
+				err(1, "Failed to open %s", path);
+			fseek(file_handle, 0L, SEEK_END);
+			long size = ftell(file_handle);
+			rewind(file_handle);
+			char *buffer = malloc(size);
+			fread(buffer, size, 1, file_handle);
+			fclose(file_handle); file_handle = NULL;
+			tee_trace_span_bytes("file", "read input", start, size);
+
+			/* Small writes are grouped and committed together */
+			res = tees_storage_write_buffered(&ctx.sess, id,
+							  buffer, size, &origin);
+			free(buffer);
+			if (res != TEEC_SUCCESS)
+				errx(1, "Failed to store %s in the secure storage: 0x%x / %u",
+				     id, res, origin);
+		}
+		fclose(list_handle); list_handle = NULL;
+
+		res = tees_storage_flush(&ctx.sess, 0, &origin);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to flush the secure storage: 0x%x / %u",
+			     res, origin);
+
+		printf("Stored files to secure storage.\n");
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == FLUSH) {
+
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		prepare_tee_session(&ctx);
+		res = tees_storage_flush(&ctx.sess, TA_SECURE_STORAGE_FLUSH_APPLY,
+					 &origin);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to flush the secure storage: 0x%x / %u",
+			     res, origin);
+
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == POLICY) {
+
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		prepare_tee_session(&ctx);
+		res = tees_storage_set_policy(&ctx.sess, policy_flags,
+					      rpmb_max_size, &origin);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to set the storage policy: 0x%x / %u",
+			     res, origin);
+
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == STATS) {
+
+		struct secure_storage_cmd_stats stats[TA_SECURE_STORAGE_CMD_COUNT];
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		prepare_tee_session(&ctx);
+		res = tees_storage_stats(&ctx.sess, stats, &origin);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to read the performance counters: 0x%x / %u",
+			     res, origin);
+		print_storage_stats(stats);
+
+		if (stats_reset) {
+			res = tees_storage_stats_reset(&ctx.sess, &origin);
+			if (res != TEEC_SUCCESS)
+				errx(1, "Failed to reset the performance counters: 0x%x / %u",
+				     res, origin);
+		}
+
+		terminate_tee_session(&ctx);
+		return 0;
+
 	} else if (mode == GET) {
 
 		char *buffer[7000];
 		FILE *file_handle = NULL;
 		struct test_ctx ctx;
+		uint32_t origin;
 		TEEC_Result res;
 		prepare_tee_session(&ctx);
 		printf("Pulling file from secure storage...\n");
 		size_t size = sizeof(buffer);
-		res = read_secure_object(&ctx, file_id,
-					buffer, &size);
+		uint64_t version;
+		res = tees_storage_read_version(&ctx.sess, file_id,
+						buffer, &size, &version,
+						&origin);
 		if (res != TEEC_SUCCESS)
-			errx(1, "Failed to read an object from the secure storage");
+			errx(1, "Failed to read an object from the secure storage: 0x%x / %u",
+			     res, origin);
+		if (version)
+			printf("Object is at version %" PRIu64 "\n", version);
 		
+		start = tee_trace_now();
 		file_handle = fopen(file_name, "wb");
 		fwrite(buffer, size, 1, file_handle);
 
 		fclose(file_handle); file_handle = NULL;
+		tee_trace_span_bytes("file", "write output", start, size);
 
 		printf("Pulled file from secure storage.\n");
 		terminate_tee_session(&ctx);
 		return 0;
+
+	} else if (mode == STAT) {
+
+		struct secure_storage_stat st;
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		prepare_tee_session(&ctx);
+		res = tees_storage_stat(&ctx.sess, file_id, &st, &origin);
+		if (res == TEEC_ERROR_ITEM_NOT_FOUND)
+			errx(2, "No object %s in the secure storage", file_id);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to stat an object of the secure storage: 0x%x / %u",
+			     res, origin);
+
+		printf("size:     %" PRIu32 "\n", st.size);
+		printf("created:  %" PRIu64 "\n", st.created);
+		printf("modified: %" PRIu64 "\n", st.modified);
+		printf("sha256:   ");
+		for (size_t i = 0; i < sizeof(st.digest); i++)
+			printf("%02x", st.digest[i]);
+		printf("\n");
+
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == EXISTS) {
+
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		int exists;
+		prepare_tee_session(&ctx);
+		res = tees_storage_exists(&ctx.sess, file_id, &exists, &origin);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to look up an object of the secure storage: 0x%x / %u",
+			     res, origin);
+
+		printf("%s\n", exists ? "yes" : "no");
+		terminate_tee_session(&ctx);
+		return exists ? 0 : 2;
+
+	} else if (mode == LOG_APPEND) {
+
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		if (message == NULL)
+			errx(1, "No log record given, use -m message");
+		prepare_tee_session(&ctx);
+		res = tees_storage_log_append(&ctx.sess, file_id,
+					      message, strlen(message),
+					      &origin);
+		if (res != TEEC_SUCCESS)
+			errx(1, "Failed to append to a log in the secure storage: 0x%x / %u",
+			     res, origin);
+
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == LOG_READ) {
+
+		size_t buffer_size = 4096;
+		char *buffer = malloc(buffer_size);
+		size_t pending = 0;
+		uint32_t seg = 0;
+		uint32_t offset = 0;
+		FILE *file_handle = NULL;
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		if (buffer == NULL)
+			errx(1, "Out of memory");
+		prepare_tee_session(&ctx);
+		printf("Pulling log from secure storage...\n");
+		file_handle = fopen(file_name, "wb");
+		if (file_handle == NULL)
+			err(1, "Failed to open %s", file_name);
+
+		for (;;) {
+			uint32_t rec_len;
+			size_t size;
+
+			/* Grow the buffer to fit a record that does not */
+			if (pending >= sizeof(rec_len)) {
+				memcpy(&rec_len, buffer, sizeof(rec_len));
+				if (sizeof(rec_len) + rec_len > buffer_size) {
+					buffer_size = sizeof(rec_len) + rec_len;
+					buffer = realloc(buffer, buffer_size);
+					if (buffer == NULL)
+						errx(1, "Out of memory");
+				}
+			}
+
+			size = buffer_size - pending;
+			res = tees_storage_log_read(&ctx.sess, file_id,
+						   buffer + pending, &size,
+						   &seg, &offset, &origin);
+			if (res != TEEC_SUCCESS)
+				errx(1, "Failed to read a log from the secure storage: 0x%x / %u",
+				     res, origin);
+			if (size == 0)
+				break;
+			start = tee_trace_now();
+			pending = dump_log_records(file_handle, buffer,
+						   pending + size);
+			tee_trace_span_bytes("file", "write output", start, size);
+		}
+		if (pending)
+			errx(1, "Log %s ends with a truncated record", file_id);
+
+		fclose(file_handle); file_handle = NULL;
+		free(buffer);
+
+		printf("Pulled log from secure storage.\n");
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == EXPORT) {
+
+		uint8_t key[TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE];
+		struct secure_storage_archive_cursor cur;
+		char *chunk = malloc(TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE);
+		FILE *file_handle = NULL;
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		if (chunk == NULL)
+			errx(1, "Out of memory");
+		read_archive_key(key_name, key);
+		file_handle = fopen(file_name, "wb");
+		if (file_handle == NULL)
+			err(1, "Failed to open %s", file_name);
+
+		prepare_tee_session(&ctx);
+		printf("Exporting secure storage...\n");
+		memset(&cur, 0, sizeof(cur));
+		while (!(cur.flags & TA_SECURE_STORAGE_ARCHIVE_DONE)) {
+			size_t size = TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE;
+
+			res = tees_storage_export_chunk(&ctx.sess, key,
+							chunk, &size, &cur,
+							&origin);
+			if (res != TEEC_SUCCESS)
+				errx(1, "Failed to export the secure storage: 0x%x / %u",
+				     res, origin);
+			start = tee_trace_now();
+			if (fwrite(chunk, size, 1, file_handle) != 1)
+				err(1, "Failed to write %s", file_name);
+			tee_trace_span_bytes("file", "write output", start, size);
+		}
+		if (fclose(file_handle) != 0)
+			err(1, "Failed to write %s", file_name);
+		file_handle = NULL;
+
+		printf("Exported %" PRIu32 " objects in %" PRIu32 " chunks.\n",
+		       cur.item, cur.chunk);
+		memset(key, 0, sizeof(key));
+		free(chunk);
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == IMPORT) {
+
+		uint8_t key[TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE];
+		struct secure_storage_archive_cursor cur;
+		struct secure_storage_archive_chunk hdr;
+		char *chunk = malloc(TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE);
+		FILE *file_handle = NULL;
+		struct test_ctx ctx;
+		uint32_t origin;
+		TEEC_Result res;
+		if (chunk == NULL)
+			errx(1, "Out of memory");
+		read_archive_key(key_name, key);
+		file_handle = fopen(file_name, "rb");
+		if (file_handle == NULL)
+			err(1, "Failed to open %s", file_name);
+
+		prepare_tee_session(&ctx);
+		printf("Importing into secure storage...\n");
+		memset(&cur, 0, sizeof(cur));
+		while (!(cur.flags & TA_SECURE_STORAGE_ARCHIVE_DONE)) {
+			size_t size;
+
+			/* The header tells how much of the chunk follows */
+			start = tee_trace_now();
+			if (fread(&hdr, sizeof(hdr), 1, file_handle) != 1)
+				errx(1, "%s is truncated", file_name);
+			if (hdr.size > TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX)
+				errx(1, "%s is not a valid archive", file_name);
+			size = sizeof(hdr) + hdr.size +
+			       TA_SECURE_STORAGE_ARCHIVE_TAG_SIZE;
+			memcpy(chunk, &hdr, sizeof(hdr));
+			if (fread(chunk + sizeof(hdr), size - sizeof(hdr), 1,
+				  file_handle) != 1)
+				errx(1, "%s is truncated", file_name);
+			tee_trace_span_bytes("file", "read input", start, size);
+
+			res = tees_storage_import_chunk(&ctx.sess, key,
+							chunk, size, &cur,
+							&origin);
+			if (res != TEEC_SUCCESS)
+				errx(1, "Failed to import chunk %" PRIu32 ": 0x%x / %u",
+				     cur.chunk, res, origin);
+		}
+		fclose(file_handle); file_handle = NULL;
+
+		printf("Imported %" PRIu32 " objects.\n", cur.item);
+		memset(key, 0, sizeof(key));
+		free(chunk);
+		terminate_tee_session(&ctx);
+		return 0;
+
+	} else if (mode == CONTEND) {
+
+		TEEC_Context teec;
+		TEEC_Result res;
+		int ret;
+		if (sessions < 1 || reads < 0 || writes < 0)
+			errx(1, "Invalid session, read or write count");
+		res = tees_context_init(&teec);
+		if (res != TEEC_SUCCESS)
+			errx(1, "TEEC_InitializeContext failed with code 0x%x", res);
+		ret = do_contend(&teec, file_id, sessions, reads, writes);
+		tees_context_finalize(&teec);
+		return ret ? 1 : 0;
+
+	} else if (mode == BENCH) {
+
+		struct bench_config cfg = { 0 };
+		FILE *out = stdout;
+		TEEC_Context teec;
+		TEEC_Result res;
+		int ret;
+		cfg.sessions = sessions;
+		cfg.ops = reads;
+		cfg.objects = objects_arg ? strtoul(objects_arg, NULL, 0) : 64;
+		cfg.placement = placement;
+		bench_parse_mix(mix_arg, &cfg);
+		bench_parse_size(size_arg, &cfg);
+		if (cfg.sessions < 1 || cfg.ops < 0 || cfg.objects == 0)
+			errx(1, "Invalid session, operation or object count");
+
+		if (file_name != NULL) {
+			out = fopen(file_name, "w");
+			if (out == NULL)
+				err(1, "Failed to open %s", file_name);
+		}
+		res = tees_context_init(&teec);
+		if (res != TEEC_SUCCESS)
+			errx(1, "TEEC_InitializeContext failed with code 0x%x", res);
+		ret = do_bench(&teec, &cfg, out);
+		tees_context_finalize(&teec);
+		if (out != stdout && fclose(out) != 0)
+			err(1, "Failed to write %s", file_name);
+		return ret ? 1 : 0;
 	}
 
 
@@ -27,15 +27,24 @@
 #ifndef __SECURE_STORAGE_H__
 #define __SECURE_STORAGE_H__
 
+#include <stdint.h>
+
 /* UUID of the trusted application */
 #define TA_SECURE_STORAGE_UUID \
 		{ 0xf4e750bb, 0x1437, 0x4fbf, \
 			{ 0x87, 0x85, 0x8d, 0x35, 0x80, 0xc3, 0x49, 0x94 } }
+
+/*
+ * Object and log IDs are 1 to 64 bytes long and must not contain a NUL
+ * byte, commands fail with TEE_ERROR_BAD_PARAMETERS otherwise.
+ */
+
 /*
  * TA_SECURE_STORAGE_CMD_READ_RAW - Create and fill a secure storage file
  * param[0] (memref) ID used the identify the persistent object
  * param[1] (memref) Raw data dumped from the persistent object
- * param[2] unused
+ * param[2] (value) Optional, a/b: low/high 32 bits of the object version,
+ *          0 unless the object was written with WRITE_IF_VERSION
  * param[3] unused
  */
 #define TA_SECURE_STORAGE_CMD_READ_RAW		0
@@ -44,7 +53,7 @@
  * TA_SECURE_STORAGE_CMD_WRITE_RAW - Create and fill a secure storage file
  * param[0] (memref) ID used the identify the persistent object
  * param[1] (memref) Raw data to be writen in the persistent object
- * param[2] unused
+ * param[2] (value) Optional, a: TA_SECURE_STORAGE_PLACE_* placement hint
  * param[3] unused
  */
 #define TA_SECURE_STORAGE_CMD_WRITE_RAW		1
@@ -58,4 +67,293 @@
  */
 #define TA_SECURE_STORAGE_CMD_DELETE		2
 
+/*
+ * TA_SECURE_STORAGE_CMD_LOG_APPEND - Append a record to an append-only log
+ * param[0] (memref) ID used the identify the log
+ * param[1] (memref) Record to be appended
+ * param[2] unused
+ * param[3] unused
+ *
+ * Records are stored as a 32bit length followed by the record bytes. The
+ * log rolls over into a new segment object once the current one would grow
+ * past the TA's segment size.
+ */
+#define TA_SECURE_STORAGE_CMD_LOG_APPEND	3
+
+/*
+ * TA_SECURE_STORAGE_CMD_LOG_READ - Stream the content of an append-only log
+ * param[0] (memref) ID used the identify the log
+ * param[1] (memref) Framed records read from the log
+ * param[2] (value) Cursor: [in/out] a = segment, [in/out] b = offset
+ * param[3] unused
+ *
+ * Start with a zeroed cursor and call again with the returned cursor until
+ * no more bytes are returned. Records may be split across two calls.
+ */
+#define TA_SECURE_STORAGE_CMD_LOG_READ		4
+
+/*
+ * TA_SECURE_STORAGE_CMD_WRITE_BUFFERED - Write-behind variant of WRITE_RAW
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (memref) Raw data to be writen in the persistent object
+ * param[2] unused
+ * param[3] unused
+ *
+ * The write is batched with other buffered writes and committed to a
+ * journal together with them. The target object is updated when the
+ * journal is replayed, at the latest before the object is next accessed.
+ * Buffered writes are committed by the first command of the session once
+ * the batch window has passed and when the session is closed. A batch
+ * never overwrites a later write of another session to the same object,
+ * and while one session has writes batched those of the others are
+ * committed right away.
+ */
+#define TA_SECURE_STORAGE_CMD_WRITE_BUFFERED	5
+
+/*
+ * TA_SECURE_STORAGE_CMD_FLUSH - Make buffered writes durable
+ * param[0] (value) a: TA_SECURE_STORAGE_FLUSH_* flags
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_FLUSH		6
+
+/* Also replay the journal into the target objects */
+#define TA_SECURE_STORAGE_FLUSH_APPLY		(1 << 0)
+
+/*
+ * TA_SECURE_STORAGE_CMD_SET_POLICY - Set the object storage policy
+ * param[0] (value) a: TA_SECURE_STORAGE_POLICY_* flags
+ *                  b: largest object placed in RPMB without a hint
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ *
+ * With tiering enabled, objects written with the CRITICAL hint or small
+ * enough are stored in TEE_STORAGE_PRIVATE_RPMB, everything else in
+ * TEE_STORAGE_PRIVATE_REE. Without it all objects go to
+ * TEE_STORAGE_PRIVATE, that is the default backend of OP-TEE. Once tiering
+ * was enabled, both storages are searched for objects and must be
+ * available.
+ *
+ * With dedup enabled, payloads are stored once under their SHA-256 and
+ * the object IDs become reference counted references to them.
+ *
+ * With the key-value engine enabled, objects of up to about 512 bytes
+ * (ID included) are packed into hashed pages of a few large objects in
+ * TEE_STORAGE_PRIVATE instead of getting an object each, so their cost
+ * does not grow with the number of objects stored. Tiering and dedup only
+ * apply to the larger objects then. Entries stay readable after the engine
+ * is disabled again.
+ *
+ * The policy is persistent.
+ */
+#define TA_SECURE_STORAGE_CMD_SET_POLICY	7
+
+#define TA_SECURE_STORAGE_POLICY_TIERING	(1 << 0)
+#define TA_SECURE_STORAGE_POLICY_DEDUP		(1 << 1)
+#define TA_SECURE_STORAGE_POLICY_KV		(1 << 2)
+
+/* Placement hints */
+#define TA_SECURE_STORAGE_PLACE_AUTO		0
+#define TA_SECURE_STORAGE_PLACE_CRITICAL	1	/* e.g. keys */
+#define TA_SECURE_STORAGE_PLACE_BULK		2
+
+/*
+ * TA_SECURE_STORAGE_CMD_STATS - Read the per-command performance counters
+ * param[0] (memref) Array of struct secure_storage_cmd_stats, one per
+ *                   command ID up to TA_SECURE_STORAGE_CMD_COUNT
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ *
+ * The counters cover the session only, unless the TA is built with
+ * CFG_SECURE_STORAGE_STATS_PERSIST=y to keep them across sessions.
+ */
+#define TA_SECURE_STORAGE_CMD_STATS		8
+
+/*
+ * TA_SECURE_STORAGE_CMD_STATS_RESET - Clear the performance counters
+ * param[0] unused
+ * param[1] unused
+ * param[2] unused
+ * param[3] unused
+ */
+#define TA_SECURE_STORAGE_CMD_STATS_RESET	9
+
+/*
+ * TA_SECURE_STORAGE_CMD_EXPORT - Stream the client objects into an archive
+ * param[0] (memref) Archive key, TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE bytes
+ * param[1] (memref) Next archive chunk
+ * param[2] (memref) struct secure_storage_archive_cursor [in/out]
+ * param[3] unused
+ *
+ * Start with a zeroed cursor and call again with the returned cursor until
+ * it has TA_SECURE_STORAGE_ARCHIVE_DONE set, appending every chunk to the
+ * archive. A chunk holds whole objects; if the next object does not fit
+ * the buffer, the call fails with TEE_ERROR_SHORT_BUFFER and param[1]
+ * holds the size needed. An object too big for any chunk is split across
+ * chunks of TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE bytes. A cursor may
+ * be resumed from another session as long as no object was written in
+ * between. The TA keeps the last few exports only, the cursor of an older
+ * one fails with TEE_ERROR_BAD_STATE. Append-only logs are not exported.
+ */
+#define TA_SECURE_STORAGE_CMD_EXPORT		10
+
+/*
+ * TA_SECURE_STORAGE_CMD_IMPORT - Write the objects of an archive chunk
+ * param[0] (memref) Archive key, TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE bytes
+ * param[1] (memref) Next archive chunk
+ * param[2] (memref) struct secure_storage_archive_cursor [in/out]
+ * param[3] unused
+ *
+ * Chunks are given in order starting with a zeroed cursor. Each chunk is
+ * authenticated before any of its objects is written, with the current
+ * storage policy. The archive is complete once the returned cursor has
+ * TA_SECURE_STORAGE_ARCHIVE_DONE set. An import cut short can be resumed
+ * with the last cursor returned. An object split across chunks is written
+ * once its last piece was given, it has to fit in TA memory.
+ */
+#define TA_SECURE_STORAGE_CMD_IMPORT		11
+
+/*
+ * TA_SECURE_STORAGE_CMD_WRITE_IF_VERSION - Compare-and-swap write
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (memref) Raw data to be writen in the persistent object
+ * param[2] (value) [in/out] a/b: low/high 32 bits of the version expected
+ *          on input, of the object version on output
+ * param[3] (value) Optional, a: TA_SECURE_STORAGE_PLACE_* placement hint
+ *
+ * The object is written only if its version is the one expected, and
+ * then gets the next version; otherwise the call fails with
+ * TEE_ERROR_BAD_STATE and param[2] holds the current version. Objects
+ * never written with this command are at version 0, a missing object is
+ * at TA_SECURE_STORAGE_VERSION_NONE. Expecting 0 also accepts a missing
+ * object, expecting TA_SECURE_STORAGE_VERSION_NONE only that. Once
+ * versioned, an object stays versioned and any write bumps its version.
+ * Archives carry the versions along.
+ */
+#define TA_SECURE_STORAGE_CMD_WRITE_IF_VERSION	12
+
+/* Version of an object that does not exist */
+#define TA_SECURE_STORAGE_VERSION_NONE		UINT64_MAX
+
+/*
+ * TA_SECURE_STORAGE_CMD_STAT - Read the metadata of an object
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (memref) [out] struct secure_storage_stat
+ * param[2] unused
+ * param[3] unused
+ *
+ * Answered from the metadata index the TA keeps in memory, the object
+ * itself is not opened. Fails with TEE_ERROR_ITEM_NOT_FOUND when there is
+ * no such object, append-only logs are not objects. The first STAT or
+ * EXISTS of a store builds the index from the objects, the writes keep it
+ * up to date from then on.
+ */
+#define TA_SECURE_STORAGE_CMD_STAT		13
+
+/*
+ * TA_SECURE_STORAGE_CMD_EXISTS - Tell whether an object exists
+ * param[0] (memref) ID used the identify the persistent object
+ * param[1] (value) [out] a: 1 if the object exists, 0 otherwise
+ * param[2] unused
+ * param[3] unused
+ *
+ * Answered from the metadata index, like STAT.
+ */
+#define TA_SECURE_STORAGE_CMD_EXISTS		14
+
+#define TA_SECURE_STORAGE_CMD_COUNT		15
+
+#define TA_SECURE_STORAGE_DIGEST_SIZE		32
+
+/*
+ * Object metadata returned by STAT. Times are REE time in seconds, 0 for
+ * objects that were not written since the index was built.
+ */
+struct secure_storage_stat {
+	uint64_t created;
+	uint64_t modified;
+	uint32_t size;		/* payload bytes */
+	uint32_t reserved;
+	uint8_t digest[TA_SECURE_STORAGE_DIGEST_SIZE];	/* SHA-256 of the payload */
+};
+
+/*
+ * An archive is a sequence of chunks, each made of the header below, the
+ * records encrypted with AES-256-GCM and the tag. A record is a 32bit ID
+ * size, a 32bit data size, the 64bit version of the object, 0 if it has
+ * none, the 32bit offset of the data in the object and 32bit flags,
+ * followed by the ID and the data. Only an object too big for a chunk has
+ * a record with an offset, or with TA_SECURE_STORAGE_ARCHIVE_MORE set
+ * when another piece follows at the start of the next chunk. The chunks
+ * are encrypted with a key derived from the archive key and the salt of
+ * the archive, both the salt and the nonce are chosen by the TA. The
+ * header is authenticated too, so chunks can neither be reordered, dropped
+ * nor mixed between archives.
+ */
+#define TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE	32
+#define TA_SECURE_STORAGE_ARCHIVE_SALT_SIZE	16
+#define TA_SECURE_STORAGE_ARCHIVE_TAG_SIZE	16
+#define TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX	(32 * 1024)
+
+#define TA_SECURE_STORAGE_ARCHIVE_MAGIC		0x52415353	/* "SSAR" */
+#define TA_SECURE_STORAGE_ARCHIVE_VERSION	2
+
+/* Cursor and chunk flags */
+#define TA_SECURE_STORAGE_ARCHIVE_DONE		(1 << 0)
+
+/* Record flags */
+#define TA_SECURE_STORAGE_ARCHIVE_MORE		(1 << 0)
+
+struct secure_storage_archive_cursor {
+	uint32_t item;		/* objects exported or imported so far */
+	uint32_t chunk;		/* sequence number of the next chunk */
+	uint32_t flags;
+	uint32_t offset;	/* bytes of the next object done so far */
+	uint8_t salt[TA_SECURE_STORAGE_ARCHIVE_SALT_SIZE];
+};
+
+struct secure_storage_archive_chunk {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seq;
+	uint32_t flags;		/* DONE on the last chunk */
+	uint32_t items;
+	uint32_t size;		/* bytes of records */
+	uint32_t nonce;		/* GCM nonce, never reused within an archive */
+	uint32_t reserved;
+	uint8_t salt[TA_SECURE_STORAGE_ARCHIVE_SALT_SIZE];
+};
+
+/* Largest chunk the TA produces or accepts, header and tag included */
+#define TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE \
+	(sizeof(struct secure_storage_archive_chunk) + \
+	 TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX + \
+	 TA_SECURE_STORAGE_ARCHIVE_TAG_SIZE)
+
+/* Phases of a command timed separately by the TA */
+#define TA_SECURE_STORAGE_PHASE_OBJ_OPEN	0
+#define TA_SECURE_STORAGE_PHASE_OP_ALLOC	1
+#define TA_SECURE_STORAGE_PHASE_CRYPTO		2
+#define TA_SECURE_STORAGE_PHASE_STORAGE		3
+#define TA_SECURE_STORAGE_PHASE_COUNT		4
+
+/*
+ * Counters kept for each command. Times are in milliseconds as measured
+ * with TEE_GetSystemTime().
+ */
+struct secure_storage_cmd_stats {
+	uint32_t calls;
+	uint32_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t time_total_ms;
+	uint32_t time_max_ms;
+	uint32_t reserved;
+	uint64_t phase_total_ms[TA_SECURE_STORAGE_PHASE_COUNT];
+};
+
 #endif /* __SECURE_STORAGE_H__ */
@@ -30,128 +30,5217 @@
 #include <tee_internal_api.h>
 #include <tee_internal_api_extensions.h>
 
+#include <tee_arena.h>
+
+/* Append-only logs are split into segments of at most this many bytes */
+#define LOG_SEGMENT_MAX_SIZE	(16 * 1024)
+
+/* Tags of the internal objects, see make_internal_id() */
+#define LOG_HEAD_TAG		'H'
+#define LOG_SEGMENT_TAG		'S'
+#define JOURNAL_TAG		'J'
+#define POLICY_TAG		'P'
+#define BLOB_TAG		'B'
+#define STATS_TAG		'C'
+#define LOCK_TAG		'L'
+#define META_TAG		'M'
+#define BATCH_MARKER_TAG	'W'
+#define FENCE_TAG		'F'
+#define EXPORT_TAG		'X'
+#define IMPORT_TAG		'I'
+
+#define LOG_HEAD_MAGIC		0x474f4c53	/* "SLOG" */
+
+struct log_head {
+	uint32_t magic;
+	uint32_t last_seg;
+};
+
+/*
+ * Buffered writes are grouped in memory and committed to the journal
+ * together once the batch holds this many bytes or is this old.
+ */
+#define JOURNAL_BATCH_MAX_SIZE	(4 * 1024)
+#define JOURNAL_BATCH_WINDOW_MS	50
+
+/*
+ * Scratch memory of a session (object IDs, journal replay buffer, counter
+ * snapshots), reset once the command is done. Sized for the largest user,
+ * the journal replay buffer.
+ */
+#define SESSION_ARENA_SIZE	(JOURNAL_BATCH_MAX_SIZE + 1024)
+
+/* Journal record header, followed by the object ID and the object data */
+struct journal_rec {
+	uint32_t id_sz;
+	uint32_t data_sz;
+	/* Store generation of the command that wrote the record */
+	uint32_t generation;
+	uint32_t flags;
+};
+
+/* A later write of the ID by another instance supersedes the record */
+#define JOURNAL_REC_STALE	(1U << 0)
+
+/*
+ * A batch stays in the memory of its instance until committed, while other
+ * instances may write the same objects. So only one instance at a time
+ * holds a pending batch, keeping the batch marker object open, and any
+ * other write of a client object meanwhile appends a fence, the ID and the
+ * generation of the write, to the fence object. The holder drops the
+ * records the fences supersede when it commits. An instance that cannot
+ * hold a batch commits its buffered writes right away. A holder that cannot
+ * get the lock to commit leaves its batch in the marker, and the next
+ * writer to open the marker takes it over.
+ */
+static struct {
+	char *buf;
+	size_t len;
+	TEE_Time first;
+	TEE_ObjectHandle marker;
+} journal_batch;
+
+/* The journal holds records, as of the lock last taken */
+static bool journal_dirty = true;
+/* Some instance holds a pending batch, fences are kept for it */
+static bool journal_pending;
+static bool journal_fenced;
+
+/*
+ * Every session runs in an instance of its own. Commands that only read
+ * run concurrently under a shared lock, the others under an exclusive one,
+ * both taken by opening the lock object with the matching share flags.
+ * The lock object also holds what the instances have to agree on: a
+ * generation bumped by every writer that changed the store, which tells
+ * an instance that what it cached of the store is stale, whether the
+ * journal holds records and whether an instance holds a pending batch.
+ * It is only written when that changes, a writer that found nothing to do
+ * costs the others nothing.
+ */
+#define STORE_LOCK_TIMEOUT_MS	2000
+#define STORE_LOCK_MAX_WAIT_MS	32
+/* Attempts at committing buffered writes as a session goes away */
+#define BATCH_COMMIT_TRIES	3
+
+/* Store state flags */
+#define STORE_JOURNAL		(1U << 0)
+/* An instance holds a pending batch, the fence object holds fences */
+#define STORE_BATCH		(1U << 1)
+#define STORE_FENCES		(1U << 2)
+/* The metadata index matches the client objects */
+#define STORE_INDEX		(1U << 3)
+
+struct store_state {
+	uint32_t generation;
+	uint32_t flags;
+};
+
+static struct {
+	TEE_ObjectHandle object;
+	bool exclusive;
+	/* The command found work that has to be done under the write lock */
+	bool upgrade;
+	/* state is what the instance caches reflect */
+	bool synced;
+	/* The command changed the store, the generation is bumped */
+	bool changed;
+	struct store_state state;
+} store_lock;
+
+/* Arena of the session whose command is running */
+static struct tee_arena *arena;
+
+/*
+ * Counters are kept in the memory of the instance, so of its session. Only
+ * built with CFG_SECURE_STORAGE_STATS_PERSIST are they merged into an
+ * object as each session closes, for STATS to cover every session, at the
+ * cost of a read and a write of that object per session.
+ */
+#ifdef CFG_SECURE_STORAGE_STATS_PERSIST
+#define STATS_PERSIST		true
+#else
+#define STATS_PERSIST		false
+#endif
+
+/* Counters not yet merged into the persisted ones */
+static struct secure_storage_cmd_stats live_stats[TA_SECURE_STORAGE_CMD_COUNT];
+static bool live_stats_dirty;
+
+/* Time spent in each phase by the command being executed */
+static uint32_t cmd_phase_ms[TA_SECURE_STORAGE_PHASE_COUNT];
+static struct {
+	TEE_Time start;
+	uint32_t depth;
+} phase_clock[TA_SECURE_STORAGE_PHASE_COUNT];
+
+/* Number of entries of the in-memory placement index */
+#define PLACEMENT_INDEX_SIZE	64
+
+/* Objects up to this size go to RPMB once tiering is enabled */
+#define PLACEMENT_DEFAULT_RPMB_MAX_SIZE	512
+
+/*
+ * Internal policy flags, set once dedup, the key-value engine, tiering
+ * or WRITE_IF_VERSION was used
+ */
+#define POLICY_DEDUP_USED	(1U << 31)
+#define POLICY_KV_USED		(1U << 30)
+#define POLICY_TIERING_USED	(1U << 29)
+#define POLICY_VERSION_USED	(1U << 28)
+#define POLICY_INTERNAL		(POLICY_DEDUP_USED | POLICY_KV_USED | \
+				 POLICY_TIERING_USED | POLICY_VERSION_USED)
+
+struct storage_policy {
+	uint32_t flags;
+	uint32_t rpmb_max_size;
+};
+
+static struct storage_policy storage_policy = {
+	.flags = 0,
+	.rpmb_max_size = PLACEMENT_DEFAULT_RPMB_MAX_SIZE,
+};
+
+/*
+ * With deduplication the payload is stored once in a blob named after its
+ * SHA-256 and the client's ID only holds a reference to it.
+ */
+#define DEDUP_DIGEST_SIZE	32
+
+#define BLOB_MAGIC		0x424f4c42	/* "BLOB" */
+
+/*
+ * What the TA records about a client object is kept out of its data, which
+ * the client controls: the object is created from a generic secret whose
+ * value is this struct. Client data alone only ever makes data objects.
+ */
+#define OBJECT_META_REF		(1U << 0)	/* Payload is in blob digest */
+#define OBJECT_META_VERSION	(1U << 1)	/* Written by WRITE_IF_VERSION */
+
+struct object_meta {
+	uint32_t flags;
+	uint32_t reserved;
+	uint8_t digest[DEDUP_DIGEST_SIZE];
+	uint64_t version;	/* from 1 on, with OBJECT_META_VERSION */
+};
+
+/* Blob header, followed by the payload */
+struct blob_hdr {
+	uint32_t magic;
+	uint32_t refcount;
+};
+
+/*
+ * Direct mapped cache of the storage each recently used object lives in,
+ * indexed by a hash of the object ID. A stale or colliding entry only
+ * costs a failed open before falling back to probing the storages.
+ */
+static struct {
+	uint32_t hash;
+	uint32_t storage;
+} placement_index[PLACEMENT_INDEX_SIZE];
+
+/*
+ * TEE_STORAGE_PRIVATE is not a storage of its own but the default backend
+ * of OP-TEE, REE FS unless it was built without it. Client objects are
+ * only ever placed in and looked up by the backend, so that an object
+ * written before tiering is seen once and under one storage.
+ */
+#ifdef CFG_SECURE_STORAGE_PRIVATE_RPMB
+#define STORAGE_PRIVATE_BACKEND	TEE_STORAGE_PRIVATE_RPMB
+#else
+#define STORAGE_PRIVATE_BACKEND	TEE_STORAGE_PRIVATE_REE
+#endif
+
+/* Order in which storages are probed on a placement index miss */
+static const uint32_t placement_storages[] = {
+	TEE_STORAGE_PRIVATE_RPMB,
+	TEE_STORAGE_PRIVATE_REE,
+};
+
+/*
+ * Objects the TA keeps for its own bookkeeping are named after the caller's
+ * ID followed by a NUL separator, a tag and a sequence number. They can
+ * only be told from client objects because every command taking a client
+ * ID rejects it unless client_id_valid().
+ * Returns the length of the generated ID or 0 if it does not fit.
+ */
+static size_t make_internal_id(char *out, const void *id, size_t id_sz,
+			       char tag, uint32_t seq)
+{
+	size_t sz = id_sz + 2 + sizeof(seq);
+
+	if (sz > TEE_OBJECT_ID_MAX_LEN)
+		return 0;
+
+	TEE_MemMove(out, id, id_sz);
+	out[id_sz] = '\0';
+	out[id_sz + 1] = tag;
+	TEE_MemMove(out + id_sz + 2, &seq, sizeof(seq));
+
+	return sz;
+}
+
+/* Client IDs are non-empty and hold no NUL, see make_internal_id() */
+static bool client_id_valid(const void *id, size_t id_sz)
+{
+	const char *c = id;
+	size_t n;
+
+	if (!id_sz || id_sz > TEE_OBJECT_ID_MAX_LEN)
+		return false;
+
+	for (n = 0; n < id_sz; n++)
+		if (!c[n])
+			return false;
+
+	return true;
+}
+
+/*
+ * An object held open by another instance is retried with a growing delay.
+ * Returns false once STORE_LOCK_TIMEOUT_MS was spent waiting.
+ */
+static bool conflict_wait(uint32_t *waited)
+{
+	uint32_t delay = *waited ? *waited : 1;
+
+	if (*waited >= STORE_LOCK_TIMEOUT_MS)
+		return false;
+	if (delay > STORE_LOCK_MAX_WAIT_MS)
+		delay = STORE_LOCK_MAX_WAIT_MS;
+
+	TEE_Wait(delay);
+	*waited += delay;
+	return true;
+}
+
+/* Have the command run again under the exclusive lock */
+static TEE_Result store_need_exclusive(void)
+{
+	store_lock.upgrade = true;
+	return TEE_ERROR_BUSY;
+}
+
+/*
+ * The command changed what other instances may cache of the store, or
+ * ordered a write against the generation.
+ */
+static void store_changed(void)
+{
+	store_lock.changed = true;
+}
+
+/* Only a writer holds the lock object open for writing */
+static TEE_Result store_lock_save(const struct store_state *state)
+{
+	TEE_Result res;
+
+	res = TEE_SeekObjectData(store_lock.object, 0, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(store_lock.object, state,
+					  sizeof(*state));
+	return res;
+}
+
+static uint32_t elapsed_ms(const TEE_Time *since)
+{
+	TEE_Time now;
+
+	TEE_GetSystemTime(&now);
+	return (now.seconds - since->seconds) * 1000 +
+	       now.millis - since->millis;
+}
+
+/*
+ * Phases nest (e.g. objects opened while writing one), only the outermost
+ * begin/end pair of a phase is timed.
+ */
+static void phase_begin(uint32_t phase)
+{
+	if (!phase_clock[phase].depth++)
+		TEE_GetSystemTime(&phase_clock[phase].start);
+}
+
+static void phase_end(uint32_t phase)
+{
+	if (!--phase_clock[phase].depth)
+		cmd_phase_ms[phase] += elapsed_ms(&phase_clock[phase].start);
+}
+
+static void stats_merge(struct secure_storage_cmd_stats *dst,
+			const struct secure_storage_cmd_stats *src)
+{
+	uint32_t n;
+	uint32_t p;
+
+	for (n = 0; n < TA_SECURE_STORAGE_CMD_COUNT; n++) {
+		dst[n].calls += src[n].calls;
+		dst[n].errors += src[n].errors;
+		dst[n].bytes_in += src[n].bytes_in;
+		dst[n].bytes_out += src[n].bytes_out;
+		dst[n].time_total_ms += src[n].time_total_ms;
+		if (src[n].time_max_ms > dst[n].time_max_ms)
+			dst[n].time_max_ms = src[n].time_max_ms;
+		for (p = 0; p < TA_SECURE_STORAGE_PHASE_COUNT; p++)
+			dst[n].phase_total_ms[p] += src[n].phase_total_ms[p];
+	}
+}
+
+static uint32_t param_bytes(uint32_t param_types, TEE_Param params[4],
+			    uint32_t type_a, uint32_t type_b)
+{
+	uint32_t bytes = 0;
+	uint32_t type;
+	uint32_t n;
+
+	for (n = 0; n < 4; n++) {
+		type = TEE_PARAM_TYPE_GET(param_types, n);
+		if (type == type_a || type == type_b)
+			bytes += params[n].memref.size;
+	}
+
+	return bytes;
+}
+
+static void stats_account(uint32_t command, TEE_Result res,
+			  uint32_t bytes_in, uint32_t bytes_out,
+			  uint32_t time_ms)
+{
+	struct secure_storage_cmd_stats *st = &live_stats[command];
+	uint32_t p;
+
+	st->calls++;
+	if (res != TEE_SUCCESS)
+		st->errors++;
+	st->bytes_in += bytes_in;
+	st->bytes_out += bytes_out;
+	st->time_total_ms += time_ms;
+	if (time_ms > st->time_max_ms)
+		st->time_max_ms = time_ms;
+	for (p = 0; p < TA_SECURE_STORAGE_PHASE_COUNT; p++)
+		st->phase_total_ms[p] += cmd_phase_ms[p];
+
+	live_stats_dirty = true;
+}
+
+static size_t stats_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, STATS_TAG, 0);
+}
+
+static TEE_Result read_stats(TEE_ObjectHandle object,
+			     struct secure_storage_cmd_stats *stats)
+{
+	uint32_t read_bytes;
+
+	TEE_MemFill(stats, 0, sizeof(live_stats));
+	return TEE_ReadObjectData(object, stats, sizeof(live_stats),
+				  &read_bytes);
+}
+
+/*
+ * The TA instance does not outlive its sessions, so counters to be kept
+ * are merged into a persistent object whenever a session closes.
+ */
+static TEE_Result stats_flush(void)
+{
+	struct secure_storage_cmd_stats *stats;
+	char sid[TEE_OBJECT_ID_MAX_LEN];
+	size_t sid_sz = stats_id(sid);
+	TEE_ObjectHandle object = TEE_HANDLE_NULL;
+	bool created = false;
+	uint32_t waited = 0;
+	TEE_Result res;
+
+	if (!STATS_PERSIST || !live_stats_dirty)
+		return TEE_SUCCESS;
+
+	stats = tee_arena_alloc(arena, sizeof(live_stats));
+	if (!stats)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	/* Instances closing at the same time take turns */
+	for (;;) {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, sid, sid_sz,
+					       TEE_DATA_FLAG_ACCESS_READ |
+					       TEE_DATA_FLAG_ACCESS_WRITE,
+					       &object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+			TEE_MemFill(stats, 0, sizeof(live_stats));
+			stats_merge(stats, live_stats);
+			res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+							 sid, sid_sz,
+							 TEE_DATA_FLAG_ACCESS_READ |
+							 TEE_DATA_FLAG_ACCESS_WRITE_META,
+							 TEE_HANDLE_NULL,
+							 stats, sizeof(live_stats),
+							 &object);
+			created = res == TEE_SUCCESS;
+		}
+		if (res != TEE_ERROR_ACCESS_CONFLICT || !conflict_wait(&waited))
+			break;
+	}
+
+	if (res == TEE_SUCCESS && !created) {
+		res = read_stats(object, stats);
+		if (res == TEE_SUCCESS) {
+			stats_merge(stats, live_stats);
+			res = TEE_SeekObjectData(object, 0, TEE_DATA_SEEK_SET);
+		}
+		if (res == TEE_SUCCESS)
+			res = TEE_WriteObjectData(object, stats,
+						  sizeof(live_stats));
+	}
+	if (object != TEE_HANDLE_NULL)
+		TEE_CloseObject(object);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	TEE_MemFill(live_stats, 0, sizeof(live_stats));
+	live_stats_dirty = false;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result get_stats(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct secure_storage_cmd_stats *stats;
+	char sid[TEE_OBJECT_ID_MAX_LEN];
+	size_t sid_sz = stats_id(sid);
+	TEE_ObjectHandle object;
+	uint32_t waited = 0;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (params[0].memref.size < sizeof(live_stats)) {
+		params[0].memref.size = sizeof(live_stats);
+		return TEE_ERROR_SHORT_BUFFER;
+	}
+
+	stats = tee_arena_alloc(arena, sizeof(live_stats));
+	if (!stats)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemFill(stats, 0, sizeof(live_stats));
+	res = TEE_ERROR_ITEM_NOT_FOUND;
+	while (STATS_PERSIST) {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, sid, sid_sz,
+					       TEE_DATA_FLAG_ACCESS_READ |
+					       TEE_DATA_FLAG_SHARE_READ,
+					       &object);
+		if (res != TEE_ERROR_ACCESS_CONFLICT || !conflict_wait(&waited))
+			break;
+	}
+	if (res == TEE_SUCCESS) {
+		res = read_stats(object, stats);
+		TEE_CloseObject(object);
+	} else if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		res = TEE_SUCCESS;
+	}
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Include what happened since the last session closed */
+	stats_merge(stats, live_stats);
+	TEE_MemMove(params[0].memref.buffer, stats, sizeof(live_stats));
+	params[0].memref.size = sizeof(live_stats);
+	return TEE_SUCCESS;
+}
+
+static TEE_Result reset_stats(uint32_t param_types,
+			      TEE_Param __unused params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	char sid[TEE_OBJECT_ID_MAX_LEN];
+	size_t sid_sz = stats_id(sid);
+	TEE_ObjectHandle object;
+	uint32_t waited = 0;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	TEE_MemFill(live_stats, 0, sizeof(live_stats));
+	live_stats_dirty = false;
+	if (!STATS_PERSIST)
+		return TEE_SUCCESS;
+
+	do {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, sid, sid_sz,
+					       TEE_DATA_FLAG_ACCESS_WRITE_META,
+					       &object);
+	} while (res == TEE_ERROR_ACCESS_CONFLICT && conflict_wait(&waited));
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	return TEE_CloseAndDeletePersistentObject1(object);
+}
+
+/* FNV-1a, only used to spread object IDs over in-memory tables */
+static uint32_t id_hash(const void *id, size_t id_sz)
+{
+	const uint8_t *p = id;
+	uint32_t hash = 0x811c9dc5;
+	size_t n;
+
+	for (n = 0; n < id_sz; n++) {
+		hash ^= p[n];
+		hash *= 0x01000193;
+	}
+
+	/* 0 marks a free placement index entry */
+	return hash ? hash : 1;
+}
+
+static void placement_update(uint32_t hash, uint32_t storage)
+{
+	unsigned int slot = hash % PLACEMENT_INDEX_SIZE;
+
+	placement_index[slot].hash = storage ? hash : 0;
+	placement_index[slot].storage = storage;
+}
+
+static uint32_t placement_choose(size_t data_sz, uint32_t hint)
+{
+	if (!(storage_policy.flags & TA_SECURE_STORAGE_POLICY_TIERING))
+		return STORAGE_PRIVATE_BACKEND;
+
+	switch (hint) {
+	case TA_SECURE_STORAGE_PLACE_CRITICAL:
+		return TEE_STORAGE_PRIVATE_RPMB;
+	case TA_SECURE_STORAGE_PLACE_BULK:
+		return TEE_STORAGE_PRIVATE_REE;
+	default:
+		if (data_sz <= storage_policy.rpmb_max_size)
+			return TEE_STORAGE_PRIVATE_RPMB;
+		return TEE_STORAGE_PRIVATE_REE;
+	}
+}
+
+static uint32_t storage_backend(uint32_t storage)
+{
+	return storage == TEE_STORAGE_PRIVATE ? STORAGE_PRIVATE_BACKEND :
+						storage;
+}
+
+/* Only a store that ever used tiering has objects outside of PRIVATE */
+static bool storage_in_use(uint32_t storage)
+{
+	return storage == STORAGE_PRIVATE_BACKEND ||
+	       storage_policy.flags & POLICY_TIERING_USED;
+}
+
+/*
+ * Open a client object wherever it was placed. The placement index is
+ * tried first, then every storage in use in turn. On success *storage
+ * tells where the object was found.
+ */
+static TEE_Result probe_object(const char *obj_id, size_t obj_id_sz,
+			       uint32_t flags, TEE_ObjectHandle *object,
+			       uint32_t *storage)
+{
+	uint32_t hash = id_hash(obj_id, obj_id_sz);
+	unsigned int slot = hash % PLACEMENT_INDEX_SIZE;
+	uint32_t cached = 0;
+	TEE_Result res = TEE_ERROR_ITEM_NOT_FOUND;
+	size_t n;
+
+	if (placement_index[slot].hash == hash) {
+		cached = placement_index[slot].storage;
+		res = TEE_OpenPersistentObject(cached, obj_id, obj_id_sz,
+					       flags, object);
+		if (res == TEE_SUCCESS)
+			*storage = cached;
+		if (res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	for (n = 0; n < sizeof(placement_storages) /
+			 sizeof(placement_storages[0]); n++) {
+		if (placement_storages[n] == cached ||
+		    !storage_in_use(placement_storages[n]))
+			continue;
+
+		res = TEE_OpenPersistentObject(placement_storages[n],
+					       obj_id, obj_id_sz,
+					       flags, object);
+		if (res == TEE_SUCCESS) {
+			*storage = placement_storages[n];
+			placement_update(hash, *storage);
+			return res;
+		}
+		/* The object might be in a storage that failed to answer */
+		if (res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	return TEE_ERROR_ITEM_NOT_FOUND;
+}
+
+static TEE_Result open_object(const char *obj_id, size_t obj_id_sz,
+			      uint32_t flags, TEE_ObjectHandle *object,
+			      uint32_t *storage)
+{
+	TEE_Result res;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+	res = probe_object(obj_id, obj_id_sz, flags, object, storage);
+	phase_end(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+
+	return res;
+}
+
+static void placement_forget(const char *obj_id, size_t obj_id_sz)
+{
+	store_changed();
+	placement_update(id_hash(obj_id, obj_id_sz), 0);
+}
+
+static TEE_Result load_storage_policy(void)
+{
+	char pid[TEE_OBJECT_ID_MAX_LEN];
+	size_t pid_sz = make_internal_id(pid, NULL, 0, POLICY_TAG, 0);
+	struct storage_policy policy;
+	TEE_ObjectHandle object;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, pid, pid_sz,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_SHARE_READ, &object);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_ReadObjectData(object, &policy, sizeof(policy), &read_bytes);
+	TEE_CloseObject(object);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (read_bytes != sizeof(policy))
+		return TEE_ERROR_CORRUPT_OBJECT;
+
+	storage_policy = policy;
+	return TEE_SUCCESS;
+}
+
+/* The policy is kept so that every later session applies it */
+static TEE_Result save_storage_policy(const struct storage_policy *policy)
+{
+	char pid[TEE_OBJECT_ID_MAX_LEN];
+	size_t pid_sz = make_internal_id(pid, NULL, 0, POLICY_TAG, 0);
+	TEE_ObjectHandle object;
+	TEE_Result res;
+
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, pid, pid_sz,
+					 TEE_DATA_FLAG_ACCESS_READ |
+					 TEE_DATA_FLAG_ACCESS_WRITE_META |
+					 TEE_DATA_FLAG_OVERWRITE,
+					 TEE_HANDLE_NULL,
+					 policy, sizeof(*policy), &object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to store storage policy, res=0x%08x", res);
+		return res;
+	}
+	TEE_CloseObject(object);
+
+	storage_policy = *policy;
+	store_changed();
+	return TEE_SUCCESS;
+}
+
+static TEE_Result set_storage_policy(uint32_t param_types,
+				       TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct storage_policy policy;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	policy.flags = (params[0].value.a & ~POLICY_INTERNAL) |
+		       (storage_policy.flags & POLICY_VERSION_USED);
+	policy.rpmb_max_size = params[0].value.b;
+	if ((policy.flags | storage_policy.flags) &
+	    (TA_SECURE_STORAGE_POLICY_TIERING | POLICY_TIERING_USED))
+		policy.flags |= POLICY_TIERING_USED;
+	if ((policy.flags | storage_policy.flags) &
+	    (TA_SECURE_STORAGE_POLICY_DEDUP | POLICY_DEDUP_USED))
+		policy.flags |= POLICY_DEDUP_USED;
+	if ((policy.flags | storage_policy.flags) &
+	    (TA_SECURE_STORAGE_POLICY_KV | POLICY_KV_USED))
+		policy.flags |= POLICY_KV_USED;
+
+	return save_storage_policy(&policy);
+}
+
+/* The transient object a client object with metadata is created from */
+static TEE_Result object_meta_attrs(const struct object_meta *meta,
+				    TEE_ObjectHandle *attrs)
+{
+	TEE_Attribute attr;
+	TEE_Result res;
+
+	res = TEE_AllocateTransientObject(TEE_TYPE_GENERIC_SECRET,
+					  sizeof(*meta) * 8, attrs);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, meta,
+			     sizeof(*meta));
+	res = TEE_PopulateTransientObject(*attrs, &attr, 1);
+	if (res != TEE_SUCCESS) {
+		TEE_FreeTransientObject(*attrs);
+		*attrs = TEE_HANDLE_NULL;
+	}
+	return res;
+}
+
+/*
+ * Create or replace an object holding hdr followed by data, in the storage
+ * the placement policy picks for it. meta is NULL for a plain data object.
+ */
+static TEE_Result write_object(const char *obj_id, size_t obj_id_sz,
+			       const struct object_meta *meta,
+			       const void *hdr, size_t hdr_sz,
+			       const void *data, size_t data_sz,
+			       uint32_t hint)
+{
+	TEE_ObjectHandle attrs = TEE_HANDLE_NULL;
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	uint32_t obj_data_flag;
+	uint32_t storage = placement_choose(hdr_sz + data_sz, hint);
+	uint32_t old_storage = 0;
+	TEE_ObjectHandle old_object = TEE_HANDLE_NULL;
+
+	/*
+	 * With tiering an object may move to another storage when it is
+	 * rewritten, the copy left behind must not shadow the new one.
+	 */
+	if (storage_policy.flags & TA_SECURE_STORAGE_POLICY_TIERING) {
+		res = open_object(obj_id, obj_id_sz,
+				  TEE_DATA_FLAG_ACCESS_WRITE_META,
+				  &old_object, &old_storage);
+		/* The same backend, OVERWRITE replaces it in place */
+		if (res == TEE_SUCCESS &&
+		    storage_backend(old_storage) == storage_backend(storage)) {
+			TEE_CloseObject(old_object);
+			old_object = TEE_HANDLE_NULL;
+		}
+		if (res != TEE_SUCCESS && res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	if (meta) {
+		res = object_meta_attrs(meta, &attrs);
+		if (res != TEE_SUCCESS)
+			goto exit;
+	}
+
+	/*
+	 * Create object in secure storage and fill with data
+	 */
+	obj_data_flag = TEE_DATA_FLAG_ACCESS_READ |		/* we can later read the oject */
+			TEE_DATA_FLAG_ACCESS_WRITE |		/* we can later write into the object */
+			TEE_DATA_FLAG_ACCESS_WRITE_META |	/* we can later destroy or rename the object */
+			TEE_DATA_FLAG_OVERWRITE;		/* destroy existing object of same ID */
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_CreatePersistentObject(storage,
+					obj_id, obj_id_sz,
+					obj_data_flag,
+					attrs,
+					hdr, hdr_sz,
+					&object);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_CreatePersistentObject failed 0x%08x", res);
+		phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+		goto exit;
+	}
+
+	/* The data position is back at 0 once the object is created */
+	res = TEE_SeekObjectData(object, hdr_sz, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(object, data, data_sz);
+	if (res != TEE_SUCCESS) {
+		EMSG("TEE_WriteObjectData failed 0x%08x", res);
+		TEE_CloseAndDeletePersistentObject1(object);
+		phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+		goto exit;
+	}
+	TEE_CloseObject(object);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+
+	placement_update(id_hash(obj_id, obj_id_sz), storage);
+	store_changed();
+	if (old_object != TEE_HANDLE_NULL) {
+		TEE_CloseAndDeletePersistentObject1(old_object);
+		old_object = TEE_HANDLE_NULL;
+	}
+exit:
+	if (attrs != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(attrs);
+	if (old_object != TEE_HANDLE_NULL)
+		TEE_CloseObject(old_object);
+	return res;
+}
+
+static size_t blob_id(char *out, const uint8_t *digest)
+{
+	out[0] = '\0';
+	out[1] = BLOB_TAG;
+	TEE_MemMove(out + 2, digest, DEDUP_DIGEST_SIZE);
+
+	return 2 + DEDUP_DIGEST_SIZE;
+}
+
+static TEE_Result hash_data(const void *data, size_t data_sz,
+			    uint8_t *digest)
+{
+	TEE_OperationHandle op;
+	uint32_t digest_sz = DEDUP_DIGEST_SIZE;
+	TEE_Result res;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	res = TEE_AllocateOperation(&op, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+	phase_end(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	res = TEE_DigestDoFinal(op, data, data_sz, digest, &digest_sz);
+	phase_end(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	TEE_FreeOperation(op);
+	return res;
+}
+
+/*
+ * Metadata index of the client objects: the size, times and SHA-256 of
+ * the payload of every object, keyed by a digest of its ID, so that STAT
+ * and EXISTS are answered without opening the object. The index object
+ * holds a header followed by an open addressing table with linear probing,
+ * at most half full. It is used in place a page at a time through a small
+ * cache: a write updates one slot, a delete shifts the following entries
+ * of its run back, and only a table that fills up is rewritten, twice as
+ * large.
+ *
+ * The index is built from the objects by the first STAT or EXISTS and
+ * maintained by the writes from then on, stores that never asked do not
+ * pay for it. STORE_INDEX in the lock object tells that it matches the
+ * objects. A writer clears it before changing an object and sets it again
+ * on release, so an interrupted command leaves an index that is rebuilt
+ * rather than trusted.
+ */
+#define META_MAGIC		0x58444d53	/* "SMDX" */
+#define META_VERSION		1
+#define META_ID_DIGEST_SIZE	16
+#define META_MIN_SLOTS		64
+#define META_PAGE_SLOTS		32
+#define META_CACHE_PAGES	4
+#define META_SEQ_INDEX		0
+#define META_SEQ_SCRATCH	1
+/* Payloads are hashed this much at a time, more than a key-value record */
+#define META_HASH_CHUNK		4096
+
+struct meta_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t nslots;	/* power of two, a multiple of the page */
+	uint32_t count;
+};
+
+struct meta_entry {
+	uint8_t id_digest[META_ID_DIGEST_SIZE];
+	uint32_t used;
+	uint32_t reserved;
+	struct secure_storage_stat stat;
+};
+
+struct meta_cached_page {
+	uint32_t page;
+	uint32_t lru;
+	bool valid;
+	struct meta_entry entries[META_PAGE_SLOTS];
+};
+
+static struct {
+	/* The index object matches the client objects */
+	bool valid;
+	/* Open until another instance changes the store, like the KV store */
+	TEE_ObjectHandle object;
+	struct meta_hdr hdr;
+	uint32_t lru_clock;
+	/* Pages are written through, any of them can be evicted */
+	struct meta_cached_page *cache;
+} meta;
+
+static size_t meta_id(char *out, uint32_t seq)
+{
+	return make_internal_id(out, NULL, 0, META_TAG, seq);
+}
+
+static TEE_Result meta_id_digest(const void *id, size_t id_sz,
+				 uint8_t *id_digest)
+{
+	uint8_t digest[DEDUP_DIGEST_SIZE];
+	TEE_Result res;
+
+	res = hash_data(id, id_sz, digest);
+	if (res == TEE_SUCCESS)
+		TEE_MemMove(id_digest, digest, META_ID_DIGEST_SIZE);
+	return res;
+}
+
+/* Smallest table that holds count entries at most half full */
+static uint32_t meta_nslots(uint32_t count)
+{
+	uint32_t nslots = META_MIN_SLOTS;
+
+	while (nslots < 2 * count)
+		nslots *= 2;
+
+	return nslots;
+}
+
+static uint32_t meta_home(const uint8_t *id_digest)
+{
+	uint32_t n;
+
+	TEE_MemMove(&n, id_digest, sizeof(n));
+	return n & (meta.hdr.nslots - 1);
+}
+
+static uint32_t meta_slot_offset(uint32_t slot)
+{
+	return sizeof(struct meta_hdr) + slot * sizeof(struct meta_entry);
+}
+
+static void meta_close(void)
+{
+	if (meta.object != TEE_HANDLE_NULL)
+		TEE_CloseObject(meta.object);
+	meta.object = TEE_HANDLE_NULL;
+
+	TEE_Free(meta.cache);
+	meta.cache = NULL;
+}
+
+/* The index no longer matches the objects, it is built again when needed */
+static void meta_invalidate(void)
+{
+	meta.valid = false;
+	meta_close();
+}
+
+/* Get the page holding a slot through the cache */
+static TEE_Result meta_page_get(uint32_t slot, struct meta_cached_page **out)
+{
+	uint32_t page = slot / META_PAGE_SLOTS;
+	struct meta_cached_page *victim = NULL;
+	struct meta_cached_page *cp;
+	uint32_t read_bytes;
+	TEE_Result res;
+	size_t n;
+
+	for (n = 0; n < META_CACHE_PAGES; n++) {
+		cp = &meta.cache[n];
+		if (cp->valid && cp->page == page) {
+			cp->lru = ++meta.lru_clock;
+			*out = cp;
+			return TEE_SUCCESS;
+		}
+		if (!victim || (victim->valid &&
+				(!cp->valid || cp->lru < victim->lru)))
+			victim = cp;
+	}
+
+	victim->valid = false;
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(meta.object,
+				 meta_slot_offset(page * META_PAGE_SLOTS),
+				 TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_ReadObjectData(meta.object, victim->entries,
+					 sizeof(victim->entries), &read_bytes);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res == TEE_SUCCESS && read_bytes != sizeof(victim->entries))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	victim->page = page;
+	victim->lru = ++meta.lru_clock;
+	victim->valid = true;
+	*out = victim;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result meta_entry_get(uint32_t slot, struct meta_entry *entry)
+{
+	struct meta_cached_page *cp;
+	TEE_Result res;
+
+	res = meta_page_get(slot, &cp);
+	if (res == TEE_SUCCESS)
+		*entry = cp->entries[slot % META_PAGE_SLOTS];
+	return res;
+}
+
+/* Write one slot to the index object and to its cached page, if any */
+static TEE_Result meta_entry_save(uint32_t slot,
+				  const struct meta_entry *entry)
+{
+	TEE_Result res;
+	size_t n;
+
+	store_changed();
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(meta.object, meta_slot_offset(slot),
+				 TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(meta.object, entry, sizeof(*entry));
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	for (n = 0; n < META_CACHE_PAGES; n++)
+		if (meta.cache[n].valid &&
+		    meta.cache[n].page == slot / META_PAGE_SLOTS)
+			meta.cache[n].entries[slot % META_PAGE_SLOTS] = *entry;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result meta_hdr_save(void)
+{
+	TEE_Result res;
+
+	store_changed();
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(meta.object, 0, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(meta.object, &meta.hdr,
+					  sizeof(meta.hdr));
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	return res;
+}
+
+/*
+ * Find the slot of the entry with this ID digest, or the free slot it
+ * would take. entry->used tells which one it is.
+ */
+static TEE_Result meta_find(const uint8_t *id_digest, uint32_t *slot,
+			    struct meta_entry *entry)
+{
+	uint32_t mask = meta.hdr.nslots - 1;
+	uint32_t n = meta_home(id_digest);
+	uint32_t probes;
+	TEE_Result res;
+
+	for (probes = 0; probes < meta.hdr.nslots; probes++) {
+		res = meta_entry_get(n, entry);
+		if (res != TEE_SUCCESS)
+			return res;
+		if (!entry->used ||
+		    !TEE_MemCompare(entry->id_digest, id_digest,
+				    META_ID_DIGEST_SIZE)) {
+			*slot = n;
+			return TEE_SUCCESS;
+		}
+		n = (n + 1) & mask;
+	}
+
+	/* Never more than half full, unless the object was damaged */
+	return TEE_ERROR_CORRUPT_OBJECT;
+}
+
+/* Add an entry that is not in the table yet, the header is left to save */
+static TEE_Result meta_insert(const struct meta_entry *entry)
+{
+	struct meta_entry old;
+	uint32_t slot;
+	TEE_Result res;
+
+	res = meta_find(entry->id_digest, &slot, &old);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = meta_entry_save(slot, entry);
+	if (res == TEE_SUCCESS && !old.used)
+		meta.hdr.count++;
+	return res;
+}
+
+/* Open the index object and check its header */
+static TEE_Result meta_load(void)
+{
+	char mid[TEE_OBJECT_ID_MAX_LEN];
+	size_t mid_sz = meta_id(mid, META_SEQ_INDEX);
+	TEE_ObjectInfo info;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	if (meta.object != TEE_HANDLE_NULL)
+		return TEE_SUCCESS;
+
+	meta.cache = TEE_Malloc(META_CACHE_PAGES * sizeof(*meta.cache), 0);
+	if (!meta.cache)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, mid, mid_sz,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_ACCESS_WRITE |
+				       TEE_DATA_FLAG_SHARE_READ |
+				       TEE_DATA_FLAG_SHARE_WRITE,
+				       &meta.object);
+	phase_end(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+	if (res != TEE_SUCCESS) {
+		meta.object = TEE_HANDLE_NULL;
+		meta_close();
+		return res;
+	}
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_GetObjectInfo1(meta.object, &info);
+	if (res == TEE_SUCCESS)
+		res = TEE_ReadObjectData(meta.object, &meta.hdr,
+					 sizeof(meta.hdr), &read_bytes);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res == TEE_SUCCESS &&
+	    (read_bytes != sizeof(meta.hdr) || meta.hdr.magic != META_MAGIC ||
+	     meta.hdr.version != META_VERSION ||
+	     meta.hdr.nslots < META_MIN_SLOTS ||
+	     meta.hdr.nslots & (meta.hdr.nslots - 1) ||
+	     meta.hdr.count > meta.hdr.nslots / 2 ||
+	     info.dataSize != meta_slot_offset(meta.hdr.nslots)))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS) {
+		meta_close();
+		return res;
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Empty the index object into a table of nslots, creating the object if
+ * there is none. It is rewritten in place, other instances may have it
+ * open and find the new header after the generation bump.
+ */
+static TEE_Result meta_reset(uint32_t nslots)
+{
+	char mid[TEE_OBJECT_ID_MAX_LEN];
+	size_t mid_sz = meta_id(mid, META_SEQ_INDEX);
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ |
+			 TEE_DATA_FLAG_ACCESS_WRITE |
+			 TEE_DATA_FLAG_SHARE_READ |
+			 TEE_DATA_FLAG_SHARE_WRITE;
+	struct meta_entry *page;
+	TEE_Result res;
+	uint32_t n;
+
+	if (meta.object == TEE_HANDLE_NULL) {
+		meta.cache = TEE_Malloc(META_CACHE_PAGES *
+					sizeof(*meta.cache), 0);
+		if (!meta.cache)
+			return TEE_ERROR_OUT_OF_MEMORY;
+
+		/* A stale or damaged one is rewritten as it is */
+		phase_begin(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					       mid, mid_sz, flags,
+					       &meta.object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+							 mid, mid_sz, flags,
+							 TEE_HANDLE_NULL,
+							 NULL, 0,
+							 &meta.object);
+		phase_end(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+		if (res != TEE_SUCCESS) {
+			meta.object = TEE_HANDLE_NULL;
+			meta_close();
+			return res;
+		}
+	}
+
+	for (n = 0; n < META_CACHE_PAGES; n++)
+		meta.cache[n].valid = false;
+	meta.hdr.magic = META_MAGIC;
+	meta.hdr.version = META_VERSION;
+	meta.hdr.nslots = nslots;
+	meta.hdr.count = 0;
+
+	/* The first cached page is free for the zeroes now */
+	page = meta.cache[0].entries;
+	TEE_MemFill(page, 0, sizeof(meta.cache[0].entries));
+
+	res = meta_hdr_save();
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	for (n = 0; res == TEE_SUCCESS && n < nslots; n += META_PAGE_SLOTS)
+		res = TEE_WriteObjectData(meta.object, page,
+					  sizeof(meta.cache[0].entries));
+	if (res == TEE_SUCCESS)
+		res = TEE_TruncateObjectData(meta.object,
+					     meta_slot_offset(nslots));
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	return res;
+}
+
+/*
+ * Rewrite the table twice as large. The entries are set aside in a scratch
+ * object first, a page at a time, so that the memory used stays the same
+ * whatever the number of objects.
+ */
+static TEE_Result meta_grow(void)
+{
+	char sid[TEE_OBJECT_ID_MAX_LEN];
+	size_t sid_sz = meta_id(sid, META_SEQ_SCRATCH);
+	uint32_t nslots = meta.hdr.nslots;
+	uint32_t count = meta.hdr.count;
+	struct meta_entry *page;
+	TEE_ObjectHandle scratch;
+	struct meta_cached_page *cp;
+	uint32_t read_bytes;
+	uint32_t kept = 0;
+	uint32_t size;
+	TEE_Result res;
+	uint32_t n;
+
+	page = TEE_Malloc(META_PAGE_SLOTS * sizeof(*page), 0);
+	if (!page)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, sid, sid_sz,
+					 TEE_DATA_FLAG_ACCESS_READ |
+					 TEE_DATA_FLAG_ACCESS_WRITE |
+					 TEE_DATA_FLAG_ACCESS_WRITE_META |
+					 TEE_DATA_FLAG_OVERWRITE,
+					 TEE_HANDLE_NULL, NULL, 0, &scratch);
+	if (res != TEE_SUCCESS) {
+		TEE_Free(page);
+		return res;
+	}
+
+	for (n = 0; res == TEE_SUCCESS && n < nslots; n++) {
+		res = meta_page_get(n, &cp);
+		if (res != TEE_SUCCESS || !cp->entries[n % META_PAGE_SLOTS].used)
+			continue;
+		page[kept++ % META_PAGE_SLOTS] =
+			cp->entries[n % META_PAGE_SLOTS];
+		if (kept % META_PAGE_SLOTS && kept != count)
+			continue;
+
+		size = (kept - 1) % META_PAGE_SLOTS + 1;
+		res = TEE_WriteObjectData(scratch, page,
+					  size * sizeof(*page));
+	}
+	if (res == TEE_SUCCESS && kept != count)
+		res = TEE_ERROR_CORRUPT_OBJECT;
+
+	if (res == TEE_SUCCESS)
+		res = meta_reset(meta_nslots(count + 1));
+	if (res == TEE_SUCCESS)
+		res = TEE_SeekObjectData(scratch, 0, TEE_DATA_SEEK_SET);
+	for (n = 0; res == TEE_SUCCESS && n < count; n++) {
+		if (n % META_PAGE_SLOTS == 0) {
+			size = count - n < META_PAGE_SLOTS ?
+			       count - n : META_PAGE_SLOTS;
+			res = TEE_ReadObjectData(scratch, page,
+						 size * sizeof(*page),
+						 &read_bytes);
+			if (res == TEE_SUCCESS &&
+			    read_bytes != size * sizeof(*page))
+				res = TEE_ERROR_CORRUPT_OBJECT;
+			if (res != TEE_SUCCESS)
+				break;
+		}
+		res = meta_insert(&page[n % META_PAGE_SLOTS]);
+	}
+	if (res == TEE_SUCCESS)
+		res = meta_hdr_save();
+
+	TEE_CloseAndDeletePersistentObject1(scratch);
+	TEE_Free(page);
+	return res;
+}
+
+/* Mark the index stale in the lock object before an object changes */
+static TEE_Result meta_begin(void)
+{
+	struct store_state state = store_lock.state;
+	TEE_Result res;
+
+	if (!(state.flags & STORE_INDEX))
+		return TEE_SUCCESS;
+
+	state.flags &= ~STORE_INDEX;
+	res = store_lock_save(&state);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to update lock object, res=0x%08x", res);
+		return res;
+	}
+
+	store_lock.state.flags = state.flags;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Record the new payload of an object that was just written. Failing to
+ * only costs a rebuild of the index, the write itself stands.
+ */
+static void meta_put(const char *obj_id, size_t obj_id_sz,
+		     const void *data, size_t data_sz)
+{
+	uint8_t id_digest[META_ID_DIGEST_SIZE];
+	struct meta_entry entry;
+	bool added = false;
+	uint32_t slot = 0;
+	TEE_Time now;
+	TEE_Result res;
+
+	if (!meta.valid)
+		return;
+
+	res = meta_load();
+	if (res == TEE_SUCCESS)
+		res = meta_id_digest(obj_id, obj_id_sz, id_digest);
+	if (res == TEE_SUCCESS)
+		res = meta_find(id_digest, &slot, &entry);
+	if (res == TEE_SUCCESS && !entry.used &&
+	    2 * (meta.hdr.count + 1) > meta.hdr.nslots) {
+		res = meta_grow();
+		if (res == TEE_SUCCESS)
+			res = meta_find(id_digest, &slot, &entry);
+	}
+	if (res == TEE_SUCCESS) {
+		TEE_GetREETime(&now);
+		if (!entry.used) {
+			TEE_MemFill(&entry, 0, sizeof(entry));
+			TEE_MemMove(entry.id_digest, id_digest,
+				    sizeof(id_digest));
+			entry.used = 1;
+			entry.stat.created = now.seconds;
+			meta.hdr.count++;
+			added = true;
+		}
+		entry.stat.modified = now.seconds;
+		entry.stat.size = data_sz;
+		res = hash_data(data, data_sz, entry.stat.digest);
+	}
+	if (res == TEE_SUCCESS)
+		res = meta_entry_save(slot, &entry);
+	if (res == TEE_SUCCESS && added)
+		res = meta_hdr_save();
+
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to update metadata index, res=0x%08x", res);
+		meta_invalidate();
+	}
+}
+
+/*
+ * Take the entry out and shift the rest of its run back into the hole, so
+ * that every entry stays reachable from its home slot without tombstones.
+ */
+static void meta_remove(const char *obj_id, size_t obj_id_sz)
+{
+	uint8_t id_digest[META_ID_DIGEST_SIZE];
+	struct meta_entry entry;
+	uint32_t mask;
+	uint32_t hole = 0;
+	uint32_t home;
+	uint32_t n;
+	TEE_Result res;
+
+	if (!meta.valid)
+		return;
+
+	res = meta_load();
+	if (res == TEE_SUCCESS)
+		res = meta_id_digest(obj_id, obj_id_sz, id_digest);
+	if (res == TEE_SUCCESS)
+		res = meta_find(id_digest, &hole, &entry);
+	if (res == TEE_SUCCESS && !entry.used)
+		return;
+
+	mask = meta.hdr.nslots - 1;
+	for (n = (hole + 1) & mask; res == TEE_SUCCESS; n = (n + 1) & mask) {
+		res = meta_entry_get(n, &entry);
+		if (res != TEE_SUCCESS || !entry.used)
+			break;
+
+		/* Entries whose home lies between the hole and them stay */
+		home = meta_home(entry.id_digest);
+		if (((n - home) & mask) < ((n - hole) & mask))
+			continue;
+
+		res = meta_entry_save(hole, &entry);
+		hole = n;
+	}
+	if (res == TEE_SUCCESS) {
+		TEE_MemFill(&entry, 0, sizeof(entry));
+		res = meta_entry_save(hole, &entry);
+	}
+	if (res == TEE_SUCCESS) {
+		meta.hdr.count--;
+		res = meta_hdr_save();
+	}
+
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to update metadata index, res=0x%08x", res);
+		meta_invalidate();
+	}
+}
+
+/* Reads the metadata of an object, all zero for a plain data object */
+static TEE_Result read_object_meta(TEE_ObjectHandle object,
+				   const TEE_ObjectInfo *info,
+				   struct object_meta *meta)
+{
+	uint32_t meta_sz = sizeof(*meta);
+	TEE_Result res;
+
+	TEE_MemFill(meta, 0, sizeof(*meta));
+	if (info->objectType != TEE_TYPE_GENERIC_SECRET)
+		return TEE_SUCCESS;
+
+	res = TEE_GetObjectBufferAttribute(object, TEE_ATTR_SECRET_VALUE,
+					   meta, &meta_sz);
+	if (res == TEE_SUCCESS && meta_sz != sizeof(*meta))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	return res;
+}
+
+/* Metadata of the object stored under an ID, all zero if there is none */
+static TEE_Result lookup_object_meta(const char *obj_id, size_t obj_id_sz,
+				     struct object_meta *meta)
+{
+	TEE_ObjectHandle object;
+	TEE_ObjectInfo info;
+	uint32_t storage;
+	TEE_Result res;
+
+	TEE_MemFill(meta, 0, sizeof(*meta));
+	res = open_object(obj_id, obj_id_sz,
+			  TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_SHARE_READ,
+			  &object, &storage);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_GetObjectInfo1(object, &info);
+	if (res == TEE_SUCCESS)
+		res = read_object_meta(object, &info, meta);
+	TEE_CloseObject(object);
+	return res;
+}
+
+static uint64_t object_meta_version(const struct object_meta *meta)
+{
+	return meta->flags & OBJECT_META_VERSION ? meta->version : 0;
+}
+
+/*
+ * Drop one reference to a blob and garbage collect it once nobody refers
+ * to it anymore.
+ */
+static TEE_Result blob_unref(const uint8_t *digest)
+{
+	char bid[TEE_OBJECT_ID_MAX_LEN];
+	size_t bid_sz = blob_id(bid, digest);
+	struct blob_hdr hdr;
+	TEE_ObjectHandle blob;
+	uint32_t read_bytes;
+	uint32_t storage;
+	TEE_Result res;
+
+	res = open_object(bid, bid_sz,
+			  TEE_DATA_FLAG_ACCESS_READ |
+			  TEE_DATA_FLAG_ACCESS_WRITE |
+			  TEE_DATA_FLAG_ACCESS_WRITE_META,
+			  &blob, &storage);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_ReadObjectData(blob, &hdr, sizeof(hdr), &read_bytes);
+	if (res == TEE_SUCCESS && (read_bytes != sizeof(hdr) ||
+				   hdr.magic != BLOB_MAGIC || !hdr.refcount))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS) {
+		TEE_CloseObject(blob);
+		return res;
+	}
+
+	if (hdr.refcount <= 1) {
+		TEE_CloseAndDeletePersistentObject1(blob);
+		placement_forget(bid, bid_sz);
+		return TEE_SUCCESS;
+	}
+
+	hdr.refcount--;
+	res = TEE_SeekObjectData(blob, 0, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(blob, &hdr, sizeof(hdr));
+	TEE_CloseObject(blob);
+	return res;
+}
+
+/* Take a reference to the blob holding data, storing it if it is new */
+static TEE_Result blob_ref(const uint8_t *digest, const void *data,
+			   size_t data_sz)
+{
+	char bid[TEE_OBJECT_ID_MAX_LEN];
+	size_t bid_sz = blob_id(bid, digest);
+	struct blob_hdr hdr;
+	TEE_ObjectHandle blob;
+	uint32_t read_bytes;
+	uint32_t storage;
+	TEE_Result res;
+
+	res = open_object(bid, bid_sz,
+			  TEE_DATA_FLAG_ACCESS_READ |
+			  TEE_DATA_FLAG_ACCESS_WRITE,
+			  &blob, &storage);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		hdr.magic = BLOB_MAGIC;
+		hdr.refcount = 1;
+		return write_object(bid, bid_sz, NULL, &hdr, sizeof(hdr),
+				    data, data_sz,
+				    TA_SECURE_STORAGE_PLACE_BULK);
+	}
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_ReadObjectData(blob, &hdr, sizeof(hdr), &read_bytes);
+	if (res == TEE_SUCCESS && (read_bytes != sizeof(hdr) ||
+				   hdr.magic != BLOB_MAGIC))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res == TEE_SUCCESS) {
+		hdr.refcount++;
+		res = TEE_SeekObjectData(blob, 0, TEE_DATA_SEEK_SET);
+	}
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(blob, &hdr, sizeof(hdr));
+	TEE_CloseObject(blob);
+	return res;
+}
+
+/*
+ * Store data once under its SHA-256 and make the ID a reference to it.
+ * The new blob is referenced before the ID is switched over and the old
+ * one released only afterwards: an interruption can leak a reference but
+ * never leave an ID pointing at a collected blob.
+ */
+static TEE_Result write_dedup_object(const char *obj_id, size_t obj_id_sz,
+				     const void *data, size_t data_sz,
+				     uint32_t hint)
+{
+	struct object_meta old_meta;
+	struct object_meta meta = { .flags = OBJECT_META_REF };
+	TEE_Result res;
+
+	res = hash_data(data, data_sz, meta.digest);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = lookup_object_meta(obj_id, obj_id_sz, &old_meta);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Same content as already stored, nothing to write at all */
+	if (old_meta.flags & OBJECT_META_REF &&
+	    !TEE_MemCompare(old_meta.digest, meta.digest, DEDUP_DIGEST_SIZE))
+		return TEE_SUCCESS;
+
+	res = blob_ref(meta.digest, data, data_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = write_object(obj_id, obj_id_sz, &meta, NULL, 0, NULL, 0, hint);
+	if (res != TEE_SUCCESS) {
+		blob_unref(meta.digest);
+		return res;
+	}
+
+	if (old_meta.flags & OBJECT_META_REF)
+		return blob_unref(old_meta.digest);
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Key-value engine, used for small objects once TA_SECURE_STORAGE_POLICY_KV
+ * is set. Entries live in slotted pages addressed by linear hashing: the
+ * bucket object holds a meta page followed by the primary page of every
+ * bucket, chains of pages that overflow a bucket live in the overflow
+ * object. Buckets are split one at a time as the store fills up, so most
+ * lookups read a single page and the number of persistent objects stays
+ * the same however many entries are stored.
+ *
+ * Pages are cached in TA memory and modified there. Each store or delete
+ * ends by writing the dirty pages back, going through a redo log object
+ * whenever more than one page changed so that a command is never applied
+ * halfway.
+ */
+#define KV_PAGE_SIZE		4096
+#define KV_CACHE_PAGES		12
+#define KV_INITIAL_LEVEL	2
+
+/* Largest entry (ID and data), bigger objects keep an object of their own */
+#define KV_MAX_RECORD		512
+
+/*
+ * Longest bucket chain a store may create. Entries that do not fit fall
+ * back to an object of their own, which also bounds the pages a command
+ * can dirty to what the cache holds.
+ */
+#define KV_MAX_CHAIN		3
+
+/* Buckets are split once the pages are this full on average, in percent */
+#define KV_SPLIT_LOAD		75
+
+/* Sequence numbers of the engine's objects, all tagged KV_TAG */
+#define KV_TAG			'K'
+#define KV_SEQ_BUCKETS		0
+#define KV_SEQ_OVERFLOW		1
+#define KV_SEQ_LOG		2
+#define KV_SEQ_LOG_TMP		3
+
+#define KV_MAGIC		0x5653564b	/* "KVSV" */
+#define KV_VERSION		1
+#define KV_LOG_MAGIC		0x474c564b	/* "KVLG" */
+
+/* Page numbers with this bit set are pages of the overflow object */
+#define KV_OVERFLOW_PAGE	(1U << 31)
+
+/* Stored at the start of page 0 of the bucket object */
+struct kv_meta {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t seed;			/* keys the bucket hash */
+	uint32_t level;			/* 1 << level buckets before splitting */
+	uint32_t split;			/* next bucket to split */
+	uint32_t overflow_pages;	/* pages allocated in the overflow object */
+	uint32_t free_page;		/* head of the free overflow page list */
+	uint32_t entries;
+	uint64_t used_bytes;		/* slots and records of all entries */
+};
+
+/*
+ * Page header, followed by the slot array. Records are packed from the end
+ * of the page downwards and the slots are kept in the order of decreasing
+ * record offset, which lets a page be compacted in place.
+ */
+struct kv_page_hdr {
+	uint32_t next;			/* next page of the chain, 0 for none */
+	uint16_t nslots;
+	uint16_t data_start;
+	uint16_t holes;			/* bytes of records deleted in between */
+	uint16_t reserved;
+};
+
+/* A record is the entry's ID followed by its data */
+struct kv_slot {
+	uint32_t hash;
+	uint16_t offset;
+	uint16_t data_sz;
+	uint16_t id_sz;
+	uint16_t reserved;
+};
+
+struct kv_log_hdr {
+	uint32_t magic;
+	uint32_t count;
+};
+
+/* Redo log record header, followed by the page content */
+struct kv_log_rec {
+	uint32_t page;
+	uint32_t size;
+};
+
+struct kv_cached_page {
+	uint32_t page;
+	uint32_t lru;
+	bool valid;
+	bool dirty;
+	uint8_t data[KV_PAGE_SIZE];
+};
+
+static struct {
+	TEE_ObjectHandle buckets;
+	TEE_ObjectHandle overflow;
+	struct kv_meta meta;
+	struct kv_meta committed;
+	/* The meta page has changed beyond its counters */
+	bool meta_dirty;
+	bool meta_critical;
+	uint32_t lru_clock;
+	struct kv_cached_page *cache;
+} kv;
+
+static size_t kv_id(char *out, uint32_t seq)
+{
+	return make_internal_id(out, NULL, 0, KV_TAG, seq);
+}
+
+static struct kv_page_hdr *kv_hdr(struct kv_cached_page *cp)
+{
+	return (struct kv_page_hdr *)cp->data;
+}
+
+static struct kv_slot *kv_slots(struct kv_cached_page *cp)
+{
+	return (struct kv_slot *)(kv_hdr(cp) + 1);
+}
+
+static void kv_page_init(struct kv_cached_page *cp)
+{
+	struct kv_page_hdr *hdr = kv_hdr(cp);
+
+	hdr->next = 0;
+	hdr->nslots = 0;
+	hdr->data_start = KV_PAGE_SIZE;
+	hdr->holes = 0;
+	hdr->reserved = 0;
+}
+
+/*
+ * FNV-1a of the ID keyed with the store's random seed, so the IDs a client
+ * picks cannot be steered into a single bucket, and mixed so that the low
+ * bits used to address buckets depend on every byte.
+ */
+static uint32_t kv_hash(const void *id, size_t id_sz)
+{
+	const uint8_t *p = id;
+	uint32_t hash = 0x811c9dc5;
+	size_t n;
+
+	for (n = 0; n < sizeof(kv.meta.seed); n++) {
+		hash ^= (kv.meta.seed >> (8 * n)) & 0xff;
+		hash *= 0x01000193;
+	}
+	for (n = 0; n < id_sz; n++) {
+		hash ^= p[n];
+		hash *= 0x01000193;
+	}
+
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+/* Page number of the primary page of the bucket a hash belongs to */
+static uint32_t kv_bucket_page(uint32_t hash)
+{
+	uint32_t bucket = hash & ((1U << kv.meta.level) - 1);
+
+	if (bucket < kv.meta.split)
+		bucket = hash & ((2U << kv.meta.level) - 1);
+
+	return bucket + 1;
+}
+
+static TEE_ObjectHandle kv_page_object(uint32_t page)
+{
+	return page & KV_OVERFLOW_PAGE ? kv.overflow : kv.buckets;
+}
+
+static TEE_Result kv_seek_page(uint32_t page)
+{
+	return TEE_SeekObjectData(kv_page_object(page),
+				  (page & ~KV_OVERFLOW_PAGE) * KV_PAGE_SIZE,
+				  TEE_DATA_SEEK_SET);
+}
+
+static TEE_Result kv_write_page(uint32_t page, const void *data, size_t size)
+{
+	TEE_Result res;
+
+	store_changed();
+	res = kv_seek_page(page);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(kv_page_object(page), data, size);
+
+	return res;
+}
+
+/*
+ * Get a page through the cache. A fresh page is initialized empty instead
+ * of being read. Dirty pages are never evicted, running out of clean ones
+ * fails the command.
+ */
+static TEE_Result kv_page_get(uint32_t page, bool fresh,
+			      struct kv_cached_page **out)
+{
+	struct kv_cached_page *victim = NULL;
+	struct kv_cached_page *cp;
+	uint32_t read_bytes;
+	TEE_Result res;
+	size_t n;
+
+	for (n = 0; n < KV_CACHE_PAGES; n++) {
+		cp = &kv.cache[n];
+		if (cp->valid && cp->page == page) {
+			if (fresh)
+				kv_page_init(cp);
+			cp->lru = ++kv.lru_clock;
+			*out = cp;
+			return TEE_SUCCESS;
+		}
+		if (!cp->valid)
+			victim = cp;
+		else if (!cp->dirty && (!victim ||
+					(victim->valid && cp->lru < victim->lru)))
+			victim = cp;
+	}
+	if (!victim) {
+		EMSG("Key-value page cache exhausted");
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	victim->valid = false;
+	if (fresh) {
+		kv_page_init(victim);
+	} else {
+		phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+		res = kv_seek_page(page);
+		if (res == TEE_SUCCESS)
+			res = TEE_ReadObjectData(kv_page_object(page),
+						 victim->data, KV_PAGE_SIZE,
+						 &read_bytes);
+		phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		/*
+		 * Buckets are only written once they hold something, the
+		 * ones never written read as nothing or as zeroes.
+		 */
+		if (read_bytes && read_bytes != KV_PAGE_SIZE)
+			return TEE_ERROR_CORRUPT_OBJECT;
+		if (!read_bytes || !kv_hdr(victim)->data_start)
+			kv_page_init(victim);
+	}
+
+	victim->page = page;
+	victim->lru = ++kv.lru_clock;
+	victim->dirty = false;
+	victim->valid = true;
+	*out = victim;
+	return TEE_SUCCESS;
+}
+
+/* Replay a redo log left behind by an interrupted commit */
+static TEE_Result kv_log_replay(void)
+{
+	char lid[TEE_OBJECT_ID_MAX_LEN];
+	size_t lid_sz = kv_id(lid, KV_SEQ_LOG);
+	struct kv_log_hdr hdr;
+	struct kv_log_rec rec;
+	TEE_ObjectHandle log;
+	/* Only replayed while the cache is still empty */
+	uint8_t *buf = kv.cache[0].data;
+	uint32_t read_bytes;
+	TEE_Result res;
+	uint32_t n;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, lid, lid_sz,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_ACCESS_WRITE_META,
+				       &log);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Left by a writer that was interrupted, a reader cannot replay it */
+	if (!store_lock.exclusive) {
+		TEE_CloseObject(log);
+		return store_need_exclusive();
+	}
+
+	res = TEE_ReadObjectData(log, &hdr, sizeof(hdr), &read_bytes);
+	if (res == TEE_SUCCESS && (read_bytes != sizeof(hdr) ||
+				   hdr.magic != KV_LOG_MAGIC))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+
+	for (n = 0; res == TEE_SUCCESS && n < hdr.count; n++) {
+		res = TEE_ReadObjectData(log, &rec, sizeof(rec), &read_bytes);
+		if (res == TEE_SUCCESS && (read_bytes != sizeof(rec) ||
+					   rec.size > KV_PAGE_SIZE))
+			res = TEE_ERROR_CORRUPT_OBJECT;
+		if (res == TEE_SUCCESS)
+			res = TEE_ReadObjectData(log, buf, rec.size,
+						 &read_bytes);
+		if (res == TEE_SUCCESS && read_bytes != rec.size)
+			res = TEE_ERROR_CORRUPT_OBJECT;
+		if (res == TEE_SUCCESS)
+			res = kv_write_page(rec.page, buf, rec.size);
+	}
+
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to replay key-value log, res=0x%08x", res);
+		TEE_CloseObject(log);
+		return res;
+	}
+
+	return TEE_CloseAndDeletePersistentObject1(log);
+}
+
+static void kv_close(void)
+{
+	if (kv.buckets != TEE_HANDLE_NULL)
+		TEE_CloseObject(kv.buckets);
+	if (kv.overflow != TEE_HANDLE_NULL)
+		TEE_CloseObject(kv.overflow);
+	kv.buckets = TEE_HANDLE_NULL;
+	kv.overflow = TEE_HANDLE_NULL;
+
+	TEE_Free(kv.cache);
+	kv.cache = NULL;
+}
+
+static TEE_Result kv_create(void)
+{
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	size_t id_sz;
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ |
+			 TEE_DATA_FLAG_ACCESS_WRITE |
+			 TEE_DATA_FLAG_ACCESS_WRITE_META |
+			 TEE_DATA_FLAG_SHARE_READ |
+			 TEE_DATA_FLAG_SHARE_WRITE |
+			 TEE_DATA_FLAG_OVERWRITE;
+	TEE_Result res;
+
+	TEE_MemFill(&kv.meta, 0, sizeof(kv.meta));
+	kv.meta.magic = KV_MAGIC;
+	kv.meta.version = KV_VERSION;
+	kv.meta.level = KV_INITIAL_LEVEL;
+	TEE_GenerateRandom(&kv.meta.seed, sizeof(kv.meta.seed));
+
+	/* The bucket object is created last, it marks the store as usable */
+	id_sz = kv_id(id, KV_SEQ_OVERFLOW);
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, id, id_sz,
+					 flags, TEE_HANDLE_NULL, NULL, 0,
+					 &kv.overflow);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	id_sz = kv_id(id, KV_SEQ_BUCKETS);
+	return TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, id, id_sz,
+					  flags, TEE_HANDLE_NULL,
+					  &kv.meta, sizeof(kv.meta),
+					  &kv.buckets);
+}
+
+/*
+ * The objects stay open until another instance changes the store, shared
+ * with the other instances. Returns TEE_ERROR_ITEM_NOT_FOUND if there is no
+ * store and create is false.
+ */
+static TEE_Result kv_open(bool create)
+{
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	size_t id_sz;
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ |
+			 TEE_DATA_FLAG_ACCESS_WRITE |
+			 TEE_DATA_FLAG_SHARE_READ |
+			 TEE_DATA_FLAG_SHARE_WRITE;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	if (kv.buckets != TEE_HANDLE_NULL)
+		return TEE_SUCCESS;
+
+	kv.cache = TEE_Malloc(KV_CACHE_PAGES * sizeof(*kv.cache), 0);
+	if (!kv.cache)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+	id_sz = kv_id(id, KV_SEQ_BUCKETS);
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, id, id_sz,
+				       flags, &kv.buckets);
+	if (res == TEE_SUCCESS) {
+		id_sz = kv_id(id, KV_SEQ_OVERFLOW);
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, id, id_sz,
+					       flags, &kv.overflow);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			res = TEE_ERROR_CORRUPT_OBJECT;
+	} else if (res == TEE_ERROR_ITEM_NOT_FOUND && create) {
+		res = kv_create();
+	}
+	phase_end(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+
+	if (res == TEE_SUCCESS)
+		res = kv_log_replay();
+	if (res == TEE_SUCCESS)
+		res = TEE_SeekObjectData(kv.buckets, 0, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_ReadObjectData(kv.buckets, &kv.meta,
+					 sizeof(kv.meta), &read_bytes);
+	if (res == TEE_SUCCESS && (read_bytes != sizeof(kv.meta) ||
+				   kv.meta.magic != KV_MAGIC ||
+				   kv.meta.version != KV_VERSION))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS) {
+		if (res != TEE_ERROR_ITEM_NOT_FOUND && !store_lock.upgrade)
+			EMSG("Failed to open key-value store, res=0x%08x", res);
+		kv_close();
+		return res;
+	}
+
+	kv.committed = kv.meta;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Write the dirty pages and the meta page to a redo log, atomically. The
+ * log is returned open so that it can be dropped once applied.
+ */
+static TEE_Result kv_log_write(struct kv_cached_page **dirty, size_t count,
+			       TEE_ObjectHandle *log)
+{
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	size_t id_sz = kv_id(id, KV_SEQ_LOG_TMP);
+	struct kv_log_hdr hdr = {
+		.magic = KV_LOG_MAGIC,
+		.count = count + 1,
+	};
+	struct kv_log_rec rec;
+	TEE_Result res;
+	size_t n;
+
+	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, id, id_sz,
+					 TEE_DATA_FLAG_ACCESS_WRITE |
+					 TEE_DATA_FLAG_ACCESS_WRITE_META |
+					 TEE_DATA_FLAG_OVERWRITE,
+					 TEE_HANDLE_NULL, NULL, 0, log);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_WriteObjectData(*log, &hdr, sizeof(hdr));
+	rec.size = KV_PAGE_SIZE;
+	for (n = 0; res == TEE_SUCCESS && n < count; n++) {
+		rec.page = dirty[n]->page;
+		res = TEE_WriteObjectData(*log, &rec, sizeof(rec));
+		if (res == TEE_SUCCESS)
+			res = TEE_WriteObjectData(*log, dirty[n]->data,
+						  KV_PAGE_SIZE);
+	}
+
+	rec.page = 0;
+	rec.size = sizeof(kv.meta);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(*log, &rec, sizeof(rec));
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(*log, &kv.meta, sizeof(kv.meta));
+
+	/* The log only counts once it has its final name */
+	if (res == TEE_SUCCESS) {
+		id_sz = kv_id(id, KV_SEQ_LOG);
+		res = TEE_RenamePersistentObject(*log, id, id_sz);
+	}
+	if (res != TEE_SUCCESS) {
+		TEE_CloseAndDeletePersistentObject1(*log);
+		*log = TEE_HANDLE_NULL;
+	}
+
+	return res;
+}
+
+static void kv_abort(void)
+{
+	size_t n;
+
+	if (!kv.cache)
+		return;
+
+	for (n = 0; n < KV_CACHE_PAGES; n++) {
+		if (kv.cache[n].dirty) {
+			kv.cache[n].valid = false;
+			kv.cache[n].dirty = false;
+		}
+	}
+
+	kv.meta = kv.committed;
+	kv.meta_dirty = false;
+	kv.meta_critical = false;
+}
+
+/*
+ * Make the changes of a command durable. A single changed page is
+ * written in place, only the entry counters in the meta page could be
+ * lost with it. Anything more goes through the redo log.
+ */
+static TEE_Result kv_commit(void)
+{
+	struct kv_cached_page *dirty[KV_CACHE_PAGES];
+	struct kv_cached_page *cp;
+	TEE_ObjectHandle log = TEE_HANDLE_NULL;
+	TEE_Result res = TEE_SUCCESS;
+	bool logged = false;
+	size_t count = 0;
+	size_t n;
+	size_t m;
+
+	/* Pages are written in order, the objects only grow at their end */
+	for (n = 0; n < KV_CACHE_PAGES; n++) {
+		if (!kv.cache[n].dirty)
+			continue;
+		cp = &kv.cache[n];
+		for (m = count; m && dirty[m - 1]->page > cp->page; m--)
+			dirty[m] = dirty[m - 1];
+		dirty[m] = cp;
+		count++;
+	}
+	if (!count && !kv.meta_dirty)
+		return TEE_SUCCESS;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (count > 1 || kv.meta_critical) {
+		res = kv_log_write(dirty, count, &log);
+		logged = res == TEE_SUCCESS;
+	}
+	for (n = 0; res == TEE_SUCCESS && n < count; n++)
+		res = kv_write_page(dirty[n]->page, dirty[n]->data,
+				    KV_PAGE_SIZE);
+	if (res == TEE_SUCCESS && kv.meta_dirty)
+		res = kv_write_page(0, &kv.meta, sizeof(kv.meta));
+	if (res == TEE_SUCCESS && logged) {
+		res = TEE_CloseAndDeletePersistentObject1(log);
+		log = TEE_HANDLE_NULL;
+	}
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to commit key-value pages, res=0x%08x", res);
+		kv_abort();
+		/* Reopening the store replays the log that made it */
+		if (logged) {
+			if (log != TEE_HANDLE_NULL)
+				TEE_CloseObject(log);
+			kv_close();
+		}
+		return res;
+	}
+
+	for (n = 0; n < count; n++)
+		dirty[n]->dirty = false;
+	kv.committed = kv.meta;
+	kv.meta_dirty = false;
+	kv.meta_critical = false;
+	return TEE_SUCCESS;
+}
+
+/* Commit on success, drop the changes of the failed command otherwise */
+static TEE_Result kv_end(TEE_Result res)
+{
+	if (res == TEE_SUCCESS)
+		return kv_commit();
+
+	kv_abort();
+	return res;
+}
+
+static TEE_Result kv_page_alloc(struct kv_cached_page **out)
+{
+	TEE_Result res;
+	uint32_t page;
+
+	if (kv.meta.free_page) {
+		page = kv.meta.free_page;
+		res = kv_page_get(page, false, out);
+		if (res != TEE_SUCCESS)
+			return res;
+		kv.meta.free_page = kv_hdr(*out)->next;
+		kv_page_init(*out);
+	} else {
+		page = KV_OVERFLOW_PAGE | kv.meta.overflow_pages;
+		res = kv_page_get(page, true, out);
+		if (res != TEE_SUCCESS)
+			return res;
+		kv.meta.overflow_pages++;
+	}
+
+	(*out)->dirty = true;
+	kv.meta_dirty = true;
+	kv.meta_critical = true;
+	return TEE_SUCCESS;
+}
+
+static void kv_page_release(struct kv_cached_page *cp)
+{
+	kv_page_init(cp);
+	kv_hdr(cp)->next = kv.meta.free_page;
+	kv.meta.free_page = cp->page;
+
+	cp->dirty = true;
+	kv.meta_dirty = true;
+	kv.meta_critical = true;
+}
+
+/* Find the page and slot holding an entry */
+static TEE_Result kv_find(const void *id, size_t id_sz, uint32_t hash,
+			  struct kv_cached_page **out, size_t *slot)
+{
+	uint32_t page = kv_bucket_page(hash);
+	uint32_t pages = 0;
+	struct kv_cached_page *cp;
+	struct kv_slot *slots;
+	TEE_Result res;
+	size_t n;
+
+	while (page) {
+		/* A chain cannot be longer than all overflow pages */
+		if (pages++ > kv.meta.overflow_pages)
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		res = kv_page_get(page, false, &cp);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		slots = kv_slots(cp);
+		for (n = 0; n < kv_hdr(cp)->nslots; n++) {
+			if (slots[n].hash == hash && slots[n].id_sz == id_sz &&
+			    !TEE_MemCompare(cp->data + slots[n].offset, id,
+					    id_sz)) {
+				*out = cp;
+				*slot = n;
+				return TEE_SUCCESS;
+			}
+		}
+		page = kv_hdr(cp)->next;
+	}
+
+	return TEE_ERROR_ITEM_NOT_FOUND;
+}
+
+static void kv_page_remove(struct kv_cached_page *cp, size_t slot)
+{
+	struct kv_page_hdr *hdr = kv_hdr(cp);
+	struct kv_slot *slots = kv_slots(cp);
+
+	hdr->holes += slots[slot].id_sz + slots[slot].data_sz;
+	TEE_MemMove(slots + slot, slots + slot + 1,
+		    (hdr->nslots - slot - 1) * sizeof(*slots));
+	hdr->nslots--;
+	if (!hdr->nslots) {
+		hdr->data_start = KV_PAGE_SIZE;
+		hdr->holes = 0;
+	}
+	cp->dirty = true;
+}
+
+/* Move the records up to the end of the page, squeezing out the holes */
+static void kv_page_compact(struct kv_cached_page *cp)
+{
+	struct kv_page_hdr *hdr = kv_hdr(cp);
+	struct kv_slot *slots = kv_slots(cp);
+	size_t end = KV_PAGE_SIZE;
+	size_t len;
+	size_t n;
+
+	for (n = 0; n < hdr->nslots; n++) {
+		len = slots[n].id_sz + slots[n].data_sz;
+		end -= len;
+		TEE_MemMove(cp->data + end, cp->data + slots[n].offset, len);
+		slots[n].offset = end;
+	}
+	hdr->data_start = end;
+	hdr->holes = 0;
+}
+
+static bool kv_page_add(struct kv_cached_page *cp, uint32_t hash,
+			const void *id, size_t id_sz,
+			const void *data, size_t data_sz)
+{
+	struct kv_page_hdr *hdr = kv_hdr(cp);
+	struct kv_slot *slot;
+	size_t room;
+
+	room = hdr->data_start - sizeof(*hdr) -
+	       hdr->nslots * sizeof(struct kv_slot);
+	if (room < sizeof(*slot) + id_sz + data_sz) {
+		if (room + hdr->holes < sizeof(*slot) + id_sz + data_sz)
+			return false;
+		kv_page_compact(cp);
+	}
+
+	hdr->data_start -= id_sz + data_sz;
+	TEE_MemMove(cp->data + hdr->data_start, id, id_sz);
+	TEE_MemMove(cp->data + hdr->data_start + id_sz, data, data_sz);
+
+	slot = kv_slots(cp) + hdr->nslots++;
+	slot->hash = hash;
+	slot->offset = hdr->data_start;
+	slot->data_sz = data_sz;
+	slot->id_sz = id_sz;
+	slot->reserved = 0;
+
+	cp->dirty = true;
+	return true;
+}
+
+/*
+ * Add an entry to the first page of its bucket chain with room for it,
+ * extending the chain if there is none. Returns TEE_ERROR_STORAGE_NO_SPACE
+ * if that would make the chain longer than max_chain pages.
+ */
+static TEE_Result kv_insert(uint32_t hash, const void *id, size_t id_sz,
+			    const void *data, size_t data_sz,
+			    uint32_t max_chain)
+{
+	uint32_t page = kv_bucket_page(hash);
+	struct kv_cached_page *tail;
+	struct kv_cached_page *cp;
+	uint32_t pages = 0;
+	TEE_Result res;
+
+	for (;;) {
+		if (pages++ > kv.meta.overflow_pages)
+			return TEE_ERROR_CORRUPT_OBJECT;
+
+		res = kv_page_get(page, false, &cp);
+		if (res != TEE_SUCCESS)
+			return res;
+		if (kv_page_add(cp, hash, id, id_sz, data, data_sz))
+			return TEE_SUCCESS;
+		if (!kv_hdr(cp)->next)
+			break;
+		page = kv_hdr(cp)->next;
+	}
+
+	if (pages >= max_chain)
+		return TEE_ERROR_STORAGE_NO_SPACE;
+
+	/* Dirty pages stay cached while the new page is brought in */
+	tail = cp;
+	tail->dirty = true;
+	res = kv_page_alloc(&cp);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	kv_hdr(tail)->next = cp->page;
+	kv_page_add(cp, hash, id, id_sz, data, data_sz);
+	return TEE_SUCCESS;
+}
+
+static bool kv_needs_split(void)
+{
+	uint64_t buckets = (1U << kv.meta.level) + kv.meta.split;
+
+	return kv.meta.used_bytes * 100 >
+	       buckets * KV_PAGE_SIZE * KV_SPLIT_LOAD;
+}
+
+/*
+ * Split the next bucket in line: its entries are spread over itself and
+ * a new bucket appended at the end, using one more bit of their hash.
+ */
+static TEE_Result kv_split(void)
+{
+	uint32_t first = kv.meta.split + 1;
+	struct kv_cached_page *cp;
+	struct kv_slot *slots;
+	struct kv_slot *slot;
+	uint32_t pages = 0;
+	uint32_t page;
+	TEE_Result res;
+	uint8_t *buf;
+	size_t len = 0;
+	size_t pos;
+	size_t n;
+
+	/* Count the pages of the chain to size the buffer */
+	for (page = first; page; page = kv_hdr(cp)->next) {
+		if (pages++ > kv.meta.overflow_pages)
+			return TEE_ERROR_CORRUPT_OBJECT;
+		res = kv_page_get(page, false, &cp);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	buf = TEE_Malloc(pages * KV_PAGE_SIZE, 0);
+	if (!buf)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	/* Take the entries out, freeing the overflow pages on the way */
+	for (page = first; page; ) {
+		res = kv_page_get(page, false, &cp);
+		if (res != TEE_SUCCESS)
+			goto out;
+
+		slots = kv_slots(cp);
+		for (n = 0; n < kv_hdr(cp)->nslots; n++) {
+			TEE_MemMove(buf + len, &slots[n], sizeof(slots[n]));
+			len += sizeof(slots[n]);
+			TEE_MemMove(buf + len, cp->data + slots[n].offset,
+				    slots[n].id_sz + slots[n].data_sz);
+			len += slots[n].id_sz + slots[n].data_sz;
+		}
+
+		page = kv_hdr(cp)->next;
+		if (cp->page == first) {
+			kv_page_init(cp);
+			cp->dirty = true;
+		} else {
+			kv_page_release(cp);
+		}
+	}
+
+	/* The new bucket gets the next page of the bucket object */
+	res = kv_page_get(first + (1U << kv.meta.level), true, &cp);
+	if (res != TEE_SUCCESS)
+		goto out;
+	cp->dirty = true;
+
+	kv.meta.split++;
+	if (kv.meta.split == 1U << kv.meta.level) {
+		kv.meta.level++;
+		kv.meta.split = 0;
+	}
+	kv.meta_dirty = true;
+	kv.meta_critical = true;
+
+	for (pos = 0; pos < len; ) {
+		slot = (struct kv_slot *)(buf + pos);
+		pos += sizeof(*slot);
+		res = kv_insert(slot->hash, buf + pos, slot->id_sz,
+				buf + pos + slot->id_sz, slot->data_sz,
+				UINT32_MAX);
+		if (res != TEE_SUCCESS)
+			goto out;
+		pos += slot->id_sz + slot->data_sz;
+	}
+
+out:
+	TEE_Free(buf);
+	return res;
+}
+
+/*
+ * Store an entry. Returns TEE_ERROR_STORAGE_NO_SPACE for entries the
+ * engine does not take, which then get an object of their own.
+ */
+static TEE_Result kv_store(const char *id, size_t id_sz,
+			   const void *data, size_t data_sz)
+{
+	struct kv_cached_page *cp;
+	struct kv_slot *slot;
+	uint32_t hash;
+	TEE_Result res;
+	size_t n;
+
+	if (id_sz + data_sz > KV_MAX_RECORD)
+		return TEE_ERROR_STORAGE_NO_SPACE;
+
+	res = kv_open(true);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Growing the table is a change of its own, it may also fail */
+	if (kv_needs_split()) {
+		res = kv_end(kv_split());
+		if (res != TEE_SUCCESS)
+			EMSG("Failed to split key-value bucket, res=0x%08x",
+			     res);
+		if (kv.buckets == TEE_HANDLE_NULL)
+			return res;
+	}
+
+	hash = kv_hash(id, id_sz);
+	res = kv_find(id, id_sz, hash, &cp, &n);
+	if (res == TEE_SUCCESS) {
+		slot = kv_slots(cp) + n;
+		if (slot->data_sz == data_sz) {
+			TEE_MemMove(cp->data + slot->offset + id_sz, data,
+				    data_sz);
+			cp->dirty = true;
+			return kv_end(TEE_SUCCESS);
+		}
+		kv.meta.entries--;
+		kv.meta.used_bytes -= sizeof(*slot) + id_sz + slot->data_sz;
+		kv_page_remove(cp, n);
+	} else if (res != TEE_ERROR_ITEM_NOT_FOUND) {
+		return kv_end(res);
+	}
+
+	res = kv_insert(hash, id, id_sz, data, data_sz, KV_MAX_CHAIN);
+	if (res == TEE_SUCCESS) {
+		kv.meta.entries++;
+		kv.meta.used_bytes += sizeof(*slot) + id_sz + data_sz;
+		kv.meta_dirty = true;
+	}
+
+	return kv_end(res);
+}
+
+/*
+ * Read an entry into data. *data_sz is updated with the size of the entry,
+ * also when the buffer is too short.
+ */
+static TEE_Result kv_load(const char *id, size_t id_sz,
+			  void *data, size_t *data_sz)
+{
+	struct kv_cached_page *cp;
+	struct kv_slot *slot;
+	TEE_Result res;
+	size_t n;
+
+	res = kv_open(false);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = kv_find(id, id_sz, kv_hash(id, id_sz), &cp, &n);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	slot = kv_slots(cp) + n;
+	if (slot->data_sz > *data_sz) {
+		*data_sz = slot->data_sz;
+		return TEE_ERROR_SHORT_BUFFER;
+	}
+
+	TEE_MemMove(data, cp->data + slot->offset + id_sz, slot->data_sz);
+	*data_sz = slot->data_sz;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result kv_remove(const char *id, size_t id_sz)
+{
+	struct kv_cached_page *cp;
+	struct kv_slot *slot;
+	TEE_Result res;
+	size_t n;
+
+	res = kv_open(false);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = kv_find(id, id_sz, kv_hash(id, id_sz), &cp, &n);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	slot = kv_slots(cp) + n;
+	kv.meta.entries--;
+	kv.meta.used_bytes -= sizeof(*slot) + id_sz + slot->data_sz;
+	kv.meta_dirty = true;
+	kv_page_remove(cp, n);
+
+	return kv_end(TEE_SUCCESS);
+}
+
+/*
+ * Versioned objects bypass dedup and the key-value engine, whatever held
+ * the ID before is dropped once the object is written.
+ */
+static TEE_Result write_versioned_object(const char *obj_id, size_t obj_id_sz,
+					 uint64_t version, const void *data,
+					 size_t data_sz, uint32_t hint)
+{
+	struct object_meta meta = {
+		.flags = OBJECT_META_VERSION,
+		.version = version,
+	};
+	struct object_meta old_meta = { .flags = 0 };
+	TEE_Result res;
+
+	if (storage_policy.flags & POLICY_KV_USED) {
+		res = kv_remove(obj_id, obj_id_sz);
+		if (res != TEE_SUCCESS && res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	if (storage_policy.flags & POLICY_DEDUP_USED) {
+		res = lookup_object_meta(obj_id, obj_id_sz, &old_meta);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	res = write_object(obj_id, obj_id_sz, &meta, NULL, 0, data, data_sz,
+			   hint);
+	if (res == TEE_SUCCESS && old_meta.flags & OBJECT_META_REF)
+		res = blob_unref(old_meta.digest);
+
+	return res;
+}
+
+/* Write a client object according to the storage policy */
+static TEE_Result write_client_object(const char *obj_id, size_t obj_id_sz,
+				      const void *data, size_t data_sz,
+				      uint32_t hint)
+{
+	struct object_meta old_meta = { .flags = 0 };
+	TEE_Result res;
+
+	/*
+	 * A versioned object stays versioned whatever writes it, so that a
+	 * compare-and-swap never misses a write. Stores that never used
+	 * WRITE_IF_VERSION do not pay for the lookup.
+	 */
+	if (storage_policy.flags & POLICY_VERSION_USED) {
+		res = lookup_object_meta(obj_id, obj_id_sz, &old_meta);
+		if (res != TEE_SUCCESS)
+			return res;
+		if (old_meta.flags & OBJECT_META_VERSION)
+			return write_versioned_object(obj_id, obj_id_sz,
+						      old_meta.version + 1,
+						      data, data_sz, hint);
+	}
+
+	/*
+	 * Looking for an object stored under the ID before would cost the
+	 * open the engine is there to avoid, such an object is left behind,
+	 * shadowed by the entry, until the ID is deleted.
+	 */
+	if (storage_policy.flags & TA_SECURE_STORAGE_POLICY_KV) {
+		res = kv_store(obj_id, obj_id_sz, data, data_sz);
+		if (res != TEE_ERROR_STORAGE_NO_SPACE)
+			return res;
+	}
+
+	/* An entry left in the engine would shadow the object */
+	if (storage_policy.flags & POLICY_KV_USED) {
+		res = kv_remove(obj_id, obj_id_sz);
+		if (res != TEE_SUCCESS && res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	if (storage_policy.flags & TA_SECURE_STORAGE_POLICY_DEDUP)
+		return write_dedup_object(obj_id, obj_id_sz, data, data_sz,
+					  hint);
+
+	/* Only a store that ever used dedup can hold references */
+	if (storage_policy.flags & POLICY_DEDUP_USED) {
+		res = lookup_object_meta(obj_id, obj_id_sz, &old_meta);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	res = write_object(obj_id, obj_id_sz, NULL, NULL, 0, data, data_sz,
+			   hint);
+	if (res == TEE_SUCCESS && old_meta.flags & OBJECT_META_REF)
+		res = blob_unref(old_meta.digest);
+
+	return res;
+}
+
+/*
+ * Every change of a client object goes through the metadata index. A
+ * failed write may have changed the object anyway, the index is dropped.
+ */
+static TEE_Result put_object(const char *obj_id, size_t obj_id_sz,
+			     const void *data, size_t data_sz, uint32_t hint)
+{
+	TEE_Result res;
+
+	res = meta_begin();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = write_client_object(obj_id, obj_id_sz, data, data_sz, hint);
+	if (res == TEE_SUCCESS)
+		meta_put(obj_id, obj_id_sz, data, data_sz);
+	else
+		meta_invalidate();
+
+	return res;
+}
+
+/* Same as put_object() for an object written at the given version */
+static TEE_Result put_versioned_object(const char *obj_id, size_t obj_id_sz,
+				       uint64_t version, const void *data,
+				       size_t data_sz, uint32_t hint)
+{
+	struct storage_policy policy;
+	TEE_Result res;
+
+	/* From now on every write looks for the version to bump */
+	if (!(storage_policy.flags & POLICY_VERSION_USED)) {
+		policy = storage_policy;
+		policy.flags |= POLICY_VERSION_USED;
+		res = save_storage_policy(&policy);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	res = meta_begin();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = write_versioned_object(obj_id, obj_id_sz, version, data,
+				     data_sz, hint);
+	if (res == TEE_SUCCESS)
+		meta_put(obj_id, obj_id_sz, data, data_sz);
+	else
+		meta_invalidate();
+
+	return res;
+}
+
+/*
+ * Version of whatever is stored under an ID: 0 for an object without one,
+ * TA_SECURE_STORAGE_VERSION_NONE if there is nothing.
+ */
+static TEE_Result lookup_object_version(const char *obj_id, size_t obj_id_sz,
+					uint64_t *version)
+{
+	struct object_meta meta;
+	TEE_ObjectHandle object;
+	TEE_ObjectInfo info;
+	uint32_t storage;
+	size_t data_sz = 0;
+	TEE_Result res;
+
+	*version = TA_SECURE_STORAGE_VERSION_NONE;
+
+	/* Entries of the key-value engine are never versioned */
+	if (storage_policy.flags & POLICY_KV_USED) {
+		res = kv_load(obj_id, obj_id_sz, NULL, &data_sz);
+		if (res == TEE_SUCCESS || res == TEE_ERROR_SHORT_BUFFER) {
+			*version = 0;
+			return TEE_SUCCESS;
+		}
+		if (res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	res = open_object(obj_id, obj_id_sz,
+			  TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_SHARE_READ,
+			  &object, &storage);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_GetObjectInfo1(object, &info);
+	if (res == TEE_SUCCESS)
+		res = read_object_meta(object, &info, &meta);
+	if (res == TEE_SUCCESS)
+		*version = object_meta_version(&meta);
+	TEE_CloseObject(object);
+	return res;
+}
+
+static size_t journal_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, JOURNAL_TAG, 0);
+}
+
+static size_t batch_marker_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, BATCH_MARKER_TAG, 0);
+}
+
+static size_t fence_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, FENCE_TAG, 0);
+}
+
+/* Drop the fences, there is no pending batch they are kept for anymore */
+static void journal_unfence(void)
+{
+	char fid[TEE_OBJECT_ID_MAX_LEN];
+	size_t fid_sz = fence_id(fid);
+	TEE_ObjectHandle object;
+	TEE_Result res;
+
+	journal_pending = false;
+	if (!journal_fenced)
+		return;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, fid, fid_sz,
+				       TEE_DATA_FLAG_ACCESS_WRITE_META,
+				       &object);
+	if (res == TEE_SUCCESS)
+		TEE_CloseAndDeletePersistentObject1(object);
+	if (res == TEE_SUCCESS || res == TEE_ERROR_ITEM_NOT_FOUND)
+		journal_fenced = false;
+	else
+		EMSG("Failed to delete fence object, res=0x%08x", res);
+}
+
+/* Flag the records of a batch written before the fence of their ID */
+static void journal_supersede(char *buf, size_t len,
+			      const struct journal_rec *fence, const char *id)
+{
+	struct journal_rec rec;
+	size_t pos;
+
+	for (pos = 0; pos < len;
+	     pos += sizeof(rec) + rec.id_sz + rec.data_sz) {
+		TEE_MemMove(&rec, buf + pos, sizeof(rec));
+		if (rec.id_sz != fence->id_sz ||
+		    rec.generation >= fence->generation ||
+		    TEE_MemCompare(buf + pos + sizeof(rec), id, rec.id_sz))
+			continue;
+
+		rec.flags |= JOURNAL_REC_STALE;
+		TEE_MemMove(buf + pos, &rec, sizeof(rec));
+	}
+}
+
+/* Drop the records of a pending batch that fences supersede */
+static TEE_Result journal_filter(char *buf, size_t *len)
+{
+	char fid[TEE_OBJECT_ID_MAX_LEN];
+	size_t fid_sz = fence_id(fid);
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	struct journal_rec rec;
+	TEE_ObjectHandle object;
+	uint32_t read_bytes;
+	size_t rec_sz;
+	size_t pos;
+	size_t kept;
+	TEE_Result res;
+
+	if (!journal_fenced)
+		return TEE_SUCCESS;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, fid, fid_sz,
+				       TEE_DATA_FLAG_ACCESS_READ, &object);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open fence object, res=0x%08x", res);
+		return res;
+	}
+
+	for (;;) {
+		res = TEE_ReadObjectData(object, &rec, sizeof(rec),
+					 &read_bytes);
+		if (res != TEE_SUCCESS || !read_bytes)
+			break;
+		if (read_bytes != sizeof(rec) ||
+		    rec.id_sz > TEE_OBJECT_ID_MAX_LEN) {
+			res = TEE_ERROR_CORRUPT_OBJECT;
+			break;
+		}
+
+		res = TEE_ReadObjectData(object, id, rec.id_sz, &read_bytes);
+		if (res == TEE_SUCCESS && read_bytes != rec.id_sz)
+			res = TEE_ERROR_CORRUPT_OBJECT;
+		if (res != TEE_SUCCESS)
+			break;
+
+		journal_supersede(buf, *len, &rec, id);
+	}
+	TEE_CloseObject(object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to read fences, res=0x%08x", res);
+		return res;
+	}
+
+	for (pos = 0, kept = 0; pos < *len; pos += rec_sz) {
+		TEE_MemMove(&rec, buf + pos, sizeof(rec));
+		rec_sz = sizeof(rec) + rec.id_sz + rec.data_sz;
+		if (rec.flags & JOURNAL_REC_STALE)
+			continue;
+
+		TEE_MemMove(buf + kept, buf + pos, rec_sz);
+		kept += rec_sz;
+	}
+	*len = kept;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Append records to the journal object with a single write, so that a
+ * whole batch pays the storage commit cost only once.
+ */
+static TEE_Result journal_append(const char *buf, size_t len)
+{
+	char jid[TEE_OBJECT_ID_MAX_LEN];
+	size_t jid_sz = journal_id(jid);
+	TEE_ObjectHandle journal;
+	TEE_Result res;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, jid, jid_sz,
+				       TEE_DATA_FLAG_ACCESS_WRITE, &journal);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+						 jid, jid_sz,
+						 TEE_DATA_FLAG_ACCESS_READ |
+						 TEE_DATA_FLAG_ACCESS_WRITE |
+						 TEE_DATA_FLAG_ACCESS_WRITE_META,
+						 TEE_HANDLE_NULL, NULL, 0,
+						 &journal);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open journal, res=0x%08x", res);
+		return res;
+	}
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(journal, 0, TEE_DATA_SEEK_END);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(journal, buf, len);
+	TEE_CloseObject(journal);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to commit journal batch, res=0x%08x", res);
+		return res;
+	}
+
+	journal_dirty = true;
+	return TEE_SUCCESS;
+}
+
+/*
+ * The holder of the pending batch is gone if its marker can be opened. A
+ * holder that could not get the lock before going away left its batch in
+ * the marker: it is moved to the journal, less what the fences kept for it
+ * supersede, and the fences are dropped. Fails with
+ * TEE_ERROR_ACCESS_CONFLICT while the holder is still around.
+ */
+static TEE_Result journal_adopt(void)
+{
+	char mid[TEE_OBJECT_ID_MAX_LEN];
+	size_t mid_sz = batch_marker_id(mid);
+	TEE_ObjectHandle marker;
+	TEE_ObjectInfo info;
+	uint32_t read_bytes;
+	char *buf = NULL;
+	size_t len = 0;
+	TEE_Result res;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, mid, mid_sz,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_ACCESS_WRITE_META,
+				       &marker);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		journal_unfence();
+		return TEE_SUCCESS;
+	}
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_GetObjectInfo1(marker, &info);
+	if (res == TEE_SUCCESS && info.dataSize > JOURNAL_BATCH_MAX_SIZE)
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res == TEE_SUCCESS && info.dataSize) {
+		len = info.dataSize;
+		buf = TEE_Malloc(len, 0);
+		if (!buf)
+			res = TEE_ERROR_OUT_OF_MEMORY;
+	}
+	if (res == TEE_SUCCESS && len) {
+		res = TEE_ReadObjectData(marker, buf, len, &read_bytes);
+		if (res == TEE_SUCCESS && read_bytes != len)
+			res = TEE_ERROR_CORRUPT_OBJECT;
+	}
+	if (res == TEE_SUCCESS && len)
+		res = journal_filter(buf, &len);
+	if (res == TEE_SUCCESS && len)
+		res = journal_append(buf, len);
+	TEE_Free(buf);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to take over pending batch, res=0x%08x", res);
+		TEE_CloseObject(marker);
+		return res;
+	}
+
+	TEE_CloseAndDeletePersistentObject1(marker);
+	journal_unfence();
+	return TEE_SUCCESS;
+}
+
+/*
+ * Make this instance the holder of the pending batch by opening the marker
+ * without sharing it. Fails with TEE_ERROR_ACCESS_CONFLICT while another
+ * instance holds one.
+ */
+static TEE_Result journal_claim(void)
+{
+	char mid[TEE_OBJECT_ID_MAX_LEN];
+	size_t mid_sz = batch_marker_id(mid);
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ |
+			 TEE_DATA_FLAG_ACCESS_WRITE;
+	TEE_Result res;
+
+	if (journal_pending) {
+		res = journal_adopt();
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, mid, mid_sz,
+				       flags, &journal_batch.marker);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+						 mid, mid_sz, flags,
+						 TEE_HANDLE_NULL, NULL, 0,
+						 &journal_batch.marker);
+	if (res != TEE_SUCCESS) {
+		journal_batch.marker = TEE_HANDLE_NULL;
+		return res;
+	}
+
+	journal_pending = true;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Commit the writes batched in memory to the journal object. The holder
+ * of the pending batch then gives it up.
+ */
+static TEE_Result journal_commit(void)
+{
+	TEE_Result res;
+
+	if (journal_batch.marker != TEE_HANDLE_NULL) {
+		res = journal_filter(journal_batch.buf, &journal_batch.len);
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	if (journal_batch.len) {
+		res = journal_append(journal_batch.buf, journal_batch.len);
+		if (res != TEE_SUCCESS)
+			return res;
+		journal_batch.len = 0;
+	}
+
+	if (journal_batch.marker != TEE_HANDLE_NULL) {
+		journal_unfence();
+		TEE_CloseObject(journal_batch.marker);
+		journal_batch.marker = TEE_HANDLE_NULL;
+	}
+
+	return TEE_SUCCESS;
+}
+
+/*
+ * Leave the pending batch in the marker for the next writer to take over,
+ * when the store stayed too busy to commit it. Only the holder can open the
+ * marker, so this needs no lock.
+ */
+static TEE_Result journal_abandon(void)
+{
+	TEE_Result res;
+
+	if (journal_batch.marker == TEE_HANDLE_NULL)
+		return TEE_ERROR_BUSY;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(journal_batch.marker, 0, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(journal_batch.marker,
+					  journal_batch.buf, journal_batch.len);
+	if (res == TEE_SUCCESS)
+		res = TEE_TruncateObjectData(journal_batch.marker,
+					     journal_batch.len);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	TEE_CloseObject(journal_batch.marker);
+	journal_batch.marker = TEE_HANDLE_NULL;
+	journal_batch.len = 0;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Replay the journal into the target objects and drop it. Records are
+ * replayed in order so the latest write of an ID wins. Replaying is
+ * idempotent, an interrupted replay is simply redone next time.
+ */
+static TEE_Result journal_apply(void)
+{
+	char jid[TEE_OBJECT_ID_MAX_LEN];
+	size_t jid_sz = journal_id(jid);
+	struct journal_rec rec;
+	TEE_ObjectHandle journal;
+	TEE_Result res;
+	uint32_t read_bytes;
+	size_t mark;
+	char *buf;
+
+	res = journal_commit();
+	if (res != TEE_SUCCESS)
+		return res;
+	if (!journal_dirty)
+		return TEE_SUCCESS;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, jid, jid_sz,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_ACCESS_WRITE_META,
+				       &journal);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		journal_dirty = false;
+		return TEE_SUCCESS;
+	}
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open journal, res=0x%08x", res);
+		return res;
+	}
+
+	mark = tee_arena_mark(arena);
+	buf = tee_arena_alloc(arena, JOURNAL_BATCH_MAX_SIZE);
+	if (!buf) {
+		TEE_CloseObject(journal);
+		return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	for (;;) {
+		res = TEE_ReadObjectData(journal, &rec, sizeof(rec),
+					 &read_bytes);
+		if (res != TEE_SUCCESS || !read_bytes)
+			break;
+		if (read_bytes != sizeof(rec) ||
+		    rec.id_sz > TEE_OBJECT_ID_MAX_LEN ||
+		    rec.data_sz > JOURNAL_BATCH_MAX_SIZE - rec.id_sz) {
+			res = TEE_ERROR_CORRUPT_OBJECT;
+			break;
+		}
+
+		res = TEE_ReadObjectData(journal, buf,
+					 rec.id_sz + rec.data_sz,
+					 &read_bytes);
+		if (res == TEE_SUCCESS &&
+		    read_bytes != rec.id_sz + rec.data_sz)
+			res = TEE_ERROR_CORRUPT_OBJECT;
+		if (res != TEE_SUCCESS)
+			break;
+
+		res = put_object(buf, rec.id_sz, buf + rec.id_sz,
+				 rec.data_sz, TA_SECURE_STORAGE_PLACE_AUTO);
+		if (res != TEE_SUCCESS)
+			break;
+	}
+	tee_arena_release(arena, mark);
+
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to apply journal, res=0x%08x", res);
+		TEE_CloseObject(journal);
+		return res;
+	}
+
+	TEE_CloseAndDeletePersistentObject1(journal);
+	journal_dirty = false;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Tell the holder of the pending batch, if any, that the command is about
+ * to write or delete the client object. Every command doing so calls it.
+ */
+static TEE_Result journal_fence(const char *obj_id, size_t obj_id_sz)
+{
+	char buf[sizeof(struct journal_rec) + TEE_OBJECT_ID_MAX_LEN];
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	size_t id_sz;
+	struct journal_rec rec = {
+		.id_sz = obj_id_sz,
+		.generation = store_lock.state.generation,
+	};
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	bool dirty;
+
+	if (!journal_pending || journal_batch.marker != TEE_HANDLE_NULL)
+		return TEE_SUCCESS;
+
+	/* Records taken over are older than the write about to be done */
+	dirty = journal_dirty;
+	res = journal_adopt();
+	if (res == TEE_SUCCESS && journal_dirty && !dirty)
+		res = journal_apply();
+	if (res != TEE_ERROR_ACCESS_CONFLICT)
+		return res;
+
+	id_sz = fence_id(id);
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, id, id_sz,
+				       TEE_DATA_FLAG_ACCESS_WRITE, &object);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+						 id, id_sz,
+						 TEE_DATA_FLAG_ACCESS_READ |
+						 TEE_DATA_FLAG_ACCESS_WRITE |
+						 TEE_DATA_FLAG_ACCESS_WRITE_META,
+						 TEE_HANDLE_NULL, NULL, 0,
+						 &object);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open fence object, res=0x%08x", res);
+		return res;
+	}
+
+	TEE_MemMove(buf, &rec, sizeof(rec));
+	TEE_MemMove(buf + sizeof(rec), obj_id, obj_id_sz);
+	res = TEE_SeekObjectData(object, 0, TEE_DATA_SEEK_END);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(object, buf,
+					  sizeof(rec) + obj_id_sz);
+	TEE_CloseObject(object);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	store_changed();
+	journal_fenced = true;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Any direct access to the objects must see the writes still sitting in
+ * the batch or the journal, and must not be overtaken by a later replay.
+ */
+static TEE_Result journal_drain(void)
+{
+	if (!journal_batch.len && !journal_dirty)
+		return TEE_SUCCESS;
+	if (!store_lock.exclusive)
+		return store_need_exclusive();
+
+	return journal_apply();
+}
+
+static TEE_Result create_raw_object(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_param_types_hint =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE);
+	uint32_t hint = TA_SECURE_STORAGE_PLACE_AUTO;
+	TEE_Result res;
+	char *obj_id;
+	size_t obj_id_sz;
+	char *data;
+	size_t data_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types == exp_param_types_hint)
+		hint = params[2].value.a;
+	else if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_drain();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	obj_id_sz = params[0].memref.size;
+	obj_id = tee_arena_alloc(arena, obj_id_sz);
+	if (!obj_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	if (!client_id_valid(obj_id, obj_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_fence(obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	data = (char *)params[1].memref.buffer;
+	data_sz = params[1].memref.size;
+
+	return put_object(obj_id, obj_id_sz, data, data_sz, hint);
+}
+
+static TEE_Result write_object_if_version(uint32_t param_types,
+					  TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INOUT,
+				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_param_types_hint =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_INOUT,
+				TEE_PARAM_TYPE_VALUE_INPUT);
+	uint32_t hint = TA_SECURE_STORAGE_PLACE_AUTO;
+	uint64_t expected;
+	uint64_t version;
+	TEE_Result res;
+	char *obj_id;
+	size_t obj_id_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types == exp_param_types_hint)
+		hint = params[3].value.a;
+	else if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_drain();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	obj_id_sz = params[0].memref.size;
+	obj_id = tee_arena_alloc(arena, obj_id_sz);
+	if (!obj_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	if (!client_id_valid(obj_id, obj_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	expected = ((uint64_t)params[2].value.b << 32) | params[2].value.a;
+	res = lookup_object_version(obj_id, obj_id_sz, &version);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/*
+	 * The store lock is held exclusively, nobody can write in between.
+	 * 0 also stands for no object at all, VERSION_NONE only for that.
+	 */
+	if (version != expected &&
+	    !(expected == 0 && version == TA_SECURE_STORAGE_VERSION_NONE)) {
+		params[2].value.a = (uint32_t)version;
+		params[2].value.b = (uint32_t)(version >> 32);
+		return TEE_ERROR_BAD_STATE;
+	}
+
+	res = journal_fence(obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	version = version == TA_SECURE_STORAGE_VERSION_NONE ? 1 : version + 1;
+	res = put_versioned_object(obj_id, obj_id_sz, version,
+				   params[1].memref.buffer,
+				   params[1].memref.size, hint);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	params[2].value.a = (uint32_t)version;
+	params[2].value.b = (uint32_t)(version >> 32);
+	return TEE_SUCCESS;
+}
+
+static TEE_Result create_buffered_object(uint32_t param_types,
+					 TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct journal_rec rec;
+	TEE_Result res;
+	char *obj_id;
+	char *pos;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	rec.id_sz = params[0].memref.size;
+	rec.data_sz = params[1].memref.size;
+	obj_id = tee_arena_alloc(arena, rec.id_sz);
+	if (!obj_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(obj_id, params[0].memref.buffer, rec.id_sz);
+	if (!client_id_valid(obj_id, rec.id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/* Too big to ever be batched, write it through */
+	if (sizeof(rec) + rec.id_sz + rec.data_sz > JOURNAL_BATCH_MAX_SIZE) {
+		res = journal_drain();
+		if (res == TEE_SUCCESS)
+			res = journal_fence(obj_id, rec.id_sz);
+		if (res != TEE_SUCCESS)
+			return res;
+		return put_object(obj_id, rec.id_sz, params[1].memref.buffer,
+				  rec.data_sz, TA_SECURE_STORAGE_PLACE_AUTO);
+	}
+
+	if (!journal_batch.buf) {
+		journal_batch.buf = TEE_Malloc(JOURNAL_BATCH_MAX_SIZE, 0);
+		if (!journal_batch.buf)
+			return TEE_ERROR_OUT_OF_MEMORY;
+	}
+
+	if (journal_batch.len + sizeof(rec) + rec.id_sz + rec.data_sz >
+	    JOURNAL_BATCH_MAX_SIZE) {
+		res = journal_commit();
+		if (res != TEE_SUCCESS)
+			return res;
+	}
+
+	if (!journal_batch.len) {
+		res = journal_claim();
+		if (res != TEE_SUCCESS && res != TEE_ERROR_ACCESS_CONFLICT)
+			return res;
+		TEE_GetSystemTime(&journal_batch.first);
+	}
+
+	/* A fence of a later write has to carry a later generation */
+	rec.generation = store_lock.state.generation;
+	rec.flags = 0;
+	store_changed();
+	pos = journal_batch.buf + journal_batch.len;
+	TEE_MemMove(pos, &rec, sizeof(rec));
+	TEE_MemMove(pos + sizeof(rec), obj_id, rec.id_sz);
+	TEE_MemMove(pos + sizeof(rec) + rec.id_sz, params[1].memref.buffer,
+		    rec.data_sz);
+	journal_batch.len += sizeof(rec) + rec.id_sz + rec.data_sz;
+
+	/* Another instance holds a batch, this one cannot be kept pending */
+	if (journal_batch.marker == TEE_HANDLE_NULL) {
+		res = journal_fence(obj_id, rec.id_sz);
+		if (res == TEE_SUCCESS)
+			res = journal_commit();
+		if (res != TEE_SUCCESS)
+			journal_batch.len = 0;
+		return res;
+	}
+
+	/* Close the batch once its time window has passed */
+	if (elapsed_ms(&journal_batch.first) >= JOURNAL_BATCH_WINDOW_MS)
+		return journal_commit();
+
+	return TEE_SUCCESS;
+}
+
+static TEE_Result flush_objects(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	if (params[0].value.a & TA_SECURE_STORAGE_FLUSH_APPLY)
+		return journal_apply();
+
+	return journal_commit();
+}
+
+static TEE_Result remove_object(const char *obj_id, size_t obj_id_sz)
+{
+	TEE_ObjectHandle object;
+	TEE_ObjectInfo object_info;
+	struct object_meta meta;
+	TEE_Result kv_res = TEE_ERROR_ITEM_NOT_FOUND;
+	TEE_Result res;
+	uint32_t storage;
+
+	/*
+	 * An object written before the engine was enabled may still be
+	 * shadowed by the entry, so both are deleted.
+	 */
+	if (storage_policy.flags & POLICY_KV_USED) {
+		kv_res = kv_remove(obj_id, obj_id_sz);
+		if (kv_res != TEE_SUCCESS && kv_res != TEE_ERROR_ITEM_NOT_FOUND)
+			return kv_res;
+	}
+
+	/*
+	 * Check object exists and delete it
+	 */
+	res = open_object(obj_id, obj_id_sz,
+			  TEE_DATA_FLAG_ACCESS_READ |
+			  TEE_DATA_FLAG_ACCESS_WRITE_META, /* we must be allowed to delete it */
+			  &object, &storage);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND && kv_res == TEE_SUCCESS)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = TEE_GetObjectInfo1(object, &object_info);
+	if (res == TEE_SUCCESS)
+		res = read_object_meta(object, &object_info, &meta);
+	if (res != TEE_SUCCESS) {
+		TEE_CloseObject(object);
+		return res;
+	}
+
+	TEE_CloseAndDeletePersistentObject1(object);
+	placement_forget(obj_id, obj_id_sz);
+
+	/* Deleting the last reference collects the blob */
+	if (meta.flags & OBJECT_META_REF)
+		res = blob_unref(meta.digest);
+
+	return res;
+}
+
 static TEE_Result delete_object(uint32_t param_types, TEE_Param params[4])
 {
-	const uint32_t exp_param_types =
-		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
-				TEE_PARAM_TYPE_NONE,
-				TEE_PARAM_TYPE_NONE,
-				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	TEE_Result res;
+	char *obj_id;
+	size_t obj_id_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_drain();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	obj_id_sz = params[0].memref.size;
+	obj_id = tee_arena_alloc(arena, obj_id_sz);
+	if (!obj_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	if (!client_id_valid(obj_id, obj_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_fence(obj_id, obj_id_sz);
+	if (res == TEE_SUCCESS)
+		res = meta_begin();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* Nothing changed if there was no such object */
+	res = remove_object(obj_id, obj_id_sz);
+	if (res == TEE_SUCCESS)
+		meta_remove(obj_id, obj_id_sz);
+	else if (res != TEE_ERROR_ITEM_NOT_FOUND)
+		meta_invalidate();
+
+	return res;
+}
+
+/*
+ * Position an open client object at its payload. A deduplicated object is
+ * swapped for the blob it refers to. On return *object is open, or
+ * TEE_HANDLE_NULL if the blob could not be opened. version may be NULL.
+ */
+static TEE_Result seek_payload(TEE_ObjectHandle *object, uint32_t *payload_sz,
+			       uint64_t *version)
+{
+	TEE_ObjectInfo object_info;
+	struct object_meta meta;
+	char bid[TEE_OBJECT_ID_MAX_LEN];
+	size_t bid_sz;
+	uint32_t storage;
+	TEE_Result res;
+
+	res = TEE_GetObjectInfo1(*object, &object_info);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to get object info, res=0x%08x", res);
+		return res;
+	}
+	*payload_sz = object_info.dataSize;
+	if (version)
+		*version = 0;
+
+	res = read_object_meta(*object, &object_info, &meta);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (version)
+		*version = object_meta_version(&meta);
+	if (!(meta.flags & OBJECT_META_REF))
+		return TEE_SUCCESS;
+
+	/* Deduplicated object, the payload lives in the blob it refers to */
+	TEE_CloseObject(*object);
+	*object = TEE_HANDLE_NULL;
+
+	bid_sz = blob_id(bid, meta.digest);
+	res = open_object(bid, bid_sz,
+			  TEE_DATA_FLAG_ACCESS_READ |
+			  TEE_DATA_FLAG_SHARE_READ,
+			  object, &storage);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open blob, res=0x%08x", res);
+		*object = TEE_HANDLE_NULL;
+		return res;
+	}
+
+	res = TEE_GetObjectInfo1(*object, &object_info);
+	if (res == TEE_SUCCESS &&
+	    object_info.dataSize < sizeof(struct blob_hdr))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res == TEE_SUCCESS)
+		res = TEE_SeekObjectData(*object, sizeof(struct blob_hdr),
+					 TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		*payload_sz = object_info.dataSize - sizeof(struct blob_hdr);
+
+	return res;
+}
+
+static TEE_Result read_raw_object(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	const uint32_t exp_param_types_version =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE);
+	bool want_version = param_types == exp_param_types_version;
+	uint64_t version = 0;
+	TEE_ObjectHandle object;
+	TEE_Result res;
+	uint32_t read_bytes;
+	uint32_t payload_sz;
+	uint32_t storage;
+	char *obj_id;
+	size_t obj_id_sz;
+	char *data;
+	size_t data_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types && !want_version)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_drain();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	obj_id_sz = params[0].memref.size;
+	obj_id = tee_arena_alloc(arena, obj_id_sz);
+	if (!obj_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	if (!client_id_valid(obj_id, obj_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	data = (char *)params[1].memref.buffer;
+	data_sz = params[1].memref.size;
+
+	/* Entries of the key-value engine are never versioned */
+	if (want_version) {
+		params[2].value.a = 0;
+		params[2].value.b = 0;
+	}
+
+	if (storage_policy.flags & POLICY_KV_USED) {
+		res = kv_load(obj_id, obj_id_sz, data, &data_sz);
+		if (res == TEE_SUCCESS || res == TEE_ERROR_SHORT_BUFFER)
+			params[1].memref.size = data_sz;
+		if (res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	/*
+	 * Check the object exist and can be dumped into output buffer
+	 * then dump it.
+	 */
+	res = open_object(obj_id, obj_id_sz,
+			  TEE_DATA_FLAG_ACCESS_READ |
+			  TEE_DATA_FLAG_SHARE_READ,
+			  &object, &storage);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open persistent object, res=0x%08x", res);
+		return res;
+	}
+
+	res = seek_payload(&object, &payload_sz, &version);
+	if (res != TEE_SUCCESS)
+		goto exit;
+	if (want_version) {
+		params[2].value.a = (uint32_t)version;
+		params[2].value.b = (uint32_t)(version >> 32);
+	}
+
+	if (payload_sz > data_sz) {
+		/*
+		 * Provided buffer is too short.
+		 * Return the expected size together with status "short buffer"
+		 */
+		params[1].memref.size = payload_sz;
+		res = TEE_ERROR_SHORT_BUFFER;
+		goto exit;
+	}
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_ReadObjectData(object, data, payload_sz, &read_bytes);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res != TEE_SUCCESS || read_bytes != payload_sz) {
+		EMSG("TEE_ReadObjectData failed 0x%08x, read %" PRIu32 " over %u",
+				res, read_bytes, payload_sz);
+		goto exit;
+	}
+
+	/* Return the number of byte effectively filled */
+	params[1].memref.size = read_bytes;
+exit:
+	if (object != TEE_HANDLE_NULL)
+		TEE_CloseObject(object);
+	return res;
+}
+
+static TEE_Result open_log_segment(const char *log_id, size_t log_id_sz,
+				   uint32_t seg, uint32_t flags,
+				   TEE_ObjectHandle *object)
+{
+	char seg_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t seg_id_sz;
+	TEE_Result res;
+
+	seg_id_sz = make_internal_id(seg_id, log_id, log_id_sz,
+				     LOG_SEGMENT_TAG, seg);
+	if (!seg_id_sz)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+				       seg_id, seg_id_sz, flags, object);
+	phase_end(TA_SECURE_STORAGE_PHASE_OBJ_OPEN);
+
+	return res;
+}
+
+static TEE_Result create_log_segment(const char *log_id, size_t log_id_sz,
+				     uint32_t seg, TEE_ObjectHandle *object)
+{
+	char seg_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t seg_id_sz;
+
+	seg_id_sz = make_internal_id(seg_id, log_id, log_id_sz,
+				     LOG_SEGMENT_TAG, seg);
+	if (!seg_id_sz)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	return TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+					  seg_id, seg_id_sz,
+					  TEE_DATA_FLAG_ACCESS_READ |
+					  TEE_DATA_FLAG_ACCESS_WRITE |
+					  TEE_DATA_FLAG_ACCESS_WRITE_META,
+					  TEE_HANDLE_NULL, NULL, 0, object);
+}
+
+/*
+ * The log head only records the segment currently being appended to, it is
+ * rewritten on segment rollover, never on a plain append.
+ */
+static TEE_Result open_log_head(const char *log_id, size_t log_id_sz,
+				TEE_ObjectHandle *head,
+				struct log_head *state)
+{
+	char head_id[TEE_OBJECT_ID_MAX_LEN];
+	size_t head_id_sz;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	head_id_sz = make_internal_id(head_id, log_id, log_id_sz,
+				      LOG_HEAD_TAG, 0);
+	if (!head_id_sz)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+				       head_id, head_id_sz,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_ACCESS_WRITE,
+				       head);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+		state->magic = LOG_HEAD_MAGIC;
+		state->last_seg = 0;
+		return TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+						  head_id, head_id_sz,
+						  TEE_DATA_FLAG_ACCESS_READ |
+						  TEE_DATA_FLAG_ACCESS_WRITE |
+						  TEE_DATA_FLAG_ACCESS_WRITE_META,
+						  TEE_HANDLE_NULL,
+						  state, sizeof(*state), head);
+	}
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_ReadObjectData(*head, state, sizeof(*state), &read_bytes);
+	if (res == TEE_SUCCESS && (read_bytes != sizeof(*state) ||
+				   state->magic != LOG_HEAD_MAGIC))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS)
+		TEE_CloseObject(*head);
+
+	return res;
+}
+
+static TEE_Result append_log_object(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	TEE_ObjectHandle head;
+	TEE_ObjectHandle segment;
+	TEE_ObjectInfo segment_info;
+	struct log_head state;
+	TEE_Result res;
+	char *log_id;
+	size_t log_id_sz;
+	char *data;
+	uint32_t data_sz;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	data = (char *)params[1].memref.buffer;
+	data_sz = params[1].memref.size;
+	if (data_sz > LOG_SEGMENT_MAX_SIZE - sizeof(data_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	log_id_sz = params[0].memref.size;
+	log_id = tee_arena_alloc(arena, log_id_sz);
+	if (!log_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(log_id, params[0].memref.buffer, log_id_sz);
+	if (!client_id_valid(log_id, log_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = open_log_head(log_id, log_id_sz, &head, &state);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open log head, res=0x%08x", res);
+		return res;
+	}
+
+	res = open_log_segment(log_id, log_id_sz, state.last_seg,
+			       TEE_DATA_FLAG_ACCESS_READ |
+			       TEE_DATA_FLAG_ACCESS_WRITE,
+			       &segment);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		res = create_log_segment(log_id, log_id_sz, state.last_seg,
+					 &segment);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to open log segment %" PRIu32 ", res=0x%08x",
+		     state.last_seg, res);
+		goto exit;
+	}
+
+	res = TEE_GetObjectInfo1(segment, &segment_info);
+	if (res != TEE_SUCCESS)
+		goto close_segment;
+
+	/*
+	 * Roll over into a fresh segment rather than growing this one past
+	 * the threshold, so no single object gets expensive to rewrite.
+	 */
+	if (segment_info.dataSize &&
+	    segment_info.dataSize + sizeof(data_sz) + data_sz >
+	    LOG_SEGMENT_MAX_SIZE) {
+		TEE_CloseObject(segment);
+
+		state.last_seg++;
+		res = create_log_segment(log_id, log_id_sz, state.last_seg,
+					 &segment);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to create log segment %" PRIu32
+			     ", res=0x%08x", state.last_seg, res);
+			goto exit;
+		}
+
+		res = TEE_SeekObjectData(head, 0, TEE_DATA_SEEK_SET);
+		if (res == TEE_SUCCESS)
+			res = TEE_WriteObjectData(head, &state, sizeof(state));
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to update log head, res=0x%08x", res);
+			TEE_CloseAndDeletePersistentObject1(segment);
+			goto exit;
+		}
+	}
+
+	/* Records are framed with their length so a reader can split them */
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(segment, 0, TEE_DATA_SEEK_END);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(segment, &data_sz, sizeof(data_sz));
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(segment, data, data_sz);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res != TEE_SUCCESS)
+		EMSG("Failed to append log record, res=0x%08x", res);
+
+close_segment:
+	TEE_CloseObject(segment);
+exit:
+	TEE_CloseObject(head);
+	return res;
+}
+
+static TEE_Result read_log_object(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_VALUE_INOUT,
+				TEE_PARAM_TYPE_NONE);
+	TEE_ObjectHandle segment;
+	TEE_Result res = TEE_SUCCESS;
+	uint32_t read_bytes;
+	uint32_t seg;
+	uint32_t offset;
+	uint32_t prev_seg = 0;
+	uint32_t prev_offset = 0;
+	bool advanced = false;
+	char *log_id;
+	size_t log_id_sz;
+	char *data;
+	size_t data_sz;
+	size_t filled = 0;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	log_id_sz = params[0].memref.size;
+	log_id = tee_arena_alloc(arena, log_id_sz);
+	if (!log_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(log_id, params[0].memref.buffer, log_id_sz);
+	if (!client_id_valid(log_id, log_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	data = (char *)params[1].memref.buffer;
+	data_sz = params[1].memref.size;
+
+	/* The cursor is (segment, offset into segment) */
+	seg = params[2].value.a;
+	offset = params[2].value.b;
+
+	/*
+	 * Stream from the cursor onwards, crossing into the next segment
+	 * whenever the current one is exhausted, until the output buffer is
+	 * full or there are no more segments. The cursor is only moved past
+	 * a segment once its successor exists, so records appended later to
+	 * the last segment are not skipped by the next call.
+	 */
+	for (;;) {
+		res = open_log_segment(log_id, log_id_sz, seg,
+				       TEE_DATA_FLAG_ACCESS_READ |
+				       TEE_DATA_FLAG_SHARE_READ,
+				       &segment);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND && advanced) {
+			seg = prev_seg;
+			offset = prev_offset;
+			res = TEE_SUCCESS;
+			break;
+		}
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to open log segment %" PRIu32
+			     ", res=0x%08x", seg, res);
+			break;
+		}
+
+		phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+		res = TEE_SeekObjectData(segment, offset, TEE_DATA_SEEK_SET);
+		if (res == TEE_SUCCESS)
+			res = TEE_ReadObjectData(segment, data + filled,
+						 data_sz - filled,
+						 &read_bytes);
+		TEE_CloseObject(segment);
+		phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to read log segment %" PRIu32
+			     ", res=0x%08x", seg, res);
+			break;
+		}
+
+		filled += read_bytes;
+		offset += read_bytes;
+		if (filled == data_sz)
+			break;
+
+		prev_seg = seg;
+		prev_offset = offset;
+		advanced = true;
+		seg++;
+		offset = 0;
+	}
+
+	if (res == TEE_SUCCESS) {
+		params[1].memref.size = filled;
+		params[2].value.a = seg;
+		params[2].value.b = offset;
+	}
+
+	return res;
+}
+
+/*
+ * Archives carry the client objects, wherever the policy put them, in the
+ * order they are walked: the key-value entries first, then the objects of
+ * every storage. Objects shadowed by an entry, internal objects and blobs
+ * are skipped, a deduplicated object is exported with its payload.
+ */
+#define ARCHIVE_LABEL		"ss-archive-v2"
+#define ARCHIVE_SOURCE_KV	0
+#define ARCHIVE_SOURCE_COUNT	(1 + sizeof(placement_storages) / \
+				 sizeof(placement_storages[0]))
+
+/* Archive record header, followed by the object ID and the object data */
+struct archive_rec {
+	uint32_t id_sz;
+	uint32_t data_sz;
+	uint64_t version;	/* 0 for an object without one */
+	uint32_t offset;	/* of the data in the object */
+	uint32_t flags;		/* TA_SECURE_STORAGE_ARCHIVE_MORE */
+};
+
+/*
+ * Exports in progress, kept by the TA so that the salt and the GCM nonces
+ * of an archive never come from the client. A cursor only names its
+ * archive by the salt; every chunk produced, a replayed one included, takes
+ * the next nonce of that archive. A new export reuses the oldest slot, the
+ * cursors of the export it held are refused from then on.
+ */
+#define EXPORT_SLOTS		4
+
+struct export_slot {
+	uint8_t salt[TA_SECURE_STORAGE_ARCHIVE_SALT_SIZE];
+	uint32_t used;
+	uint32_t nonce;		/* next nonce of the archive */
+};
+
+struct export_state {
+	struct export_slot slots[EXPORT_SLOTS];
+	uint32_t next;		/* slot taken by the next export */
+	uint32_t reserved;
+};
+
+static size_t export_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, EXPORT_TAG, 0);
+}
+
+/*
+ * Draw the nonce of the next chunk of the archive with the given salt, or
+ * of a new archive whose salt is generated into salt when fresh is set.
+ * The state is written back before the nonce is used.
+ */
+static TEE_Result export_nonce(uint8_t *salt, bool fresh, uint32_t *nonce)
+{
+	char xid[TEE_OBJECT_ID_MAX_LEN];
+	size_t xid_sz = export_id(xid);
+	struct export_state state;
+	struct export_slot *slot = NULL;
+	TEE_ObjectHandle object = TEE_HANDLE_NULL;
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ |
+			 TEE_DATA_FLAG_ACCESS_WRITE;
+	uint32_t read_bytes;
+	uint32_t waited = 0;
+	TEE_Result res;
+	uint32_t n;
+
+	TEE_MemFill(&state, 0, sizeof(state));
+	for (;;) {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, xid, xid_sz,
+					       flags, &object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+							 xid, xid_sz, flags,
+							 TEE_HANDLE_NULL,
+							 &state, sizeof(state),
+							 &object);
+		if (res != TEE_ERROR_ACCESS_CONFLICT || !conflict_wait(&waited))
+			break;
+	}
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = TEE_ReadObjectData(object, &state, sizeof(state), &read_bytes);
+	if (res == TEE_SUCCESS && read_bytes != sizeof(state))
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	if (fresh) {
+		slot = &state.slots[state.next % EXPORT_SLOTS];
+		state.next = (state.next + 1) % EXPORT_SLOTS;
+		TEE_GenerateRandom(slot->salt, sizeof(slot->salt));
+		slot->used = 1;
+		slot->nonce = 0;
+		TEE_MemMove(salt, slot->salt, sizeof(slot->salt));
+	} else {
+		for (n = 0; n < EXPORT_SLOTS; n++) {
+			if (state.slots[n].used &&
+			    !TEE_MemCompare(state.slots[n].salt, salt,
+					    sizeof(state.slots[n].salt))) {
+				slot = &state.slots[n];
+				break;
+			}
+		}
+	}
+	if (!slot) {
+		res = TEE_ERROR_BAD_STATE;
+		goto out;
+	}
+	if (slot->nonce == UINT32_MAX) {
+		res = TEE_ERROR_OVERFLOW;
+		goto out;
+	}
+	*nonce = slot->nonce++;
+
+	res = TEE_SeekObjectData(object, 0, TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_WriteObjectData(object, &state, sizeof(state));
+out:
+	TEE_CloseObject(object);
+	return res;
+}
+
+/*
+ * Position of the export being streamed. It is only valid for the cursor
+ * it was left at, any other cursor walks the objects again from the start.
+ */
+static struct {
+	bool active;
+	struct secure_storage_archive_cursor cursor;
+	uint32_t item;
+	uint32_t offset;
+	uint32_t source;
+	uint32_t bucket;
+	uint32_t page;
+	uint32_t slot;
+	TEE_ObjectEnumHandle objects;
+	bool started;
+	/* Object at the position, if any, only open during a command */
+	TEE_ObjectHandle object;
+	char id[TEE_OBJECT_ID_MAX_LEN];
+	uint32_t id_sz;
+} archive;
+
+static void archive_reset(void)
+{
+	if (archive.object != TEE_HANDLE_NULL)
+		TEE_CloseObject(archive.object);
+	if (archive.objects != TEE_HANDLE_NULL)
+		TEE_FreePersistentObjectEnumerator(archive.objects);
+	TEE_MemFill(&archive, 0, sizeof(archive));
+	archive.object = TEE_HANDLE_NULL;
+	archive.objects = TEE_HANDLE_NULL;
+}
+
+static void archive_release(void)
+{
+	if (archive.object != TEE_HANDLE_NULL)
+		TEE_CloseObject(archive.object);
+	archive.object = TEE_HANDLE_NULL;
+}
+
+/* Next key-value entry from the position on, false once all were seen */
+static TEE_Result archive_peek_kv(bool *found)
+{
+	struct kv_cached_page *cp;
+	struct kv_slot *slot;
+	TEE_Result res;
+
+	*found = false;
+	if (!(storage_policy.flags & POLICY_KV_USED))
+		return TEE_SUCCESS;
+
+	res = kv_open(false);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	while (archive.bucket < (1U << kv.meta.level) + kv.meta.split) {
+		if (!archive.page)
+			archive.page = archive.bucket + 1;
+
+		res = kv_page_get(archive.page, false, &cp);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		if (archive.slot < kv_hdr(cp)->nslots) {
+			slot = kv_slots(cp) + archive.slot;
+			TEE_MemMove(archive.id, cp->data + slot->offset,
+				    slot->id_sz);
+			archive.id_sz = slot->id_sz;
+			*found = true;
+			return TEE_SUCCESS;
+		}
+
+		archive.slot = 0;
+		archive.page = kv_hdr(cp)->next;
+		if (!archive.page)
+			archive.bucket++;
+	}
+
+	return TEE_SUCCESS;
+}
+
+/* Whether a storage object is a client object the archive carries */
+static TEE_Result archive_wanted(uint32_t storage, bool *wanted)
+{
+	struct kv_cached_page *cp;
+	uint32_t found_in;
+	TEE_Result res;
+	size_t n;
+
+	*wanted = false;
+	for (n = 0; n < archive.id_sz; n++)
+		if (!archive.id[n])
+			return TEE_SUCCESS;
+
+	if (kv.buckets != TEE_HANDLE_NULL) {
+		res = kv_find(archive.id, archive.id_sz,
+			      kv_hash(archive.id, archive.id_sz), &cp, &n);
+		if (res == TEE_SUCCESS)
+			return TEE_SUCCESS;
+		if (res != TEE_ERROR_ITEM_NOT_FOUND)
+			return res;
+	}
+
+	/* A copy left in another storage is shadowed by the one found first */
+	res = open_object(archive.id, archive.id_sz,
+			  TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_SHARE_READ,
+			  &archive.object, &found_in);
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		return TEE_SUCCESS;
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (found_in != storage) {
+		archive_release();
+		return TEE_SUCCESS;
+	}
+
+	*wanted = true;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Move to the next object to export, unless the position is already at
+ * one. Returns TEE_ERROR_ITEM_NOT_FOUND once all objects were walked.
+ */
+static TEE_Result archive_peek(void)
+{
+	TEE_ObjectInfo info;
+	uint32_t storage;
+	TEE_Result res;
+	bool found;
+
+	while (archive.source < ARCHIVE_SOURCE_COUNT) {
+		if (archive.source == ARCHIVE_SOURCE_KV) {
+			res = archive_peek_kv(&found);
+			if (res != TEE_SUCCESS || found)
+				return res;
+			archive.source++;
+			continue;
+		}
+
+		storage = placement_storages[archive.source - 1];
+		if (!storage_in_use(storage)) {
+			archive.source++;
+			continue;
+		}
+		if (archive.id_sz) {
+			if (archive.object != TEE_HANDLE_NULL)
+				return TEE_SUCCESS;
+			res = TEE_OpenPersistentObject(storage, archive.id,
+						       archive.id_sz,
+						       TEE_DATA_FLAG_ACCESS_READ |
+						       TEE_DATA_FLAG_SHARE_READ,
+						       &archive.object);
+			if (res != TEE_ERROR_ITEM_NOT_FOUND)
+				return res;
+			archive.id_sz = 0;
+		}
+
+		if (archive.objects == TEE_HANDLE_NULL) {
+			res = TEE_AllocatePersistentObjectEnumerator(
+				&archive.objects);
+			if (res != TEE_SUCCESS)
+				return res;
+		}
+		if (!archive.started) {
+			res = TEE_StartPersistentObjectEnumerator(
+				archive.objects, storage);
+			if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+				archive.source++;
+				continue;
+			}
+			if (res != TEE_SUCCESS)
+				return res;
+			archive.started = true;
+		}
+
+		archive.id_sz = sizeof(archive.id);
+		res = TEE_GetNextPersistentObject(archive.objects, &info,
+						  archive.id, &archive.id_sz);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+			TEE_ResetPersistentObjectEnumerator(archive.objects);
+			archive.started = false;
+			archive.id_sz = 0;
+			archive.source++;
+			continue;
+		}
+		if (res != TEE_SUCCESS)
+			return res;
+
+		res = archive_wanted(storage, &found);
+		if (res != TEE_SUCCESS || found)
+			return res;
+		archive.id_sz = 0;
+	}
+
+	return TEE_ERROR_ITEM_NOT_FOUND;
+}
+
+static void archive_advance(void)
+{
+	if (archive.source == ARCHIVE_SOURCE_KV)
+		archive.slot++;
+	archive_release();
+	archive.id_sz = 0;
+	archive.offset = 0;
+	archive.item++;
+}
+
+/*
+ * Read the version of the object at the position and its payload from
+ * offset on, as much as fits *data_sz bytes. *data_sz is updated with the
+ * bytes read, *payload_sz with the size of the whole payload. A key-value
+ * record is read whole or not at all.
+ */
+static TEE_Result archive_load(void *data, uint32_t offset, size_t *data_sz,
+			       uint32_t *payload_sz, uint64_t *version)
+{
+	size_t kv_sz = *data_sz;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	*version = 0;
+	if (archive.source == ARCHIVE_SOURCE_KV) {
+		res = kv_load(archive.id, archive.id_sz, data, &kv_sz);
+		if (res != TEE_SUCCESS && res != TEE_ERROR_SHORT_BUFFER)
+			return res;
+		*payload_sz = kv_sz;
+		*data_sz = res == TEE_SUCCESS ? kv_sz : 0;
+		return TEE_SUCCESS;
+	}
+
+	res = seek_payload(&archive.object, payload_sz, version);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	/* The object was written since the previous piece was read */
+	if (offset > *payload_sz)
+		return TEE_ERROR_BAD_STATE;
+	if (*data_sz > *payload_sz - offset)
+		*data_sz = *payload_sz - offset;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	res = TEE_SeekObjectData(archive.object, offset, TEE_DATA_SEEK_CUR);
+	if (res == TEE_SUCCESS)
+		res = TEE_ReadObjectData(archive.object, data, *data_sz,
+					 &read_bytes);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res == TEE_SUCCESS && read_bytes != *data_sz)
+		res = TEE_ERROR_CORRUPT_OBJECT;
+
+	/* Back at the start for the next read, a blob is looked up again */
+	archive_release();
+	return res;
+}
+
+/*
+ * Hash the payload of the object at the position a buffer of buf_sz bytes
+ * at a time, so that the largest object does not set the memory needed. A
+ * key-value record always fits.
+ */
+static TEE_Result archive_digest(void *buf, size_t buf_sz, uint32_t *size,
+				 uint8_t *digest)
+{
+	uint32_t digest_sz = DEDUP_DIGEST_SIZE;
+	uint32_t payload_sz = 0;
+	uint32_t read_bytes;
+	size_t data_sz = buf_sz;
+	TEE_OperationHandle op;
+	TEE_Result res;
+
+	if (archive.source == ARCHIVE_SOURCE_KV) {
+		res = kv_load(archive.id, archive.id_sz, buf, &data_sz);
+		if (res == TEE_SUCCESS) {
+			*size = data_sz;
+			res = hash_data(buf, data_sz, digest);
+		}
+		return res;
+	}
+
+	res = seek_payload(&archive.object, &payload_sz, NULL);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	res = TEE_AllocateOperation(&op, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+	phase_end(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	*size = payload_sz;
+	while (payload_sz) {
+		data_sz = payload_sz < buf_sz ? payload_sz : buf_sz;
+		phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+		res = TEE_ReadObjectData(archive.object, buf, data_sz,
+					 &read_bytes);
+		phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+		if (res == TEE_SUCCESS && read_bytes != data_sz)
+			res = TEE_ERROR_CORRUPT_OBJECT;
+		if (res != TEE_SUCCESS)
+			break;
+
+		phase_begin(TA_SECURE_STORAGE_PHASE_CRYPTO);
+		TEE_DigestUpdate(op, buf, data_sz);
+		phase_end(TA_SECURE_STORAGE_PHASE_CRYPTO);
+		payload_sz -= data_sz;
+	}
+	if (res == TEE_SUCCESS) {
+		phase_begin(TA_SECURE_STORAGE_PHASE_CRYPTO);
+		res = TEE_DigestDoFinal(op, NULL, 0, digest, &digest_sz);
+		phase_end(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	}
+	TEE_FreeOperation(op);
+	return res;
+}
+
+/* Bring the position to the cursor, walking the objects again if needed */
+static TEE_Result archive_seek(const struct secure_storage_archive_cursor *cur)
+{
+	TEE_Result res;
+	uint32_t n;
+
+	if (archive.active &&
+	    !TEE_MemCompare(&archive.cursor, cur, sizeof(*cur)))
+		return TEE_SUCCESS;
+
+	archive_reset();
+	for (n = 0; n < cur->item; n++) {
+		res = archive_peek();
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			return TEE_ERROR_BAD_STATE;
+		if (res != TEE_SUCCESS)
+			return res;
+		archive_advance();
+	}
+
+	archive.offset = cur->offset;
+	archive.cursor = *cur;
+	archive.active = true;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Encrypt or decrypt the records of a chunk with AES-GCM. The key is
+ * HMAC-SHA256(archive key, label || salt), the nonce is the one the TA drew
+ * for the chunk and the header is authenticated along.
+ */
+static TEE_Result archive_crypt(uint32_t mode, const void *key,
+				const struct secure_storage_archive_chunk *hdr,
+				const void *src, void *dst, void *tag)
+{
+	uint8_t chunk_key[TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE];
+	uint8_t nonce[12] = { 0 };
+	TEE_OperationHandle op = TEE_HANDLE_NULL;
+	TEE_ObjectHandle obj = TEE_HANDLE_NULL;
+	TEE_Attribute attr;
+	uint32_t key_sz = sizeof(chunk_key);
+	uint32_t tag_sz = TA_SECURE_STORAGE_ARCHIVE_TAG_SIZE;
+	uint32_t dst_sz = hdr->size;
+	TEE_Result res;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	res = TEE_AllocateTransientObject(TEE_TYPE_HMAC_SHA256,
+					  TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE * 8,
+					  &obj);
+	if (res == TEE_SUCCESS) {
+		TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, key,
+				     TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE);
+		res = TEE_PopulateTransientObject(obj, &attr, 1);
+	}
+	if (res == TEE_SUCCESS)
+		res = TEE_AllocateOperation(&op, TEE_ALG_HMAC_SHA256,
+					    TEE_MODE_MAC,
+					    TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE * 8);
+	if (res == TEE_SUCCESS)
+		res = TEE_SetOperationKey(op, obj);
+	phase_end(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	TEE_MACInit(op, NULL, 0);
+	TEE_MACUpdate(op, ARCHIVE_LABEL, sizeof(ARCHIVE_LABEL) - 1);
+	res = TEE_MACComputeFinal(op, hdr->salt, sizeof(hdr->salt),
+				  chunk_key, &key_sz);
+	phase_end(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	TEE_FreeOperation(op);
+	TEE_FreeTransientObject(obj);
+	op = TEE_HANDLE_NULL;
+	obj = TEE_HANDLE_NULL;
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	phase_begin(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	res = TEE_AllocateTransientObject(TEE_TYPE_AES, key_sz * 8, &obj);
+	if (res == TEE_SUCCESS) {
+		TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE,
+				     chunk_key, key_sz);
+		res = TEE_PopulateTransientObject(obj, &attr, 1);
+	}
+	if (res == TEE_SUCCESS)
+		res = TEE_AllocateOperation(&op, TEE_ALG_AES_GCM, mode,
+					    key_sz * 8);
+	if (res == TEE_SUCCESS)
+		res = TEE_SetOperationKey(op, obj);
+	phase_end(TA_SECURE_STORAGE_PHASE_OP_ALLOC);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	TEE_MemMove(nonce, &hdr->nonce, sizeof(hdr->nonce));
+	phase_begin(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	res = TEE_AEInit(op, nonce, sizeof(nonce), tag_sz * 8,
+			 sizeof(*hdr), hdr->size);
+	if (res == TEE_SUCCESS) {
+		TEE_AEUpdateAAD(op, hdr, sizeof(*hdr));
+		if (mode == TEE_MODE_ENCRYPT)
+			res = TEE_AEEncryptFinal(op, src, hdr->size, dst,
+						 &dst_sz, tag, &tag_sz);
+		else
+			res = TEE_AEDecryptFinal(op, src, hdr->size, dst,
+						 &dst_sz, tag, tag_sz);
+	}
+	phase_end(TA_SECURE_STORAGE_PHASE_CRYPTO);
+	if (res == TEE_SUCCESS && dst_sz != hdr->size)
+		res = TEE_ERROR_GENERIC;
+
+out:
+	TEE_MemFill(chunk_key, 0, sizeof(chunk_key));
+	if (op != TEE_HANDLE_NULL)
+		TEE_FreeOperation(op);
+	if (obj != TEE_HANDLE_NULL)
+		TEE_FreeTransientObject(obj);
+	return res;
+}
+
+/*
+ * Pack the objects from the position on into buf, at most buf_sz bytes of
+ * records. *needed is set when not even the first object fits. An object
+ * too big for any chunk fills a whole chunk with each of its pieces.
+ */
+static TEE_Result archive_pack(uint8_t *buf, size_t buf_sz,
+			       struct secure_storage_archive_chunk *hdr,
+			       size_t *needed)
+{
+	struct archive_rec rec;
+	uint32_t payload_sz;
+	size_t len = 0;
+	size_t fixed;
+	size_t left;
+	size_t data_sz;
+	TEE_Result res;
+
+	for (;;) {
+		res = archive_peek();
+		if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+			hdr->flags |= TA_SECURE_STORAGE_ARCHIVE_DONE;
+			break;
+		}
+		if (res != TEE_SUCCESS)
+			return res;
+
+		fixed = sizeof(rec) + archive.id_sz;
+		data_sz = buf_sz - len > fixed ? buf_sz - len - fixed : 0;
+
+		res = archive_load(buf + len + fixed, archive.offset, &data_sz,
+				   &payload_sz, &rec.version);
+		if (res != TEE_SUCCESS)
+			return res;
+
+		left = fixed + payload_sz - archive.offset;
+		if (left > buf_sz - len) {
+			if (hdr->items)
+				break;
+			if (left <= TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX ||
+			    buf_sz < TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX) {
+				*needed = left;
+				if (*needed > TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX)
+					*needed = TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX;
+				return TEE_ERROR_SHORT_BUFFER;
+			}
+		}
+
+		rec.id_sz = archive.id_sz;
+		rec.data_sz = data_sz;
+		rec.offset = archive.offset;
+		rec.flags = 0;
+		if (archive.offset + data_sz < payload_sz)
+			rec.flags |= TA_SECURE_STORAGE_ARCHIVE_MORE;
+		TEE_MemMove(buf + len, &rec, sizeof(rec));
+		TEE_MemMove(buf + len + sizeof(rec), archive.id, rec.id_sz);
+		len += sizeof(rec) + rec.id_sz + rec.data_sz;
+
+		hdr->items++;
+		if (rec.flags & TA_SECURE_STORAGE_ARCHIVE_MORE) {
+			archive.offset += data_sz;
+			break;
+		}
+		archive_advance();
+	}
+
+	hdr->size = len;
+	return TEE_SUCCESS;
+}
+
+static TEE_Result export_objects(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_MEMREF_OUTPUT,
+				TEE_PARAM_TYPE_MEMREF_INOUT,
+				TEE_PARAM_TYPE_NONE);
+	struct secure_storage_archive_cursor cur;
+	struct secure_storage_archive_chunk hdr;
+	uint8_t key[TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE];
+	uint8_t tag[TA_SECURE_STORAGE_ARCHIVE_TAG_SIZE];
+	uint8_t *out;
+	uint8_t *buf = NULL;
+	size_t out_sz;
+	size_t buf_sz;
+	size_t needed = 0;
+	bool fresh;
+	TEE_Result res;
+
+	/*
+	 * Safely get the invocation parameters
+	 */
+	if (param_types != exp_param_types ||
+	    params[0].memref.size != sizeof(key) ||
+	    params[2].memref.size != sizeof(cur))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	TEE_MemMove(key, params[0].memref.buffer, sizeof(key));
+	TEE_MemMove(&cur, params[2].memref.buffer, sizeof(cur));
+	out = params[1].memref.buffer;
+	out_sz = params[1].memref.size;
+	if (cur.flags & TA_SECURE_STORAGE_ARCHIVE_DONE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_drain();
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	/* A new archive gets a salt of its own, hence a key of its own */
+	fresh = !cur.item && !cur.chunk;
+	if (fresh)
+		TEE_MemFill(cur.salt, 0, sizeof(cur.salt));
+
+	res = archive_seek(&cur);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	buf_sz = TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX;
+	if (out_sz < sizeof(hdr) + sizeof(tag))
+		buf_sz = 0;
+	else if (out_sz - sizeof(hdr) - sizeof(tag) < buf_sz)
+		buf_sz = out_sz - sizeof(hdr) - sizeof(tag);
+
+	buf = TEE_Malloc(TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX, 0);
+	if (!buf) {
+		res = TEE_ERROR_OUT_OF_MEMORY;
+		goto out;
+	}
+
+	TEE_MemFill(&hdr, 0, sizeof(hdr));
+	hdr.magic = TA_SECURE_STORAGE_ARCHIVE_MAGIC;
+	hdr.version = TA_SECURE_STORAGE_ARCHIVE_VERSION;
+	hdr.seq = cur.chunk;
+
+	res = archive_pack(buf, buf_sz, &hdr, &needed);
+	if (res == TEE_ERROR_SHORT_BUFFER)
+		params[1].memref.size = sizeof(hdr) + needed + sizeof(tag);
+	if (res != TEE_SUCCESS)
+		goto out;
+
+	res = export_nonce(cur.salt, fresh, &hdr.nonce);
+	if (res != TEE_SUCCESS) {
+		EMSG("No nonce for archive chunk, res=0x%08x", res);
+		goto out;
+	}
+	TEE_MemMove(hdr.salt, cur.salt, sizeof(hdr.salt));
+
+	res = archive_crypt(TEE_MODE_ENCRYPT, key, &hdr, buf,
+			    out + sizeof(hdr), tag);
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to encrypt archive chunk, res=0x%08x", res);
+		goto out;
+	}
+
+	TEE_MemMove(out, &hdr, sizeof(hdr));
+	TEE_MemMove(out + sizeof(hdr) + hdr.size, tag, sizeof(tag));
+	params[1].memref.size = sizeof(hdr) + hdr.size + sizeof(tag);
+
+	cur.item = archive.item;
+	cur.offset = archive.offset;
+	cur.chunk++;
+	cur.flags |= hdr.flags & TA_SECURE_STORAGE_ARCHIVE_DONE;
+	TEE_MemMove(params[2].memref.buffer, &cur, sizeof(cur));
+	archive.cursor = cur;
+
+out:
+	/* The position is only worth keeping for a cursor that can resume */
+	if ((res != TEE_SUCCESS && res != TEE_ERROR_SHORT_BUFFER) ||
+	    (cur.flags & TA_SECURE_STORAGE_ARCHIVE_DONE))
+		archive_reset();
+	archive_release();
+	if (buf) {
+		TEE_MemFill(buf, 0, TA_SECURE_STORAGE_ARCHIVE_CHUNK_MAX);
+		TEE_Free(buf);
+	}
+	TEE_MemFill(key, 0, sizeof(key));
+	return res;
+}
+
+/* Write an object of an archive as any client write would */
+static TEE_Result import_object(const char *obj_id, size_t obj_id_sz,
+				uint64_t version, const void *data,
+				size_t data_sz)
+{
+	TEE_Result res;
+
+	res = journal_fence(obj_id, obj_id_sz);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	if (version)
+		return put_versioned_object(obj_id, obj_id_sz, version, data,
+					    data_sz,
+					    TA_SECURE_STORAGE_PLACE_AUTO);
+
+	return put_object(obj_id, obj_id_sz, data, data_sz,
+			  TA_SECURE_STORAGE_PLACE_AUTO);
+}
+
+/*
+ * The pieces of an object split across chunks are gathered in the import
+ * stage object, after a header naming the archive and the object so that a
+ * piece of anything else is never appended to them. A piece given again
+ * once an import was cut short replaces what it wrote the first time.
+ */
+struct import_stage {
+	uint8_t salt[TA_SECURE_STORAGE_ARCHIVE_SALT_SIZE];
+	uint32_t id_sz;
+	char id[TEE_OBJECT_ID_MAX_LEN];
+};
+
+static size_t import_stage_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, IMPORT_TAG, 0);
+}
+
+/* Stage a piece of an object, and write the object with the last one */
+static TEE_Result import_piece(const struct archive_rec *rec,
+			       const uint8_t *salt, const char *obj_id,
+			       const void *data)
+{
+	char sid[TEE_OBJECT_ID_MAX_LEN];
+	size_t sid_sz = import_stage_id(sid);
+	struct import_stage stage;
+	struct import_stage staged;
 	TEE_ObjectHandle object;
+	TEE_ObjectInfo info;
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ |
+			 TEE_DATA_FLAG_ACCESS_WRITE |
+			 TEE_DATA_FLAG_ACCESS_WRITE_META;
+	uint32_t read_bytes;
+	uint8_t *whole = NULL;
+	size_t whole_sz = rec->offset + rec->data_sz;
 	TEE_Result res;
-	char *obj_id;
-	size_t obj_id_sz;
-
-	/*
-	 * Safely get the invocation parameters
-	 */
-	if (param_types != exp_param_types)
-		return TEE_ERROR_BAD_PARAMETERS;
-
-	obj_id_sz = params[0].memref.size;
-	obj_id = TEE_Malloc(obj_id_sz, 0);
-	if (!obj_id)
-		return TEE_ERROR_OUT_OF_MEMORY;
 
-	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	TEE_MemFill(&stage, 0, sizeof(stage));
+	TEE_MemMove(stage.salt, salt, sizeof(stage.salt));
+	stage.id_sz = rec->id_sz;
+	TEE_MemMove(stage.id, obj_id, rec->id_sz);
 
-	/*
-	 * Check object exists and delete it
-	 */
-	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
-					obj_id, obj_id_sz,
-					TEE_DATA_FLAG_ACCESS_READ |
-					TEE_DATA_FLAG_ACCESS_WRITE_META, /* we must be allowed to delete it */
-					&object);
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (!rec->offset) {
+		res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+						 sid, sid_sz,
+						 flags |
+						 TEE_DATA_FLAG_OVERWRITE,
+						 TEE_HANDLE_NULL,
+						 &stage, sizeof(stage),
+						 &object);
+	} else {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, sid,
+					       sid_sz, flags, &object);
+		if (res == TEE_ERROR_ITEM_NOT_FOUND)
+			res = TEE_ERROR_BAD_STATE;
+		if (res == TEE_SUCCESS) {
+			res = TEE_GetObjectInfo1(object, &info);
+			if (res == TEE_SUCCESS)
+				res = TEE_ReadObjectData(object, &staged,
+							 sizeof(staged),
+							 &read_bytes);
+			/* Not the previous piece of this object */
+			if (res == TEE_SUCCESS &&
+			    (read_bytes != sizeof(staged) ||
+			     TEE_MemCompare(&staged, &stage, sizeof(stage)) ||
+			     info.dataSize - sizeof(stage) < rec->offset))
+				res = TEE_ERROR_BAD_STATE;
+			if (res != TEE_SUCCESS)
+				TEE_CloseObject(object);
+		}
+	}
+	if (res == TEE_SUCCESS) {
+		res = TEE_TruncateObjectData(object,
+					     sizeof(stage) + rec->offset);
+		if (res == TEE_SUCCESS)
+			res = TEE_SeekObjectData(object, 0, TEE_DATA_SEEK_END);
+		if (res == TEE_SUCCESS)
+			res = TEE_WriteObjectData(object, data, rec->data_sz);
+		if (res != TEE_SUCCESS)
+			TEE_CloseObject(object);
+	}
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to open persistent object, res=0x%08x", res);
-		TEE_Free(obj_id);
+		EMSG("Failed to stage object piece, res=0x%08x", res);
 		return res;
 	}
 
-	TEE_CloseAndDeletePersistentObject1(object);
-	TEE_Free(obj_id);
+	if (rec->flags & TA_SECURE_STORAGE_ARCHIVE_MORE) {
+		TEE_CloseObject(object);
+		return TEE_SUCCESS;
+	}
 
+	whole = TEE_Malloc(whole_sz, 0);
+	if (!whole)
+		res = TEE_ERROR_OUT_OF_MEMORY;
+	phase_begin(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res == TEE_SUCCESS)
+		res = TEE_SeekObjectData(object, sizeof(stage),
+					 TEE_DATA_SEEK_SET);
+	if (res == TEE_SUCCESS)
+		res = TEE_ReadObjectData(object, whole, whole_sz,
+					 &read_bytes);
+	phase_end(TA_SECURE_STORAGE_PHASE_STORAGE);
+	if (res == TEE_SUCCESS && read_bytes != whole_sz)
+		res = TEE_ERROR_CORRUPT_OBJECT;
+	if (res == TEE_SUCCESS)
+		res = import_object(obj_id, rec->id_sz, rec->version, whole,
+				    whole_sz);
+
+	/* A failed import can be resumed with the last piece again */
+	if (res == TEE_SUCCESS)
+		TEE_CloseAndDeletePersistentObject1(object);
+	else
+		TEE_CloseObject(object);
+	if (whole) {
+		TEE_MemFill(whole, 0, whole_sz);
+		TEE_Free(whole);
+	}
 	return res;
 }
 
-static TEE_Result create_raw_object(uint32_t param_types, TEE_Param params[4])
+static TEE_Result import_objects(uint32_t param_types, TEE_Param params[4])
 {
 	const uint32_t exp_param_types =
 		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
 				TEE_PARAM_TYPE_MEMREF_INPUT,
-				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_MEMREF_INOUT,
 				TEE_PARAM_TYPE_NONE);
-	TEE_ObjectHandle object;
+	struct secure_storage_archive_cursor cur;
+	struct secure_storage_archive_chunk hdr;
+	uint8_t key[TA_SECURE_STORAGE_ARCHIVE_KEY_SIZE];
+	uint8_t tag[TA_SECURE_STORAGE_ARCHIVE_TAG_SIZE];
+	struct archive_rec rec;
+	const uint8_t *in;
+	uint8_t *buf = NULL;
+	size_t in_sz;
+	size_t pos;
+	uint32_t n;
 	TEE_Result res;
-	char *obj_id;
-	size_t obj_id_sz;
-	char *data;
-	size_t data_sz;
-	uint32_t obj_data_flag;
 
 	/*
 	 * Safely get the invocation parameters
 	 */
-	if (param_types != exp_param_types)
+	if (param_types != exp_param_types ||
+	    params[0].memref.size != sizeof(key) ||
+	    params[2].memref.size != sizeof(cur))
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	obj_id_sz = params[0].memref.size;
-	obj_id = TEE_Malloc(obj_id_sz, 0);
-	if (!obj_id)
+	in = params[1].memref.buffer;
+	in_sz = params[1].memref.size;
+	TEE_MemMove(&cur, params[2].memref.buffer, sizeof(cur));
+	if (cur.flags & TA_SECURE_STORAGE_ARCHIVE_DONE ||
+	    in_sz < sizeof(hdr) + sizeof(tag) ||
+	    in_sz > TA_SECURE_STORAGE_ARCHIVE_CHUNK_SIZE)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	TEE_MemMove(&hdr, in, sizeof(hdr));
+	if (hdr.magic != TA_SECURE_STORAGE_ARCHIVE_MAGIC ||
+	    hdr.version != TA_SECURE_STORAGE_ARCHIVE_VERSION ||
+	    hdr.size != in_sz - sizeof(hdr) - sizeof(tag))
+		return TEE_ERROR_BAD_FORMAT;
+
+	/* Chunks have to come in order and from the same archive */
+	if (hdr.seq != cur.chunk ||
+	    (cur.chunk && TEE_MemCompare(hdr.salt, cur.salt, sizeof(cur.salt))))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = journal_drain();
+	if (res != TEE_SUCCESS)
+		return res;
+
+	buf = TEE_Malloc(hdr.size ? hdr.size : 1, 0);
+	if (!buf)
 		return TEE_ERROR_OUT_OF_MEMORY;
 
-	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	TEE_MemMove(key, params[0].memref.buffer, sizeof(key));
+	TEE_MemMove(tag, in + sizeof(hdr) + hdr.size, sizeof(tag));
+	res = archive_crypt(TEE_MODE_DECRYPT, key, &hdr, in + sizeof(hdr),
+			    buf, tag);
+	TEE_MemFill(key, 0, sizeof(key));
+	if (res != TEE_SUCCESS) {
+		EMSG("Failed to authenticate archive chunk, res=0x%08x", res);
+		goto out;
+	}
 
-	data = (char *)params[1].memref.buffer;
-	data_sz = params[1].memref.size;
+	/* Nothing is written unless all records of the chunk are sound */
+	for (pos = 0, n = 0; n < hdr.items; n++) {
+		if (hdr.size - pos < sizeof(rec)) {
+			res = TEE_ERROR_BAD_FORMAT;
+			goto out;
+		}
+		TEE_MemMove(&rec, buf + pos, sizeof(rec));
+		pos += sizeof(rec);
+		/* Only the first record goes on with the object cut before */
+		if (hdr.size - pos < rec.id_sz ||
+		    hdr.size - pos - rec.id_sz < rec.data_sz ||
+		    rec.version == TA_SECURE_STORAGE_VERSION_NONE ||
+		    !client_id_valid(buf + pos, rec.id_sz) ||
+		    rec.offset != (n ? 0 : cur.offset) ||
+		    rec.data_sz > UINT32_MAX - rec.offset ||
+		    rec.flags & ~TA_SECURE_STORAGE_ARCHIVE_MORE ||
+		    (rec.flags & TA_SECURE_STORAGE_ARCHIVE_MORE &&
+		     n + 1 != hdr.items)) {
+			res = TEE_ERROR_BAD_FORMAT;
+			goto out;
+		}
+		pos += rec.id_sz + rec.data_sz;
+	}
+	if (pos != hdr.size) {
+		res = TEE_ERROR_BAD_FORMAT;
+		goto out;
+	}
 
-	/*
-	 * Create object in secure storage and fill with data
-	 */
-	obj_data_flag = TEE_DATA_FLAG_ACCESS_READ |		/* we can later read the oject */
-			TEE_DATA_FLAG_ACCESS_WRITE |		/* we can later write into the object */
-			TEE_DATA_FLAG_ACCESS_WRITE_META |	/* we can later destroy or rename the object */
-			TEE_DATA_FLAG_OVERWRITE;		/* destroy existing object of same ID */
+	for (pos = 0, n = 0; n < hdr.items; n++) {
+		TEE_MemMove(&rec, buf + pos, sizeof(rec));
+		pos += sizeof(rec);
+		if (rec.offset || rec.flags & TA_SECURE_STORAGE_ARCHIVE_MORE)
+			res = import_piece(&rec, hdr.salt, (char *)buf + pos,
+					   buf + pos + rec.id_sz);
+		else
+			res = import_object((char *)buf + pos, rec.id_sz,
+					    rec.version, buf + pos + rec.id_sz,
+					    rec.data_sz);
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to import object, res=0x%08x", res);
+			goto out;
+		}
+		pos += rec.id_sz + rec.data_sz;
+	}
 
-	res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
-					obj_id, obj_id_sz,
-					obj_data_flag,
-					TEE_HANDLE_NULL,
-					NULL, 0,		/* we may not fill it right now */
-					&object);
+	cur.item += hdr.items;
+	cur.offset = 0;
+	if (hdr.items && rec.flags & TA_SECURE_STORAGE_ARCHIVE_MORE) {
+		cur.item--;
+		cur.offset = rec.offset + rec.data_sz;
+	}
+	cur.chunk++;
+	cur.flags |= hdr.flags & TA_SECURE_STORAGE_ARCHIVE_DONE;
+	TEE_MemMove(cur.salt, hdr.salt, sizeof(cur.salt));
+	TEE_MemMove(params[2].memref.buffer, &cur, sizeof(cur));
+
+out:
+	TEE_MemFill(buf, 0, hdr.size);
+	TEE_Free(buf);
+	return res;
+}
+
+/*
+ * Write a fresh index of all client objects, walked like an export: once
+ * to count them and size the table, once to hash them. The times of the
+ * objects are not known, they are left at 0.
+ */
+static TEE_Result meta_build(void)
+{
+	struct meta_entry entry;
+	uint32_t count = 0;
+	uint8_t *buf;
+	TEE_Result res;
+
+	meta_close();
+	buf = TEE_Malloc(META_HASH_CHUNK, 0);
+	if (!buf)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	/* Any export of this instance walks the objects again */
+	archive_reset();
+	while ((res = archive_peek()) == TEE_SUCCESS) {
+		count++;
+		archive_advance();
+	}
+	if (res == TEE_ERROR_ITEM_NOT_FOUND)
+		res = meta_reset(meta_nslots(count));
+
+	archive_reset();
+	while (res == TEE_SUCCESS) {
+		res = archive_peek();
+		if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+			res = TEE_SUCCESS;
+			break;
+		}
+		if (res != TEE_SUCCESS)
+			break;
+
+		TEE_MemFill(&entry, 0, sizeof(entry));
+		entry.used = 1;
+		res = meta_id_digest(archive.id, archive.id_sz,
+				     entry.id_digest);
+		if (res == TEE_SUCCESS)
+			res = archive_digest(buf, META_HASH_CHUNK,
+					     &entry.stat.size,
+					     entry.stat.digest);
+		if (res == TEE_SUCCESS)
+			res = meta_insert(&entry);
+		archive_advance();
+	}
+	archive_reset();
+	TEE_Free(buf);
+
+	if (res == TEE_SUCCESS)
+		res = meta_hdr_save();
 	if (res != TEE_SUCCESS) {
-		EMSG("TEE_CreatePersistentObject failed 0x%08x", res);
-		TEE_Free(obj_id);
+		EMSG("Failed to build metadata index, res=0x%08x", res);
+		meta_close();
 		return res;
 	}
 
-	res = TEE_WriteObjectData(object, data, data_sz);
-	if (res != TEE_SUCCESS) {
-		EMSG("TEE_WriteObjectData failed 0x%08x", res);
-		TEE_CloseAndDeletePersistentObject1(object);
-	} else {
-		TEE_CloseObject(object);
+	meta.valid = true;
+	return TEE_SUCCESS;
+}
+
+/* Have the index open, it is built under the write lock if stale */
+static TEE_Result meta_open(void)
+{
+	TEE_Result res;
+
+	if (meta.valid) {
+		res = meta_load();
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to load metadata index, res=0x%08x", res);
+			meta_invalidate();
+		}
 	}
-	TEE_Free(obj_id);
+	if (meta.valid)
+		return TEE_SUCCESS;
+	if (!store_lock.exclusive)
+		return store_need_exclusive();
+
+	return meta_build();
+}
+
+/* Index entry of the object stored under an ID, used if there is one */
+static TEE_Result meta_lookup(const TEE_Param *id, struct meta_entry *entry)
+{
+	uint8_t id_digest[META_ID_DIGEST_SIZE];
+	size_t obj_id_sz = id->memref.size;
+	char *obj_id;
+	uint32_t slot;
+	TEE_Result res;
+
+	obj_id = tee_arena_alloc(arena, obj_id_sz);
+	if (!obj_id)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	TEE_MemMove(obj_id, id->memref.buffer, obj_id_sz);
+	if (!client_id_valid(obj_id, obj_id_sz))
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	/* Buffered writes count too */
+	res = journal_drain();
+	if (res == TEE_SUCCESS)
+		res = meta_open();
+	if (res == TEE_SUCCESS)
+		res = meta_id_digest(obj_id, obj_id_sz, id_digest);
+	if (res == TEE_SUCCESS)
+		res = meta_find(id_digest, &slot, entry);
+
 	return res;
 }
 
-static TEE_Result read_raw_object(uint32_t param_types, TEE_Param params[4])
+static TEE_Result stat_object(uint32_t param_types, TEE_Param params[4])
 {
 	const uint32_t exp_param_types =
 		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
 				TEE_PARAM_TYPE_MEMREF_OUTPUT,
 				TEE_PARAM_TYPE_NONE,
 				TEE_PARAM_TYPE_NONE);
-	TEE_ObjectHandle object;
-	TEE_ObjectInfo object_info;
+	struct meta_entry entry;
 	TEE_Result res;
-	uint32_t read_bytes;
-	char *obj_id;
-	size_t obj_id_sz;
-	char *data;
-	size_t data_sz;
 
 	/*
 	 * Safely get the invocation parameters
@@ -159,91 +5248,292 @@ static TEE_Result read_raw_object(uint32_t param_types, TEE_Param params[4])
 	if (param_types != exp_param_types)
 		return TEE_ERROR_BAD_PARAMETERS;
 
-	obj_id_sz = params[0].memref.size;
-	obj_id = TEE_Malloc(obj_id_sz, 0);
-	if (!obj_id)
-		return TEE_ERROR_OUT_OF_MEMORY;
+	if (params[1].memref.size < sizeof(entry.stat)) {
+		params[1].memref.size = sizeof(entry.stat);
+		return TEE_ERROR_SHORT_BUFFER;
+	}
 
-	TEE_MemMove(obj_id, params[0].memref.buffer, obj_id_sz);
+	res = meta_lookup(&params[0], &entry);
+	if (res != TEE_SUCCESS)
+		return res;
+	if (!entry.used)
+		return TEE_ERROR_ITEM_NOT_FOUND;
 
-	data = (char *)params[1].memref.buffer;
-	data_sz = params[1].memref.size;
+	TEE_MemMove(params[1].memref.buffer, &entry.stat, sizeof(entry.stat));
+	params[1].memref.size = sizeof(entry.stat);
+	return TEE_SUCCESS;
+}
+
+static TEE_Result object_exists(uint32_t param_types, TEE_Param params[4])
+{
+	const uint32_t exp_param_types =
+		TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_INPUT,
+				TEE_PARAM_TYPE_VALUE_OUTPUT,
+				TEE_PARAM_TYPE_NONE,
+				TEE_PARAM_TYPE_NONE);
+	struct meta_entry entry;
+	TEE_Result res;
 
 	/*
-	 * Check the object exist and can be dumped into output buffer
-	 * then dump it.
+	 * Safely get the invocation parameters
 	 */
-	res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
-					obj_id, obj_id_sz,
-					TEE_DATA_FLAG_ACCESS_READ |
-					TEE_DATA_FLAG_SHARE_READ,
-					&object);
+	if (param_types != exp_param_types)
+		return TEE_ERROR_BAD_PARAMETERS;
+
+	res = meta_lookup(&params[0], &entry);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	params[1].value.a = entry.used != 0;
+	params[1].value.b = 0;
+	return TEE_SUCCESS;
+}
+
+static size_t lock_id(char *out)
+{
+	return make_internal_id(out, NULL, 0, LOCK_TAG, 0);
+}
+
+/* Drop what the instance cached of a store another instance changed */
+static TEE_Result store_sync(const struct store_state *state)
+{
+	TEE_Result res;
+
+	if (!store_lock.synced ||
+	    state->generation != store_lock.state.generation) {
+		TEE_MemFill(placement_index, 0, sizeof(placement_index));
+		kv_close();
+		meta_close();
+		res = load_storage_policy();
+		if (res != TEE_SUCCESS) {
+			EMSG("Failed to load storage policy, res=0x%08x", res);
+			return res;
+		}
+	}
+
+	journal_dirty = state->flags & STORE_JOURNAL;
+	journal_pending = state->flags & STORE_BATCH;
+	journal_fenced = state->flags & STORE_FENCES;
+	meta.valid = state->flags & STORE_INDEX;
+	store_lock.state = *state;
+	store_lock.synced = true;
+	return TEE_SUCCESS;
+}
+
+/*
+ * Take the lock for the command about to run. Readers share it, a writer
+ * waits for the readers to be done and keeps out everybody else.
+ */
+static TEE_Result store_lock_acquire(bool exclusive)
+{
+	char lid[TEE_OBJECT_ID_MAX_LEN];
+	size_t lid_sz = lock_id(lid);
+	uint32_t flags = TEE_DATA_FLAG_ACCESS_READ;
+	struct store_state state;
+	bool created = false;
+	uint32_t waited = 0;
+	uint32_t read_bytes;
+	TEE_Result res;
+
+	if (exclusive)
+		flags |= TEE_DATA_FLAG_ACCESS_WRITE;
+	else
+		flags |= TEE_DATA_FLAG_SHARE_READ;
+
+	for (;;) {
+		res = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE,
+					       lid, lid_sz, flags,
+					       &store_lock.object);
+		/*
+		 * A store without lock object may hold a journal written
+		 * before instances ran concurrently, the first writer
+		 * creates it and checks.
+		 */
+		if (res == TEE_ERROR_ITEM_NOT_FOUND && !exclusive)
+			return store_need_exclusive();
+		if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+			state.generation = 0;
+			state.flags = STORE_JOURNAL;
+			res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE,
+							 lid, lid_sz, flags,
+							 TEE_HANDLE_NULL,
+							 &state, sizeof(state),
+							 &store_lock.object);
+			created = res == TEE_SUCCESS;
+		}
+		if (res != TEE_ERROR_ACCESS_CONFLICT ||
+		    !conflict_wait(&waited))
+			break;
+	}
+	if (res == TEE_ERROR_ACCESS_CONFLICT)
+		return TEE_ERROR_BUSY;
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to open persistent object, res=0x%08x", res);
-		TEE_Free(obj_id);
+		EMSG("Failed to open lock object, res=0x%08x", res);
 		return res;
 	}
 
-	res = TEE_GetObjectInfo1(object, &object_info);
+	if (!created) {
+		res = TEE_ReadObjectData(store_lock.object, &state,
+					 sizeof(state), &read_bytes);
+		if (res == TEE_SUCCESS && read_bytes != sizeof(state))
+			res = TEE_ERROR_CORRUPT_OBJECT;
+	}
+	if (res == TEE_SUCCESS)
+		res = store_sync(&state);
 	if (res != TEE_SUCCESS) {
-		EMSG("Failed to create persistent object, res=0x%08x", res);
-		goto exit;
+		TEE_CloseObject(store_lock.object);
+		store_lock.object = TEE_HANDLE_NULL;
+		return res;
 	}
 
-	if (object_info.dataSize > data_sz) {
-		/*
-		 * Provided buffer is too short.
-		 * Return the expected size together with status "short buffer"
-		 */
-		params[1].memref.size = object_info.dataSize;
-		res = TEE_ERROR_SHORT_BUFFER;
-		goto exit;
+	store_lock.exclusive = exclusive;
+	store_lock.changed = false;
+	return TEE_SUCCESS;
+}
+
+/*
+ * A writer that changed the store bumps the generation on its way out,
+ * the lock object is left alone if the state is the same.
+ */
+static void store_lock_release(void)
+{
+	struct store_state state = store_lock.state;
+	TEE_Result res = TEE_SUCCESS;
+
+	if (store_lock.object == TEE_HANDLE_NULL)
+		return;
+
+	if (store_lock.exclusive) {
+		if (store_lock.changed)
+			state.generation++;
+		state.flags = journal_dirty ? STORE_JOURNAL : 0;
+		if (journal_pending)
+			state.flags |= STORE_BATCH;
+		if (journal_fenced)
+			state.flags |= STORE_FENCES;
+		if (meta.valid)
+			state.flags |= STORE_INDEX;
+		if (TEE_MemCompare(&state, &store_lock.state, sizeof(state)))
+			res = store_lock_save(&state);
+		if (res == TEE_SUCCESS) {
+			store_lock.state = state;
+		} else {
+			EMSG("Failed to update lock object, res=0x%08x", res);
+			store_lock.synced = false;
+		}
 	}
 
-	res = TEE_ReadObjectData(object, data, object_info.dataSize,
-				 &read_bytes);
-	if (res != TEE_SUCCESS || read_bytes != object_info.dataSize) {
-		EMSG("TEE_ReadObjectData failed 0x%08x, read %" PRIu32 " over %u",
-				res, read_bytes, object_info.dataSize);
-		goto exit;
+	TEE_CloseObject(store_lock.object);
+	store_lock.object = TEE_HANDLE_NULL;
+	store_lock.exclusive = false;
+}
+
+/* Commit the batched writes outside of a command */
+static TEE_Result batch_commit(void)
+{
+	TEE_Result res;
+
+	if (!journal_batch.len)
+		return TEE_SUCCESS;
+
+	res = store_lock_acquire(true);
+	if (res != TEE_SUCCESS)
+		return res;
+
+	res = journal_commit();
+	store_lock_release();
+	return res;
+}
+
+/*
+ * The batched writes were acknowledged, so they are committed before the
+ * session or the instance goes away. A store that stays busy gets them
+ * from the next writer instead.
+ */
+static TEE_Result batch_commit_wait(void)
+{
+	uint32_t waited = 0;
+	uint32_t tries;
+	TEE_Result res;
+
+	for (tries = 1;; tries++) {
+		res = batch_commit();
+		if (res != TEE_ERROR_BUSY || tries == BATCH_COMMIT_TRIES ||
+		    !conflict_wait(&waited))
+			break;
 	}
+	if (res == TEE_ERROR_BUSY)
+		res = journal_abandon();
 
-	/* Return the number of byte effectively filled */
-	params[1].memref.size = read_bytes;
-exit:
-	TEE_CloseObject(object);
-	TEE_Free(obj_id);
 	return res;
 }
 
 TEE_Result TA_CreateEntryPoint(void)
 {
-	/* Nothing to do */
+	/* The storage policy is loaded along with the first lock taken */
 	return TEE_SUCCESS;
 }
 
 void TA_DestroyEntryPoint(void)
 {
-	/* Nothing to do */
+	if (batch_commit_wait() != TEE_SUCCESS)
+		EMSG("Failed to commit buffered writes");
+	if (journal_batch.marker != TEE_HANDLE_NULL)
+		TEE_CloseObject(journal_batch.marker);
+	TEE_Free(journal_batch.buf);
+	archive_reset();
+	kv_close();
+	meta_close();
 }
 
 TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types,
 				    TEE_Param __unused params[4],
-				    void __unused **session)
+				    void **session)
 {
-	/* Nothing to do */
+	struct tee_arena *session_arena;
+
+	/* Allocated once so commands cause no heap traffic of their own */
+	session_arena = TEE_Malloc(sizeof(*session_arena) +
+				   SESSION_ARENA_SIZE, 0);
+	if (!session_arena)
+		return TEE_ERROR_OUT_OF_MEMORY;
+
+	tee_arena_init(session_arena, session_arena + 1, SESSION_ARENA_SIZE);
+	*session = session_arena;
 	return TEE_SUCCESS;
 }
 
-void TA_CloseSessionEntryPoint(void __unused *session)
+void TA_CloseSessionEntryPoint(void *session)
+{
+	arena = session;
+
+	/* Don't let buffered writes outlive the session that issued them */
+	if (batch_commit_wait() != TEE_SUCCESS)
+		EMSG("Failed to commit buffered writes");
+	if (stats_flush() != TEE_SUCCESS)
+		EMSG("Failed to save performance counters");
+
+	arena = NULL;
+	TEE_Free(session);
+}
+
+static bool command_is_reader(uint32_t command)
 {
-	/* Nothing to do */
+	switch (command) {
+	case TA_SECURE_STORAGE_CMD_READ_RAW:
+	case TA_SECURE_STORAGE_CMD_LOG_READ:
+	case TA_SECURE_STORAGE_CMD_STATS:
+	case TA_SECURE_STORAGE_CMD_EXPORT:
+	case TA_SECURE_STORAGE_CMD_STAT:
+	case TA_SECURE_STORAGE_CMD_EXISTS:
+		return true;
+	default:
+		return false;
+	}
 }
 
-TEE_Result TA_InvokeCommandEntryPoint(void __unused *session,
-				      uint32_t command,
-				      uint32_t param_types,
-				      TEE_Param params[4])
+static TEE_Result dispatch_command(uint32_t command, uint32_t param_types,
+				   TEE_Param params[4])
 {
 	switch (command) {
 	case TA_SECURE_STORAGE_CMD_WRITE_RAW:
@@ -252,8 +5542,94 @@ TEE_Result TA_InvokeCommandEntryPoint(void __unused *session,
 		return read_raw_object(param_types, params);
 	case TA_SECURE_STORAGE_CMD_DELETE:
 		return delete_object(param_types, params);
+	case TA_SECURE_STORAGE_CMD_LOG_APPEND:
+		return append_log_object(param_types, params);
+	case TA_SECURE_STORAGE_CMD_LOG_READ:
+		return read_log_object(param_types, params);
+	case TA_SECURE_STORAGE_CMD_WRITE_BUFFERED:
+		return create_buffered_object(param_types, params);
+	case TA_SECURE_STORAGE_CMD_FLUSH:
+		return flush_objects(param_types, params);
+	case TA_SECURE_STORAGE_CMD_SET_POLICY:
+		return set_storage_policy(param_types, params);
+	case TA_SECURE_STORAGE_CMD_STATS:
+		return get_stats(param_types, params);
+	case TA_SECURE_STORAGE_CMD_STATS_RESET:
+		return reset_stats(param_types, params);
+	case TA_SECURE_STORAGE_CMD_EXPORT:
+		return export_objects(param_types, params);
+	case TA_SECURE_STORAGE_CMD_IMPORT:
+		return import_objects(param_types, params);
+	case TA_SECURE_STORAGE_CMD_WRITE_IF_VERSION:
+		return write_object_if_version(param_types, params);
+	case TA_SECURE_STORAGE_CMD_STAT:
+		return stat_object(param_types, params);
+	case TA_SECURE_STORAGE_CMD_EXISTS:
+		return object_exists(param_types, params);
 	default:
 		EMSG("Command ID 0x%x is not supported", command);
 		return TEE_ERROR_NOT_SUPPORTED;
 	}
 }
+
+/*
+ * Run a command under the store lock. A reader that finds writes to
+ * complete first, a journal to replay for instance, is run again as a
+ * writer.
+ */
+static TEE_Result invoke_command(uint32_t command, uint32_t param_types,
+				 TEE_Param params[4])
+{
+	bool exclusive = !command_is_reader(command);
+	TEE_Result res;
+
+	/* The batch window holds whether or not more buffered writes come */
+	if (journal_batch.len &&
+	    elapsed_ms(&journal_batch.first) >= JOURNAL_BATCH_WINDOW_MS &&
+	    batch_commit() != TEE_SUCCESS)
+		EMSG("Failed to commit buffered writes");
+
+	for (;;) {
+		store_lock.upgrade = false;
+		res = store_lock_acquire(exclusive);
+		if (res == TEE_SUCCESS) {
+			res = dispatch_command(command, param_types, params);
+			store_lock_release();
+		}
+		if (!store_lock.upgrade || exclusive)
+			return res;
+
+		exclusive = true;
+		tee_arena_reset(arena);
+	}
+}
+
+TEE_Result TA_InvokeCommandEntryPoint(void *session,
+				      uint32_t command,
+				      uint32_t param_types,
+				      TEE_Param params[4])
+{
+	uint32_t bytes_in;
+	TEE_Time start;
+	TEE_Result res;
+
+	TEE_MemFill(cmd_phase_ms, 0, sizeof(cmd_phase_ms));
+	bytes_in = param_bytes(param_types, params,
+			       TEE_PARAM_TYPE_MEMREF_INPUT,
+			       TEE_PARAM_TYPE_MEMREF_INOUT);
+	TEE_GetSystemTime(&start);
+
+	arena = session;
+	res = invoke_command(command, param_types, params);
+	tee_arena_reset(arena);
+
+	if (command < TA_SECURE_STORAGE_CMD_COUNT)
+		stats_account(command, res, bytes_in,
+			      res == TEE_SUCCESS ?
+			      param_bytes(param_types, params,
+					  TEE_PARAM_TYPE_MEMREF_OUTPUT,
+					  TEE_PARAM_TYPE_MEMREF_INOUT) : 0,
+			      elapsed_ms(&start));
+
+	return res;
+}
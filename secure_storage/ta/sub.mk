@@ -1,2 +1,3 @@
 global-incdirs-y += include
+global-incdirs-y += ../../common/include
 srcs-y += secure_storage_ta.c
@@ -4,11 +4,53 @@
 /* For the UUID (found in the TA's h-file(s)) */
 #include <se_ta.h>
 
+#include <teesecure.h>
+
+#include <tees_sha2.h>
+#include <tee_trace.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define AES_BLOCK_SIZE 16
+
+/* Size of the segments handed out to the worker sessions of --parallel */
+#define CTR_SEGMENT_SIZE (64 * 1024)
+
+/* Size of the file chunks streamed to SIGN_FILE */
+#define SIGN_FILE_CHUNK_SIZE (64 * 1024)
 
-#define TEE_TYPE_AES 0xA0000010
-#define TEE_TYPE_RSA_KEYPAIR 0xA1000030
+/* Size of the plaintext chunks of seal and unseal */
+#define ENVELOPE_CHUNK_SIZE (64 * 1024)
+
+/* Size of the reads hashed on the host by --digest and --prehash */
+#define HOST_HASH_CHUNK_SIZE (64 * 1024)
+
+/* Default size of the host side pool of TEE random bytes used by random */
+#define RANDOM_POOL_SIZE (64 * 1024)
+
+/*
+ * Signature file of an item signed with sign-batch: this header, the proof
+ * of the item and the batch signature. crypto --verify --prehash tells it
+ * from a plain signature by the magic.
+ */
+#define BATCH_SIG_MAGIC 0x31424553 /* "SEB1" */
+
+struct batch_sig_header
+{
+  uint32_t magic;
+  uint32_t index;
+  uint32_t count;
+  uint32_t sig_len;
+};
 
 /* TEE resources */
 struct test_ctx
@@ -26,18 +68,16 @@ void usage(void)
 
 void prepare_tee_session(struct test_ctx *ctx)
 {
-  TEEC_UUID uuid = TA_SE_UUID;
   uint32_t origin;
   TEEC_Result res;
 
   /* Initialize a context connecting us to the TEE */
-  res = TEEC_InitializeContext(NULL, &ctx->ctx);
+  res = tees_context_init(&ctx->ctx);
   if (res != TEEC_SUCCESS)
     errx(1, "TEEC_InitializeContext failed with code 0x%x", res);
 
   /* Open a session with the TA */
-  res = TEEC_OpenSession(&ctx->ctx, &ctx->sess, &uuid,
-                         TEEC_LOGIN_PUBLIC, NULL, NULL, &origin);
+  res = tees_crypto_open(&ctx->ctx, &ctx->sess, &origin);
   if (res != TEEC_SUCCESS)
     errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
          res, origin);
@@ -45,85 +85,371 @@ void prepare_tee_session(struct test_ctx *ctx)
 
 void terminate_tee_session(struct test_ctx *ctx)
 {
-  TEEC_CloseSession(&ctx->sess);
-  TEEC_FinalizeContext(&ctx->ctx);
+  tees_session_close(&ctx->sess);
+  tees_context_finalize(&ctx->ctx);
 }
 
-void do_digest(struct test_ctx *ctx, uint32_t flags, uint8_t *in, size_t in_len, uint8_t *out, uint32_t *out_len)
+/* Work shared by the sessions of a parallel AES-CTR run */
+struct ctr_job
 {
-  TEEC_Operation op;
-  uint32_t origin;
-  TEEC_Result res;
+  TEEC_Context *ctx;
+  int in_fd;
+  int out_fd;
+  off_t size;
+  uint32_t key_id;
+  uint32_t flags;
+  uint8_t iv[AES_BLOCK_SIZE];
+  pthread_mutex_t lock;
+  off_t next;
+  int failed;
+};
 
-  memset(&op, 0, sizeof(op));
-  op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
-                                   TEEC_MEMREF_TEMP_INOUT,
-                                   TEEC_MEMREF_TEMP_INOUT,
-                                   TEEC_NONE);
+/* Counter block of AES block number block: iv + block, big endian */
+void ctr_iv_at(const uint8_t *iv, uint64_t block, uint8_t *out)
+{
+  unsigned int carry = 0;
 
-  op.params[0].value.a = flags;
+  for (int i = AES_BLOCK_SIZE - 1; i >= 0; i--)
+  {
+    unsigned int sum = iv[i] + (block & 0xff) + carry;
 
-  op.params[1].tmpref.buffer = in;
-  op.params[1].tmpref.size = in_len;
-  op.params[2].tmpref.buffer = out;
-  op.params[2].tmpref.size = *out_len;
+    out[i] = sum & 0xff;
+    carry = sum >> 8;
+    block >>= 8;
+  }
+}
+
+/* Stop the other workers after their current segment */
+static void ctr_fail(struct ctr_job *job)
+{
+  pthread_mutex_lock(&job->lock);
+  job->failed = 1;
+  pthread_mutex_unlock(&job->lock);
+}
+
+/*
+ * Each worker runs its own session, hence its own TA instance, and takes
+ * segments until the file is done. Segments are independent once their
+ * counter block is known, so they are written in place with pwrite().
+ */
+void *ctr_worker(void *arg)
+{
+  struct ctr_job *job = arg;
+  TEEC_Session sess;
+  uint32_t origin;
+  TEEC_Result res;
+  uint8_t iv[AES_BLOCK_SIZE];
+  uint8_t *in = malloc(CTR_SEGMENT_SIZE);
+  uint8_t *out = malloc(CTR_SEGMENT_SIZE);
+  uint64_t start;
+
+  if (in == NULL || out == NULL)
+    errx(1, "Out of memory");
 
-  res = TEEC_InvokeCommand(&ctx->sess, ENC_DEC,
-                           &op, &origin);
+  res = tees_crypto_open(job->ctx, &sess, &origin);
   if (res != TEEC_SUCCESS)
-    errx(1, "TEEC_InvokeCommand(ENCRYPT_DECRYPT) failed 0x%x origin 0x%x",
+    errx(1, "TEEC_Opensession failed with code 0x%x origin 0x%x",
          res, origin);
-  *out_len = op.params[2].tmpref.size;
+  for (;;)
+  {
+    off_t offset;
+    size_t len;
+    size_t out_len;
+    int failed;
+
+    pthread_mutex_lock(&job->lock);
+    offset = job->next;
+    job->next += CTR_SEGMENT_SIZE;
+    failed = job->failed;
+    pthread_mutex_unlock(&job->lock);
+    if (failed || offset >= job->size)
+      break;
+
+    len = job->size - offset < CTR_SEGMENT_SIZE ? job->size - offset : CTR_SEGMENT_SIZE;
+    start = tee_trace_now();
+    if (pread(job->in_fd, in, len, offset) != (ssize_t)len)
+    {
+      warn("Failed to read segment at %lld", (long long)offset);
+      ctr_fail(job);
+      break;
+    }
+    tee_trace_span_bytes("file", "read segment", start, len);
+
+    ctr_iv_at(job->iv, offset / AES_BLOCK_SIZE, iv);
+    out_len = len;
+    res = tees_crypto_run_iv(&sess, job->key_id, job->flags, in, len,
+                             out, &out_len, iv, sizeof(iv), &origin);
+    if (res != TEEC_SUCCESS)
+    {
+      warnx("TEEC_InvokeCommand(ENCRYPT_DECRYPT) failed 0x%x origin 0x%x",
+            res, origin);
+      ctr_fail(job);
+      break;
+    }
+
+    start = tee_trace_now();
+    if (pwrite(job->out_fd, out, out_len, offset) != (ssize_t)out_len)
+    {
+      warn("Failed to write segment at %lld", (long long)offset);
+      ctr_fail(job);
+      break;
+    }
+    tee_trace_span_bytes("file", "write segment", start, out_len);
+  }
+  tees_session_close(&sess);
+
+  free(in);
+  free(out);
+  return NULL;
+}
+
+int do_parallel_ctr(TEEC_Context *ctx, const char *in_path, const char *out_path,
+                    uint32_t key_id, uint32_t flags, const uint8_t *iv, int workers)
+{
+  struct ctr_job job = {};
+  pthread_t threads[workers];
+  struct stat st;
+  int started = 0;
+
+  job.in_fd = open(in_path, O_RDONLY);
+  if (job.in_fd < 0)
+    err(1, "Failed to open %s", in_path);
+  job.out_fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (job.out_fd < 0)
+    err(1, "Failed to open %s", out_path);
+  if (fstat(job.in_fd, &st) != 0)
+    err(1, "Failed to stat %s", in_path);
+
+  job.ctx = ctx;
+  job.size = st.st_size;
+  job.key_id = key_id;
+  job.flags = flags;
+  memcpy(job.iv, iv, AES_BLOCK_SIZE);
+  pthread_mutex_init(&job.lock, NULL);
+
+  /* Size the output first so segments can land in any order */
+  if (ftruncate(job.out_fd, job.size) != 0)
+    err(1, "Failed to size %s", out_path);
+
+  for (int i = 0; i < workers; i++)
+  {
+    if (pthread_create(&threads[i], NULL, ctr_worker, &job) != 0)
+    {
+      warnx("Failed to start worker %d", i);
+      break;
+    }
+    started++;
+  }
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_mutex_destroy(&job.lock);
+  close(job.in_fd);
+  close(job.out_fd);
+  return (started == 0 || job.failed) ? -1 : 0;
 }
 
-void do_crypto(struct test_ctx *ctx, uint32_t key_id, uint32_t flags, uint8_t *in, size_t in_len, uint8_t *out, size_t *out_len)
+/*
+ * Stream a file to the TA which hashes it and signs the digest, all in this
+ * session. The chunks go through one shared memory buffer allocated up
+ * front, so they are not copied again by the client library.
+ */
+void do_sign_file(struct test_ctx *ctx, uint32_t key_id, uint32_t flags, FILE *in_file,
+                  uint8_t *sig, size_t *sig_len)
 {
-  TEEC_Operation op;
+  TEEC_SharedMemory shm;
+  size_t sig_size = *sig_len;
   uint32_t origin;
   TEEC_Result res;
+  uint32_t stage = SIGN_FILE_FIRST;
+  uint64_t start;
+  long remaining;
+
+  fseek(in_file, 0L, SEEK_END);
+  remaining = ftell(in_file);
+  fseek(in_file, 0L, SEEK_SET);
 
-  memset(&op, 0, sizeof(op));
-  op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
-                                   TEEC_MEMREF_TEMP_INOUT,
-                                   TEEC_MEMREF_TEMP_INOUT,
-                                   TEEC_NONE);
+  memset(&shm, 0, sizeof(shm));
+  shm.size = SIGN_FILE_CHUNK_SIZE;
+  shm.flags = TEEC_MEM_INPUT;
+  res = TEEC_AllocateSharedMemory(&ctx->ctx, &shm);
+  if (res != TEEC_SUCCESS)
+    errx(1, "TEEC_AllocateSharedMemory failed with code 0x%x", res);
 
-  op.params[0].value.a = key_id;
-  op.params[0].value.b = flags;
+  do
+  {
+    size_t len = remaining < SIGN_FILE_CHUNK_SIZE ? remaining : SIGN_FILE_CHUNK_SIZE;
 
-  op.params[1].tmpref.buffer = in;
-  op.params[1].tmpref.size = in_len;
-  op.params[2].tmpref.buffer = out;
-  op.params[2].tmpref.size = *out_len;
+    start = tee_trace_now();
+    if (fread(shm.buffer, 1, len, in_file) != len)
+      errx(1, "Failed to read the input file");
+    tee_trace_span_bytes("file", "read chunk", start, len);
+    remaining -= len;
+    if (remaining == 0)
+      stage |= SIGN_FILE_LAST;
 
-  res = TEEC_InvokeCommand(&ctx->sess, ENC_DEC,
-                           &op, &origin);
-  if (res != TEEC_SUCCESS)
-    errx(1, "TEEC_InvokeCommand(ENCRYPT_DECRYPT) failed 0x%x origin 0x%x",
-         res, origin);
-  *out_len = op.params[2].tmpref.size;
+    *sig_len = sig_size;
+    res = tees_crypto_sign_chunk(&ctx->sess, key_id, flags, stage, &shm, len,
+                                 sig, sig_len, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(SIGN_FILE) failed 0x%x origin 0x%x",
+           res, origin);
+    stage = 0;
+  } while (remaining > 0);
+
+  TEEC_ReleaseSharedMemory(&shm);
 }
 
-void do_keygen(struct test_ctx *ctx, uint32_t key_type, uint32_t key_size, uint32_t key_id)
+/*
+ * Seal a file into an envelope for an RSA key, or open one, streaming it
+ * through the TA in chunks. The input and output chunks go through shared
+ * memory allocated up front. When opening, the last chunk is made to hold
+ * the whole GCM tag. Returns -1 if a chunk failed, the output is then
+ * incomplete and, when opening, not authenticated.
+ */
+int do_envelope(struct test_ctx *ctx, int seal, uint32_t key_id, uint32_t flags,
+                FILE *in_file, FILE *out_file)
 {
-  TEEC_Operation op;
+  TEEC_SharedMemory in_shm;
+  TEEC_SharedMemory out_shm;
+  uint32_t stage = SIGN_FILE_FIRST;
   uint32_t origin;
   TEEC_Result res;
+  uint64_t start;
+  size_t out_len;
+  long remaining;
+  int ret = 0;
 
-  memset(&op, 0, sizeof(op));
-  op.paramTypes = TEEC_PARAM_TYPES(TEEC_VALUE_INPUT,
-                                   TEEC_VALUE_INPUT,
-                                   TEEC_VALUE_INPUT,
-                                   TEEC_NONE);
+  fseek(in_file, 0L, SEEK_END);
+  remaining = ftell(in_file);
+  fseek(in_file, 0L, SEEK_SET);
 
-  op.params[0].value.a = key_type;
-  op.params[0].value.b = key_size;
-  op.params[1].value.a = key_id;
+  memset(&in_shm, 0, sizeof(in_shm));
+  in_shm.size = ENVELOPE_CHUNK_SIZE + SE_ENVELOPE_TAG_SIZE;
+  in_shm.flags = TEEC_MEM_INPUT;
+  res = TEEC_AllocateSharedMemory(&ctx->ctx, &in_shm);
+  if (res != TEEC_SUCCESS)
+    errx(1, "TEEC_AllocateSharedMemory failed with code 0x%x", res);
 
-  res = TEEC_InvokeCommand(&ctx->sess, GENERATE_KEY, &op, &origin);
+  memset(&out_shm, 0, sizeof(out_shm));
+  out_shm.size = in_shm.size + SE_ENVELOPE_OVERHEAD;
+  out_shm.flags = TEEC_MEM_OUTPUT;
+  res = TEEC_AllocateSharedMemory(&ctx->ctx, &out_shm);
   if (res != TEEC_SUCCESS)
-    errx(1, "TEEC_InvokeCommand(GENERATE_KEY) failed 0x%x origin 0x%x",
-         res, origin);
+    errx(1, "TEEC_AllocateSharedMemory failed with code 0x%x", res);
+
+  do
+  {
+    size_t len = remaining < ENVELOPE_CHUNK_SIZE ? remaining : ENVELOPE_CHUNK_SIZE;
+
+    /* Never leave a tail shorter than the tag for the next chunk */
+    if (!seal && remaining - (long)len < SE_ENVELOPE_TAG_SIZE)
+      len = remaining;
+
+    start = tee_trace_now();
+    if (fread(in_shm.buffer, 1, len, in_file) != len)
+      errx(1, "Failed to read the input file");
+    tee_trace_span_bytes("file", "read chunk", start, len);
+    remaining -= len;
+    if (remaining == 0)
+      stage |= SIGN_FILE_LAST;
+
+    if (seal)
+      res = tees_crypto_seal_chunk(&ctx->sess, key_id, flags, stage,
+                                   &in_shm, len, &out_shm, &out_len, &origin);
+    else
+      res = tees_crypto_open_chunk(&ctx->sess, key_id, stage,
+                                   &in_shm, len, &out_shm, &out_len, &origin);
+    if (res != TEEC_SUCCESS)
+    {
+      warnx("TEEC_InvokeCommand(%s) failed 0x%x origin 0x%x",
+            seal ? "ENVELOPE_SEAL" : "ENVELOPE_OPEN", res, origin);
+      ret = -1;
+      break;
+    }
+
+    start = tee_trace_now();
+    if (fwrite(out_shm.buffer, 1, out_len, out_file) != out_len)
+      errx(1, "Failed to write the output file");
+    tee_trace_span_bytes("file", "write chunk", start, out_len);
+    stage = 0;
+  } while (remaining > 0);
+
+  TEEC_ReleaseSharedMemory(&out_shm);
+  TEEC_ReleaseSharedMemory(&in_shm);
+  return ret;
+}
+
+/*
+ * Hash a file on the host, the input is not secret so only the digest has
+ * to go through the world switch. SHA-512 when flags has it, SHA-256
+ * otherwise. Returns the size of the digest.
+ */
+size_t host_digest(FILE *in_file, uint32_t flags, uint8_t *digest)
+{
+  static uint8_t buf[HOST_HASH_CHUNK_SIZE];
+  struct tees_sha256_ctx sha256;
+  struct tees_sha512_ctx sha512;
+  uint64_t start = tee_trace_now();
+  size_t total = 0;
+  size_t len;
+
+  if ((flags & SHA512) > 0)
+    tees_sha512_init(&sha512);
+  else
+    tees_sha256_init(&sha256);
+
+  while ((len = fread(buf, 1, sizeof(buf), in_file)) > 0)
+  {
+    if ((flags & SHA512) > 0)
+      tees_sha512_update(&sha512, buf, len);
+    else
+      tees_sha256_update(&sha256, buf, len);
+    total += len;
+  }
+  if (ferror(in_file))
+    errx(1, "Failed to read the input file");
+
+  if ((flags & SHA512) > 0)
+  {
+    tees_sha512_final(&sha512, digest);
+    tee_trace_span_bytes("hash", "sha512 c", start, total);
+    return TEES_SHA512_SIZE;
+  }
+  tees_sha256_final(&sha256, digest);
+  tee_trace_span_bytes("hash", tees_sha256_engine(), start, total);
+  return TEES_SHA256_SIZE;
+}
+
+void print_stats(struct se_cmd_stats *stats)
+{
+  static const char *const names[SE_CMD_COUNT] = {
+    "GENERATE_KEY", "ENC_DEC", "STATS", "STATS_RESET", "FILL_POOL",
+    "GENERATE_KEYS", "SIGN_FILE", "ENVELOPE_SEAL", "ENVELOPE_OPEN",
+    "SIGN_BATCH", "RANDOM"
+  };
+
+  printf("%-14s %8s %6s %10s %10s %8s %8s %8s %8s %8s %8s %8s\n",
+         "command", "calls", "errors", "bytes_in", "bytes_out",
+         "avg_ms", "max_ms", "total_ms",
+         "key_open", "op_alloc", "crypto", "storage");
+  for (int i = 0; i < SE_CMD_COUNT; i++)
+  {
+    struct se_cmd_stats *st = &stats[i];
+
+    printf("%-14s %8" PRIu32 " %6" PRIu32 " %10" PRIu64 " %10" PRIu64
+           " %8" PRIu64 " %8" PRIu32 " %8" PRIu64
+           " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64 "\n",
+           names[i], st->calls, st->errors, st->bytes_in, st->bytes_out,
+           st->calls ? st->time_total_ms / st->calls : 0,
+           st->time_max_ms, st->time_total_ms,
+           st->phase_total_ms[SE_PHASE_KEY_OPEN],
+           st->phase_total_ms[SE_PHASE_OP_ALLOC],
+           st->phase_total_ms[SE_PHASE_CRYPTO],
+           st->phase_total_ms[SE_PHASE_STORAGE]);
+  }
 }
 
 void set_mode(char *mode, uint32_t *flags_p)
@@ -160,38 +486,170 @@ void set_mode(char *mode, uint32_t *flags_p)
   {
     *flags_p |= SHA512;
   }
+  else if (strcmp(mode, "TEE_ALG_HMAC_SHA256") == 0)
+  {
+    *flags_p |= MAC_SHA256;
+  }
+  else if (strcmp(mode, "TEE_ALG_AES_GCM") == 0)
+  {
+    *flags_p |= GCM;
+  }
   else
   {
-    printf("Available modes: TEE_ALG_AES_CBC_NOPAD\nTEE_ALG_AES_CTR\nTEE_ALG_RSAES_PKCS1_OAEP_MGF1_SHA256\nTEE_ALG_RSA_NOPAD\nTEE_ALG_RSASSA_PKCS1_V1_5_SHA256\nTEE_ALG_RSASSA_PKCS1_PSS_MGF1_SHA256\n");
+    printf("Available modes: TEE_ALG_AES_CBC_NOPAD\nTEE_ALG_AES_CTR\nTEE_ALG_RSAES_PKCS1_OAEP_MGF1_SHA256\nTEE_ALG_RSA_NOPAD\nTEE_ALG_RSASSA_PKCS1_V1_5_SHA256\nTEE_ALG_RSASSA_PKCS1_PSS_MGF1_SHA256\nTEE_ALG_HMAC_SHA256\nTEE_ALG_AES_GCM\n");
   }
   return;
 }
 
+/* 32 hex digits into a binary IV */
+int parse_hex_iv(const char *hex, uint8_t *iv)
+{
+  if (strlen(hex) != 2 * AES_BLOCK_SIZE)
+    return -1;
+  for (int i = 0; i < AES_BLOCK_SIZE; i++)
+  {
+    if (sscanf(hex + 2 * i, "%2hhx", &iv[i]) != 1)
+      return -1;
+  }
+  return 0;
+}
+
+/*
+ * Write size random bytes drawn through a host side pool, in requests of
+ * chunk bytes like a service asking for nonces would.
+ */
+void do_random(struct test_ctx *ctx, FILE *out_file, size_t size, size_t chunk,
+               size_t pool_size)
+{
+  struct tees_random_pool pool;
+  uint8_t buf[4096];
+  uint64_t start = tee_trace_now();
+  uint32_t origin;
+  TEEC_Result res;
+
+  if (chunk == 0 || chunk > sizeof(buf))
+    errx(1, "--chunk must be between 1 and %zu", sizeof(buf));
+
+  res = tees_random_pool_init(&pool, &ctx->ctx, &ctx->sess, pool_size);
+  if (res != TEEC_SUCCESS)
+    errx(1, "TEEC_AllocateSharedMemory failed 0x%x", res);
+
+  for (size_t done = 0; done < size; done += chunk)
+  {
+    size_t n = size - done < chunk ? size - done : chunk;
+
+    res = tees_random_pool_get(&pool, buf, n, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(RANDOM) failed 0x%x origin 0x%x",
+           res, origin);
+    if (fwrite(buf, 1, n, out_file) != n)
+      errx(1, "Failed to write the output file");
+  }
+  tee_trace_span_bytes("random", "pool", start, size);
+
+  printf("### %zu bytes in %zu byte requests, %u RANDOM calls\n",
+         size, chunk, pool.refills);
+  memset(buf, 0, sizeof(buf));
+  tees_random_pool_free(&pool);
+}
+
 int main(int argc, char *argv[])
 {
   uint8_t *IV = NULL;
+  uint8_t iv_buf[AES_BLOCK_SIZE];
+  int iv_binary = 0;
+  int iv_random = 0;
+  size_t random_size = 0;
+  size_t random_chunk = AES_BLOCK_SIZE;
+  size_t random_pool = RANDOM_POOL_SIZE;
   uint8_t *input = NULL;
   FILE *out_file = NULL;
   FILE *in_file = NULL;
+  char *in_path = NULL;
+  char *out_path = NULL;
+  int workers = 0;
   uint32_t key_id = 0;
   uint32_t key_size = 0;
   uint32_t key_type = 0;
   uint32_t flags = 0;
+  int stats_reset = 0;
+  uint32_t pool_target = 0;
+  uint32_t pool_budget = 0;
+  char *key_id_list = NULL;
+  char *batch_paths[SE_BATCH_MAX_ITEMS];
+  uint32_t batch_count = 0;
+  char *trace_name = NULL;
+  int prehash = 0;
+  uint64_t start;
+  uint32_t origin;
+  TEEC_Result res;
   struct test_ctx ctx = {};
 
   enum
   {
     KEYGEN,
-    CRYPTO
+    CRYPTO,
+    STATS_MODE,
+    FILL_POOL_MODE,
+    KEYGEN_BATCH,
+    SIGN_FILE_MODE,
+    SEAL_MODE,
+    UNSEAL_MODE,
+    SIGN_BATCH_MODE,
+    RANDOM_MODE
   } mode = CRYPTO;
   if (strcmp(argv[1], "keygen") == 0)
   {
     mode = KEYGEN;
   }
+  else if (strcmp(argv[1], "stats") == 0)
+  {
+    mode = STATS_MODE;
+  }
+  else if (strcmp(argv[1], "fill-pool") == 0)
+  {
+    mode = FILL_POOL_MODE;
+  }
+  else if (strcmp(argv[1], "keygen-batch") == 0)
+  {
+    mode = KEYGEN_BATCH;
+  }
+  else if (strcmp(argv[1], "sign-file") == 0)
+  {
+    mode = SIGN_FILE_MODE;
+  }
+  else if (strcmp(argv[1], "seal") == 0)
+  {
+    mode = SEAL_MODE;
+  }
+  else if (strcmp(argv[1], "unseal") == 0)
+  {
+    mode = UNSEAL_MODE;
+  }
+  else if (strcmp(argv[1], "sign-batch") == 0)
+  {
+    mode = SIGN_BATCH_MODE;
+  }
+  else if (strcmp(argv[1], "random") == 0)
+  {
+    mode = RANDOM_MODE;
+  }
 
   for (int i = 2; i < argc; i++)
   {
-    if (strcmp(argv[i], "--IV") == 0)
+    if (strcmp(argv[i], "--IV") == 0 && strcmp(argv[i + 1], "random") == 0)
+    {
+      /* Drawn from the TEE once the session is open */
+      iv_random = 1;
+    }
+    else if (strcmp(argv[i], "--IV_hex") == 0)
+    {
+      if (parse_hex_iv(argv[i + 1], iv_buf) != 0)
+        errx(1, "--IV_hex takes %d hex digits", 2 * AES_BLOCK_SIZE);
+      IV = iv_buf;
+      iv_binary = 1;
+    }
+    else if (strcmp(argv[i], "--IV") == 0)
     {
       if (strlen(argv[i + 1]) != 16)
       {
@@ -208,17 +666,22 @@ int main(int argc, char *argv[])
     {
       if (strcmp(argv[i + 1], "RSA") == 0)
       {
-        key_type = TEE_TYPE_RSA_KEYPAIR;
+        key_type = TEES_KEY_RSA_KEYPAIR;
         flags |= RSA;
       }
       else if (strcmp(argv[i + 1], "AES") == 0)
       {
-        key_type = TEE_TYPE_AES;
+        key_type = TEES_KEY_AES;
         flags |= AES;
       }
+      else if (strcmp(argv[i + 1], "HMAC") == 0)
+      {
+        key_type = TEES_KEY_HMAC_SHA256;
+        flags |= HMAC;
+      }
       else
       {
-        printf("Available key types: AES, RSA\n");
+        printf("Available key types: AES, RSA, HMAC\n");
       }
     }
     else if (strcmp(argv[i], "--key_size") == 0)
@@ -260,11 +723,18 @@ int main(int argc, char *argv[])
         printf("--in_file already specified\n");
       }
     }
+    else if (strcmp(argv[i], "--in_file") == 0 && mode == SIGN_BATCH_MODE)
+    {
+      if (batch_count == SE_BATCH_MAX_ITEMS)
+        errx(1, "sign-batch takes at most %d files", SE_BATCH_MAX_ITEMS);
+      batch_paths[batch_count++] = argv[i + 1];
+    }
     else if (strcmp(argv[i], "--in_file") == 0)
     {
       if (input == NULL)
       {
         in_file = fopen(argv[i + 1], "rb");
+        in_path = argv[i + 1];
       }
       else
       {
@@ -274,6 +744,51 @@ int main(int argc, char *argv[])
     else if (strcmp(argv[i], "--out_file") == 0)
     {
       out_file = fopen(argv[i + 1], "a+b");
+      out_path = argv[i + 1];
+    }
+    else if (strcmp(argv[i], "--parallel") == 0)
+    {
+      workers = atoi(argv[i + 1]);
+    }
+    else if (strcmp(argv[i], "--count") == 0)
+    {
+      pool_target = atoi(argv[i + 1]);
+    }
+    else if (strcmp(argv[i], "--budget") == 0)
+    {
+      pool_budget = atoi(argv[i + 1]);
+    }
+    else if (strcmp(argv[i], "--IDs") == 0)
+    {
+      key_id_list = argv[i + 1];
+    }
+    else if (strcmp(argv[i], "--reset") == 0)
+    {
+      stats_reset = 1;
+    }
+    else if (strcmp(argv[i], "--prehash") == 0)
+    {
+      prehash = 1;
+    }
+    else if (strcmp(argv[i], "--derived") == 0)
+    {
+      flags |= DERIVED;
+    }
+    else if (strcmp(argv[i], "--size") == 0)
+    {
+      random_size = strtoul(argv[i + 1], NULL, 0);
+    }
+    else if (strcmp(argv[i], "--chunk") == 0)
+    {
+      random_chunk = strtoul(argv[i + 1], NULL, 0);
+    }
+    else if (strcmp(argv[i], "--pool_size") == 0)
+    {
+      random_pool = strtoul(argv[i + 1], NULL, 0);
+    }
+    else if (strcmp(argv[i], "--trace") == 0)
+    {
+      trace_name = argv[i + 1];
     }
     else if (strcmp(argv[i], "--help") == 0)
     {
@@ -281,10 +796,81 @@ int main(int argc, char *argv[])
     }
   }
 
+  tee_trace_init("tee_crypto", trace_name);
+
+  /* Digests of non-secret data are computed here, no TEE session needed */
+  if (mode == CRYPTO && (flags & DIGEST) > 0)
+  {
+    uint8_t digest[TEES_SHA512_SIZE];
+    size_t digest_len;
+
+    if (out_file == NULL)
+      errx(1, "--digest needs --out_file");
+
+    printf("### Hashing input...\n");
+    if (in_file != NULL)
+    {
+      digest_len = host_digest(in_file, flags, digest);
+      fclose(in_file);
+    }
+    else if (input != NULL && (flags & SHA512) > 0)
+    {
+      tees_sha512(input, strlen((char *)input), digest);
+      digest_len = TEES_SHA512_SIZE;
+    }
+    else if (input != NULL)
+    {
+      tees_sha256(input, strlen((char *)input), digest);
+      digest_len = TEES_SHA256_SIZE;
+    }
+    else
+    {
+      errx(1, "--digest needs --in or --in_file");
+    }
+
+    printf("### Writting results to file...\n");
+    start = tee_trace_now();
+    fwrite(digest, digest_len, 1, out_file);
+    fclose(out_file);
+    tee_trace_span_bytes("file", "write output", start, digest_len);
+    printf("### Success!\n");
+    return 0;
+  }
+
   printf("### Preparing TEE Session...\n");
   prepare_tee_session(&ctx);
 
-  if (mode == CRYPTO)
+  if (iv_random)
+  {
+    res = tees_crypto_random(&ctx.sess, iv_buf, sizeof(iv_buf), &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(RANDOM) failed 0x%x origin 0x%x",
+           res, origin);
+    /* Printed so that the data can be decrypted with --IV_hex */
+    printf("### IV: ");
+    for (int i = 0; i < AES_BLOCK_SIZE; i++)
+      printf("%02x", iv_buf[i]);
+    printf("\n");
+    IV = iv_buf;
+    iv_binary = 1;
+  }
+
+  if (mode == CRYPTO && workers > 0)
+  {
+    if ((flags & (AES | CTR)) != (AES | CTR) || IV == NULL ||
+        in_path == NULL || out_path == NULL)
+      errx(1, "--parallel needs AES with TEE_ALG_AES_CTR, --IV, --in_file and --out_file");
+
+    fclose(in_file);
+    fclose(out_file);
+    printf("### Starting %d crypto sessions...\n", workers);
+    if (do_parallel_ctr(&ctx.ctx, in_path, out_path, key_id, flags, IV, workers) != 0)
+      errx(1, "Parallel AES-CTR failed");
+    printf("### Terminating TEE Session...\n");
+    terminate_tee_session(&ctx);
+    printf("### Success!\n");
+  }
+  else if (mode == CRYPTO)
   {
     uint8_t in[4096];
     uint8_t out[4096];
@@ -293,27 +879,42 @@ int main(int argc, char *argv[])
 
     out_len = 4096;
 
-    if ((IV != NULL) && (key_type == TEE_TYPE_AES))
+    if ((IV != NULL) && (key_type == TEES_KEY_AES) && !iv_binary)
     {
       printf("### Setting IV...\n");
       memcpy(out, IV, 17);
     }
 
-    if (input != NULL)
+    if (input != NULL && prehash)
+    {
+      printf("### Hashing input...\n");
+      tees_sha256(input, strlen((char *)input), in);
+      in_len = TEES_SHA256_SIZE;
+    }
+    else if (input != NULL)
     {
       printf("### Parsing input...\n");
       memcpy(in, input, (strlen(input) + 1));
       in_len = strlen(input);
     }
+    else if (in_file != NULL && prehash)
+    {
+      /* The signature schemes all hash with SHA-256 */
+      printf("### Hashing input file...\n");
+      in_len = host_digest(in_file, flags & ~SHA512, in);
+      fclose(in_file);
+    }
     else if (in_file != NULL)
     {
       printf("### Parsing input file...\n");
+      start = tee_trace_now();
       fseek(in_file, 0L, SEEK_END);
       size_t file_size = ftell(in_file);
       in_len = file_size;
       fseek(in_file, 0L, SEEK_SET);
       fread(in, file_size, 1, in_file);
       fclose(in_file);
+      tee_trace_span_bytes("file", "read input", start, file_size);
     }
 
     if ((flags & VERIFY) > 0)
@@ -321,12 +922,14 @@ int main(int argc, char *argv[])
       if (out_file != NULL)
       {
         printf("### Parsing signature...\n");
+        start = tee_trace_now();
         fseek(out_file, 0L, SEEK_END);
         size_t file_size = ftell(out_file);
         out_len = file_size;
         fseek(out_file, 0L, SEEK_SET);
         fread(out, file_size, 1, out_file);
         fclose(out_file);
+        tee_trace_span_bytes("file", "read signature", start, file_size);
       }
       else
       {
@@ -334,13 +937,47 @@ int main(int argc, char *argv[])
       }
     }
 
+    /* An item of a batch is checked through the batch digest */
+    struct batch_sig_header hdr = {};
+
+    if ((flags & VERIFY) > 0 && out_len >= sizeof(hdr))
+      memcpy(&hdr, out, sizeof(hdr));
+    if (hdr.magic == BATCH_SIG_MAGIC)
+    {
+      size_t proof_len;
+
+      if (hdr.count == 0 || hdr.count > SE_BATCH_MAX_ITEMS || hdr.index >= hdr.count)
+        errx(1, "Malformed batch signature");
+      proof_len = tees_batch_depth(hdr.count) * SE_BATCH_HASH_SIZE;
+      if (sizeof(hdr) + proof_len + hdr.sig_len != out_len)
+        errx(1, "Malformed batch signature");
+      if (!prehash || in_len != TEES_SHA256_SIZE)
+        errx(1, "Batch signatures need --prehash");
+
+      printf("### Checking batch proof...\n");
+      tees_batch_digest(in, hdr.index, hdr.count, out + sizeof(hdr), in);
+      memmove(out, out + sizeof(hdr) + proof_len, hdr.sig_len);
+      out_len = hdr.sig_len;
+    }
+
     printf("### Starting crypto session...\n");
-    do_crypto(&ctx, key_id, flags, in, in_len, out, &out_len);
+    if (iv_binary && key_type == TEES_KEY_AES)
+      res = tees_crypto_run_iv(&ctx.sess, key_id, flags, in, in_len, out,
+                               &out_len, IV, AES_BLOCK_SIZE, &origin);
+    else
+      res = tees_crypto_run(&ctx.sess, key_id, flags, in, in_len, out,
+                            &out_len, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(ENCRYPT_DECRYPT) failed 0x%x origin 0x%x",
+           res, origin);
 
     if ((flags & VERIFY) == 0)
     {
       printf("### Writting results to file...\n");
+      start = tee_trace_now();
       fwrite(out, out_len, 1, out_file);
+      fflush(out_file);
+      tee_trace_span_bytes("file", "write output", start, out_len);
     }
     printf("### Terminating TEE Session...\n");
     terminate_tee_session(&ctx);
@@ -349,11 +986,193 @@ int main(int argc, char *argv[])
   else if (mode == KEYGEN)
   {
     printf("### Starting key generation session...\n");
-    do_keygen(&ctx, key_type, key_size, key_id);
+    res = tees_crypto_generate_key(&ctx.sess, key_type, key_size, key_id,
+                                   &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(GENERATE_KEY) failed 0x%x origin 0x%x",
+           res, origin);
+    printf("### Terminating TEE Session...\n");
+    terminate_tee_session(&ctx);
+    printf("### Success!\n");
+  }
+  else if (mode == SIGN_FILE_MODE)
+  {
+    uint8_t sig[512];
+    size_t sig_len = sizeof(sig);
+
+    if (in_file == NULL || out_file == NULL)
+      errx(1, "sign-file needs --in_file and --out_file");
+
+    printf("### Starting sign file session...\n");
+    do_sign_file(&ctx, key_id, flags, in_file, sig, &sig_len);
+    fclose(in_file);
+
+    /* Only the signature goes to the output, never append to a stale one */
+    out_file = freopen(out_path, "wb", out_file);
+    if (out_file == NULL)
+      err(1, "Failed to open %s", out_path);
+
+    printf("### Writting signature to file...\n");
+    start = tee_trace_now();
+    fwrite(sig, sig_len, 1, out_file);
+    fclose(out_file);
+    tee_trace_span_bytes("file", "write output", start, sig_len);
+    printf("### Terminating TEE Session...\n");
+    terminate_tee_session(&ctx);
+    printf("### Success!\n");
+  }
+  else if (mode == SIGN_BATCH_MODE)
+  {
+    static uint8_t digests[SE_BATCH_MAX_ITEMS][SE_BATCH_HASH_SIZE];
+    uint32_t depth = tees_batch_depth(batch_count);
+    size_t proofs_len = (size_t)batch_count * depth * SE_BATCH_HASH_SIZE;
+    uint8_t *proofs = malloc(proofs_len + 1);
+    uint8_t sig[512];
+    size_t sig_len = sizeof(sig);
+
+    if (batch_count == 0)
+      errx(1, "sign-batch needs --in_file");
+    if (proofs == NULL)
+      errx(1, "Out of memory");
+
+    printf("### Hashing %u input files...\n", batch_count);
+    for (uint32_t i = 0; i < batch_count; i++)
+    {
+      FILE *f = fopen(batch_paths[i], "rb");
+
+      if (f == NULL)
+        err(1, "Failed to open %s", batch_paths[i]);
+      host_digest(f, 0, digests[i]);
+      fclose(f);
+    }
+
+    printf("### Starting batch sign session...\n");
+    res = tees_crypto_sign_batch(&ctx.sess, key_id, flags, digests, batch_count,
+                                 sig, &sig_len, proofs, &proofs_len, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(SIGN_BATCH) failed 0x%x origin 0x%x",
+           res, origin);
+
+    printf("### Writting signatures to files...\n");
+    for (uint32_t i = 0; i < batch_count; i++)
+    {
+      struct batch_sig_header hdr = { BATCH_SIG_MAGIC, i, batch_count, sig_len };
+      char sig_path[4096];
+      FILE *f;
+
+      snprintf(sig_path, sizeof(sig_path), "%s.sig", batch_paths[i]);
+      f = fopen(sig_path, "wb");
+      if (f == NULL)
+        err(1, "Failed to open %s", sig_path);
+      start = tee_trace_now();
+      if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 ||
+          fwrite(proofs + (size_t)i * depth * SE_BATCH_HASH_SIZE, 1,
+                 depth * SE_BATCH_HASH_SIZE, f) != depth * SE_BATCH_HASH_SIZE ||
+          fwrite(sig, 1, sig_len, f) != sig_len)
+        errx(1, "Failed to write %s", sig_path);
+      fclose(f);
+      tee_trace_span_bytes("file", "write output", start,
+                           sizeof(hdr) + depth * SE_BATCH_HASH_SIZE + sig_len);
+    }
+    free(proofs);
+    printf("### Terminating TEE Session...\n");
+    terminate_tee_session(&ctx);
+    printf("### Success!\n");
+  }
+  else if (mode == SEAL_MODE || mode == UNSEAL_MODE)
+  {
+    if (in_file == NULL || out_file == NULL)
+      errx(1, "seal and unseal need --in_file and --out_file");
+
+    out_file = freopen(out_path, "wb", out_file);
+    if (out_file == NULL)
+      err(1, "Failed to open %s", out_path);
+
+    printf("### Starting envelope session...\n");
+    if (do_envelope(&ctx, mode == SEAL_MODE, key_id, flags, in_file, out_file) != 0)
+    {
+      /* A partial envelope is useless, a partly opened one not authentic */
+      fclose(out_file);
+      unlink(out_path);
+      errx(1, "Failed to %s %s", mode == SEAL_MODE ? "seal" : "open", in_path);
+    }
+    fclose(in_file);
+    fclose(out_file);
+    printf("### Terminating TEE Session...\n");
+    terminate_tee_session(&ctx);
+    printf("### Success!\n");
+  }
+  else if (mode == FILL_POOL_MODE)
+  {
+    printf("### Filling key pool...\n");
+    uint32_t level;
+
+    res = tees_crypto_fill_pool(&ctx.sess, key_type, key_size, pool_target,
+                                pool_budget, &level, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(FILL_POOL) failed 0x%x origin 0x%x",
+           res, origin);
+    printf("### Key pool holds %u keys\n", level);
+    terminate_tee_session(&ctx);
+  }
+  else if (mode == KEYGEN_BATCH)
+  {
+    uint32_t key_ids[256];
+    uint32_t provisioned = 0;
+    size_t count = 0;
+    char *tok;
+
+    for (tok = strtok(key_id_list, ","); tok != NULL && count < 256;
+         tok = strtok(NULL, ","))
+    {
+      key_ids[count++] = atoi(tok);
+    }
+
+    printf("### Starting batch key generation session...\n");
+    res = tees_crypto_generate_keys(&ctx.sess, key_type, key_size, key_ids,
+                                    count, &provisioned, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(GENERATE_KEYS) failed 0x%x origin 0x%x, %u of %zu keys provisioned",
+           res, origin, provisioned, count);
+    printf("### Terminating TEE Session...\n");
+    terminate_tee_session(&ctx);
+    printf("### Success!\n");
+  }
+  else if (mode == RANDOM_MODE)
+  {
+    if (out_file == NULL || random_size == 0)
+      errx(1, "random needs --size and --out_file");
+
+    out_file = freopen(out_path, "wb", out_file);
+    if (out_file == NULL)
+      err(1, "Failed to open %s", out_path);
+
+    printf("### Drawing random bytes...\n");
+    do_random(&ctx, out_file, random_size, random_chunk, random_pool);
+    fclose(out_file);
     printf("### Terminating TEE Session...\n");
     terminate_tee_session(&ctx);
     printf("### Success!\n");
   }
+  else if (mode == STATS_MODE)
+  {
+    struct se_cmd_stats stats[SE_CMD_COUNT];
+
+    res = tees_crypto_stats(&ctx.sess, stats, &origin);
+    if (res != TEEC_SUCCESS)
+      errx(1, "TEEC_InvokeCommand(STATS) failed 0x%x origin 0x%x",
+           res, origin);
+    print_stats(stats);
+    if (stats_reset)
+    {
+      printf("### Resetting counters...\n");
+      res = tees_crypto_stats_reset(&ctx.sess, &origin);
+      if (res != TEEC_SUCCESS)
+        errx(1, "TEEC_InvokeCommand(STATS_RESET) failed 0x%x origin 0x%x",
+             res, origin);
+    }
+    terminate_tee_session(&ctx);
+  }
 
   return 0;
 }
\ No newline at end of file
@@ -7,6 +7,8 @@
 #ifndef __SE_TA_H__
 #define __SE_TA_H__
 
+#include <stdint.h>
+
 /*
  * This TA implements HOTP according to:
  * https://www.ietf.org/rfc/rfc4226.txt
@@ -17,7 +19,104 @@
 		{ 0x31, 0x20, 0x4a, 0x6f, 0x63, 0x6b, 0x65, 0x42 } }
 
 #define GENERATE_KEY	0
-#define ENC_DEC		1
+#define ENC_DEC		1 //* [in] value: a key ID, b flags; [in] memref: input; [inout] memref: output; [in] memref: optional binary IV
+#define STATS		2 //* [out] memref: struct se_cmd_stats per command
+#define STATS_RESET	3
+#define FILL_POOL	4 //* [in] value: a key type, b key size; [inout] value: a pool target/level, b max keys to generate (0 = no limit)
+#define GENERATE_KEYS	5 //* [in] value: a key type, b key size; [in] memref: uint32_t key IDs; [out] value: a keys provisioned
+#define SIGN_FILE	6 //* [in] value: a key ID, b flags; [in] memref: next file chunk; [out] memref: signature; [in] value: a SIGN_FILE_* flags
+#define ENVELOPE_SEAL	7 //* [in] value: a RSA key ID, b flags; [in] memref: next plaintext chunk; [out] memref: envelope bytes; [in] value: a SIGN_FILE_* flags
+#define ENVELOPE_OPEN	8 //* [in] value: a RSA key ID; [in] memref: next envelope chunk; [out] memref: plaintext; [in] value: a SIGN_FILE_* flags
+#define SIGN_BATCH	9 //* [in] value: a key ID, b flags; [in] memref: SHA-256 digests; [out] memref: signature; [out] memref: inclusion proofs
+#define RANDOM		10 //* [out] memref: filled with random bytes
+
+#define SE_CMD_COUNT	11
+
+/*
+ * SIGN_FILE is invoked once per chunk of the file. The SHA-256 digest is
+ * kept by the TA between calls and signed when the last chunk arrives.
+ */
+#define SIGN_FILE_FIRST	(1 << 0)
+#define SIGN_FILE_LAST	(1 << 1)
+
+/*
+ * Envelopes encrypt a payload of any size for an RSA keypair. The TA draws
+ * a fresh AES-256 data key, wraps it with RSA-OAEP and encrypts the payload
+ * with AES-GCM (or AES-CTR, without integrity, when CTR is in the flags).
+ * The container is the header below, the wrapped key, the ciphertext and
+ * for GCM the tag, the header and wrapped key being authenticated too.
+ *
+ * ENVELOPE_SEAL and ENVELOPE_OPEN are chunked like SIGN_FILE. The output of
+ * the first SEAL chunk starts with the header and the first OPEN chunk must
+ * hold the whole header, the last OPEN chunk must hold the whole tag.
+ * Plaintext returned by OPEN is only authentic once the last chunk has
+ * succeeded. Each chunk needs an output buffer SE_ENVELOPE_OVERHEAD bytes
+ * larger than its input.
+ */
+#define SE_ENVELOPE_MAGIC	0x31564553 /* "SEV1" */
+#define SE_ENVELOPE_GCM		0
+#define SE_ENVELOPE_CTR		1
+#define SE_ENVELOPE_KEY_SIZE	32
+#define SE_ENVELOPE_GCM_IV_SIZE	12
+#define SE_ENVELOPE_TAG_SIZE	16
+#define SE_ENVELOPE_MAX_WRAPPED	512
+
+struct se_envelope_header {
+	uint32_t magic;
+	uint32_t cipher;
+	uint32_t wrapped_len;
+	uint8_t iv[16];		/* GCM uses the first 12 bytes */
+};
+
+#define SE_ENVELOPE_OVERHEAD	(sizeof(struct se_envelope_header) + \
+				 SE_ENVELOPE_MAX_WRAPPED + \
+				 2 * SE_ENVELOPE_TAG_SIZE)
+
+/*
+ * SIGN_BATCH signs up to SE_BATCH_MAX_ITEMS digests with one private key
+ * operation. The TA builds a Merkle tree over them,
+ *   leaf = SHA-256(SE_BATCH_LEAF || digest)
+ *   node = SHA-256(SE_BATCH_NODE || left || right)
+ * where the last node of a level with an odd width moves up unchanged, and
+ * signs the batch digest SHA-256(SE_BATCH_ROOT || count || root), count
+ * being 32 bits little endian. The batch digest is verified like any other
+ * digest with ENC_DEC.
+ *
+ * The proofs are count records of depth hashes, depth being the number of
+ * levels above the leaves (0 for a single item). Hash k of item i is the
+ * sibling of node i >> k at level k, zero when the node has none.
+ */
+#define SE_BATCH_MAX_ITEMS	256
+#define SE_BATCH_HASH_SIZE	32
+#define SE_BATCH_LEAF		0
+#define SE_BATCH_NODE		1
+#define SE_BATCH_ROOT		2
+
+/* Number of distinct key type/size pairs the key pool can hold */
+#define SE_POOL_MAX_CLASSES	8
+
+/* Phases of a command timed separately by the TA */
+#define SE_PHASE_KEY_OPEN	0
+#define SE_PHASE_OP_ALLOC	1
+#define SE_PHASE_CRYPTO		2
+#define SE_PHASE_STORAGE	3
+#define SE_PHASE_COUNT		4
+
+/*
+ * Per-command counters returned by STATS, indexed by command ID. Times are
+ * in milliseconds as measured with TEE_GetSystemTime(). They cover the
+ * session only, unless the TA is built with CFG_TEE_CRYPTO_STATS_PERSIST=y.
+ */
+struct se_cmd_stats {
+	uint32_t calls;
+	uint32_t errors;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t time_total_ms;
+	uint32_t time_max_ms;
+	uint32_t reserved;
+	uint64_t phase_total_ms[SE_PHASE_COUNT];
+};
 
 #endif
 
@@ -35,4 +134,8 @@
 #define SIGN_RSASSA_MGF	2048  //* TEE_ALG_RSASSA_PKCS1_PSS_MGF1_SHA256
 #define SHA256          4096  //* TEE_ALG_SHA256
 #define SHA512          8192  //* TEE_ALG_SHA512
-#define DIGEST          16384 //* Digest mode
\ No newline at end of file
+#define DIGEST          16384 //* Digest mode
+#define HMAC            32768 //* HMAC, SIGN computes and VERIFY checks a MAC
+#define MAC_SHA256      65536 //* TEE_ALG_HMAC_SHA256
+#define GCM             131072 //* TEE_ALG_AES_GCM
+#define DERIVED         262144 //* AES/HMAC key derived from the master key, the key ID is the context
\ No newline at end of file
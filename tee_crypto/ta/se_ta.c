@@ -3,8 +3,26 @@
 #include <tee_internal_api_extensions.h>
 #include <tee_internal_api.h>
 
+#include <tee_arena.h>
+
 #define MAX_AES_KEYSIZE 256
 #define MAX_RSA_KEYSIZE 2048
+#define MAX_HMAC_KEYSIZE 1024
+
+/*
+ * Scratch memory of the session, reset after every command. The TA runs one
+ * instance per session so a single arena per instance is enough.
+ */
+#define SESSION_ARENA_SIZE 1024
+
+static struct tee_arena *arena;
+
+/* Digest of the file being signed by SIGN_FILE, kept across its chunks */
+static TEE_OperationHandle sign_file_digest;
+
+/* Data key cipher of the envelope being sealed or opened, kept across its chunks */
+static TEE_OperationHandle envelope_op;
+static uint32_t envelope_algo;
 
 struct cryptography
 {
@@ -13,6 +31,347 @@ struct cryptography
   uint8_t *IV;
 };
 
+/* Object ID of the persisted counters, distinct from the 4 byte key IDs */
+#define STATS_OBJ_ID "se_stats"
+
+/*
+ * Pre-generated keys are kept in a FIFO per key type/size. The pool index
+ * holds the sequence numbers of the oldest and next key of each FIFO, keys
+ * are stored as POOL_OBJ_ID followed by struct pool_key_id.
+ */
+#define POOL_OBJ_ID "se_pool"
+
+struct pool_class {
+  uint32_t key_type;
+  uint32_t key_size;
+  uint32_t head;
+  uint32_t tail;
+};
+
+struct pool_key_id {
+  char prefix[sizeof(POOL_OBJ_ID) - 1];
+  uint32_t key_type;
+  uint32_t key_size;
+  uint32_t seq;
+};
+
+/*
+ * Recently verified RSA (key ID, digest, signature) triples of the session.
+ * An entry is the SHA-256 of the triple, entries are replaced in FIFO
+ * order. The cache lives in instance memory only: looking at storage on
+ * every verification would cost more than the verification. A stored key
+ * is never replaced, another instance cannot give a key ID a new key
+ * behind the cache's back.
+ */
+#define VCACHE_ENTRIES 64
+#define VCACHE_HASH_SIZE 32
+
+struct vcache_entry {
+  uint32_t key_id;
+  uint32_t used;
+  uint8_t hash[VCACHE_HASH_SIZE];
+};
+
+static struct {
+  uint32_t next;
+  struct vcache_entry entries[VCACHE_ENTRIES];
+} vcache;
+
+/*
+ * Counters live in instance memory and cover its session. Built with
+ * CFG_TEE_CRYPTO_STATS_PERSIST they are merged into STATS_OBJ_ID when the
+ * session closes so that STATS covers every session, which costs a read
+ * and a write of that object per session.
+ */
+#ifdef CFG_TEE_CRYPTO_STATS_PERSIST
+#define STATS_PERSIST true
+#else
+#define STATS_PERSIST false
+#endif
+
+/* Counters of this instance not yet merged into the persisted ones */
+static struct se_cmd_stats live_stats[SE_CMD_COUNT];
+static bool live_stats_dirty;
+
+/* Time spent in each phase by the command being executed */
+static uint32_t cmd_phase_ms[SE_PHASE_COUNT];
+static struct {
+  TEE_Time start;
+  uint32_t depth;
+} phase_clock[SE_PHASE_COUNT];
+
+static uint32_t elapsed_ms(const TEE_Time *since)
+{
+  TEE_Time now;
+
+  TEE_GetSystemTime(&now);
+  return (now.seconds - since->seconds) * 1000 + now.millis - since->millis;
+}
+
+/*
+ * Phases may nest (e.g. storage accessed from within a crypto helper), only
+ * the outermost begin/end pair of a phase is timed.
+ */
+static void phase_begin(uint32_t phase)
+{
+  if (!phase_clock[phase].depth++)
+    TEE_GetSystemTime(&phase_clock[phase].start);
+}
+
+static void phase_end(uint32_t phase)
+{
+  if (!--phase_clock[phase].depth)
+    cmd_phase_ms[phase] += elapsed_ms(&phase_clock[phase].start);
+}
+
+static void stats_merge(struct se_cmd_stats *dst, const struct se_cmd_stats *src)
+{
+  uint32_t i, p;
+
+  for (i = 0; i < SE_CMD_COUNT; i++) {
+    dst[i].calls += src[i].calls;
+    dst[i].errors += src[i].errors;
+    dst[i].bytes_in += src[i].bytes_in;
+    dst[i].bytes_out += src[i].bytes_out;
+    dst[i].time_total_ms += src[i].time_total_ms;
+    if (src[i].time_max_ms > dst[i].time_max_ms)
+      dst[i].time_max_ms = src[i].time_max_ms;
+    for (p = 0; p < SE_PHASE_COUNT; p++)
+      dst[i].phase_total_ms[p] += src[i].phase_total_ms[p];
+  }
+}
+
+static void stats_account(uint32_t cmd_id, TEE_Result res, uint32_t param_types,
+                          TEE_Param params[4], uint32_t in_bytes, uint32_t time_ms)
+{
+  struct se_cmd_stats *st = &live_stats[cmd_id];
+  uint32_t i, p;
+
+  st->calls++;
+  if (res != TEE_SUCCESS)
+    st->errors++;
+  st->bytes_in += in_bytes;
+  for (i = 0; i < 4; i++) {
+    uint32_t type = TEE_PARAM_TYPE_GET(param_types, i);
+
+    if (type == TEE_PARAM_TYPE_MEMREF_OUTPUT || type == TEE_PARAM_TYPE_MEMREF_INOUT)
+      st->bytes_out += params[i].memref.size;
+  }
+  st->time_total_ms += time_ms;
+  if (time_ms > st->time_max_ms)
+    st->time_max_ms = time_ms;
+  for (p = 0; p < SE_PHASE_COUNT; p++)
+    st->phase_total_ms[p] += cmd_phase_ms[p];
+
+  live_stats_dirty = true;
+}
+
+static uint32_t param_in_bytes(uint32_t param_types, TEE_Param params[4])
+{
+  uint32_t in_bytes = 0;
+  uint32_t i;
+
+  for (i = 0; i < 4; i++) {
+    uint32_t type = TEE_PARAM_TYPE_GET(param_types, i);
+
+    if (type == TEE_PARAM_TYPE_MEMREF_INPUT || type == TEE_PARAM_TYPE_MEMREF_INOUT)
+      in_bytes += params[i].memref.size;
+  }
+  return in_bytes;
+}
+
+/*
+ * Open an object shared by all instances. Instances of this TA run
+ * concurrently, so the object is opened exclusively and the open retried
+ * while another instance holds it.
+ */
+static TEE_Result open_shared_object(const void *id, uint32_t id_len, uint32_t flags,
+                                     TEE_ObjectHandle *obj)
+{
+  TEE_Result ret = TEE_SUCCESS;
+  uint32_t tries;
+
+  for (tries = 0; tries < 10; tries++) {
+    ret = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, id, id_len, flags, obj);
+    if (ret != TEE_ERROR_ACCESS_CONFLICT)
+      break;
+    TEE_Wait(1);
+  }
+  return ret;
+}
+
+static TEE_Result open_stats(uint32_t flags, TEE_ObjectHandle *obj)
+{
+  return open_shared_object(STATS_OBJ_ID, sizeof(STATS_OBJ_ID) - 1, flags, obj);
+}
+
+static TEE_Result read_stats(TEE_ObjectHandle obj, struct se_cmd_stats *stats)
+{
+  uint32_t read_bytes;
+
+  TEE_MemFill(stats, 0, sizeof(live_stats));
+  return TEE_ReadObjectData(obj, stats, sizeof(live_stats), &read_bytes);
+}
+
+/* Merge the counters of this instance into the persisted ones */
+static TEE_Result stats_flush(void)
+{
+  struct se_cmd_stats *stats;
+  TEE_ObjectHandle obj = NULL;
+  TEE_Result ret;
+
+  if (!STATS_PERSIST || !live_stats_dirty)
+    return TEE_SUCCESS;
+
+  stats = tee_arena_alloc(arena, sizeof(live_stats));
+  if (!stats)
+    return TEE_ERROR_OUT_OF_MEMORY;
+
+  ret = open_stats(TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_ACCESS_WRITE, &obj);
+  if (ret == TEE_ERROR_ITEM_NOT_FOUND) {
+    TEE_MemFill(stats, 0, sizeof(live_stats));
+    stats_merge(stats, live_stats);
+    ret = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, STATS_OBJ_ID,
+                                     sizeof(STATS_OBJ_ID) - 1,
+                                     TEE_DATA_FLAG_ACCESS_READ |
+                                     TEE_DATA_FLAG_ACCESS_WRITE_META,
+                                     TEE_HANDLE_NULL, stats, sizeof(live_stats), &obj);
+  } else if (ret == TEE_SUCCESS) {
+    ret = read_stats(obj, stats);
+    if (ret == TEE_SUCCESS) {
+      stats_merge(stats, live_stats);
+      ret = TEE_SeekObjectData(obj, 0, TEE_DATA_SEEK_SET);
+    }
+    if (ret == TEE_SUCCESS)
+      ret = TEE_WriteObjectData(obj, stats, sizeof(live_stats));
+  }
+  if (obj)
+    TEE_CloseObject(obj);
+  if (ret != TEE_SUCCESS) {
+    DMSG("Failed to persist stats: 0x%x", ret);
+    return ret;
+  }
+
+  TEE_MemFill(live_stats, 0, sizeof(live_stats));
+  live_stats_dirty = false;
+  return ret;
+}
+
+static TEE_Result cmd_stats(uint32_t param_types, TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_OUTPUT, TEE_PARAM_TYPE_NONE,
+                    TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE);
+  struct se_cmd_stats *stats;
+  TEE_ObjectHandle obj = NULL;
+  TEE_Result ret;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (params[0].memref.size < sizeof(live_stats)) {
+    params[0].memref.size = sizeof(live_stats);
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  stats = tee_arena_alloc(arena, sizeof(live_stats));
+  if (!stats)
+    return TEE_ERROR_OUT_OF_MEMORY;
+
+  TEE_MemFill(stats, 0, sizeof(live_stats));
+  ret = TEE_ERROR_ITEM_NOT_FOUND;
+  if (STATS_PERSIST)
+    ret = open_stats(TEE_DATA_FLAG_ACCESS_READ, &obj);
+  if (ret == TEE_SUCCESS) {
+    ret = read_stats(obj, stats);
+    TEE_CloseObject(obj);
+  } else if (ret == TEE_ERROR_ITEM_NOT_FOUND) {
+    ret = TEE_SUCCESS;
+  }
+  if (ret != TEE_SUCCESS)
+    return ret;
+
+  /* Include what this session did so far */
+  stats_merge(stats, live_stats);
+  TEE_MemMove(params[0].memref.buffer, stats, sizeof(live_stats));
+  params[0].memref.size = sizeof(live_stats);
+  return TEE_SUCCESS;
+}
+
+static TEE_Result cmd_stats_reset(uint32_t param_types, TEE_Param params[4])
+{
+  TEE_ObjectHandle obj = NULL;
+  TEE_Result ret;
+
+  if (param_types != TEE_PARAM_TYPES(TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE,
+                                     TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE))
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  TEE_MemFill(live_stats, 0, sizeof(live_stats));
+  live_stats_dirty = false;
+  if (!STATS_PERSIST)
+    return TEE_SUCCESS;
+
+  ret = open_stats(TEE_DATA_FLAG_ACCESS_WRITE_META, &obj);
+  if (ret == TEE_ERROR_ITEM_NOT_FOUND)
+    return TEE_SUCCESS;
+  if (ret != TEE_SUCCESS)
+    return ret;
+
+  return TEE_CloseAndDeletePersistentObject1(obj);
+}
+
+static TEE_Result vcache_hash(uint32_t key_id, uint32_t algo, const void *digest,
+                              uint32_t digest_len, const void *sig, uint32_t sig_len,
+                              uint8_t *hash)
+{
+  TEE_OperationHandle op = TEE_HANDLE_NULL;
+  uint32_t hash_len = VCACHE_HASH_SIZE;
+  TEE_Result ret;
+
+  ret = TEE_AllocateOperation(&op, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+  if (ret != TEE_SUCCESS)
+    return ret;
+
+  TEE_DigestUpdate(op, &key_id, sizeof(key_id));
+  TEE_DigestUpdate(op, &algo, sizeof(algo));
+  TEE_DigestUpdate(op, &digest_len, sizeof(digest_len));
+  TEE_DigestUpdate(op, digest, digest_len);
+  ret = TEE_DigestDoFinal(op, sig, sig_len, hash, &hash_len);
+  TEE_FreeOperation(op);
+  return ret;
+}
+
+static bool vcache_lookup(const uint8_t *hash)
+{
+  uint32_t i;
+
+  for (i = 0; i < VCACHE_ENTRIES; i++)
+    if (vcache.entries[i].used &&
+        !TEE_MemCompare(vcache.entries[i].hash, hash, VCACHE_HASH_SIZE))
+      return true;
+  return false;
+}
+
+static void vcache_insert(uint32_t key_id, const uint8_t *hash)
+{
+  struct vcache_entry *entry = &vcache.entries[vcache.next];
+
+  entry->key_id = key_id;
+  entry->used = 1;
+  TEE_MemMove(entry->hash, hash, VCACHE_HASH_SIZE);
+  vcache.next = (vcache.next + 1) % VCACHE_ENTRIES;
+}
+
+/* key_id is bound to a key, forget anything verified under it before */
+static void vcache_invalidate(uint32_t key_id)
+{
+  uint32_t i;
+
+  for (i = 0; i < VCACHE_ENTRIES; i++)
+    if (vcache.entries[i].key_id == key_id)
+      vcache.entries[i].used = 0;
+}
 
 /*!
  * \brief RSA_Operation Wraps the RSA operations in one function.
@@ -33,7 +392,9 @@ static TEE_Result RSA_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
 
   TEE_OperationHandle rsa_operation = NULL;
   TEE_Result ret = TEE_SUCCESS;
+  phase_begin(SE_PHASE_OP_ALLOC);
   ret = TEE_AllocateOperation(&rsa_operation, algorithm, mode, MAX_RSA_KEYSIZE);
+  phase_end(SE_PHASE_OP_ALLOC);
   if (ret != TEE_SUCCESS) {
     EMSG("TEE_AllocateOperation failed: 0x%x", ret);
     TEE_FreeOperation(rsa_operation);
@@ -47,6 +408,7 @@ static TEE_Result RSA_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
     return ret;
   }
   // Switch with all available RSA modes: encrypt, decrypt, sign and verify.
+  phase_begin(SE_PHASE_CRYPTO);
   switch (mode) {
   case TEE_MODE_ENCRYPT:
     ret = TEE_AsymmetricEncrypt(rsa_operation, NULL, 0, in_data, in_data_len, out_data, out_data_len);
@@ -56,7 +418,7 @@ static TEE_Result RSA_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
     break;
 
   case TEE_MODE_DECRYPT:
-    ret = TEE_AsymmetricDecrypt(rsa_operation, NULL, 0, in_data, strlen(in_data), out_data, out_data_len);
+    ret = TEE_AsymmetricDecrypt(rsa_operation, NULL, 0, in_data, in_data_len, out_data, out_data_len);
     if (ret != TEE_SUCCESS) {
       DMSG("TEE_AsymmetricDecrypt failed: 0x%x", ret);
     }
@@ -79,6 +441,7 @@ static TEE_Result RSA_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
   default:
     DMSG("Unkown RSA mode type");
   }
+  phase_end(SE_PHASE_CRYPTO);
   TEE_FreeOperation(rsa_operation);
   return ret;
 }
@@ -103,7 +466,9 @@ static TEE_Result AES_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
   TEE_OperationHandle aes_operation = NULL;
   TEE_Result ret = TEE_SUCCESS;
 
+  phase_begin(SE_PHASE_OP_ALLOC);
   ret = TEE_AllocateOperation(&aes_operation, algorithm, mode, MAX_AES_KEYSIZE);
+  phase_end(SE_PHASE_OP_ALLOC);
   if (ret != TEE_SUCCESS) {
     EMSG("TEE_AllocateOperation failed: 0x%x", ret);
     TEE_FreeOperation(aes_operation);
@@ -115,8 +480,10 @@ static TEE_Result AES_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
     TEE_FreeOperation(aes_operation);
     return ret;
   }
+  phase_begin(SE_PHASE_CRYPTO);
   TEE_CipherInit(aes_operation, IV, IV_len);
   ret = TEE_CipherDoFinal(aes_operation, in_data, in_data_len, out_data, out_data_len);
+  phase_end(SE_PHASE_CRYPTO);
   if (ret != TEE_SUCCESS) {
     EMSG("TEE_CipherDoFinal failed: 0x%x", ret);
   }
@@ -125,6 +492,70 @@ static TEE_Result AES_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_
   return ret;
 }
 
+/*!
+ * \brief HMAC_Operation Wraps the HMAC operations in one function.
+ * \param mode          TEE_MODE_SIGN computes the MAC, TEE_MODE_VERIFY
+ * checks it.
+ * \param algorithm     Supported algorithms are defined above for HMAC.
+ * \param key           The key that will be used for the operation.
+ * \param in_data       Pointer to the input data buffer.
+ * \param in_data_len   Size of the input data buffer.
+ * \param mac           Pointer to the MAC buffer, output when signing and
+ * input when verifying.
+ * \param mac_len       Pointer to memory containing the size of the MAC
+ * buffer.
+ */
+static TEE_Result HMAC_Operation(TEE_OperationMode mode, uint32_t algorithm, TEE_ObjectHandle key,
+                                 void *in_data, uint32_t in_data_len, void *mac,
+                                 uint32_t *mac_len)
+{
+  TEE_OperationHandle mac_operation = NULL;
+  TEE_Result ret = TEE_SUCCESS;
+
+  phase_begin(SE_PHASE_OP_ALLOC);
+  ret = TEE_AllocateOperation(&mac_operation, algorithm, TEE_MODE_MAC, MAX_HMAC_KEYSIZE);
+  phase_end(SE_PHASE_OP_ALLOC);
+  if (ret != TEE_SUCCESS) {
+    EMSG("TEE_AllocateOperation failed: 0x%x", ret);
+    return ret;
+  }
+
+  ret = TEE_SetOperationKey(mac_operation, key);
+  if (ret != TEE_SUCCESS) {
+    EMSG("TEE_SetOperationKey failed: 0x%x", ret);
+    TEE_FreeOperation(mac_operation);
+    return ret;
+  }
+
+  phase_begin(SE_PHASE_CRYPTO);
+  /* The input is already one buffer, the final call takes all of it */
+  TEE_MACInit(mac_operation, NULL, 0);
+
+  switch (mode) {
+  case TEE_MODE_SIGN:
+    ret = TEE_MACComputeFinal(mac_operation, in_data, in_data_len, mac, mac_len);
+    if (ret != TEE_SUCCESS) {
+      DMSG("TEE_MACComputeFinal failed: 0x%x", ret);
+    }
+    break;
+
+  case TEE_MODE_VERIFY:
+    ret = TEE_MACCompareFinal(mac_operation, in_data, in_data_len, mac, *mac_len);
+    if (ret != TEE_SUCCESS) {
+      DMSG("TEE_MACCompareFinal failed: 0x%x", ret);
+    }
+    break;
+
+  default:
+    DMSG("Unknown HMAC mode type");
+    ret = TEE_ERROR_BAD_PARAMETERS;
+  }
+  phase_end(SE_PHASE_CRYPTO);
+
+  TEE_FreeOperation(mac_operation);
+  return ret;
+}
+
 /*!
  * \brief digest_operation Wraps the hash operations in one function.
  * \param algorithm        Supported algorithms are defined above for hash
@@ -141,15 +572,19 @@ static TEE_Result digest_operation(uint32_t algorithm, void *in_data,
                                    uint32_t *out_data_len) {
   TEE_OperationHandle dig_operation = NULL;
   TEE_Result ret = TEE_SUCCESS;
+  phase_begin(SE_PHASE_OP_ALLOC);
   ret = TEE_AllocateOperation(&dig_operation, algorithm, TEE_MODE_DIGEST, 0);
+  phase_end(SE_PHASE_OP_ALLOC);
   if (ret != TEE_SUCCESS) {
     DMSG("TEE_AllocateOperation failed: 0x%x", ret);
     TEE_FreeOperation(dig_operation);
     return ret;
   }
 
+  phase_begin(SE_PHASE_CRYPTO);
   ret = TEE_DigestDoFinal(dig_operation, in_data, in_data_len, out_data,
                           out_data_len);
+  phase_end(SE_PHASE_CRYPTO);
   if (ret != TEE_SUCCESS) {
     DMSG("TEE_AllocateOperation failed: 0x%x", ret);
   }
@@ -167,7 +602,9 @@ static TEE_Result store_key(TEE_ObjectHandle key, uint32_t id) {
   TEE_ObjectHandle temp = NULL;
   TEE_Result ret = TEE_SUCCESS;
 
+  phase_begin(SE_PHASE_STORAGE);
   ret = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, &id, sizeof(id), NULL, key, NULL, 0, &temp);
+  phase_end(SE_PHASE_STORAGE);
   if (ret != TEE_SUCCESS) {
     DMSG("TEE_CreatePersistentObject failed: 0x%x", ret);
     return ret;
@@ -177,40 +614,330 @@ static TEE_Result store_key(TEE_ObjectHandle key, uint32_t id) {
   return ret;
 }
 
-static TEE_Result cmd_gen_key(uint32_t param_types, TEE_Param params[4] ) {
+static TEE_Result generate_key(uint32_t key_type, uint32_t key_size, TEE_ObjectHandle *key)
+{
 	TEE_Result res;
-	TEE_ObjectHandle key;
-	uint32_t key_type = params[0].value.a;
-  uint32_t key_size = params[0].value.b;
-  uint32_t key_id = params[1].value.a;
-
 
-	res = TEE_AllocateTransientObject(key_type, key_size, &key);
+	res = TEE_AllocateTransientObject(key_type, key_size, key);
 	if (res) {
 		EMSG("TEE_AllocateTransientObject(%#" PRIx32 ", %" PRId32 "): %#" PRIx32, key_type, key_size, res);
 		return res;
 	}
 
-	res = TEE_GenerateKey(key, key_size, NULL, 0);
+	phase_begin(SE_PHASE_CRYPTO);
+	res = TEE_GenerateKey(*key, key_size, NULL, 0);
+	phase_end(SE_PHASE_CRYPTO);
 	if (res) {
 		EMSG("TEE_GenerateKey(%" PRId32 "): %#" PRIx32, key_size, res);
-		TEE_FreeTransientObject(key);
-		return res;
+		TEE_FreeTransientObject(*key);
+		*key = TEE_HANDLE_NULL;
 	}
+	return res;
+}
+
+static struct pool_key_id pool_key_id(uint32_t key_type, uint32_t key_size, uint32_t seq)
+{
+  struct pool_key_id id;
+
+  TEE_MemMove(id.prefix, POOL_OBJ_ID, sizeof(id.prefix));
+  id.key_type = key_type;
+  id.key_size = key_size;
+  id.seq = seq;
+  return id;
+}
+
+/*
+ * Lock and load the pool index. The returned handle must be released with
+ * pool_close(), the index is held exclusively until then.
+ */
+static TEE_Result pool_open(TEE_ObjectHandle *obj, struct pool_class *classes)
+{
+  uint32_t flags = TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_ACCESS_WRITE;
+  uint32_t read_bytes;
+  TEE_Result ret;
+
+  TEE_MemFill(classes, 0, sizeof(struct pool_class) * SE_POOL_MAX_CLASSES);
+  ret = open_shared_object(POOL_OBJ_ID, sizeof(POOL_OBJ_ID) - 1, flags, obj);
+  if (ret == TEE_ERROR_ITEM_NOT_FOUND) {
+    /* Losing a creation race shows up as a conflict, open it again then */
+    ret = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, POOL_OBJ_ID,
+                                     sizeof(POOL_OBJ_ID) - 1, flags,
+                                     TEE_HANDLE_NULL, classes,
+                                     sizeof(struct pool_class) * SE_POOL_MAX_CLASSES,
+                                     obj);
+    if (ret == TEE_ERROR_ACCESS_CONFLICT)
+      ret = open_shared_object(POOL_OBJ_ID, sizeof(POOL_OBJ_ID) - 1, flags, obj);
+    else
+      return ret;
+  }
+  if (ret != TEE_SUCCESS)
+    return ret;
+
+  ret = TEE_ReadObjectData(*obj, classes,
+                           sizeof(struct pool_class) * SE_POOL_MAX_CLASSES,
+                           &read_bytes);
+  if (ret != TEE_SUCCESS)
+    TEE_CloseObject(*obj);
+  return ret;
+}
+
+static TEE_Result pool_close(TEE_ObjectHandle obj, const struct pool_class *classes)
+{
+  TEE_Result ret;
+
+  ret = TEE_SeekObjectData(obj, 0, TEE_DATA_SEEK_SET);
+  if (ret == TEE_SUCCESS)
+    ret = TEE_WriteObjectData(obj, classes,
+                              sizeof(struct pool_class) * SE_POOL_MAX_CLASSES);
+  TEE_CloseObject(obj);
+  return ret;
+}
+
+static struct pool_class *pool_find(struct pool_class *classes, uint32_t key_type,
+                                    uint32_t key_size, bool add)
+{
+  uint32_t i;
+
+  for (i = 0; i < SE_POOL_MAX_CLASSES; i++)
+    if (classes[i].key_type == key_type && classes[i].key_size == key_size)
+      return &classes[i];
+  if (!add)
+    return NULL;
+
+  for (i = 0; i < SE_POOL_MAX_CLASSES; i++) {
+    if (classes[i].head == classes[i].tail) {
+      classes[i].key_type = key_type;
+      classes[i].key_size = key_size;
+      return &classes[i];
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Bind the oldest pooled key of the given type/size to key_id by renaming
+ * it. Returns TEE_ERROR_ITEM_NOT_FOUND when the pool is empty.
+ */
+static TEE_Result pool_claim(uint32_t key_type, uint32_t key_size, uint32_t key_id)
+{
+  struct pool_class classes[SE_POOL_MAX_CLASSES];
+  struct pool_class *cls;
+  struct pool_key_id id;
+  TEE_ObjectHandle index;
+  TEE_ObjectHandle key;
+  TEE_Result ret;
+
+  phase_begin(SE_PHASE_STORAGE);
+  ret = pool_open(&index, classes);
+  if (ret != TEE_SUCCESS)
+    goto out;
+
+  cls = pool_find(classes, key_type, key_size, false);
+  ret = TEE_ERROR_ITEM_NOT_FOUND;
+  while (cls && cls->head != cls->tail) {
+    id = pool_key_id(key_type, key_size, cls->head);
+    ret = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, &id, sizeof(id),
+                                   TEE_DATA_FLAG_ACCESS_WRITE_META, &key);
+    if (ret == TEE_ERROR_ITEM_NOT_FOUND) {
+      /* Lost pool entry, skip it */
+      cls->head++;
+      continue;
+    }
+    if (ret != TEE_SUCCESS)
+      break;
+
+    ret = TEE_RenamePersistentObject(key, &key_id, sizeof(key_id));
+    TEE_CloseObject(key);
+    if (ret == TEE_SUCCESS)
+      cls->head++;
+    break;
+  }
+
+  if (pool_close(index, classes) != TEE_SUCCESS)
+    EMSG("Failed to update the key pool index");
+out:
+  phase_end(SE_PHASE_STORAGE);
+  return ret;
+}
+
+/* Add a freshly generated key at the end of the FIFO of its type/size */
+static TEE_Result pool_add(TEE_ObjectHandle key, uint32_t key_type, uint32_t key_size)
+{
+  struct pool_class classes[SE_POOL_MAX_CLASSES];
+  struct pool_class *cls;
+  struct pool_key_id id;
+  TEE_ObjectHandle pooled;
+  TEE_ObjectHandle obj;
+  TEE_Result ret;
+
+  phase_begin(SE_PHASE_STORAGE);
+  ret = pool_open(&obj, classes);
+  if (ret != TEE_SUCCESS)
+    goto out;
+
+  cls = pool_find(classes, key_type, key_size, true);
+  if (!cls) {
+    TEE_CloseObject(obj);
+    ret = TEE_ERROR_OUT_OF_MEMORY;
+    goto out;
+  }
+
+  id = pool_key_id(key_type, key_size, cls->tail);
+  ret = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, &id, sizeof(id),
+                                   TEE_DATA_FLAG_OVERWRITE, key, NULL, 0, &pooled);
+  if (ret == TEE_SUCCESS) {
+    TEE_CloseObject(pooled);
+    cls->tail++;
+    ret = pool_close(obj, classes);
+  } else {
+    TEE_CloseObject(obj);
+  }
+out:
+  phase_end(SE_PHASE_STORAGE);
+  return ret;
+}
+
+static uint32_t pool_level(uint32_t key_type, uint32_t key_size)
+{
+  struct pool_class classes[SE_POOL_MAX_CLASSES];
+  struct pool_class *cls;
+  TEE_ObjectHandle obj;
+
+  if (pool_open(&obj, classes) != TEE_SUCCESS)
+    return 0;
+  TEE_CloseObject(obj);
+
+  cls = pool_find(classes, key_type, key_size, false);
+  return cls ? cls->tail - cls->head : 0;
+}
+
+/*
+ * Bind a key to key_id, taken from the pool when one is available so the
+ * caller does not wait for the key generation.
+ */
+static TEE_Result provision_key(uint32_t key_type, uint32_t key_size, uint32_t key_id)
+{
+  TEE_ObjectHandle key;
+  TEE_Result res;
+
+  vcache_invalidate(key_id);
+
+  res = pool_claim(key_type, key_size, key_id);
+  if (res != TEE_ERROR_ITEM_NOT_FOUND)
+    return res;
+
+  res = generate_key(key_type, key_size, &key);
+  if (res != TEE_SUCCESS)
+    return res;
 
   res = store_key(key, key_id);
   if (res != TEE_SUCCESS) {
     DMSG("Key storage operation failed");
   }
 
-	TEE_FreeTransientObject(key);
-	return TEE_SUCCESS;
+  TEE_FreeTransientObject(key);
+  return res;
+}
+
+static TEE_Result cmd_gen_key(uint32_t param_types, TEE_Param params[4] ) {
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_VALUE_INPUT,
+                    TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_NONE);
+  uint32_t key_type;
+  uint32_t key_size;
+  uint32_t key_id;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  key_type = params[0].value.a;
+  key_size = params[0].value.b;
+  key_id = params[1].value.a;
+
+  return provision_key(key_type, key_size, key_id);
+}
+
+static TEE_Result cmd_gen_keys(uint32_t param_types, TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_MEMREF_INPUT,
+                    TEE_PARAM_TYPE_VALUE_OUTPUT, TEE_PARAM_TYPE_NONE);
+  uint32_t key_type = params[0].value.a;
+  uint32_t key_size = params[0].value.b;
+  uint32_t count;
+  uint32_t key_id;
+  uint32_t i;
+  TEE_Result res = TEE_SUCCESS;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  count = params[1].memref.size / sizeof(uint32_t);
+  for (i = 0; i < count; i++) {
+    TEE_MemMove(&key_id, (uint8_t *)params[1].memref.buffer + i * sizeof(key_id),
+                sizeof(key_id));
+    res = provision_key(key_type, key_size, key_id);
+    if (res != TEE_SUCCESS) {
+      EMSG("Provisioning key %" PRIu32 " failed: 0x%x", key_id, res);
+      break;
+    }
+  }
+
+  /* Tell how far we got, the IDs after it were left untouched */
+  params[2].value.a = i;
+  return res;
+}
+
+static TEE_Result cmd_fill_pool(uint32_t param_types, TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_VALUE_INOUT,
+                    TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE);
+  uint32_t key_type = params[0].value.a;
+  uint32_t key_size = params[0].value.b;
+  uint32_t target = params[1].value.a;
+  uint32_t budget = params[1].value.b;
+  uint32_t generated = 0;
+  uint32_t level;
+  TEE_ObjectHandle key;
+  TEE_Result res = TEE_SUCCESS;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  /*
+   * The budget lets the caller refill in small steps from its idle time.
+   * Keys are generated without holding the pool index, so claims are not
+   * held up by a fill running in another session.
+   */
+  level = pool_level(key_type, key_size);
+  while (level < target) {
+    if (budget && generated == budget)
+      break;
+
+    res = generate_key(key_type, key_size, &key);
+    if (res != TEE_SUCCESS)
+      break;
+    res = pool_add(key, key_type, key_size);
+    TEE_FreeTransientObject(key);
+    if (res != TEE_SUCCESS) {
+      EMSG("Adding a key to the pool failed: 0x%x", res);
+      break;
+    }
+    generated++;
+    level = pool_level(key_type, key_size);
+  }
+
+  params[1].value.a = level;
+  return res;
 }
 
 static TEE_Result get_key(uint32_t id, TEE_ObjectHandle *key) {
   TEE_Result ret = TEE_SUCCESS;
 
+  phase_begin(SE_PHASE_KEY_OPEN);
   ret = TEE_OpenPersistentObject(TEE_STORAGE_PRIVATE, &id, sizeof(id), TEE_DATA_FLAG_ACCESS_READ, key);
+  phase_end(SE_PHASE_KEY_OPEN);
   if (ret != TEE_SUCCESS) {
     DMSG("TEE_OpenPersistentObject failed: 0x%x", ret);
     return ret;
@@ -219,6 +946,685 @@ static TEE_Result get_key(uint32_t id, TEE_ObjectHandle *key) {
   return ret;
 }
 
+/*
+ * Keys of DERIVED commands are never stored. They are expanded with HKDF
+ * (RFC 5869) from a master key, using the key ID as context, and cached by
+ * the instance. The master key is uniformly random so it is the PRK as is
+ * and only the expand step runs. It is created by the first instance that
+ * needs it and shared by all of them.
+ */
+#define MASTER_OBJ_ID "se_master"
+#define MASTER_KEY_SIZE 256
+#define DERIVED_KEY_SIZE 256
+#define DERIVE_LABEL "se-derive-v1"
+#define DERIVED_CACHE_SIZE 8
+
+struct derived_key {
+  uint32_t key_id;
+  uint32_t key_type;
+  TEE_ObjectHandle key;
+};
+
+/* HMAC-SHA256 keyed with the master key, set up on the first derivation */
+static TEE_OperationHandle derive_mac;
+
+/* Keys derived by this instance, replaced in FIFO order */
+static struct derived_key derived_keys[DERIVED_CACHE_SIZE];
+static uint32_t derived_next;
+
+static TEE_Result derive_init(void)
+{
+  uint32_t flags = TEE_DATA_FLAG_ACCESS_READ | TEE_DATA_FLAG_SHARE_READ;
+  TEE_ObjectHandle master = TEE_HANDLE_NULL;
+  TEE_ObjectHandle fresh;
+  TEE_Result res;
+
+  phase_begin(SE_PHASE_KEY_OPEN);
+  res = open_shared_object(MASTER_OBJ_ID, sizeof(MASTER_OBJ_ID) - 1, flags, &master);
+  if (res == TEE_ERROR_ITEM_NOT_FOUND) {
+    res = generate_key(TEE_TYPE_HMAC_SHA256, MASTER_KEY_SIZE, &fresh);
+    if (res == TEE_SUCCESS) {
+      phase_begin(SE_PHASE_STORAGE);
+      res = TEE_CreatePersistentObject(TEE_STORAGE_PRIVATE, MASTER_OBJ_ID,
+                                       sizeof(MASTER_OBJ_ID) - 1, flags, fresh,
+                                       NULL, 0, &master);
+      phase_end(SE_PHASE_STORAGE);
+      TEE_FreeTransientObject(fresh);
+      /* Another instance created it first */
+      if (res == TEE_ERROR_ACCESS_CONFLICT)
+        res = open_shared_object(MASTER_OBJ_ID, sizeof(MASTER_OBJ_ID) - 1, flags,
+                                 &master);
+    }
+  }
+  phase_end(SE_PHASE_KEY_OPEN);
+  if (res != TEE_SUCCESS) {
+    EMSG("Cannot open the master key: 0x%x", res);
+    return res;
+  }
+
+  phase_begin(SE_PHASE_OP_ALLOC);
+  res = TEE_AllocateOperation(&derive_mac, TEE_ALG_HMAC_SHA256, TEE_MODE_MAC,
+                              MASTER_KEY_SIZE);
+  phase_end(SE_PHASE_OP_ALLOC);
+  if (res == TEE_SUCCESS) {
+    res = TEE_SetOperationKey(derive_mac, master);
+    if (res != TEE_SUCCESS) {
+      EMSG("TEE_SetOperationKey failed: 0x%x", res);
+      TEE_FreeOperation(derive_mac);
+      derive_mac = NULL;
+    }
+  } else {
+    EMSG("TEE_AllocateOperation failed: 0x%x", res);
+    derive_mac = NULL;
+  }
+  TEE_CloseObject(master);
+  return res;
+}
+
+/* HKDF-Expand with info = DERIVE_LABEL || key type || key ID */
+static TEE_Result derive_expand(uint32_t key_type, uint32_t key_id, uint8_t *okm,
+                                uint32_t okm_len)
+{
+  TEE_Result res = TEE_SUCCESS;
+  uint8_t t[32];
+  uint32_t t_len = 0;
+  uint8_t counter;
+  uint32_t n;
+
+  phase_begin(SE_PHASE_CRYPTO);
+  for (counter = 1; okm_len > 0; counter++) {
+    TEE_MACInit(derive_mac, NULL, 0);
+    TEE_MACUpdate(derive_mac, t, t_len);
+    TEE_MACUpdate(derive_mac, DERIVE_LABEL, sizeof(DERIVE_LABEL) - 1);
+    TEE_MACUpdate(derive_mac, &key_type, sizeof(key_type));
+    TEE_MACUpdate(derive_mac, &key_id, sizeof(key_id));
+    t_len = sizeof(t);
+    res = TEE_MACComputeFinal(derive_mac, &counter, sizeof(counter), t, &t_len);
+    if (res != TEE_SUCCESS) {
+      DMSG("TEE_MACComputeFinal failed: 0x%x", res);
+      break;
+    }
+
+    n = okm_len < t_len ? okm_len : t_len;
+    TEE_MemMove(okm, t, n);
+    okm += n;
+    okm_len -= n;
+  }
+  phase_end(SE_PHASE_CRYPTO);
+
+  TEE_MemFill(t, 0, sizeof(t));
+  return res;
+}
+
+/* The returned key belongs to the cache and must not be closed */
+static TEE_Result get_derived_key(uint32_t key_id, uint32_t key_type, TEE_ObjectHandle *key)
+{
+  uint8_t secret[DERIVED_KEY_SIZE / 8];
+  struct derived_key *slot;
+  TEE_Attribute attr;
+  TEE_Result res;
+  uint32_t n;
+
+  for (n = 0; n < DERIVED_CACHE_SIZE; n++) {
+    slot = &derived_keys[n];
+    if (slot->key && slot->key_id == key_id && slot->key_type == key_type) {
+      *key = slot->key;
+      return TEE_SUCCESS;
+    }
+  }
+
+  if (!derive_mac) {
+    res = derive_init();
+    if (res != TEE_SUCCESS)
+      return res;
+  }
+
+  slot = &derived_keys[derived_next];
+  if (slot->key)
+    TEE_FreeTransientObject(slot->key);
+  slot->key = TEE_HANDLE_NULL;
+
+  res = derive_expand(key_type, key_id, secret, sizeof(secret));
+  if (res == TEE_SUCCESS)
+    res = TEE_AllocateTransientObject(key_type, DERIVED_KEY_SIZE, &slot->key);
+  if (res == TEE_SUCCESS) {
+    TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, secret, sizeof(secret));
+    res = TEE_PopulateTransientObject(slot->key, &attr, 1);
+    if (res != TEE_SUCCESS) {
+      EMSG("TEE_PopulateTransientObject failed: 0x%x", res);
+      TEE_FreeTransientObject(slot->key);
+      slot->key = TEE_HANDLE_NULL;
+    }
+  }
+  TEE_MemFill(secret, 0, sizeof(secret));
+  if (res != TEE_SUCCESS)
+    return res;
+
+  slot->key_id = key_id;
+  slot->key_type = key_type;
+  derived_next = (derived_next + 1) % DERIVED_CACHE_SIZE;
+  *key = slot->key;
+  return TEE_SUCCESS;
+}
+
+static void derive_reset(void)
+{
+  uint32_t n;
+
+  for (n = 0; n < DERIVED_CACHE_SIZE; n++) {
+    if (derived_keys[n].key)
+      TEE_FreeTransientObject(derived_keys[n].key);
+    derived_keys[n].key = TEE_HANDLE_NULL;
+  }
+  derived_next = 0;
+
+  if (derive_mac)
+    TEE_FreeOperation(derive_mac);
+  derive_mac = NULL;
+}
+
+/*
+ * Key of an AES or HMAC command, derived when DERIVED is set and opened
+ * from storage otherwise. Release it with put_key().
+ */
+static TEE_Result open_key(uint32_t key_id, uint32_t flags, TEE_ObjectHandle *key)
+{
+  if ((flags & DERIVED) == 0)
+    return get_key(key_id, key);
+  if ((flags & AES) > 0)
+    return get_derived_key(key_id, TEE_TYPE_AES, key);
+  if ((flags & HMAC) > 0)
+    return get_derived_key(key_id, TEE_TYPE_HMAC_SHA256, key);
+  return TEE_ERROR_BAD_PARAMETERS;
+}
+
+static void put_key(uint32_t flags, TEE_ObjectHandle key)
+{
+  if ((flags & DERIVED) == 0)
+    TEE_CloseObject(key);
+}
+
+/* Sign a SHA-256 digest with the HMAC or RSA key selected by flags */
+static TEE_Result sign_digest(uint32_t key_id, uint32_t flags, void *digest,
+                              uint32_t digest_len, void *sig, uint32_t *sig_len)
+{
+  TEE_ObjectHandle key;
+  TEE_Result res;
+
+  res = open_key(key_id, flags, &key);
+  if (res != TEE_SUCCESS)
+    return res;
+
+  if ((flags & HMAC) > 0)
+    res = HMAC_Operation(TEE_MODE_SIGN, TEE_ALG_HMAC_SHA256, key,
+                         digest, digest_len, sig, sig_len);
+  else if ((flags & SIGN_RSASSA_MGF) > 0)
+    res = RSA_Operation(TEE_MODE_SIGN, TEE_ALG_RSASSA_PKCS1_PSS_MGF1_SHA256, key,
+                        digest, digest_len, sig, sig_len);
+  else
+    res = RSA_Operation(TEE_MODE_SIGN, TEE_ALG_RSASSA_PKCS1_V1_5_SHA256, key,
+                        digest, digest_len, sig, sig_len);
+  put_key(flags, key);
+  return res;
+}
+
+static TEE_Result sign_file_final(uint32_t key_id, uint32_t flags, void *sig,
+                                  uint32_t *sig_len)
+{
+  uint8_t digest[32];
+  uint32_t digest_len = sizeof(digest);
+  TEE_Result res;
+
+  phase_begin(SE_PHASE_CRYPTO);
+  res = TEE_DigestDoFinal(sign_file_digest, NULL, 0, digest, &digest_len);
+  phase_end(SE_PHASE_CRYPTO);
+  if (res != TEE_SUCCESS) {
+    DMSG("TEE_DigestDoFinal failed: 0x%x", res);
+    return res;
+  }
+
+  return sign_digest(key_id, flags, digest, digest_len, sig, sig_len);
+}
+
+/*
+ * Hash a file streamed in chunks and sign the digest, so the digest never
+ * leaves the TA and enrolment needs a single session.
+ */
+static TEE_Result cmd_sign_file(uint32_t param_types, TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_MEMREF_INPUT,
+                    TEE_PARAM_TYPE_MEMREF_OUTPUT, TEE_PARAM_TYPE_VALUE_INPUT);
+  uint32_t stage = params[3].value.a;
+  TEE_Result res;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if ((stage & SIGN_FILE_FIRST) > 0) {
+    if (sign_file_digest)
+      TEE_FreeOperation(sign_file_digest);
+    sign_file_digest = NULL;
+
+    phase_begin(SE_PHASE_OP_ALLOC);
+    res = TEE_AllocateOperation(&sign_file_digest, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+    phase_end(SE_PHASE_OP_ALLOC);
+    if (res != TEE_SUCCESS) {
+      EMSG("TEE_AllocateOperation failed: 0x%x", res);
+      sign_file_digest = NULL;
+      return res;
+    }
+  } else if (!sign_file_digest) {
+    return TEE_ERROR_BAD_STATE;
+  }
+
+  phase_begin(SE_PHASE_CRYPTO);
+  TEE_DigestUpdate(sign_file_digest, params[1].memref.buffer, params[1].memref.size);
+  phase_end(SE_PHASE_CRYPTO);
+
+  if ((stage & SIGN_FILE_LAST) == 0) {
+    params[2].memref.size = 0;
+    return TEE_SUCCESS;
+  }
+
+  res = sign_file_final(params[0].value.a, params[0].value.b,
+                        params[2].memref.buffer, &params[2].memref.size);
+  TEE_FreeOperation(sign_file_digest);
+  sign_file_digest = NULL;
+  return res;
+}
+
+/* Levels above the leaves of a batch tree of count items */
+static uint32_t batch_depth(uint32_t count)
+{
+  uint32_t depth = 0;
+
+  while ((1U << depth) < count)
+    depth++;
+  return depth;
+}
+
+static TEE_Result batch_hash(TEE_OperationHandle op, uint8_t prefix, const void *a,
+                             const void *b, uint8_t *out)
+{
+  uint32_t len = SE_BATCH_HASH_SIZE;
+
+  TEE_DigestUpdate(op, &prefix, sizeof(prefix));
+  TEE_DigestUpdate(op, a, SE_BATCH_HASH_SIZE);
+  return TEE_DigestDoFinal(op, b, b ? SE_BATCH_HASH_SIZE : 0, out, &len);
+}
+
+/*
+ * Reduce the leaves in nodes to the root, level by level and in place, and
+ * write the proof of every item on the way. The node of item i at level k
+ * is i >> k, an odd node out moves up unchanged.
+ */
+static TEE_Result batch_tree(TEE_OperationHandle op, uint8_t *nodes, uint32_t count,
+                             uint8_t *proofs)
+{
+  uint32_t depth = batch_depth(count);
+  uint32_t width = count;
+  uint32_t i, k, sibling;
+  uint8_t *entry;
+  TEE_Result res;
+
+  for (k = 0; width > 1; k++) {
+    for (i = 0; i < count; i++) {
+      sibling = (i >> k) ^ 1;
+      entry = proofs + (i * depth + k) * SE_BATCH_HASH_SIZE;
+      if (sibling < width)
+        TEE_MemMove(entry, nodes + sibling * SE_BATCH_HASH_SIZE, SE_BATCH_HASH_SIZE);
+      else
+        TEE_MemFill(entry, 0, SE_BATCH_HASH_SIZE);
+    }
+
+    for (i = 0; i < width / 2; i++) {
+      res = batch_hash(op, SE_BATCH_NODE, nodes + 2 * i * SE_BATCH_HASH_SIZE,
+                       nodes + (2 * i + 1) * SE_BATCH_HASH_SIZE,
+                       nodes + i * SE_BATCH_HASH_SIZE);
+      if (res != TEE_SUCCESS)
+        return res;
+    }
+    if (width & 1)
+      TEE_MemMove(nodes + i * SE_BATCH_HASH_SIZE,
+                  nodes + (width - 1) * SE_BATCH_HASH_SIZE, SE_BATCH_HASH_SIZE);
+    width = (width + 1) / 2;
+  }
+  return TEE_SUCCESS;
+}
+
+/*
+ * Sign a batch of digests with a single private key operation over the
+ * root of their Merkle tree, see se_ta.h.
+ */
+static TEE_Result cmd_sign_batch(uint32_t param_types, TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_MEMREF_INPUT,
+                    TEE_PARAM_TYPE_MEMREF_OUTPUT, TEE_PARAM_TYPE_MEMREF_OUTPUT);
+  uint32_t count = params[1].memref.size / SE_BATCH_HASH_SIZE;
+  uint8_t batch_digest[SE_BATCH_HASH_SIZE];
+  uint32_t digest_len = sizeof(batch_digest);
+  TEE_OperationHandle op = NULL;
+  uint8_t prefix = SE_BATCH_ROOT;
+  uint8_t count_le[4];
+  uint32_t proofs_size;
+  uint32_t i;
+  uint8_t *nodes;
+  TEE_Result res;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+  if (count == 0 || count > SE_BATCH_MAX_ITEMS ||
+      params[1].memref.size % SE_BATCH_HASH_SIZE)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  proofs_size = count * batch_depth(count) * SE_BATCH_HASH_SIZE;
+  if (params[3].memref.size < proofs_size) {
+    params[3].memref.size = proofs_size;
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  nodes = TEE_Malloc(count * SE_BATCH_HASH_SIZE, 0);
+  if (!nodes)
+    return TEE_ERROR_OUT_OF_MEMORY;
+
+  phase_begin(SE_PHASE_OP_ALLOC);
+  res = TEE_AllocateOperation(&op, TEE_ALG_SHA256, TEE_MODE_DIGEST, 0);
+  phase_end(SE_PHASE_OP_ALLOC);
+  if (res != TEE_SUCCESS) {
+    EMSG("TEE_AllocateOperation failed: 0x%x", res);
+    op = NULL;
+    goto out;
+  }
+
+  phase_begin(SE_PHASE_CRYPTO);
+  for (i = 0; i < count && res == TEE_SUCCESS; i++)
+    res = batch_hash(op, SE_BATCH_LEAF,
+                     (uint8_t *)params[1].memref.buffer + i * SE_BATCH_HASH_SIZE,
+                     NULL, nodes + i * SE_BATCH_HASH_SIZE);
+  if (res == TEE_SUCCESS)
+    res = batch_tree(op, nodes, count, params[3].memref.buffer);
+  if (res == TEE_SUCCESS) {
+    for (i = 0; i < sizeof(count_le); i++)
+      count_le[i] = count >> (8 * i);
+    TEE_DigestUpdate(op, &prefix, sizeof(prefix));
+    TEE_DigestUpdate(op, count_le, sizeof(count_le));
+    res = TEE_DigestDoFinal(op, nodes, SE_BATCH_HASH_SIZE, batch_digest, &digest_len);
+  }
+  phase_end(SE_PHASE_CRYPTO);
+  if (res != TEE_SUCCESS)
+    goto out;
+
+  params[3].memref.size = proofs_size;
+  res = sign_digest(params[0].value.a, params[0].value.b, batch_digest,
+                    sizeof(batch_digest), params[2].memref.buffer,
+                    &params[2].memref.size);
+
+out:
+  if (op)
+    TEE_FreeOperation(op);
+  TEE_Free(nodes);
+  return res;
+}
+
+static void envelope_reset(void)
+{
+  if (envelope_op)
+    TEE_FreeOperation(envelope_op);
+  envelope_op = NULL;
+}
+
+/*
+ * Set up envelope_op with the data key. aad is the header followed by the
+ * wrapped key, authenticated as GCM additional data.
+ */
+static TEE_Result envelope_init(TEE_OperationMode mode, uint32_t cipher,
+                                const uint8_t *iv, const uint8_t *data_key,
+                                const void *aad, uint32_t aad_len)
+{
+  TEE_ObjectHandle key = TEE_HANDLE_NULL;
+  TEE_Attribute attr;
+  TEE_Result res;
+
+  envelope_reset();
+  envelope_algo = cipher == SE_ENVELOPE_CTR ? TEE_ALG_AES_CTR : TEE_ALG_AES_GCM;
+
+  phase_begin(SE_PHASE_OP_ALLOC);
+  res = TEE_AllocateOperation(&envelope_op, envelope_algo, mode, MAX_AES_KEYSIZE);
+  if (res == TEE_SUCCESS)
+    res = TEE_AllocateTransientObject(TEE_TYPE_AES, MAX_AES_KEYSIZE, &key);
+  phase_end(SE_PHASE_OP_ALLOC);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to allocate the envelope cipher: 0x%x", res);
+    goto out;
+  }
+
+  TEE_InitRefAttribute(&attr, TEE_ATTR_SECRET_VALUE, data_key, SE_ENVELOPE_KEY_SIZE);
+  res = TEE_PopulateTransientObject(key, &attr, 1);
+  if (res == TEE_SUCCESS)
+    res = TEE_SetOperationKey(envelope_op, key);
+  if (res != TEE_SUCCESS) {
+    EMSG("Failed to set the data key: 0x%x", res);
+    goto out;
+  }
+
+  phase_begin(SE_PHASE_CRYPTO);
+  if (envelope_algo == TEE_ALG_AES_GCM) {
+    res = TEE_AEInit(envelope_op, iv, SE_ENVELOPE_GCM_IV_SIZE,
+                     SE_ENVELOPE_TAG_SIZE * 8, aad_len, 0);
+    if (res == TEE_SUCCESS)
+      TEE_AEUpdateAAD(envelope_op, aad, aad_len);
+  } else {
+    TEE_CipherInit(envelope_op, iv, sizeof(((struct se_envelope_header *)0)->iv));
+  }
+  phase_end(SE_PHASE_CRYPTO);
+
+out:
+  if (key != TEE_HANDLE_NULL)
+    TEE_FreeTransientObject(key);
+  if (res != TEE_SUCCESS)
+    envelope_reset();
+  return res;
+}
+
+/*
+ * Draw a data key, wrap it for the RSA key and write the header and the
+ * wrapped key to out. *hdr_len is set to the bytes written.
+ */
+static TEE_Result envelope_seal_header(uint32_t key_id, uint32_t flags, uint8_t *out,
+                                       uint32_t out_size, uint32_t *hdr_len)
+{
+  struct se_envelope_header hdr;
+  uint8_t data_key[SE_ENVELOPE_KEY_SIZE];
+  uint32_t wrapped_len;
+  TEE_ObjectHandle key;
+  TEE_Result res;
+
+  if (out_size < sizeof(hdr))
+    return TEE_ERROR_SHORT_BUFFER;
+
+  hdr.magic = SE_ENVELOPE_MAGIC;
+  hdr.cipher = (flags & CTR) > 0 ? SE_ENVELOPE_CTR : SE_ENVELOPE_GCM;
+  TEE_GenerateRandom(hdr.iv, sizeof(hdr.iv));
+  TEE_GenerateRandom(data_key, sizeof(data_key));
+
+  res = get_key(key_id, &key);
+  if (res != TEE_SUCCESS)
+    goto out;
+  wrapped_len = out_size - sizeof(hdr);
+  res = RSA_Operation(TEE_MODE_ENCRYPT, TEE_ALG_RSAES_PKCS1_OAEP_MGF1_SHA256, key,
+                      data_key, sizeof(data_key), out + sizeof(hdr), &wrapped_len);
+  TEE_CloseObject(key);
+  if (res != TEE_SUCCESS)
+    goto out;
+
+  hdr.wrapped_len = wrapped_len;
+  TEE_MemMove(out, &hdr, sizeof(hdr));
+  *hdr_len = sizeof(hdr) + wrapped_len;
+  res = envelope_init(TEE_MODE_ENCRYPT, hdr.cipher, hdr.iv, data_key, out, *hdr_len);
+
+out:
+  TEE_MemFill(data_key, 0, sizeof(data_key));
+  return res;
+}
+
+/*
+ * Parse the header at the start of in and unwrap the data key. *hdr_len is
+ * set to the size of the header and the wrapped key.
+ */
+static TEE_Result envelope_open_header(uint32_t key_id, const uint8_t *in, uint32_t in_len,
+                                       uint32_t *hdr_len)
+{
+  struct se_envelope_header hdr;
+  uint32_t key_len = SE_ENVELOPE_MAX_WRAPPED;
+  uint8_t *data_key;
+  TEE_ObjectHandle key;
+  TEE_Result res;
+
+  if (in_len < sizeof(hdr))
+    return TEE_ERROR_BAD_FORMAT;
+  TEE_MemMove(&hdr, in, sizeof(hdr));
+  if (hdr.magic != SE_ENVELOPE_MAGIC ||
+      (hdr.cipher != SE_ENVELOPE_GCM && hdr.cipher != SE_ENVELOPE_CTR) ||
+      hdr.wrapped_len > SE_ENVELOPE_MAX_WRAPPED ||
+      hdr.wrapped_len > in_len - sizeof(hdr))
+    return TEE_ERROR_BAD_FORMAT;
+
+  /* OAEP decryption may want a buffer as large as the modulus */
+  data_key = tee_arena_alloc(arena, key_len);
+  if (!data_key)
+    return TEE_ERROR_OUT_OF_MEMORY;
+
+  res = get_key(key_id, &key);
+  if (res != TEE_SUCCESS)
+    return res;
+  res = RSA_Operation(TEE_MODE_DECRYPT, TEE_ALG_RSAES_PKCS1_OAEP_MGF1_SHA256, key,
+                      (void *)(in + sizeof(hdr)), hdr.wrapped_len, data_key, &key_len);
+  TEE_CloseObject(key);
+  if (res == TEE_SUCCESS && key_len != SE_ENVELOPE_KEY_SIZE)
+    res = TEE_ERROR_BAD_FORMAT;
+
+  if (res == TEE_SUCCESS) {
+    *hdr_len = sizeof(hdr) + hdr.wrapped_len;
+    res = envelope_init(TEE_MODE_DECRYPT, hdr.cipher, hdr.iv, data_key, in, *hdr_len);
+  }
+  TEE_MemFill(data_key, 0, SE_ENVELOPE_MAX_WRAPPED);
+  return res;
+}
+
+/*
+ * Run one chunk through envelope_op. On the last chunk the GCM tag is
+ * appended to the output when sealing and taken from the end of the input
+ * when opening.
+ */
+static TEE_Result envelope_update(TEE_OperationMode mode, bool last, const uint8_t *in,
+                                  uint32_t in_len, uint8_t *out, uint32_t *out_len)
+{
+  uint8_t tag[SE_ENVELOPE_TAG_SIZE];
+  uint32_t tag_len = sizeof(tag);
+  TEE_Result res;
+
+  phase_begin(SE_PHASE_CRYPTO);
+  if (envelope_algo != TEE_ALG_AES_GCM) {
+    if (last)
+      res = TEE_CipherDoFinal(envelope_op, in, in_len, out, out_len);
+    else
+      res = TEE_CipherUpdate(envelope_op, in, in_len, out, out_len);
+  } else if (!last) {
+    res = TEE_AEUpdate(envelope_op, in, in_len, out, out_len);
+  } else if (mode == TEE_MODE_ENCRYPT) {
+    *out_len -= sizeof(tag);
+    res = TEE_AEEncryptFinal(envelope_op, in, in_len, out, out_len, tag, &tag_len);
+    if (res == TEE_SUCCESS) {
+      TEE_MemMove(out + *out_len, tag, tag_len);
+      *out_len += tag_len;
+    }
+  } else if (in_len < sizeof(tag)) {
+    res = TEE_ERROR_BAD_FORMAT;
+  } else {
+    in_len -= sizeof(tag);
+    TEE_MemMove(tag, in + in_len, sizeof(tag));
+    res = TEE_AEDecryptFinal(envelope_op, in, in_len, out, out_len, tag, sizeof(tag));
+  }
+  phase_end(SE_PHASE_CRYPTO);
+  if (res != TEE_SUCCESS)
+    DMSG("Envelope chunk failed: 0x%x", res);
+  return res;
+}
+
+/*
+ * Seal or open an envelope streamed in chunks, see se_ta.h. The data key
+ * only ever exists in the TA, wrapped for the RSA key in the container.
+ */
+static TEE_Result cmd_envelope(TEE_OperationMode mode, uint32_t param_types,
+                               TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_VALUE_INPUT, TEE_PARAM_TYPE_MEMREF_INPUT,
+                    TEE_PARAM_TYPE_MEMREF_OUTPUT, TEE_PARAM_TYPE_VALUE_INPUT);
+  uint32_t stage = params[3].value.a;
+  const uint8_t *in = params[1].memref.buffer;
+  uint32_t in_len = params[1].memref.size;
+  uint8_t *out = params[2].memref.buffer;
+  uint32_t out_size = params[2].memref.size;
+  uint32_t hdr_len = 0;
+  uint32_t out_len;
+  TEE_Result res;
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  if (out_size < in_len || out_size - in_len < SE_ENVELOPE_OVERHEAD) {
+    params[2].memref.size = in_len + SE_ENVELOPE_OVERHEAD;
+    return TEE_ERROR_SHORT_BUFFER;
+  }
+
+  if ((stage & SIGN_FILE_FIRST) > 0 && mode == TEE_MODE_ENCRYPT) {
+    res = envelope_seal_header(params[0].value.a, params[0].value.b,
+                               out, out_size, &hdr_len);
+    if (res != TEE_SUCCESS)
+      return res;
+    out += hdr_len;
+    out_size -= hdr_len;
+  } else if ((stage & SIGN_FILE_FIRST) > 0) {
+    res = envelope_open_header(params[0].value.a, in, in_len, &hdr_len);
+    if (res != TEE_SUCCESS)
+      return res;
+    in += hdr_len;
+    in_len -= hdr_len;
+    hdr_len = 0;
+  } else if (!envelope_op) {
+    return TEE_ERROR_BAD_STATE;
+  }
+
+  out_len = out_size;
+  res = envelope_update(mode, (stage & SIGN_FILE_LAST) > 0, in, in_len, out, &out_len);
+  if (res != TEE_SUCCESS || (stage & SIGN_FILE_LAST) > 0)
+    envelope_reset();
+  if (res != TEE_SUCCESS)
+    return res;
+
+  params[2].memref.size = hdr_len + out_len;
+  return TEE_SUCCESS;
+}
+
+/* One call fills the whole buffer, hosts pool the bytes on their side */
+static TEE_Result cmd_random(uint32_t param_types, TEE_Param params[4])
+{
+  const uint32_t exp_param_types =
+    TEE_PARAM_TYPES(TEE_PARAM_TYPE_MEMREF_OUTPUT, TEE_PARAM_TYPE_NONE,
+                    TEE_PARAM_TYPE_NONE, TEE_PARAM_TYPE_NONE);
+
+  if (param_types != exp_param_types)
+    return TEE_ERROR_BAD_PARAMETERS;
+
+  phase_begin(SE_PHASE_CRYPTO);
+  TEE_GenerateRandom(params[0].memref.buffer, params[0].memref.size);
+  phase_end(SE_PHASE_CRYPTO);
+  return TEE_SUCCESS;
+}
+
 TEE_Result cmd_do_crypto(uint32_t param_types, TEE_Param params[4]) {
   struct cryptography crypto = {0, 0, NULL};
   uint32_t state = params[0].value.b;
@@ -271,28 +1677,75 @@ TEE_Result cmd_do_crypto(uint32_t param_types, TEE_Param params[4]) {
   {
     crypto.algo = TEE_ALG_SHA512;
   }
+  else if((state & MAC_SHA256) > 0)
+  {
+    crypto.algo = TEE_ALG_HMAC_SHA256;
+  }
 
 
   if ((state & AES) > 0)
   {
     TEE_ObjectHandle key;
-    TEE_Result res = get_key(params[0].value.a, &key);
-    crypto.IV = params[2].memref.buffer;
+    uint32_t IV_len;
+    TEE_Result res = open_key(params[0].value.a, state, &key);
+    if (res != TEE_SUCCESS)
+      return res;
+    if (TEE_PARAM_TYPE_GET(param_types, 3) == TEE_PARAM_TYPE_MEMREF_INPUT) {
+      /* Binary IV, e.g. a CTR counter block which may hold zero bytes */
+      crypto.IV = params[3].memref.buffer;
+      IV_len = params[3].memref.size;
+    } else {
+      crypto.IV = params[2].memref.buffer;
+      IV_len = strlen(crypto.IV);
+    }
     res = AES_Operation(crypto.mode, crypto.algo, key,
-                        crypto.IV, strlen(crypto.IV),
+                        crypto.IV, IV_len,
                         params[1].memref.buffer, params[1].memref.size,
                         params[2].memref.buffer, &params[2].memref.size); //* IV
-    TEE_CloseObject(key);
+    put_key(state, key);
     return res;
   } 
   else if((state & RSA) > 0)
   {
     TEE_ObjectHandle key;
-    TEE_Result res = get_key(params[0].value.a, &key);
+    uint8_t triple[VCACHE_HASH_SIZE];
+    bool cacheable = false;
+    TEE_Result res;
+
+    if ((state & DERIVED) > 0)
+      return TEE_ERROR_BAD_PARAMETERS;
+
+    /* A triple verified before is answered without the public key operation */
+    if (crypto.mode == TEE_MODE_VERIFY) {
+      cacheable = vcache_hash(params[0].value.a, crypto.algo,
+                              params[1].memref.buffer, params[1].memref.size,
+                              params[2].memref.buffer, params[2].memref.size,
+                              triple) == TEE_SUCCESS;
+      if (cacheable && vcache_lookup(triple))
+        return TEE_SUCCESS;
+    }
+
+    res = get_key(params[0].value.a, &key);
+    if (res != TEE_SUCCESS)
+      return res;
     res = RSA_Operation(crypto.mode, crypto.algo, key,
                         params[1].memref.buffer, params[1].memref.size,
                         params[2].memref.buffer, &params[2].memref.size);
     TEE_CloseObject(key);
+    if (cacheable && res == TEE_SUCCESS)
+      vcache_insert(params[0].value.a, triple);
+    return res;
+  }
+  else if((state & HMAC) > 0)
+  {
+    TEE_ObjectHandle key;
+    TEE_Result res = open_key(params[0].value.a, state, &key);
+    if (res != TEE_SUCCESS)
+      return res;
+    res = HMAC_Operation(crypto.mode, crypto.algo, key,
+                         params[1].memref.buffer, params[1].memref.size,
+                         params[2].memref.buffer, &params[2].memref.size);
+    put_key(state, key);
     return res;
   }
   else if((state & DIGEST) > 0)
@@ -315,20 +1768,68 @@ void TA_DestroyEntryPoint(void) {
 
 TEE_Result TA_OpenSessionEntryPoint(uint32_t __unused param_types, TEE_Param __unused params[4],
 				    void __unused **sess_ctx) {
+  /* Allocated once so commands cause no heap traffic of their own */
+  arena = TEE_Malloc(sizeof(*arena) + SESSION_ARENA_SIZE, 0);
+  if (!arena)
+    return TEE_ERROR_OUT_OF_MEMORY;
+
+  tee_arena_init(arena, arena + 1, SESSION_ARENA_SIZE);
 	return TEE_SUCCESS;
 }
 
 void TA_CloseSessionEntryPoint(void __unused *sess_ctx) {
+  if (sign_file_digest)
+    TEE_FreeOperation(sign_file_digest);
+  envelope_reset();
+  derive_reset();
+  stats_flush();
+  TEE_Free(arena);
+  arena = NULL;
 }
 
-TEE_Result TA_InvokeCommandEntryPoint(void __unused *sess_ctx, uint32_t cmd_id,
-                                      uint32_t param_types, TEE_Param params[4]) 
+static TEE_Result invoke_command(uint32_t cmd_id, uint32_t param_types, TEE_Param params[4])
 {
 	if(cmd_id == GENERATE_KEY) {
     return cmd_gen_key(param_types, params);
   } else if (cmd_id == ENC_DEC) {
     return cmd_do_crypto(param_types, params);
+  } else if (cmd_id == STATS) {
+    return cmd_stats(param_types, params);
+  } else if (cmd_id == STATS_RESET) {
+    return cmd_stats_reset(param_types, params);
+  } else if (cmd_id == FILL_POOL) {
+    return cmd_fill_pool(param_types, params);
+  } else if (cmd_id == GENERATE_KEYS) {
+    return cmd_gen_keys(param_types, params);
+  } else if (cmd_id == SIGN_FILE) {
+    return cmd_sign_file(param_types, params);
+  } else if (cmd_id == ENVELOPE_SEAL) {
+    return cmd_envelope(TEE_MODE_ENCRYPT, param_types, params);
+  } else if (cmd_id == ENVELOPE_OPEN) {
+    return cmd_envelope(TEE_MODE_DECRYPT, param_types, params);
+  } else if (cmd_id == SIGN_BATCH) {
+    return cmd_sign_batch(param_types, params);
+  } else if (cmd_id == RANDOM) {
+    return cmd_random(param_types, params);
   } else {
     return TEE_ERROR_BAD_PARAMETERS;
 	}
+}
+
+TEE_Result TA_InvokeCommandEntryPoint(void __unused *sess_ctx, uint32_t cmd_id,
+                                      uint32_t param_types, TEE_Param params[4]) 
+{
+  uint32_t in_bytes = param_in_bytes(param_types, params);
+  TEE_Result res;
+  TEE_Time start;
+
+  TEE_MemFill(cmd_phase_ms, 0, sizeof(cmd_phase_ms));
+  TEE_GetSystemTime(&start);
+
+  res = invoke_command(cmd_id, param_types, params);
+  tee_arena_reset(arena);
+
+  if (cmd_id < SE_CMD_COUNT)
+    stats_account(cmd_id, res, param_types, params, in_bytes, elapsed_ms(&start));
+  return res;
 }
\ No newline at end of file
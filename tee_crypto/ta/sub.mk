@@ -1,2 +1,3 @@
 global-incdirs-y += include
-srcs-y += se_ta.c
\ No newline at end of file
+global-incdirs-y += ../../common/include
+srcs-y += se_ta.c